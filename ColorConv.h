@@ -28,16 +28,16 @@
 #ifndef COLOR_CONV_H
 #define COLOR_CONV_H
 
-void rgb2xyz(float* rgb, float* xyz);
-void xyz2rgb(float* xyz, float* rgb);
-void xyz2lab(float* xyz, float* lab);
-void lab2xyz(float* lab, float* xyz);
-void rgb2lab(float* rgb, float* lab);
-void lab2rgb(float* lab, float* rgb);
-void rgb2hsv(float* rgb, float* hsv);
-void hsl2rgb(float* hsl, float* rgb);
-void hsv2rgb(float* hsv, float* rgb);
-void rgb2hsl(float* rgb, float* hsl);
+static inline void rgb2xyz(float* rgb, float* xyz);
+static inline void xyz2rgb(float* xyz, float* rgb);
+static inline void xyz2lab(float* xyz, float* lab);
+static inline void lab2xyz(float* lab, float* xyz);
+static inline void rgb2lab(float* rgb, float* lab);
+static inline void lab2rgb(float* lab, float* rgb);
+static inline void rgb2hsv(float* rgb, float* hsv);
+static inline void hsl2rgb(float* hsl, float* rgb);
+static inline void hsv2rgb(float* hsv, float* rgb);
+static inline void rgb2hsl(float* rgb, float* hsl);
 
 
 // suppose the original file is in the sRGB colorspace
@@ -0,0 +1,1071 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   bench.cpp
+ *
+ * Abstract:
+ *
+ *   The benchmark suite of the LensFlare project.
+ *
+ *   Groups:
+ *     primitive  flare.hpp primitives and the primitive.h
+ *                kernels of the same disks, pixels/s
+ *     poly       poly.cpp scan converter, polygons/s and
+ *                covered pixels/s, and covered pixels/s on each
+ *                subpixel grid
+ *     color      ColorConv.h conversions, pixels/s
+ *     random     MyRandom, values/s
+ *     blur       blur.h Gaussian at 3840x2160 and several sigmas,
+ *                pixels/s
+ *     streak     streak.h 4-arm star at 1920x1080 and several
+ *                lengths, pixels/s
+ *     starburst  starburst.h 1024x1024 aperture spectrum, calls/s
+ *     binning    binning.h 400 ghosts and 4000 sparkles at
+ *                1920x1080, frames/s; the ghosts also into 8-bit
+ *                BGR, in float then converted and in fixed point
+ *     sweep      sweep.h 16 color variants of one 1920x1080
+ *                coverage, variants/s
+ *     occlusion  occlusion.h summed-area table of a 1920x1080
+ *                frame, frames/s, and the visibility of 1000
+ *                lights, queries/s
+ *     particles  particles.h step of 50000 sparkles, particles/s,
+ *                and whole 1920x1080 frames of them, frames/s
+ *     tiled      tiled.h 400 ghosts and 4000 sparkles on a 4096x4096
+ *                canvas in 1024 tiles, with and without a bloom
+ *                halo, pixels/s
+ *     effect     Init() and Draw() of every effect at 640x480,
+ *                1920x1080 and 3840x2160, calls/s
+ *
+ *   Usage:
+ *     bench [--filter <substring>] [--min-time <seconds>]
+ *           [--json <file>] [--baseline <file>] [--threshold <ratio>]
+ *
+ *   The results are written as JSON. A previous JSON output can
+ *   be given as the baseline; the benchmarks slower than the
+ *   baseline by more than the threshold (default 0.1, i.e. 10%)
+ *   are reported and the exit code is 1.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#define CV_NO_BACKWARD_COMPATIBILITY
+
+#include "cv.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "common.h"
+#include "flare.hpp"
+#include "ColorConv.h"
+#include "poly.h"
+#include "timer.h"
+#include "blur.h"
+#include "streak.h"
+#include "starburst.h"
+#include "binning.h"
+#include "primitive.h"
+#include "sweep.h"
+#include "occlusion.h"
+#include "particles.h"
+#include "tiled.h"
+
+#include "effect01_glowball.h"
+#include "effect02_spikeball.h"
+#include "effect03_starfilter.h"
+#include "effect05_circlespread.h"
+#include "effect09_stripe.h"
+#include "effect10_randomfan.h"
+#include "effect15_singlepoly.h"
+#include "effect19_sparkle.h"
+
+struct BenchResult
+{
+    std::string name;
+    std::string unit;
+    double      rate;    // units per second, the best repetition.
+    double      seconds; // the time of the best repetition.
+};
+
+static std::vector<BenchResult> g_results;
+static const char*              g_filter = 0;
+static double                   g_minTime = 0.2;
+
+// Keeps the compiler from optimizing the measured work away.
+static volatile float g_sink;
+
+static
+bool IsSelected(const std::string& name)
+{
+    return g_filter == 0 || name.find(g_filter) != std::string::npos;
+}
+
+// \brief run fn(iterations) repeatedly, doubling the iterations
+// until one run takes g_minTime, and keep the best of three runs.
+//
+// \param fn returns the number of units processed.
+template <class Fn>
+static
+void Measure(const std::string& name, const char* unit, Fn fn)
+{
+    if (!IsSelected(name))
+    {
+        return;
+    }
+
+    long long iterations = 1;
+    for (;;)
+    {
+        Timer timer;
+        fn(iterations);
+        if (timer.GetElapsedSeconds() >= g_minTime || iterations >= (1LL << 40))
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    BenchResult result;
+    result.name = name;
+    result.unit = unit;
+    result.rate = 0;
+    result.seconds = 0;
+
+    for (int r = 0; r < 3; ++r)
+    {
+        Timer timer;
+        double units = fn(iterations);
+        double seconds = timer.GetElapsedSeconds();
+        double rate = units / (seconds > 0 ? seconds : 1e-9);
+
+        if (rate > result.rate)
+        {
+            result.rate = rate;
+            result.seconds = seconds;
+        }
+    }
+
+    fprintf(stdout, "%-40s %14.4g %s\n", name.c_str(), result.rate, unit);
+    g_results.push_back(result);
+}
+
+//
+// flare.hpp primitives
+//
+
+template <class Primitive>
+static
+double RunPrimitive(Primitive& primitive, int width, int height, long long iterations)
+{
+    float c[3], sum = 0;
+
+    for (long long it = 0; it < iterations; ++it)
+    {
+        for (int i = 0; i < height; ++i)
+        {
+            for (int j = 0; j < width; ++j)
+            {
+                primitive.GetPixel(i, j, c);
+                sum += c[0];
+            }
+        }
+    }
+
+    g_sink = sum;
+    return (double)iterations * width * height;
+}
+
+static
+void BenchPrimitives()
+{
+    const int width = 640, height = 480;
+    float rgb[] = {255, 200, 100};
+
+    Flare flare(width, height, 320, 240, 150, 20, rgb);
+    FlareSolid solid(width, height, 320, 240, 150, rgb);
+    FlareGradient gradient(width, height, 320, 240, 150, rgb, 2.2f);
+
+    Measure("primitive/Flare", "pixels/s", [&](long long n) {
+        return RunPrimitive(flare, width, height, n);
+    });
+    Measure("primitive/FlareSolid", "pixels/s", [&](long long n) {
+        return RunPrimitive(solid, width, height, n);
+    });
+    Measure("primitive/FlareGradient", "pixels/s", [&](long long n) {
+        return RunPrimitive(gradient, width, height, n);
+    });
+
+    // The primitive.h kernels of the same disks, counted as canvas
+    // pixels to compare with the GetPixel loops.
+    IplImage* pImage = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    cvZero(pImage);
+
+    Measure("primitive/RingProfile", "pixels/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            drawPrimitive<RingProfile, 3, float, BlendAdditive>(RingProfile(150, 20), 320, 240, rgb, pImage);
+        }
+        return (double)n * width * height;
+    });
+    Measure("primitive/DiskProfile", "pixels/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            drawPrimitive<DiskProfile, 3, float, BlendAdditive>(DiskProfile(150), 320, 240, rgb, pImage);
+        }
+        return (double)n * width * height;
+    });
+    Measure("primitive/GradientProfile", "pixels/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            drawPrimitive<GradientProfile, 3, float, BlendAdditive>(GradientProfile(150, 2.2f), 320, 240, rgb, pImage);
+        }
+        return (double)n * width * height;
+    });
+
+    cvReleaseImage(&pImage);
+}
+
+//
+// poly.cpp scan converter
+//
+
+struct PolyTarget
+{
+    long long pixels;  // the pixels with some coverage.
+    long long area;    // the covered subpixels.
+    int       columns; // the subpixels of a pixel.
+};
+
+static int benchScreenX(Vertex* v, void* user)
+{
+    return (int)(v->image.x * ((PolyTarget*)user)->columns);
+}
+
+static void benchLerp(double alpha, Vertex* a, Vertex* b, Vertex* out, void*)
+{
+    out->image.x = LERP(alpha, a->image.x, b->image.x);
+    out->image.y = LERP(alpha, a->image.y, b->image.y);
+    out->y = (int)LERP(alpha, a->y, b->y);
+}
+
+static void benchRenderPixel(int, int, Vertex*, int area, unsigned[], Surface*, void* user)
+{
+    PolyTarget* pTarget = (PolyTarget*)user;
+    if (area > 0)
+    {
+        pTarget->pixels++;
+        pTarget->area += area;
+    }
+}
+
+static void benchRenderPixel64(int x, int y, Vertex* v, int area, uint64_t[], Surface* object, void* user)
+{
+    benchRenderPixel(x, y, v, area, 0, object, user);
+}
+
+// \brief a random convex polygon. The vertices go counterclockwise
+// in y-down screen space, which is the order drawPolygon scans.
+static
+int MakePolygon(MyRandom& random, Vertex* polygon, int width, int height)
+{
+    int n = 3 + random.GetUInt() % 6;
+    float cx = random.GetFloat(0.2f * width, 0.8f * width);
+    float cy = random.GetFloat(0.2f * height, 0.8f * height);
+    float r = random.GetFloat(10.0f, 0.2f * height);
+    float phase = random.GetFloat(0.0f, 2.0f * M_PI);
+
+    for (int k = 0; k < n; ++k)
+    {
+        float a = phase - 2.0f * M_PI * k / n;
+        memset(&polygon[k], 0, sizeof(Vertex));
+        polygon[k].image.x = cx + r * cos(a);
+        polygon[k].image.y = cy + r * sin(a);
+        polygon[k].y = (int)(polygon[k].image.y * SUBYRES);
+    }
+
+    return n;
+}
+
+static
+void BenchPoly()
+{
+    const int width = 640, height = 480;
+    const int count = 256;
+
+    MyRandom random;
+    std::vector<Vertex> polygons(count * 8);
+    std::vector<int> sizes(count);
+    for (int p = 0; p < count; ++p)
+    {
+        sizes[p] = MakePolygon(random, &polygons[p * 8], width, height);
+    }
+
+    PolyTarget target = { 0, 0, SUBXRES };
+    PolyCallbacks callbacks = { benchScreenX, benchLerp, benchRenderPixel, &target };
+    PolyCallbacks64 callbacks64 = { benchScreenX, benchLerp, benchRenderPixel64, &target };
+    Surface surface = { 255, 255, 255 };
+
+    Measure("poly/polygons", "polygons/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            for (int p = 0; p < count; ++p)
+            {
+                drawPolygon(&polygons[p * 8], sizes[p], &surface, &callbacks);
+            }
+        }
+        return (double)n * count;
+    });
+
+    Measure("poly/pixels", "pixels/s", [&](long long n) {
+        target.pixels = 0;
+        for (long long it = 0; it < n; ++it)
+        {
+            for (int p = 0; p < count; ++p)
+            {
+                drawPolygon(&polygons[p * 8], sizes[p], &surface, &callbacks);
+            }
+        }
+        return (double)target.pixels;
+    });
+
+    // The same polygons on each grid of drawPolygonGrid, the 16x64
+    // one with 64-bit mask rows.
+    for (int g = 0; g < POLY_GRID_COUNT; ++g)
+    {
+        PolyGrid grid = (PolyGrid)g;
+        std::vector<Vertex> scaled(polygons);
+        for (size_t k = 0; k < scaled.size(); ++k)
+        {
+            scaled[k].y = (int)(scaled[k].image.y * polyGridRows(grid));
+        }
+
+        char name[64];
+        sprintf(name, "poly/grid%dx%d", polyGridRows(grid), polyGridColumns(grid));
+        Measure(name, "pixels/s", [&](long long n) {
+            target.pixels = 0;
+            target.columns = polyGridColumns(grid);
+            for (long long it = 0; it < n; ++it)
+            {
+                for (int p = 0; p < count; ++p)
+                {
+                    if (grid == POLY_GRID_16X64)
+                    {
+                        drawPolygonGrid(grid, &scaled[p * 8], sizes[p], &surface, &callbacks64);
+                    }
+                    else
+                    {
+                        drawPolygonGrid(grid, &scaled[p * 8], sizes[p], &surface, &callbacks);
+                    }
+                }
+            }
+            return (double)target.pixels;
+        });
+    }
+}
+
+//
+// ColorConv.h
+//
+
+template <class Fn>
+static
+void MeasureColor(const char* name, const std::vector<float>& pixels, Fn fn)
+{
+    std::vector<float> out(pixels.size());
+    int n = (int)pixels.size() / 3;
+
+    Measure(std::string("color/") + name, "pixels/s", [&](long long iterations) {
+        for (long long it = 0; it < iterations; ++it)
+        {
+            for (int k = 0; k < n; ++k)
+            {
+                fn((float*)&pixels[k * 3], &out[k * 3]);
+            }
+        }
+        g_sink = out[0];
+        return (double)iterations * n;
+    });
+}
+
+static
+void BenchColor()
+{
+    const int n = 1 << 16;
+
+    MyRandom random;
+    std::vector<float> rgb(n * 3), lab(n * 3), hsv(n * 3);
+    for (int k = 0; k < n * 3; ++k)
+    {
+        rgb[k] = random.GetFloat();
+    }
+    for (int k = 0; k < n; ++k)
+    {
+        rgb2lab(&rgb[k * 3], &lab[k * 3]);
+        rgb2hsv(&rgb[k * 3], &hsv[k * 3]);
+    }
+
+    MeasureColor("rgb2xyz", rgb, rgb2xyz);
+    MeasureColor("xyz2rgb", rgb, xyz2rgb);
+    MeasureColor("rgb2lab", rgb, rgb2lab);
+    MeasureColor("lab2rgb", lab, lab2rgb);
+    MeasureColor("rgb2hsv", rgb, rgb2hsv);
+    MeasureColor("hsv2rgb", hsv, hsv2rgb);
+    MeasureColor("rgb2hsl", rgb, rgb2hsl);
+    MeasureColor("hsl2rgb", hsv, hsl2rgb);
+}
+
+//
+// MyRandom
+//
+
+static
+void BenchRandom()
+{
+    MyRandom random;
+
+    Measure("random/GetUInt", "values/s", [&](long long n) {
+        unsigned int sum = 0;
+        for (long long it = 0; it < n * 1024; ++it)
+        {
+            sum += random.GetUInt();
+        }
+        g_sink = (float)sum;
+        return (double)n * 1024;
+    });
+
+    Measure("random/GetFloat", "values/s", [&](long long n) {
+        float sum = 0;
+        for (long long it = 0; it < n * 1024; ++it)
+        {
+            sum += random.GetFloat();
+        }
+        g_sink = sum;
+        return (double)n * 1024;
+    });
+}
+
+//
+// blur.h. The rate should not depend on sigma.
+//
+
+static
+void BenchBlur()
+{
+    const int width = 3840, height = 2160;
+    static const float sigmas[] = {2, 16, 128};
+
+    IplImage* pImage = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    MyRandom random;
+    for (int i = 0; i < height; ++i)
+    {
+        float* p = (float*)(pImage->imageData + i * pImage->widthStep);
+        for (int k = 0; k < width * 3; ++k)
+        {
+            p[k] = random.GetFloat(0.0f, 255.0f);
+        }
+    }
+
+    GaussianBlur blur;
+    for (int s = 0; s < (int)(sizeof(sigmas) / sizeof(sigmas[0])); ++s)
+    {
+        char name[64];
+        sprintf(name, "blur/sigma%d", (int)sigmas[s]);
+
+        Measure(name, "pixels/s", [&](long long n) {
+            for (long long it = 0; it < n; ++it)
+            {
+                blur.Apply(pImage, sigmas[s]);
+            }
+            return (double)n * width * height;
+        });
+    }
+
+    cvReleaseImage(&pImage);
+}
+
+//
+// streak.h. The rate should barely depend on the length.
+//
+
+static
+void BenchStreak()
+{
+    const int width = 1920, height = 1080;
+    static const float lengths[] = {16, 128, 1024};
+
+    IplImage* pSrc = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    IplImage* pDst = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    MyRandom random;
+    for (int i = 0; i < height; ++i)
+    {
+        float* p = (float*)(pSrc->imageData + i * pSrc->widthStep);
+        for (int k = 0; k < width * 3; ++k)
+        {
+            p[k] = random.GetFloat(0.0f, 255.0f);
+        }
+    }
+    cvZero(pDst);
+
+    StreakFilter filter;
+    for (int s = 0; s < (int)(sizeof(lengths) / sizeof(lengths[0])); ++s)
+    {
+        char name[64];
+        sprintf(name, "streak/length%d", (int)lengths[s]);
+
+        Measure(name, "pixels/s", [&](long long n) {
+            for (long long it = 0; it < n; ++it)
+            {
+                filter.ApplyStar(pSrc, pDst, 4, 0.3f, lengths[s]);
+            }
+            return (double)n * width * height;
+        });
+    }
+
+    cvReleaseImage(&pSrc);
+    cvReleaseImage(&pDst);
+}
+
+//
+// starburst.h. A new engine per call, so nothing is cached.
+//
+
+static
+void BenchStarburst()
+{
+    ApertureShape shape = { 6, 0.2f, 0.0f, 1024, POLY_GRID_8X16 };
+
+    Measure("starburst/spectrum1024", "calls/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            Starburst starburst;
+            g_sink = (*starburst.GetSpectrum(shape))[0];
+        }
+        return (double)n;
+    });
+}
+
+//
+// binning.h
+//
+
+static
+void MakeGhosts(MyRandom& random, PrimitiveList& primitives, int count,
+                int width, int height, float minRadius, float maxRadius)
+{
+    for (int p = 0; p < count; ++p)
+    {
+        int x = (int)random.GetFloat(0.0f, (float)width);
+        int y = (int)random.GetFloat(0.0f, (float)height);
+        float radius = random.GetFloat(minRadius, maxRadius);
+        float rgb[] = { random.GetFloat(0.0f, 64.0f), random.GetFloat(0.0f, 64.0f), random.GetFloat(0.0f, 64.0f) };
+
+        switch (p % 3)
+        {
+            case 0:  primitives.AddRing(x, y, radius, 0.1f * radius + 1.0f, rgb); break;
+            case 1:  primitives.AddDisk(x, y, radius, rgb); break;
+            default: primitives.AddGradient(x, y, radius, rgb, 2.2f); break;
+        }
+    }
+}
+
+static
+void BenchBinning()
+{
+    const int width = 1920, height = 1080;
+
+    IplImage* pImage = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    MyRandom random;
+    PrimitiveList ghosts, sparkles;
+    MakeGhosts(random, ghosts, 400, width, height, 10.0f, 200.0f);
+    MakeGhosts(random, sparkles, 4000, width, height, 1.0f, 6.0f);
+
+    BinningRenderer renderer32(32), renderer64(64);
+
+    Measure("binning/ghosts400/tile32", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            renderer32.Render(ghosts, pImage);
+        }
+        return (double)n;
+    });
+    Measure("binning/ghosts400/tile64", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            renderer64.Render(ghosts, pImage);
+        }
+        return (double)n;
+    });
+    Measure("binning/sparkles4000/tile32", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            renderer32.Render(sparkles, pImage);
+        }
+        return (double)n;
+    });
+
+    // 8-bit previews: the float path and its conversion against the
+    // fixed-point path.
+    IplImage* pBytes = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 3);
+    LFBuffer bytes;
+    lfWrapImage(pBytes, &bytes);
+
+    Measure("binning/ghosts400/float_u8", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            renderer32.Render(ghosts, pImage);
+            lfWriteResult(pImage, &bytes, 0, 0);
+        }
+        return (double)n;
+    });
+    Measure("binning/ghosts400/fixed_u8", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            renderer32.Render(ghosts, pBytes);
+        }
+        return (double)n;
+    });
+
+    cvReleaseImage(&pBytes);
+    cvReleaseImage(&pImage);
+}
+
+// \brief the colorize pass of a color sweep; the coverage is drawn
+// once, so this is the cost per variant.
+static
+void BenchSweep()
+{
+    IplImage* pCoverage = cvCreateImage(cvSize(1920, 1080), IPL_DEPTH_32F, 3);
+    cvSet(pCoverage, cvScalarAll(128));
+
+    Sweep sweep([&](const SweepVariant&) {
+        return pCoverage;
+    });
+
+    MyRandom random;
+    for (int k = 0; k < 16; ++k)
+    {
+        float color[] = { random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f) };
+        sweep.AddColor(color);
+    }
+
+    volatile float sink = 0;
+    Measure("sweep/colors16", "variants/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            sweep.Run([&](const SweepVariant&, const IplImage* image) {
+                sink = ((const float*)image->imageData)[0];
+            });
+        }
+        return (double)(n * sweep.GetVariantCount());
+    });
+
+    cvReleaseImage(&pCoverage);
+}
+
+static
+void BenchOcclusion()
+{
+    IplImage* pFrame = cvCreateImage(cvSize(1920, 1080), IPL_DEPTH_8U, 3);
+    MyRandom random;
+    for (int i = 0; i < pFrame->height; ++i)
+    {
+        unsigned char* p = (unsigned char*)(pFrame->imageData + i * pFrame->widthStep);
+        for (int j = 0; j < pFrame->width * 3; ++j)
+        {
+            p[j] = (unsigned char)(random.GetUInt() % 256);
+        }
+    }
+
+    OcclusionMap occlusion;
+    Measure("occlusion/build1080p", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            occlusion.Build(pFrame);
+        }
+        return (double)n;
+    });
+
+    std::vector<LightSource> lights(1000);
+    for (size_t k = 0; k < lights.size(); ++k)
+    {
+        lights[k].x = random.GetFloat(0.0f, 1920.0f);
+        lights[k].y = random.GetFloat(0.0f, 1080.0f);
+    }
+
+    std::vector<float> visibility;
+    Measure("occlusion/lights1000", "queries/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            occlusion.GetVisibility(lights, 20.0f, visibility);
+            g_sink = visibility[0];
+        }
+        return (double)(n * lights.size());
+    });
+
+    cvReleaseImage(&pFrame);
+}
+
+static
+void BenchParticles()
+{
+    const int width = 1920, height = 1080, count = 50000;
+
+    ParticleEmitter emitter = {
+        0.0f, 0.0f, (float)width, (float)height,
+        1.0f, 4.0f, 0.5f, 3.0f, 0.5f, 4.0f, 8.0f,
+        { 255.0f, 255.0f, 255.0f }, 0.3f
+    };
+    ParticleSystem particles(count);
+    MyRandom random;
+    particles.Spawn(emitter, count, random);
+
+    // Steps short enough that none dies, so the count stays put.
+    Measure("particles/update50000", "particles/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            particles.Update(1e-6f);
+        }
+        return (double)(n * particles.GetCount());
+    });
+
+    // A frame at 30 fps: step, top up, emit and render.
+    IplImage* pImage = cvCreateImage(cvSize(width, height), IPL_DEPTH_32F, 3);
+    BinningRenderer renderer;
+    PrimitiveList sparkles;
+    Measure("particles/frame50000", "frames/s", [&](long long n) {
+        for (long long it = 0; it < n; ++it)
+        {
+            particles.Update(1.0f / 30.0f);
+            particles.Spawn(emitter, count - particles.GetCount(), random);
+            particles.Emit(sparkles);
+            renderer.Render(sparkles, pImage);
+        }
+        return (double)n;
+    });
+
+    cvReleaseImage(&pImage);
+}
+
+static
+void BenchTiled()
+{
+    const int size = 4096;
+
+    MyRandom random;
+    PrimitiveList primitives;
+    MakeGhosts(random, primitives, 400, size, size, 20.0f, 400.0f);
+    MakeGhosts(random, primitives, 4000, size, size, 2.0f, 12.0f);
+
+    // The tiles go nowhere, to time the rendering alone.
+    const float sigmas[] = { 0.0f, 16.0f };
+    for (int s = 0; s < 2; ++s)
+    {
+        float sigma = sigmas[s];
+        GaussianBlur blur;
+        TiledRenderer renderer(1024, sigma > 0 ? blurSupport(sigma) : 0);
+
+        char name[64];
+        sprintf(name, "tiled/canvas4k/sigma%d", (int)sigma);
+        Measure(name, "pixels/s", [&](long long n) {
+            for (long long it = 0; it < n; ++it)
+            {
+                renderer.Render(size, size,
+                    [&](IplImage* pTile, CvRect region) {
+                        PrimitiveList culled;
+                        cullPrimitives(primitives, region, culled);
+                        BinningRenderer binning;
+                        binning.Render(culled, pTile);
+                        if (sigma > 0)
+                        {
+                            blur.Apply(pTile, sigma);
+                        }
+                        return true;
+                    },
+                    [&](const IplImage* pTile, int, int) {
+                        g_sink = pTile->imageData[0];
+                        return true;
+                    });
+            }
+            return (double)n * size * size;
+        });
+    }
+}
+
+//
+// Effects. The parameters are the start-up ones of main.cpp.
+//
+
+static int   g_rayNumber = 10;
+static int   g_rayLength = 20;
+static float g_rayAngle  = M_PI * 133.0f / 180.0f;
+static float g_color[]   = {255, 255, 255};
+static float g_color1[]  = {255, 0, 0};
+
+static effect01_glowball::Effect* New01(int w, int h)
+{
+    return new effect01_glowball::Effect(w, h, 20, 30, 20, g_rayLength, g_rayNumber, g_color, g_color1);
+}
+
+static effect02_spikeball::Effect* New02(int w, int h)
+{
+    return new effect02_spikeball::Effect(w, h, g_rayLength, g_rayNumber, g_color, g_rayAngle);
+}
+
+static effect03_starfilter::Effect* New03(int w, int h)
+{
+    return new effect03_starfilter::Effect(w, h, g_rayNumber, g_rayLength, g_color, g_rayAngle, 5, 10);
+}
+
+static effect05_circlespread::Effect* New05(int w, int h)
+{
+    return new effect05_circlespread::Effect(w, h, 50, g_rayNumber, 5, 50, 101, 102, g_rayAngle, g_color);
+}
+
+static effect09_stripe::Effect* New09(int w, int h)
+{
+    return new effect09_stripe::Effect(w, h, g_rayLength, g_rayNumber, g_color1, true, g_color, g_rayAngle);
+}
+
+static effect10_randomfan::Effect* New10(int w, int h)
+{
+    return new effect10_randomfan::Effect(w, h, g_rayNumber, g_rayLength, g_color, g_rayAngle);
+}
+
+static effect15_singlepoly::Effect* New15(int w, int h)
+{
+    return new effect15_singlepoly::Effect(w, h, g_rayLength, g_rayNumber, 0, g_color, g_rayAngle);
+}
+
+static effect19_sparkle::Effect* New19(int w, int h)
+{
+    return new effect19_sparkle::Effect(w, h, g_rayNumber, g_rayLength, g_color, 133);
+}
+
+template <class EffectT>
+static
+void BenchEffect(const char* name, EffectT* (*create)(int, int))
+{
+    static const int sizes[][2] = { {640, 480}, {1920, 1080}, {3840, 2160} };
+
+    for (int s = 0; s < 3; ++s)
+    {
+        int w = sizes[s][0];
+        int h = sizes[s][1];
+        char prefix[64];
+        sprintf(prefix, "effect/%s/%dx%d/", name, w, h);
+
+        Measure(std::string(prefix) + "Init", "calls/s", [&](long long n) {
+            for (long long it = 0; it < n; ++it)
+            {
+                EffectT* pEffect = create(w, h);
+                pEffect->Init();
+                delete pEffect;
+            }
+            return (double)n;
+        });
+
+        if (!IsSelected(std::string(prefix) + "Draw"))
+        {
+            continue;
+        }
+
+        EffectT* pEffect = create(w, h);
+        if (!pEffect->Init())
+        {
+            fprintf(stderr, "Err: %s init failed.\n", name);
+            delete pEffect;
+            continue;
+        }
+
+        Measure(std::string(prefix) + "Draw", "calls/s", [&](long long n) {
+            for (long long it = 0; it < n; ++it)
+            {
+                pEffect->Draw();
+            }
+            return (double)n;
+        });
+
+        delete pEffect;
+    }
+}
+
+static
+void BenchEffects()
+{
+    BenchEffect("effect01", New01);
+    BenchEffect("effect02", New02);
+    BenchEffect("effect03", New03);
+    BenchEffect("effect05", New05);
+    BenchEffect("effect09", New09);
+    BenchEffect("effect10", New10);
+    BenchEffect("effect15", New15);
+    BenchEffect("effect19", New19);
+}
+
+//
+// JSON output and baseline comparison.
+//
+
+static
+bool WriteJson(const char* path)
+{
+    FILE* fp = fopen(path, "w");
+    if (fp == 0)
+    {
+        return false;
+    }
+
+    fprintf(fp, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < g_results.size(); ++i)
+    {
+        const BenchResult& r = g_results[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"unit\": \"%s\", \"rate\": %.6g, \"seconds\": %.6g}%s\n",
+                r.name.c_str(), r.unit.c_str(), r.rate, r.seconds,
+                i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    fclose(fp);
+    return true;
+}
+
+// \brief read the name/rate pairs of a file written by WriteJson.
+static
+bool ReadJson(const char* path, std::map<std::string, double>& rates)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == 0)
+    {
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp) != 0)
+    {
+        const char* name = strstr(line, "\"name\": \"");
+        const char* rate = strstr(line, "\"rate\": ");
+        if (name == 0 || rate == 0)
+        {
+            continue;
+        }
+
+        name += 9;
+        const char* end = strchr(name, '"');
+        if (end != 0)
+        {
+            rates[std::string(name, end)] = atof(rate + 8);
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// \return the number of regressions.
+static
+int CompareBaseline(const char* path, double threshold)
+{
+    std::map<std::string, double> baseline;
+    if (!ReadJson(path, baseline))
+    {
+        fprintf(stderr, "Err: failed to read the baseline %s.\n", path);
+        return 1;
+    }
+
+    int regressions = 0;
+    for (size_t i = 0; i < g_results.size(); ++i)
+    {
+        const BenchResult& r = g_results[i];
+        std::map<std::string, double>::const_iterator it = baseline.find(r.name);
+        if (it == baseline.end() || it->second <= 0)
+        {
+            continue;
+        }
+
+        double ratio = r.rate / it->second;
+        if (ratio < 1.0 - threshold)
+        {
+            fprintf(stdout, "REGRESSION %-40s %6.1f%% of baseline\n", r.name.c_str(), ratio * 100.0);
+            ++regressions;
+        }
+    }
+
+    fprintf(stdout, "%d regression(s) against %s (threshold %.0f%%).\n",
+            regressions, path, threshold * 100.0);
+    return regressions;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* json = "bench.json";
+    const char* baseline = 0;
+    double threshold = 0.1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            g_filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+        {
+            g_minTime = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+        {
+            json = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+        {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+        {
+            threshold = atof(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--filter <substring>] [--min-time <seconds>] "
+                    "[--json <file>] [--baseline <file>] [--threshold <ratio>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    BenchPrimitives();
+    BenchPoly();
+    BenchColor();
+    BenchRandom();
+    BenchBlur();
+    BenchStreak();
+    BenchStarburst();
+    BenchBinning();
+    BenchSweep();
+    BenchOcclusion();
+    BenchParticles();
+    BenchTiled();
+    BenchEffects();
+
+    if (!WriteJson(json))
+    {
+        fprintf(stderr, "Err: failed to write %s.\n", json);
+        return 2;
+    }
+
+    if (baseline != 0 && CompareBaseline(baseline, threshold) > 0)
+    {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,457 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   binning.h
+ *
+ * Abstract:
+ *
+ *   Tile-binned rendering of many flare disks (the ring, solid
+ *   and gradient disks of flare.hpp).
+ *
+ *   The primitives are kept as a structure of arrays. They are
+ *   binned into square screen tiles by their bounding circle (a
+ *   ring also skips the tiles inside its hole), then every tile is
+ *   shaded on a worker thread against its own primitives only,
+ *   with the kernels of primitive.h, into a small accumulation
+ *   buffer that stays in cache, and written out once. The work
+ *   follows the covered area instead of primitives x canvas. An
+ *   8-bit target takes the fixed-point kernels of fixedpoint.h
+ *   instead of the float ones.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef BINNING_H
+#define BINNING_H
+
+#include <cstring>
+#include <vector>
+
+#include "common.h"
+#include "fixedpoint.h"
+#include "primitive.h"
+#include "threadpool.h"
+#include "trace.h"
+
+enum PrimitiveType
+{
+    PRIMITIVE_RING     = 0, // Flare
+    PRIMITIVE_DISK     = 1, // FlareSolid
+    PRIMITIVE_GRADIENT = 2, // FlareGradient
+};
+
+// \brief the disks of a frame as a structure of arrays.
+class PrimitiveList
+{
+public:
+    void Clear()
+    {
+        type.clear();
+        cx.clear();
+        cy.clear();
+        inner.clear();
+        outer.clear();
+        gamma.clear();
+        red.clear();
+        green.clear();
+        blue.clear();
+    };
+
+    int GetCount() const
+    {
+        return (int)type.size();
+    };
+
+    // \brief the same ring as Flare.
+    void AddRing(int x, int y, float radius, float thickness, const float rgb[])
+    {
+        Add(PRIMITIVE_RING, x, y, radius - thickness * 0.5f, radius + thickness * 0.5f, 0, rgb);
+    };
+
+    // \brief the same disk as FlareSolid.
+    void AddDisk(int x, int y, float radius, const float rgb[])
+    {
+        Add(PRIMITIVE_DISK, x, y, 0, radius, 0, rgb);
+    };
+
+    // \brief the same disk as FlareGradient.
+    void AddGradient(int x, int y, float radius, const float rgb[], float g)
+    {
+        Add(PRIMITIVE_GRADIENT, x, y, 0, radius, g, rgb);
+    };
+
+    // \brief copy a primitive of another list, moved by (dx, dy).
+    void Append(const PrimitiveList& src, int p, int dx, int dy)
+    {
+        type.push_back(src.type[p]);
+        cx.push_back(src.cx[p] + (float)dx);
+        cy.push_back(src.cy[p] + (float)dy);
+        inner.push_back(src.inner[p]);
+        outer.push_back(src.outer[p]);
+        gamma.push_back(src.gamma[p]);
+        red.push_back(src.red[p]);
+        green.push_back(src.green[p]);
+        blue.push_back(src.blue[p]);
+    };
+
+public:
+    std::vector<unsigned char> type;
+    std::vector<float>         cx;
+    std::vector<float>         cy;
+    std::vector<float>         inner; // the hole of a ring.
+    std::vector<float>         outer;
+    std::vector<float>         gamma;
+    std::vector<float>         red;   // rgb[0] of flare.hpp.
+    std::vector<float>         green;
+    std::vector<float>         blue;
+
+private:
+    void Add(int t, int x, int y, float in, float out, float g, const float rgb[])
+    {
+        type.push_back((unsigned char)t);
+        cx.push_back((float)x);
+        cy.push_back((float)y);
+        inner.push_back(in);
+        outer.push_back(out);
+        gamma.push_back(g);
+        red.push_back(rgb[0]);
+        green.push_back(rgb[1]);
+        blue.push_back(rgb[2]);
+    };
+};
+
+class BinningRenderer
+{
+public:
+    // \brief constructor.
+    //
+    // \param tileSize the tile width and height, 32 or 64.
+    // \param pPool the threads to run on, 0 for the shared pool.
+    BinningRenderer(int tileSize = 32, ThreadPool* pPool = 0)
+    {
+        m_tileSize = tileSize >= 64 ? 64 : 32;
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+    };
+
+    // \brief render the primitives, summed, into the image.
+    //
+    // \param primitives the disks.
+    // \param dst a 3-channel float image, or an 8-bit image of 3 or 4
+    //    channels (saturated, the alpha left alone or set to 255);
+    //    rgb[0] of the primitives goes to its first channel, like
+    //    GetPixel.
+    // \param accumulate add to dst instead of overwriting it.
+    // \return false if the image is not supported.
+    bool Render(const PrimitiveList& primitives, IplImage* dst, bool accumulate = false)
+    {
+        bool fixed = dst->depth == IPL_DEPTH_8U && (dst->nChannels == 3 || dst->nChannels == 4);
+        if (!fixed && (dst->depth != IPL_DEPTH_32F || dst->nChannels != 3))
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("binning");
+
+        m_tilesX = (dst->width + m_tileSize - 1) / m_tileSize;
+        m_tilesY = (dst->height + m_tileSize - 1) / m_tileSize;
+
+        Bin(primitives, dst->width, dst->height);
+        if (fixed)
+        {
+            BuildGradientTables(primitives);
+        }
+
+        m_pPool->ParallelFor(m_tilesX * m_tilesY, 4, [&](int begin, int end) {
+            for (int t = begin; t < end; ++t)
+            {
+                // Nothing to add where no primitive reaches.
+                if (accumulate && m_offsets[t] == m_offsets[t + 1])
+                {
+                    continue;
+                }
+
+                if (!fixed)
+                {
+                    ShadeTile(primitives, t, dst, accumulate);
+                }
+                else if (dst->nChannels == 3)
+                {
+                    ShadeTileFixed<3>(primitives, t, dst, accumulate);
+                }
+                else
+                {
+                    ShadeTileFixed<4>(primitives, t, dst, accumulate);
+                }
+            }
+        });
+
+        return true;
+    };
+
+    // \brief the number of (primitive, tile) pairs of the last render.
+    int GetBinnedCount() const
+    {
+        return (int)m_binned.size();
+    };
+
+private:
+    // \brief whether the annulus inner <= d <= outer around (x, y)
+    // touches the pixel centers [x0, x1] x [y0, y1].
+    static bool Overlaps(float x, float y, float in, float out,
+                         float x0, float y0, float x1, float y1)
+    {
+        // The nearest and the farthest points of the rectangle.
+        float nx = x < x0 ? x0 - x : (x > x1 ? x - x1 : 0.0f);
+        float ny = y < y0 ? y0 - y : (y > y1 ? y - y1 : 0.0f);
+        if (nx * nx + ny * ny > out * out)
+        {
+            return false;
+        }
+
+        float fx = MAX(fabs(x - x0), fabs(x - x1));
+        float fy = MAX(fabs(y - y0), fabs(y - y1));
+        return fx * fx + fy * fy >= in * in;
+    };
+
+    // \brief sort the primitives into the tiles they touch, keeping
+    // their order within each tile.
+    void Bin(const PrimitiveList& primitives, int width, int height)
+    {
+        int numTiles = m_tilesX * m_tilesY;
+        int count = primitives.GetCount();
+
+        m_offsets.assign(numTiles + 1, 0);
+        m_binned.clear();
+
+        // Two passes: count per tile, then fill.
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            std::vector<int> cursor;
+            if (pass == 1)
+            {
+                for (int t = 0; t < numTiles; ++t)
+                {
+                    m_offsets[t + 1] += m_offsets[t];
+                }
+                m_binned.resize(m_offsets[numTiles]);
+                cursor.assign(m_offsets.begin(), m_offsets.end() - 1);
+            }
+
+            for (int p = 0; p < count; ++p)
+            {
+                float x = primitives.cx[p];
+                float y = primitives.cy[p];
+                float in = primitives.inner[p];
+                float out = primitives.outer[p];
+
+                int tx0 = MAX(0, (int)floor((x - out) / m_tileSize));
+                int ty0 = MAX(0, (int)floor((y - out) / m_tileSize));
+                int tx1 = MIN(m_tilesX - 1, (int)floor((x + out) / m_tileSize));
+                int ty1 = MIN(m_tilesY - 1, (int)floor((y + out) / m_tileSize));
+
+                for (int ty = ty0; ty <= ty1; ++ty)
+                {
+                    float y0 = (float)(ty * m_tileSize);
+                    float y1 = (float)(MIN((ty + 1) * m_tileSize, height) - 1);
+                    for (int tx = tx0; tx <= tx1; ++tx)
+                    {
+                        float x0 = (float)(tx * m_tileSize);
+                        float x1 = (float)(MIN((tx + 1) * m_tileSize, width) - 1);
+                        if (!Overlaps(x, y, in, out, x0, y0, x1, y1))
+                        {
+                            continue;
+                        }
+
+                        int t = ty * m_tilesX + tx;
+                        if (pass == 0)
+                        {
+                            m_offsets[t + 1]++;
+                        }
+                        else
+                        {
+                            m_binned[cursor[t]++] = p;
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    void ShadeTile(const PrimitiveList& primitives, int t, IplImage* dst, bool accumulate)
+    {
+        int tileX = (t % m_tilesX) * m_tileSize;
+        int tileY = (t / m_tilesX) * m_tileSize;
+        int w = MIN(m_tileSize, dst->width - tileX);
+        int h = MIN(m_tileSize, dst->height - tileY);
+
+        // The accumulation buffer of the tile, 12 or 48 KB.
+        static thread_local std::vector<float> buffer;
+        buffer.assign((size_t)m_tileSize * m_tileSize * 3, 0.0f);
+        float* tile = &buffer[0];
+
+        PrimitiveCanvas<float> canvas(tile, m_tileSize * 3, w, h, tileX, tileY);
+
+        for (int k = m_offsets[t]; k < m_offsets[t + 1]; ++k)
+        {
+            int p = m_binned[k];
+            float cx = primitives.cx[p];
+            float cy = primitives.cy[p];
+            float rgb[] = { primitives.red[p], primitives.green[p], primitives.blue[p] };
+
+            switch (primitives.type[p])
+            {
+                case PRIMITIVE_RING:
+                    drawPrimitive<RingProfile, 3, float, BlendAdditive>(
+                        RingProfile::FromEdges(primitives.inner[p], primitives.outer[p]), cx, cy, rgb, canvas);
+                    break;
+                case PRIMITIVE_DISK:
+                    drawPrimitive<DiskProfile, 3, float, BlendAdditive>(
+                        DiskProfile(primitives.outer[p]), cx, cy, rgb, canvas);
+                    break;
+                default:
+                    drawPrimitive<GradientProfile, 3, float, BlendAdditive>(
+                        GradientProfile(primitives.outer[p], primitives.gamma[p]), cx, cy, rgb, canvas);
+                    break;
+            }
+        }
+
+        for (int i = 0; i < h; ++i)
+        {
+            const float* src = tile + i * m_tileSize * 3;
+            float* p = (float*)(dst->imageData + (tileY + i) * dst->widthStep) + tileX * 3;
+            if (accumulate)
+            {
+                for (int k = 0; k < w * 3; ++k)
+                {
+                    p[k] += src[k];
+                }
+            }
+            else
+            {
+                memcpy(p, src, w * 3 * sizeof(float));
+            }
+        }
+    };
+
+    // \brief the coverage tables of the gradient disks for the fixed
+    // point path, one per primitive that is small enough.
+    void BuildGradientTables(const PrimitiveList& primitives)
+    {
+        int count = primitives.GetCount();
+        m_tableOffsets.assign(count + 1, 0);
+
+        int size = 0;
+        for (int p = 0; p < count; ++p)
+        {
+            m_tableOffsets[p] = size;
+            if (primitives.type[p] == PRIMITIVE_GRADIENT)
+            {
+                size += FixedGradientTable::GetSize(GradientProfile(primitives.outer[p], primitives.gamma[p]));
+            }
+        }
+        m_tableOffsets[count] = size;
+        m_tables.resize(size);
+
+        m_pPool->ParallelFor(count, 16, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p)
+            {
+                if (m_tableOffsets[p + 1] > m_tableOffsets[p])
+                {
+                    FixedGradientTable::Fill(GradientProfile(primitives.outer[p], primitives.gamma[p]),
+                                             &m_tables[m_tableOffsets[p]]);
+                }
+            }
+        });
+    };
+
+    // \brief ShadeTile into an 8-bit image, in fixed point.
+    template <int Channels>
+    void ShadeTileFixed(const PrimitiveList& primitives, int t, IplImage* dst, bool accumulate)
+    {
+        int tileX = (t % m_tilesX) * m_tileSize;
+        int tileY = (t / m_tilesX) * m_tileSize;
+        int w = MIN(m_tileSize, dst->width - tileX);
+        int h = MIN(m_tileSize, dst->height - tileY);
+
+        // The 8.8 accumulation buffer of the tile, 6 to 32 KB. An
+        // overwritten alpha comes out as 255.
+        static thread_local std::vector<uint16_t> buffer;
+        buffer.assign((size_t)m_tileSize * m_tileSize * Channels, 0);
+        uint16_t* tile = &buffer[0];
+        if (Channels == 4 && !accumulate)
+        {
+            for (size_t k = 3; k < buffer.size(); k += 4)
+            {
+                tile[k] = 255 << 8;
+            }
+        }
+
+        PrimitiveCanvas<uint16_t> canvas(tile, m_tileSize * Channels, w, h, tileX, tileY);
+
+        for (int k = m_offsets[t]; k < m_offsets[t + 1]; ++k)
+        {
+            int p = m_binned[k];
+            float cx = primitives.cx[p];
+            float cy = primitives.cy[p];
+            uint16_t rgb[4] = { fixedColor(primitives.red[p]), fixedColor(primitives.green[p]),
+                                fixedColor(primitives.blue[p]), 0 };
+            FixedColor<Channels> color(rgb);
+
+            switch (primitives.type[p])
+            {
+                case PRIMITIVE_RING:
+                    drawPrimitiveFixed<RingProfile, Channels>(
+                        RingProfile::FromEdges(primitives.inner[p], primitives.outer[p]), cx, cy, color, canvas);
+                    break;
+                case PRIMITIVE_DISK:
+                    drawPrimitiveFixed<DiskProfile, Channels>(
+                        DiskProfile(primitives.outer[p]), cx, cy, color, canvas);
+                    break;
+                default:
+                    if (m_tableOffsets[p + 1] > m_tableOffsets[p])
+                    {
+                        drawPrimitiveFixed<FixedGradientTable, Channels>(
+                            FixedGradientTable(&m_tables[m_tableOffsets[p]], m_tableOffsets[p + 1] - m_tableOffsets[p],
+                                               primitives.outer[p]), cx, cy, color, canvas);
+                    }
+                    else
+                    {
+                        drawPrimitiveFixed<GradientProfile, Channels>(
+                            GradientProfile(primitives.outer[p], primitives.gamma[p]), cx, cy, color, canvas);
+                    }
+                    break;
+            }
+        }
+
+        for (int i = 0; i < h; ++i)
+        {
+            fixedWriteSpan(tile + i * m_tileSize * Channels,
+                           (unsigned char*)(dst->imageData + (tileY + i) * dst->widthStep) + tileX * Channels,
+                           w * Channels, accumulate);
+        }
+    };
+
+private:
+    int              m_tileSize;
+    ThreadPool*      m_pPool;
+    int              m_tilesX;
+    int              m_tilesY;
+
+    // The primitives of tile t are m_binned[m_offsets[t]..m_offsets[t+1]).
+    std::vector<int> m_offsets;
+    std::vector<int> m_binned;
+
+    // The gradient table of primitive p is m_tables[m_tableOffsets[p]..
+    // m_tableOffsets[p+1]), empty if it has none.
+    std::vector<int>      m_tableOffsets;
+    std::vector<uint16_t> m_tables;
+};
+
+#endif // !BINNING_H
@@ -0,0 +1,341 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   blur.h
+ *
+ * Abstract:
+ *
+ *   Gaussian blur of float images at a constant cost per pixel.
+ *
+ *   The Gaussian is approximated by three stacked box filters
+ *   (the central limit theorem) whose widths are chosen to match
+ *   the requested sigma. Each box filter is a running sum, so a
+ *   pixel costs one add and one subtract per pass whatever the
+ *   radius. The rows are filtered in parallel, one pixel of up to
+ *   four channels per SSE register; the columns are filtered in
+ *   vertical strips on the thread pool, four columns per register.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef BLUR_H
+#define BLUR_H
+
+#include <cstring>
+#include <vector>
+
+#include "common.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// The number of stacked box filters.
+#define BLUR_PASSES 3
+
+// The width in floats of the vertical strips.
+#define BLUR_STRIP 64
+
+// \brief the radii of the box filters approximating a Gaussian.
+// Boxes of two widths w and w + 2 are mixed so that the variance of
+// the stack is as close to sigma^2 as possible.
+//
+// \param radii receives passes radii.
+static inline
+void blurBoxRadii(float sigma, int passes, int radii[])
+{
+    float ideal = sqrt(12.0f * sigma * sigma / (float)passes + 1.0f);
+    int lower = (int)floor(ideal);
+    if (lower % 2 == 0)
+    {
+        lower--;
+    }
+    int upper = lower + 2;
+
+    float m = (12.0f * sigma * sigma - (float)(passes * lower * lower) -
+               4.0f * (float)(passes * lower) - 3.0f * (float)passes) /
+              (-4.0f * (float)lower - 4.0f);
+    int numLower = (int)floor(m + 0.5f);
+
+    for (int k = 0; k < passes; ++k)
+    {
+        int width = k < numLower ? lower : upper;
+        radii[k] = width > 1 ? (width - 1) / 2 : 0;
+    }
+}
+
+// \brief how far a pixel reaches in a blur of sigma: the sum of the
+// box radii. A tile blurred with this much margin around it matches
+// the blur of the whole image inside.
+static inline
+int blurSupport(float sigma)
+{
+    int radii[BLUR_PASSES];
+    blurBoxRadii(sigma, BLUR_PASSES, radii);
+
+    int support = 0;
+    for (int k = 0; k < BLUR_PASSES; ++k)
+    {
+        support += radii[k];
+    }
+    return support;
+}
+
+// \brief the box filter of radius r along n samples, clamped at the
+// ends. The samples are stride floats apart and each one has lanes
+// floats (at most 4); dst may not alias src.
+static inline
+void boxFilterLine(const float* src, float* dst, int n, int stride, int lanes, int r)
+{
+    float scale = 1.0f / (float)(2 * r + 1);
+    int last = n - 1;
+
+    // The samples past the ends repeat the edge ones.
+    int inside = r < last ? r : last;
+
+    for (int c = 0; c < lanes; ++c)
+    {
+        float sum = (float)(r + 1) * src[c] + (float)(r - inside) * src[last * stride + c];
+        for (int k = 1; k <= inside; ++k)
+        {
+            sum += src[k * stride + c];
+        }
+
+        for (int k = 0; k < n; ++k)
+        {
+            dst[k * stride + c] = sum * scale;
+
+            int add = k + r + 1 < last ? k + r + 1 : last;
+            int sub = k - r > 0 ? k - r : 0;
+            sum += src[add * stride + c] - src[sub * stride + c];
+        }
+    }
+}
+
+#ifdef LF_SSE2
+// \brief boxFilterLine of 4 lanes in one register. The 4th float is
+// read and written past the 3-channel samples, so both buffers need
+// one float of padding.
+static inline
+void boxFilterLine4(const float* src, float* dst, int n, int stride, int r)
+{
+    __m128 scale = _mm_set1_ps(1.0f / (float)(2 * r + 1));
+    int last = n - 1;
+    int inside = r < last ? r : last;
+
+    __m128 sum = _mm_add_ps(_mm_mul_ps(_mm_set1_ps((float)(r + 1)), _mm_loadu_ps(src)),
+                            _mm_mul_ps(_mm_set1_ps((float)(r - inside)), _mm_loadu_ps(src + last * stride)));
+    for (int k = 1; k <= inside; ++k)
+    {
+        sum = _mm_add_ps(sum, _mm_loadu_ps(src + k * stride));
+    }
+
+    for (int k = 0; k < n; ++k)
+    {
+        _mm_storeu_ps(dst + k * stride, _mm_mul_ps(sum, scale));
+
+        int add = k + r + 1 < last ? k + r + 1 : last;
+        int sub = k - r > 0 ? k - r : 0;
+        sum = _mm_add_ps(sum, _mm_sub_ps(_mm_loadu_ps(src + add * stride),
+                                         _mm_loadu_ps(src + sub * stride)));
+    }
+}
+#endif
+
+// \brief the box filter of radius r down the columns of a strip of
+// rows x width floats (width a multiple of 4), clamped at the ends.
+static inline
+void boxFilterStrip(const float* src, float* dst, float* sum, int rows, int width, int r)
+{
+    int last = rows - 1;
+    int inside = r < last ? r : last;
+    float scale = 1.0f / (float)(2 * r + 1);
+
+    for (int c = 0; c < width; ++c)
+    {
+        sum[c] = (float)(r + 1) * src[c] + (float)(r - inside) * src[last * width + c];
+    }
+    for (int k = 1; k <= inside; ++k)
+    {
+        const float* row = src + k * width;
+        for (int c = 0; c < width; ++c)
+        {
+            sum[c] += row[c];
+        }
+    }
+
+    for (int k = 0; k < rows; ++k)
+    {
+        int add = k + r + 1 < last ? k + r + 1 : last;
+        int sub = k - r > 0 ? k - r : 0;
+        const float* pAdd = src + add * width;
+        const float* pSub = src + sub * width;
+        float* pDst = dst + k * width;
+        int c = 0;
+
+#ifdef LF_SSE2
+        __m128 s = _mm_set1_ps(scale);
+        for (; c < width; c += 4)
+        {
+            __m128 v = _mm_load_ps(sum + c);
+            _mm_store_ps(pDst + c, _mm_mul_ps(v, s));
+            _mm_store_ps(sum + c, _mm_add_ps(v, _mm_sub_ps(_mm_load_ps(pAdd + c),
+                                                           _mm_load_ps(pSub + c))));
+        }
+#endif
+
+        for (; c < width; ++c)
+        {
+            pDst[c] = sum[c] * scale;
+            sum[c] += pAdd[c] - pSub[c];
+        }
+    }
+}
+
+class GaussianBlur
+{
+public:
+    // \brief constructor.
+    //
+    // \param pPool the threads to run on, 0 for the shared pool.
+    GaussianBlur(ThreadPool* pPool = 0)
+    {
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+    };
+
+    // \brief blur the image in place.
+    //
+    // \param image a float image of 1 to 4 channels.
+    // \param sigma the standard deviation in pixels.
+    // \return false if the image is not supported.
+    bool Apply(IplImage* image, float sigma)
+    {
+        if (image->depth != IPL_DEPTH_32F || image->nChannels < 1 || image->nChannels > 4)
+        {
+            return false;
+        }
+
+        int radii[BLUR_PASSES];
+        blurBoxRadii(sigma, BLUR_PASSES, radii);
+        if (radii[BLUR_PASSES - 1] == 0)
+        {
+            return true;
+        }
+
+        LF_TRACE_SCOPE("blur");
+
+        BlurRows(image, radii);
+        BlurColumns(image, radii);
+
+        return true;
+    };
+
+private:
+    // \brief a scratch buffer of each thread, 16-byte aligned.
+    static float* Scratch(size_t size)
+    {
+        static thread_local std::vector<float> scratch;
+        if (scratch.size() < size + 4)
+        {
+            scratch.resize(size + 4);
+        }
+
+        size_t misalign = ((size_t)&scratch[0] & 15) / sizeof(float);
+        return &scratch[0] + (misalign != 0 ? 4 - misalign : 0);
+    };
+
+    void BlurRows(IplImage* image, const int radii[])
+    {
+        int width = image->width;
+        int channels = image->nChannels;
+        int n = width * channels;
+
+        m_pPool->ParallelFor(image->height, 16, [&](int begin, int end) {
+            // Two ping-pong rows, each with a float of padding.
+            float* a = Scratch((size_t)(n + 1) * 2);
+            float* b = a + n + 1;
+
+            for (int i = begin; i < end; ++i)
+            {
+                float* row = (float*)(image->imageData + i * image->widthStep);
+                memcpy(a, row, n * sizeof(float));
+
+                for (int pass = 0; pass < BLUR_PASSES; ++pass)
+                {
+#ifdef LF_SSE2
+                    if (channels >= 3)
+                    {
+                        boxFilterLine4(a, b, width, channels, radii[pass]);
+                    }
+                    else
+#endif
+                    {
+                        boxFilterLine(a, b, width, channels, channels, radii[pass]);
+                    }
+
+                    float* t = a;
+                    a = b;
+                    b = t;
+                }
+
+                memcpy(row, a, n * sizeof(float));
+            }
+        });
+    };
+
+    void BlurColumns(IplImage* image, const int radii[])
+    {
+        int rows = image->height;
+        int n = image->width * image->nChannels;
+        int numStrips = (n + BLUR_STRIP - 1) / BLUR_STRIP;
+
+        m_pPool->ParallelFor(numStrips, 1, [&](int begin, int end) {
+            float* a = Scratch((size_t)rows * BLUR_STRIP * 2 + BLUR_STRIP);
+            float* b = a + rows * BLUR_STRIP;
+            float* sum = b + rows * BLUR_STRIP;
+
+            for (int s = begin; s < end; ++s)
+            {
+                int x = s * BLUR_STRIP;
+                int count = MIN(BLUR_STRIP, n - x);
+                int width = (count + 3) & ~3;
+
+                for (int i = 0; i < rows; ++i)
+                {
+                    const float* p = (const float*)(image->imageData + i * image->widthStep) + x;
+                    float* q = a + i * width;
+                    memcpy(q, p, count * sizeof(float));
+                    for (int c = count; c < width; ++c)
+                    {
+                        q[c] = 0;
+                    }
+                }
+
+                for (int pass = 0; pass < BLUR_PASSES; ++pass)
+                {
+                    boxFilterStrip(a, b, sum, rows, width, radii[pass]);
+
+                    float* t = a;
+                    a = b;
+                    b = t;
+                }
+
+                for (int i = 0; i < rows; ++i)
+                {
+                    float* p = (float*)(image->imageData + i * image->widthStep) + x;
+                    memcpy(p, a + i * width, count * sizeof(float));
+                }
+            }
+        });
+    };
+
+private:
+    ThreadPool* m_pPool;
+};
+
+#endif // !BLUR_H
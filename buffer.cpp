@@ -0,0 +1,229 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   buffer.cpp
+ *
+ * Abstract:
+ *
+ *   Write effect results into caller-owned pixel buffers.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#include "buffer.h"
+#include "common.h"
+#include "trace.h"
+
+// \brief the conversion of one [0, 255] float to the pixel type.
+template <class T> struct Store;
+
+template <> struct Store<unsigned char>
+{
+    static unsigned char Convert(float v)
+    {
+        return (unsigned char)clip(cvRound(v), 0, 255);
+    };
+};
+
+template <> struct Store<unsigned short>
+{
+    static unsigned short Convert(float v)
+    {
+        return (unsigned short)clip(cvRound(v * 257.0f), 0, 65535);
+    };
+};
+
+template <> struct Store<float>
+{
+    static float Convert(float v)
+    {
+        return v * (1.0f / 255.0f);
+    };
+};
+
+// \brief convert one row of BGR floats in the given channel order.
+template <class T, LFChannelOrder order>
+static
+void writeRow(const float* src, T* dst, int n)
+{
+    for (int j = 0; j < n; ++j, src += 3)
+    {
+        float b = src[0];
+        float g = src[1];
+        float r = src[2];
+
+        switch (order)
+        {
+            case LF_ORDER_BGR:
+                dst[0] = Store<T>::Convert(b);
+                dst[1] = Store<T>::Convert(g);
+                dst[2] = Store<T>::Convert(r);
+                dst += 3;
+                break;
+            case LF_ORDER_RGB:
+                dst[0] = Store<T>::Convert(r);
+                dst[1] = Store<T>::Convert(g);
+                dst[2] = Store<T>::Convert(b);
+                dst += 3;
+                break;
+            case LF_ORDER_BGRA:
+                dst[0] = Store<T>::Convert(b);
+                dst[1] = Store<T>::Convert(g);
+                dst[2] = Store<T>::Convert(r);
+                dst[3] = Store<T>::Convert(MAX(r, MAX(g, b)));
+                dst += 4;
+                break;
+            case LF_ORDER_RGBA:
+                dst[0] = Store<T>::Convert(r);
+                dst[1] = Store<T>::Convert(g);
+                dst[2] = Store<T>::Convert(b);
+                dst[3] = Store<T>::Convert(MAX(r, MAX(g, b)));
+                dst += 4;
+                break;
+            default:
+                dst[0] = Store<T>::Convert(0.2126f * r + 0.7152f * g + 0.0722f * b);
+                dst += 1;
+                break;
+        }
+    }
+}
+
+#ifdef LF_SSE2
+// \brief the common case of 8-bit BGR: 16 values per iteration.
+template <>
+void writeRow<unsigned char, LF_ORDER_BGR>(const float* src, unsigned char* dst, int n)
+{
+    int count = n * 3;
+    int k = 0;
+
+    for (; k + 16 <= count; k += 16)
+    {
+        __m128i a = _mm_cvtps_epi32(_mm_loadu_ps(src + k));
+        __m128i b = _mm_cvtps_epi32(_mm_loadu_ps(src + k + 4));
+        __m128i c = _mm_cvtps_epi32(_mm_loadu_ps(src + k + 8));
+        __m128i d = _mm_cvtps_epi32(_mm_loadu_ps(src + k + 12));
+
+        __m128i lo = _mm_packs_epi32(a, b);
+        __m128i hi = _mm_packs_epi32(c, d);
+        _mm_storeu_si128((__m128i*)(dst + k), _mm_packus_epi16(lo, hi));
+    }
+
+    for (; k < count; ++k)
+    {
+        dst[k] = Store<unsigned char>::Convert(src[k]);
+    }
+}
+#endif
+
+template <class T>
+static
+void writeRows(const IplImage* result, const LFBuffer* buffer,
+               int sx, int sy, int dx, int dy, int w, int h)
+{
+    int channels = lfChannels(buffer->order);
+
+    for (int i = 0; i < h; ++i)
+    {
+        const float* src = (const float*)(result->imageData +
+                (sy + i) * result->widthStep) + sx * 3;
+        T* dst = (T*)((char*)buffer->data + (ptrdiff_t)(dy + i) * buffer->stride) + dx * channels;
+
+        switch (buffer->order)
+        {
+            case LF_ORDER_BGR:  writeRow<T, LF_ORDER_BGR>(src, dst, w); break;
+            case LF_ORDER_RGB:  writeRow<T, LF_ORDER_RGB>(src, dst, w); break;
+            case LF_ORDER_BGRA: writeRow<T, LF_ORDER_BGRA>(src, dst, w); break;
+            case LF_ORDER_RGBA: writeRow<T, LF_ORDER_RGBA>(src, dst, w); break;
+            default:            writeRow<T, LF_ORDER_GRAY>(src, dst, w); break;
+        }
+    }
+}
+
+int lfChannels(LFChannelOrder order)
+{
+    switch (order)
+    {
+        case LF_ORDER_BGR:
+        case LF_ORDER_RGB:  return 3;
+        case LF_ORDER_BGRA:
+        case LF_ORDER_RGBA: return 4;
+        default:            return 1;
+    }
+}
+
+int lfPixelSize(LFPixelFormat format, LFChannelOrder order)
+{
+    static const int sizes[] = { 1, 2, 4 };
+    return sizes[format] * lfChannels(order);
+}
+
+int lfWrapImage(IplImage* image, LFBuffer* buffer)
+{
+    switch (image->depth)
+    {
+        case IPL_DEPTH_8U:  buffer->format = LF_FORMAT_U8; break;
+        case IPL_DEPTH_16U: buffer->format = LF_FORMAT_U16; break;
+        case IPL_DEPTH_32F: buffer->format = LF_FORMAT_F32; break;
+        default:
+            return 0;
+    }
+
+    switch (image->nChannels)
+    {
+        case 1: buffer->order = LF_ORDER_GRAY; break;
+        case 3: buffer->order = LF_ORDER_BGR; break;
+        case 4: buffer->order = LF_ORDER_BGRA; break;
+        default:
+            return 0;
+    }
+
+    buffer->data = image->imageData;
+    buffer->width = image->width;
+    buffer->height = image->height;
+    buffer->stride = image->widthStep;
+
+    return 1;
+}
+
+int lfWriteResult(const IplImage* result, const LFBuffer* buffer, int x, int y)
+{
+    if (result->depth != IPL_DEPTH_32F || result->nChannels != 3 ||
+        buffer->data == 0 || buffer->format < LF_FORMAT_U8 || buffer->format > LF_FORMAT_F32)
+    {
+        return 0;
+    }
+
+    // Clip the result to the buffer.
+    int dx = MAX(x, 0);
+    int dy = MAX(y, 0);
+    int w = MIN(x + result->width, buffer->width) - dx;
+    int h = MIN(y + result->height, buffer->height) - dy;
+    if (w <= 0 || h <= 0)
+    {
+        return 1;
+    }
+
+    LF_TRACE_SCOPE("convert");
+
+    switch (buffer->format)
+    {
+        case LF_FORMAT_U8:
+            writeRows<unsigned char>(result, buffer, dx - x, dy - y, dx, dy, w, h);
+            break;
+        case LF_FORMAT_U16:
+            writeRows<unsigned short>(result, buffer, dx - x, dy - y, dx, dy, w, h);
+            break;
+        default:
+            writeRows<float>(result, buffer, dx - x, dy - y, dx, dy, w, h);
+            break;
+    }
+
+    return 1;
+}
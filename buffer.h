@@ -0,0 +1,98 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   buffer.h
+ *
+ * Abstract:
+ *
+ *   Caller-owned pixel buffers. The effect results are written
+ *   straight into a buffer described by pointer, size, stride,
+ *   pixel format and channel order, so an embedding application
+ *   can render into its own frame allocator without going
+ *   through an intermediate IplImage.
+ *
+ *   The interface is plain C.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "cxcore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum LFPixelFormat
+{
+    LF_FORMAT_U8  = 0, // [0, 255]
+    LF_FORMAT_U16 = 1, // [0, 65535]
+    LF_FORMAT_F32 = 2, // [0, 1], values above 1 are kept.
+} LFPixelFormat;
+
+typedef enum LFChannelOrder
+{
+    LF_ORDER_BGR  = 0,
+    LF_ORDER_RGB  = 1,
+    LF_ORDER_BGRA = 2,
+    LF_ORDER_RGBA = 3,
+    LF_ORDER_GRAY = 4,
+} LFChannelOrder;
+
+typedef struct LFBuffer
+{
+    void*          data;   // the first pixel of the first row.
+    int            width;
+    int            height;
+    int            stride; // bytes between rows, may be negative.
+    LFPixelFormat  format;
+    LFChannelOrder order;
+} LFBuffer;
+
+// \brief the number of channels of a channel order.
+int lfChannels(LFChannelOrder order);
+
+// \brief the bytes per pixel of a buffer.
+int lfPixelSize(LFPixelFormat format, LFChannelOrder order);
+
+// \brief describe an 8-bit, 16-bit or float IplImage as a buffer.
+// The IplImage still owns the pixels.
+// \return 0 if the image can't be described.
+int lfWrapImage(IplImage* image, LFBuffer* buffer);
+
+// \brief write an effect result into a caller buffer.
+//
+// The result is the 3-channel float (BGR, [0, 255]) image of an
+// effect, e.g. Effect::GetResult(). It is converted in a single
+// pass: rounded and saturated for the integer formats, scaled to
+// [0, 1] for float. Alpha, when present, is the largest color
+// channel so the layer can be blended "over" by the caller; gray
+// is the Rec. 709 luminance.
+//
+// \param x the x coordinate of the result origin in the buffer.
+// \param y ditto.
+// \return 0 if the formats are not supported.
+int lfWriteResult(const IplImage* result, const LFBuffer* buffer, int x, int y);
+
+#ifdef __cplusplus
+}
+
+// \brief draw an effect and write the result into the buffer.
+template <class EffectT>
+int lfRenderEffect(EffectT* pEffect, const LFBuffer* buffer)
+{
+    pEffect->Draw();
+    return lfWriteResult(pEffect->GetResult(), buffer, 0, 0);
+}
+#endif
+
+#endif // !BUFFER_H
@@ -31,6 +31,13 @@
 # define M_PI 3.1415926f
 #endif
 
+// SSE2 is available on every x86-64 target and on x86 builds with /arch:SSE2.
+#if !defined(LF_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+# define LF_SSE2 1
+# include <emmintrin.h>
+#endif
+
 // \brief return a uniform random number within [-v, v].
 static inline
 float myRandom(float limit)
@@ -0,0 +1,302 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   composite.h
+ *
+ * Abstract:
+ *
+ *   Blend an effect layer onto a photograph in linear light.
+ *
+ *   The photo is streamed in row tiles: each tile is decoded
+ *   from sRGB into a small float scratch buffer, blended with
+ *   the layer and encoded back in place, so the memory used
+ *   does not depend on the size of the photo.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef COMPOSITE_H
+#define COMPOSITE_H
+
+#include "common.h"
+#include "trace.h"
+
+enum BlendMode
+{
+    BLEND_ADD     = 0,
+    BLEND_SCREEN  = 1,
+    BLEND_LIGHTEN = 2,
+
+    BLEND_MODE_COUNT,
+};
+
+// The effects paint colors in [0, 255]; the compositor works in [0, 1].
+#define LAYER_SCALE (1.0f / 255.0f)
+
+// Resolution of the linear to sRGB encoding table.
+#define SRGB_ENCODE_BITS 16
+#define SRGB_ENCODE_SIZE (1 << SRGB_ENCODE_BITS)
+
+// \brief sRGB <-> linear lookup tables, shared by all compositors.
+class SRGBTable
+{
+public:
+    static const SRGBTable& Get()
+    {
+        static SRGBTable table;
+        return table;
+    };
+
+    // \brief 8-bit sRGB to linear in [0, 1].
+    float Decode(unsigned char v) const
+    {
+        return m_decode[v];
+    };
+
+    // \brief linear in [0, 1] (clamped) to 8-bit sRGB.
+    unsigned char Encode(float v) const
+    {
+        int i = (int)(v * (float)(SRGB_ENCODE_SIZE - 1) + 0.5f);
+        return m_encode[clip(i, 0, SRGB_ENCODE_SIZE - 1)];
+    };
+
+    const float* DecodeTable() const
+    {
+        return m_decode;
+    };
+
+private:
+    SRGBTable()
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            float c = (float)i / 255.0f;
+            m_decode[i] = (c < 0.04045f) ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+
+        for (int i = 0; i < SRGB_ENCODE_SIZE; ++i)
+        {
+            float c = (float)i / (float)(SRGB_ENCODE_SIZE - 1);
+            c = (c <= 0.0031308f) ? c * 12.92f : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+            m_encode[i] = (unsigned char)clip((int)(c * 255.0f + 0.5f), 0, 255);
+        }
+    };
+
+    float         m_decode[256];
+    unsigned char m_encode[SRGB_ENCODE_SIZE];
+};
+
+// \brief the blend kernel of one mode over n floats. dst is the
+// photo in linear light and is updated in place.
+template <int mode>
+static inline
+void blendSpan(float* dst, const float* src, int n, float opacity)
+{
+    int k = 0;
+
+#ifdef LF_SSE2
+    const __m128 scale = _mm_set1_ps(LAYER_SCALE);
+    const __m128 alpha = _mm_set1_ps(opacity);
+    const __m128 zero  = _mm_setzero_ps();
+    const __m128 one   = _mm_set1_ps(1.0f);
+
+    for (; k + 4 <= n; k += 4)
+    {
+        __m128 d = _mm_loadu_ps(dst + k);
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + k), scale);
+        __m128 b;
+
+        switch (mode)
+        {
+            case BLEND_ADD:    b = _mm_add_ps(d, s); break;
+            case BLEND_SCREEN: b = _mm_sub_ps(_mm_add_ps(d, s), _mm_mul_ps(d, s)); break;
+            default:           b = _mm_max_ps(d, s); break;
+        }
+
+        b = _mm_add_ps(d, _mm_mul_ps(_mm_sub_ps(b, d), alpha));
+        b = _mm_min_ps(_mm_max_ps(b, zero), one);
+
+        _mm_storeu_ps(dst + k, b);
+    }
+#endif
+
+    for (; k < n; ++k)
+    {
+        float d = dst[k];
+        float s = src[k] * LAYER_SCALE;
+        float b;
+
+        switch (mode)
+        {
+            case BLEND_ADD:    b = d + s; break;
+            case BLEND_SCREEN: b = d + s - d * s; break;
+            default:           b = d > s ? d : s; break;
+        }
+
+        b = d + (b - d) * opacity;
+        dst[k] = b < 0.0f ? 0.0f : (b > 1.0f ? 1.0f : b);
+    }
+}
+
+class Compositor
+{
+public:
+    // \brief constructor.
+    //
+    // \param tileRows the number of photo rows decoded at a time.
+    Compositor(int tileRows = 16)
+    {
+        m_tileRows = tileRows > 0 ? tileRows : 1;
+        m_pScratch = 0;
+        m_scratchSize = 0;
+    };
+
+    ~Compositor()
+    {
+        delete [] m_pScratch;
+    };
+
+    // \brief blend the layer onto the photo in place.
+    //
+    // \param layer the 3-channel float effect result.
+    // \param photo a 3-channel 8-bit sRGB image, or a 3-channel
+    //    float image already in linear light in [0, 255].
+    // \param x the x coordinate of the layer origin in the photo.
+    // \param y ditto.
+    // \param mode the blend mode.
+    // \param opacity the strength of the layer in [0, 1].
+    // \return false if the images are not supported.
+    bool Composite(const IplImage* layer,
+                   IplImage* photo,
+                   int x,
+                   int y,
+                   BlendMode mode,
+                   float opacity = 1.0f)
+    {
+        if (layer->depth != IPL_DEPTH_32F || layer->nChannels != 3 ||
+            photo->nChannels != 3 ||
+            (photo->depth != IPL_DEPTH_8U && photo->depth != IPL_DEPTH_32F))
+        {
+            return false;
+        }
+
+        // Only the overlapping rectangle is touched.
+        int x0 = MAX(x, 0);
+        int y0 = MAX(y, 0);
+        int x1 = MIN(x + layer->width, photo->width);
+        int y1 = MIN(y + layer->height, photo->height);
+        if (x0 >= x1 || y0 >= y1)
+        {
+            return true;
+        }
+
+        LF_TRACE_SCOPE("composite");
+
+        int n = (x1 - x0) * 3;
+
+        Reserve(m_tileRows * n);
+
+        for (int ty = y0; ty < y1; ty += m_tileRows)
+        {
+            int rows = MIN(m_tileRows, y1 - ty);
+
+            for (int r = 0; r < rows; ++r)
+            {
+                float* lin = m_pScratch + r * n;
+                const float* src = (const float*)(layer->imageData +
+                        (ty + r - y) * layer->widthStep) + (x0 - x) * 3;
+
+                if (photo->depth == IPL_DEPTH_8U)
+                {
+                    DecodeRow(photo, ty + r, x0, n, lin);
+                }
+                else
+                {
+                    const float* p = (const float*)(photo->imageData +
+                            (ty + r) * photo->widthStep) + x0 * 3;
+                    for (int k = 0; k < n; ++k)
+                    {
+                        lin[k] = p[k] * LAYER_SCALE;
+                    }
+                }
+
+                switch (mode)
+                {
+                    case BLEND_ADD:    blendSpan<BLEND_ADD>(lin, src, n, opacity); break;
+                    case BLEND_SCREEN: blendSpan<BLEND_SCREEN>(lin, src, n, opacity); break;
+                    default:           blendSpan<BLEND_LIGHTEN>(lin, src, n, opacity); break;
+                }
+            }
+
+            for (int r = 0; r < rows; ++r)
+            {
+                const float* lin = m_pScratch + r * n;
+
+                if (photo->depth == IPL_DEPTH_8U)
+                {
+                    EncodeRow(photo, ty + r, x0, n, lin);
+                }
+                else
+                {
+                    float* p = (float*)(photo->imageData +
+                            (ty + r) * photo->widthStep) + x0 * 3;
+                    for (int k = 0; k < n; ++k)
+                    {
+                        p[k] = lin[k] * 255.0f;
+                    }
+                }
+            }
+        }
+
+        return true;
+    };
+
+private:
+    void Reserve(int size)
+    {
+        if (size > m_scratchSize)
+        {
+            delete [] m_pScratch;
+            m_pScratch = new float [size];
+            m_scratchSize = size;
+        }
+    };
+
+    static void DecodeRow(const IplImage* photo, int row, int x0, int n, float* lin)
+    {
+        const float* table = SRGBTable::Get().DecodeTable();
+        const unsigned char* p = (const unsigned char*)(photo->imageData +
+                row * photo->widthStep) + x0 * 3;
+
+        for (int k = 0; k < n; ++k)
+        {
+            lin[k] = table[p[k]];
+        }
+    };
+
+    static void EncodeRow(IplImage* photo, int row, int x0, int n, const float* lin)
+    {
+        const SRGBTable& table = SRGBTable::Get();
+        unsigned char* p = (unsigned char*)(photo->imageData +
+                row * photo->widthStep) + x0 * 3;
+
+        for (int k = 0; k < n; ++k)
+        {
+            p[k] = table.Encode(lin[k]);
+        }
+    };
+
+private:
+    int    m_tileRows;
+    float* m_pScratch; // m_tileRows rows of the photo in linear light.
+    int    m_scratchSize;
+};
+
+#endif // !COMPOSITE_H
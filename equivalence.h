@@ -0,0 +1,1451 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   equivalence.h
+ *
+ * Abstract:
+ *
+ *   Differential checks of the optimized kernels (SIMD, lookup
+ *   tables, fixed point, threads) against the scalar reference
+ *   code they replace.
+ *
+ *   Every kernel check runs a number of randomized trials; each
+ *   trial draws its parameters from a MyRandom, runs both the
+ *   reference and the fast path and feeds the differences to an
+ *   ErrorStats. The checker reports the max and mean error per
+ *   kernel against the kernel's tolerance.
+ *
+ *   Run it with "LensFlare -verify [filter] [seed]".
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef EQUIVALENCE_H
+#define EQUIVALENCE_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+
+#include "common.h"
+#include "composite.h"
+#include "lightdetect.h"
+#include "occlusion.h"
+#include "buffer.h"
+#include "framefile.h"
+#include "blur.h"
+#include "streak.h"
+#include "starburst.h"
+#include "binning.h"
+#include "primitive.h"
+#include "poly.h"
+#include "sweep.h"
+#include "particles.h"
+#include "tiled.h"
+#include "flare.hpp"
+
+// \brief the error of a fast kernel against the reference.
+class ErrorStats
+{
+public:
+    ErrorStats()
+    {
+        m_max = 0;
+        m_sum = 0;
+        m_count = 0;
+    };
+
+    // \brief absolute difference of one value.
+    void Add(double reference, double fast)
+    {
+        AddError(fabs(reference - fast));
+    };
+
+    // \brief difference relative to the magnitude of the reference,
+    // or absolute below 1.
+    void AddRelative(double reference, double fast)
+    {
+        double scale = fabs(reference) > 1.0 ? fabs(reference) : 1.0;
+        AddError(fabs(reference - fast) / scale);
+    };
+
+    void AddError(double error)
+    {
+        // NaN never compares, so count it as an infinite error.
+        if (!(error <= m_max))
+        {
+            m_max = (error == error) ? error : HUGE_VAL;
+        }
+        m_sum += error;
+        m_count++;
+    };
+
+    double GetMax() const { return m_max; };
+    double GetMean() const { return m_count > 0 ? m_sum / m_count : 0.0; };
+    long long GetCount() const { return m_count; };
+
+private:
+    double    m_max;
+    double    m_sum;
+    long long m_count;
+};
+
+class EquivalenceChecker
+{
+public:
+    // \brief one randomized trial of a kernel.
+    typedef std::function<void (MyRandom& random, ErrorStats& stats)> Trial;
+
+    // \brief add a kernel check.
+    //
+    // \param name the kernel, "group/kernel".
+    // \param tolerance the largest accepted error.
+    // \param trials the number of randomized trials.
+    void Register(const char* name, double tolerance, int trials, Trial trial)
+    {
+        Kernel kernel;
+        kernel.name = name;
+        kernel.tolerance = tolerance;
+        kernel.trials = trials;
+        kernel.trial = trial;
+        m_kernels.push_back(kernel);
+    };
+
+    // \brief run the checks and print a report.
+    //
+    // \param filter only the kernels whose name contains it, or 0.
+    // \param seed the seed of the parameter sweeps.
+    // \return true if every kernel is within its tolerance.
+    bool Run(FILE* fp, const char* filter = 0, unsigned long seed = 10001)
+    {
+        int failures = 0;
+        int count = 0;
+
+        fprintf(fp, "%-28s %10s %12s %12s %12s  %s\n",
+                "kernel", "samples", "max error", "mean error", "tolerance", "result");
+
+        for (size_t k = 0; k < m_kernels.size(); ++k)
+        {
+            const Kernel& kernel = m_kernels[k];
+            if (filter != 0 && kernel.name.find(filter) == std::string::npos)
+            {
+                continue;
+            }
+
+            MyRandom random(seed);
+            ErrorStats stats;
+            for (int t = 0; t < kernel.trials; ++t)
+            {
+                kernel.trial(random, stats);
+            }
+
+            bool passed = stats.GetMax() <= kernel.tolerance;
+            fprintf(fp, "%-28s %10lld %12.4g %12.4g %12.4g  %s\n",
+                    kernel.name.c_str(), stats.GetCount(), stats.GetMax(), stats.GetMean(),
+                    kernel.tolerance, passed ? "ok" : "FAILED");
+
+            failures += passed ? 0 : 1;
+            count++;
+        }
+
+        fprintf(fp, "%d of %d kernel(s) failed.\n", failures, count);
+        return failures == 0;
+    };
+
+private:
+    struct Kernel
+    {
+        std::string name;
+        double      tolerance;
+        int         trials;
+        Trial       trial;
+    };
+
+    std::vector<Kernel> m_kernels;
+};
+
+//
+// The reference implementations that don't exist elsewhere.
+//
+
+// \brief Park-Miller minimal standard with plain 64-bit modulo,
+// the definition rand31's Carta optimization must match.
+static inline
+unsigned long referenceRand31(unsigned long seed)
+{
+    return (unsigned long)(((unsigned long long)seed * 16807ULL) % 0x7FFFFFFFULL);
+}
+
+static inline
+float referenceSRGBDecode(float c)
+{
+    return (c < 0.04045f) ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline
+int referenceSRGBEncode(float v)
+{
+    v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    float c = (v <= 0.0031308f) ? v * 12.92f : 1.055f * pow(v, 1.0f / 2.4f) - 0.055f;
+    return clip((int)(c * 255.0f + 0.5f), 0, 255);
+}
+
+// \brief the labels of an 8-connected flood fill, the reference of
+// the single-pass detector. Returns the components' centroids.
+static inline
+void referenceComponents(const std::vector<float>& lum, int w, int h, float threshold,
+                         std::vector<LightSource>& sources)
+{
+    std::vector<int> label(w * h, -1);
+    std::vector<int> stack;
+    sources.clear();
+
+    for (int start = 0; start < w * h; ++start)
+    {
+        if (lum[start] < threshold || label[start] >= 0)
+        {
+            continue;
+        }
+
+        double sum = 0, sumX = 0, sumY = 0;
+        int area = 0;
+        label[start] = (int)sources.size();
+        stack.push_back(start);
+
+        while (!stack.empty())
+        {
+            int p = stack.back();
+            stack.pop_back();
+            int x = p % w, y = p / w;
+            sum += lum[p];
+            sumX += lum[p] * x;
+            sumY += lum[p] * y;
+            area++;
+
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                for (int dx = -1; dx <= 1; ++dx)
+                {
+                    int nx = x + dx, ny = y + dy;
+                    if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+                    {
+                        continue;
+                    }
+                    int q = ny * w + nx;
+                    if (label[q] < 0 && lum[q] >= threshold)
+                    {
+                        label[q] = label[start];
+                        stack.push_back(q);
+                    }
+                }
+            }
+        }
+
+        LightSource s;
+        s.x = (float)(sumX / sum);
+        s.y = (float)(sumY / sum);
+        s.energy = (float)sum;
+        s.area = area;
+        s.intensity = (float)(sum / area);
+        s.peak = 0;
+        sources.push_back(s);
+    }
+}
+
+// \brief the stacked box blur by direct convolution, in doubles.
+// The image is w x h pixels of the given channels, clamped at the
+// edges like the running sums.
+static inline
+void referenceBoxBlur(std::vector<double>& image, int w, int h, int channels, const int radii[], int passes)
+{
+    std::vector<double> tmp(image.size());
+
+    for (int pass = 0; pass < passes; ++pass)
+    {
+        int r = radii[pass];
+
+        for (int dir = 0; dir < 2; ++dir)
+        {
+            for (int i = 0; i < h; ++i)
+            {
+                for (int j = 0; j < w; ++j)
+                {
+                    for (int c = 0; c < channels; ++c)
+                    {
+                        double sum = 0;
+                        for (int k = -r; k <= r; ++k)
+                        {
+                            int y = dir == 0 ? i : clip(i + k, 0, h - 1);
+                            int x = dir == 0 ? clip(j + k, 0, w - 1) : j;
+                            sum += image[(y * w + x) * channels + c];
+                        }
+                        tmp[(i * w + j) * channels + c] = sum / (2 * r + 1);
+                    }
+                }
+            }
+            image.swap(tmp);
+        }
+    }
+}
+
+// \brief the streak of the pixel (u, v) of the lines by direct
+// convolution with the stacked boxes, in doubles.
+static inline
+void referenceStreak(const IplImage* src, const StreakLines& lines, const int radii[], int stages,
+                     int u, int v, double out[])
+{
+    // The kernel is the convolution of the boxes.
+    std::vector<double> kernel(1, 1.0);
+    for (int s = 0; s < stages; ++s)
+    {
+        int r = radii[s];
+        std::vector<double> next(kernel.size() + 2 * r, 0.0);
+        for (size_t k = 0; k < kernel.size(); ++k)
+        {
+            for (int j = 0; j <= 2 * r; ++j)
+            {
+                next[k + j] += kernel[k] / (2 * r + 1);
+            }
+        }
+        kernel.swap(next);
+    }
+
+    const float* p = (const float*)src->imageData;
+    int half = (int)kernel.size() / 2;
+    int v0 = lines.GetLine(u, v);
+
+    for (int c = 0; c < src->nChannels; ++c)
+    {
+        out[c] = 0;
+    }
+
+    for (int j = -half; j <= half; ++j)
+    {
+        int uj = u + j;
+        if (uj < 0 || uj >= lines.numU)
+        {
+            continue;
+        }
+
+        double y = v0 + (double)((float)uj * lines.slope);
+        int yi = (int)floor(y);
+        double t = y - yi;
+        for (int c = 0; c < src->nChannels; ++c)
+        {
+            double a = (yi >= 0 && yi < lines.numV) ? p[uj * lines.stepU + yi * lines.stepV + c] : 0.0;
+            double b = (yi + 1 >= 0 && yi + 1 < lines.numV) ? p[uj * lines.stepU + (yi + 1) * lines.stepV + c] : 0.0;
+            out[c] += kernel[j + half] * (a * (1 - t) + b * t);
+        }
+    }
+}
+
+// \brief draw a primitive of primitive.h by run-time type and
+// blend mode (0 overwrite, 1 additive, 2 max).
+template <class PixelT, class Blend>
+static
+void drawPrimitiveOf(int type, float radius, float thickness, float gamma,
+                     float x, float y, const float rgb[], IplImage* image)
+{
+    switch (type)
+    {
+        case 0:
+            drawPrimitive<RingProfile, 3, PixelT, Blend>(RingProfile(radius, thickness), x, y, rgb, image);
+            break;
+        case 1:
+            drawPrimitive<DiskProfile, 3, PixelT, Blend>(DiskProfile(radius), x, y, rgb, image);
+            break;
+        default:
+            drawPrimitive<GradientProfile, 3, PixelT, Blend>(GradientProfile(radius, gamma), x, y, rgb, image);
+            break;
+    }
+}
+
+template <class PixelT>
+static
+void drawPrimitiveOf(int mode, int type, float radius, float thickness, float gamma,
+                     float x, float y, const float rgb[], IplImage* image)
+{
+    switch (mode)
+    {
+        case 0:  drawPrimitiveOf<PixelT, BlendOverwrite>(type, radius, thickness, gamma, x, y, rgb, image); break;
+        case 1:  drawPrimitiveOf<PixelT, BlendAdditive>(type, radius, thickness, gamma, x, y, rgb, image); break;
+        default: drawPrimitiveOf<PixelT, BlendMax>(type, radius, thickness, gamma, x, y, rgb, image); break;
+    }
+}
+
+// \brief a scene of gradient disks laid out by a seed in a color,
+// with a red ring in the middle if it has two colors.
+static
+void drawSweepScene(unsigned long seed, const float color[3], bool twoColors, IplImage* image)
+{
+    MyRandom random(seed);
+    PrimitiveList primitives;
+    for (int k = 0; k < 4; ++k)
+    {
+        int x = (int)random.GetFloat(0.0f, (float)image->width);
+        int y = (int)random.GetFloat(0.0f, (float)image->height);
+        primitives.AddGradient(x, y, random.GetFloat(2.0f, 24.0f), color, 2.2f);
+    }
+    if (twoColors)
+    {
+        float red[] = {0, 0, 255};
+        primitives.AddRing(image->width / 2, image->height / 2,
+                (float)MIN(image->width, image->height) / 3, 2.0f, red);
+    }
+
+    BinningRenderer renderer;
+    renderer.Render(primitives, image);
+}
+
+// \brief the pixels handed to renderPixel by the scan converter:
+// x, y, the area and the mask rows of each.
+struct PolyRecord
+{
+    int                    rows;    // the subpixels of the grid.
+    int                    columns;
+    std::vector<long long> pixels;
+};
+
+static inline
+int polyRecordX(Vertex* v, void* user)
+{
+    return (int)(v->image.x * ((PolyRecord*)user)->columns);
+}
+
+static inline
+void polyRecordLerp(double alpha, Vertex* a, Vertex* b, Vertex* out, void*)
+{
+    out->image.x = LERP(alpha, a->image.x, b->image.x);
+    out->image.y = LERP(alpha, a->image.y, b->image.y);
+    out->y = (int)LERP(alpha, a->y, b->y);
+}
+
+static inline
+void polyRecordPixel(int x, int y, Vertex*, int area, unsigned mask[], Surface*, void* user)
+{
+    PolyRecord* pRecord = (PolyRecord*)user;
+    pRecord->pixels.push_back(x);
+    pRecord->pixels.push_back(y);
+    pRecord->pixels.push_back(area);
+    pRecord->pixels.insert(pRecord->pixels.end(), mask, mask + pRecord->rows);
+}
+
+static inline
+void polyRecordPixel64(int x, int y, Vertex*, int area, uint64_t mask[], Surface*, void* user)
+{
+    PolyRecord* pRecord = (PolyRecord*)user;
+    pRecord->pixels.push_back(x);
+    pRecord->pixels.push_back(y);
+    pRecord->pixels.push_back(area);
+    pRecord->pixels.insert(pRecord->pixels.end(), mask, mask + pRecord->rows);
+}
+
+// \brief a random convex polygon in a w x h canvas, counterclockwise
+// in y-down space like the scan order, with y in rows of the grid.
+static inline
+void referencePolygon(MyRandom& random, int w, int h, std::vector<Vertex>& polygon)
+{
+    int n = 3 + random.GetUInt() % 8;
+    float cx = random.GetFloat(0.0f, (float)w);
+    float cy = random.GetFloat(0.0f, (float)h);
+    float r = random.GetFloat(0.5f, 0.5f * (float)h);
+    float phase = random.GetFloat(0.0f, 2.0f * (float)M_PI);
+
+    polygon.resize(n);
+    for (int k = 0; k < n; ++k)
+    {
+        float a = phase - 2.0f * (float)M_PI * (float)k / (float)n;
+        memset(&polygon[k], 0, sizeof(Vertex));
+        polygon[k].image.x = cx + r * cos(a);
+        polygon[k].image.y = cy + r * sin(a);
+    }
+}
+
+// \brief scan convert a polygon on a grid, into record, with the
+// 64-bit mask rows if wide.
+static inline
+void drawPolygonRecord(std::vector<Vertex> polygon, int grid, PolyRecord& record, bool wide = false)
+{
+    record.rows = grid < 0 ? SUBYRES : polyGridRows((PolyGrid)grid);
+    record.columns = grid < 0 ? SUBXRES : polyGridColumns((PolyGrid)grid);
+    record.pixels.clear();
+    for (size_t k = 0; k < polygon.size(); ++k)
+    {
+        polygon[k].y = (int)(polygon[k].image.y * record.rows);
+    }
+
+    PolyCallbacks callbacks = { polyRecordX, polyRecordLerp, polyRecordPixel, &record };
+    PolyCallbacks64 callbacks64 = { polyRecordX, polyRecordLerp, polyRecordPixel64, &record };
+    Surface surface = { 255, 255, 255 };
+    if (grid < 0)
+    {
+        drawPolygon(&polygon[0], (int)polygon.size(), &surface, &callbacks);
+    }
+    else if (wide)
+    {
+        drawPolygonGrid((PolyGrid)grid, &polygon[0], (int)polygon.size(), &surface, &callbacks64);
+    }
+    else
+    {
+        drawPolygonGrid((PolyGrid)grid, &polygon[0], (int)polygon.size(), &surface, &callbacks);
+    }
+}
+
+// \brief the checks of the kernels in the tree.
+static inline
+void registerStandardChecks(EquivalenceChecker& checker)
+{
+    // common.h: Carta's rand31 against the 64-bit modulo definition.
+    checker.Register("random/rand31", 0.0, 64, [](MyRandom& random, ErrorStats& stats) {
+        unsigned long seed = 1 + random.GetUInt() % 0x7FFFFFFE;
+        MyRandom fast(seed);
+        unsigned long reference = seed;
+        for (int k = 0; k < 4096; ++k)
+        {
+            reference = referenceRand31(reference);
+            stats.Add((double)reference, (double)fast.GetUInt());
+        }
+    });
+
+    // composite.h: the sRGB tables.
+    checker.Register("srgb/decode", 1e-6, 1, [](MyRandom&, ErrorStats& stats) {
+        for (int v = 0; v < 256; ++v)
+        {
+            stats.Add(referenceSRGBDecode(v / 255.0f), SRGBTable::Get().Decode((unsigned char)v));
+        }
+    });
+
+    checker.Register("srgb/encode", 1.0, 64, [](MyRandom& random, ErrorStats& stats) {
+        for (int k = 0; k < 4096; ++k)
+        {
+            float v = random.GetFloat(-0.1f, 1.1f);
+            stats.Add(referenceSRGBEncode(v), SRGBTable::Get().Encode(v));
+        }
+    });
+
+    // composite.h: the SIMD blend kernels against the scalar tail.
+    struct Blend
+    {
+        static void Check(int mode, MyRandom& random, ErrorStats& stats)
+        {
+            int n = 1 + random.GetUInt() % 257;
+            float opacity = random.GetFloat(0.0f, 1.0f);
+            std::vector<float> src(n), fast(n), reference(n);
+            for (int k = 0; k < n; ++k)
+            {
+                src[k] = random.GetFloat(0.0f, 400.0f);
+                fast[k] = reference[k] = random.GetFloat();
+            }
+
+            switch (mode)
+            {
+                case BLEND_ADD:    blendSpan<BLEND_ADD>(&fast[0], &src[0], n, opacity); break;
+                case BLEND_SCREEN: blendSpan<BLEND_SCREEN>(&fast[0], &src[0], n, opacity); break;
+                default:           blendSpan<BLEND_LIGHTEN>(&fast[0], &src[0], n, opacity); break;
+            }
+
+            for (int k = 0; k < n; ++k)
+            {
+                float d = reference[k];
+                float s = src[k] / 255.0f;
+                float b = mode == BLEND_ADD ? d + s : (mode == BLEND_SCREEN ? 1 - (1 - d) * (1 - s) : MAX(d, s));
+                b = d + (b - d) * opacity;
+                stats.Add(MIN(MAX(b, 0.0f), 1.0f), fast[k]);
+            }
+        };
+    };
+
+    checker.Register("composite/add", 1e-6, 256, [](MyRandom& random, ErrorStats& stats) {
+        Blend::Check(BLEND_ADD, random, stats);
+    });
+    checker.Register("composite/screen", 1e-6, 256, [](MyRandom& random, ErrorStats& stats) {
+        Blend::Check(BLEND_SCREEN, random, stats);
+    });
+    checker.Register("composite/lighten", 1e-6, 256, [](MyRandom& random, ErrorStats& stats) {
+        Blend::Check(BLEND_LIGHTEN, random, stats);
+    });
+
+    // buffer.cpp: the result conversion against cvConvert's rounding.
+    checker.Register("buffer/u8", 0.0, 64, [](MyRandom& random, ErrorStats& stats) {
+        int w = 1 + random.GetUInt() % 97, h = 1 + random.GetUInt() % 5;
+        IplImage* pResult = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+        IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+        for (int i = 0; i < h; ++i)
+        {
+            float* p = (float*)(pResult->imageData + i * pResult->widthStep);
+            for (int k = 0; k < w * 3; ++k)
+            {
+                p[k] = random.GetFloat(-20.0f, 300.0f);
+            }
+        }
+
+        LFBuffer buffer;
+        lfWrapImage(pImage, &buffer);
+        lfWriteResult(pResult, &buffer, 0, 0);
+
+        for (int i = 0; i < h; ++i)
+        {
+            const float* p = (const float*)(pResult->imageData + i * pResult->widthStep);
+            const unsigned char* q = (const unsigned char*)(pImage->imageData + i * pImage->widthStep);
+            for (int k = 0; k < w * 3; ++k)
+            {
+                stats.Add(clip(cvRound(p[k]), 0, 255), q[k]);
+            }
+        }
+
+        cvReleaseImage(&pResult);
+        cvReleaseImage(&pImage);
+    });
+
+    // framefile.h: half floats keep 11 significant bits.
+    checker.Register("framefile/half", 1.0 / 2048.0, 64, [](MyRandom& random, ErrorStats& stats) {
+        for (int k = 0; k < 4096; ++k)
+        {
+            float v = random.GetFloat(-60000.0f, 60000.0f) * pow(2.0f, -random.GetFloat(0.0f, 14.0f));
+            stats.AddError(fabs(halfToFloat(floatToHalf(v)) - v) / fabs(v));
+        }
+    });
+
+    // lightdetect.h: single-pass labeling against a flood fill, on
+    // float gray, 8-bit gray and 8-bit BGR images (the SSE2 skip of
+    // the dark blocks of ScanRow8U).
+    checker.Register("lightdetect/centroid", 1e-3, 48, [](MyRandom& random, ErrorStats& stats) {
+        int w = 64 + random.GetUInt() % 64, h = 32 + random.GetUInt() % 64;
+        int kind = random.GetUInt() % 3;
+        bool bytes = kind != 0;
+        int channels = kind == 2 ? 3 : 1;
+        IplImage* pImage = cvCreateImage(cvSize(w, h), bytes ? IPL_DEPTH_8U : IPL_DEPTH_32F, channels);
+
+        // Sparse bright speckles make odd shaped components; sparser
+        // ones leave dark blocks to skip.
+        float density = random.GetUInt() % 2 ? 0.35f : 0.03f;
+        std::vector<float> lum(w * h);
+        for (int i = 0; i < h; ++i)
+        {
+            char* row = pImage->imageData + i * pImage->widthStep;
+            for (int j = 0; j < w; ++j)
+            {
+                bool bright = random.GetFloat() < density;
+                if (!bytes)
+                {
+                    ((float*)row)[j] = lum[i * w + j] = bright ? random.GetFloat(200.0f, 255.0f) : 0.0f;
+                    continue;
+                }
+
+                unsigned char* p = (unsigned char*)row + j * channels;
+                for (int c = 0; c < channels; ++c)
+                {
+                    p[c] = (unsigned char)(bright ? 200 + random.GetUInt() % 56 : random.GetUInt() % 100);
+                }
+                if (!bright && channels == 3 && random.GetUInt() % 8 == 0)
+                {
+                    // A saturated red stays below the threshold but
+                    // stops the skip.
+                    p[0] = p[1] = 0;
+                    p[2] = 255;
+                }
+
+                // The integer luminance of LightDetector, in [0, 255].
+                int y = channels == 3 ? 19 * p[0] + 183 * p[1] + 54 * p[2] : p[0] << 8;
+                lum[i * w + j] = (float)y / 256.0f;
+            }
+        }
+
+        LightDetector detector(0.5f, 1, 0);
+        std::vector<LightSource> fast, reference;
+        detector.Detect(pImage, fast);
+        referenceComponents(lum, w, h, 0.5f * 255.0f, reference);
+
+        if (fast.size() != reference.size())
+        {
+            stats.AddError(HUGE_VAL);
+        }
+
+        // Pair every reference component with the nearest detected
+        // one of the same area.
+        std::vector<bool> used(fast.size(), false);
+        for (size_t r = 0; r < reference.size(); ++r)
+        {
+            int best = -1;
+            float bestDistance = 0;
+            for (size_t k = 0; k < fast.size(); ++k)
+            {
+                float dx = fast[k].x - reference[r].x;
+                float dy = fast[k].y - reference[r].y;
+                float distance = dx * dx + dy * dy;
+                if (!used[k] && fast[k].area == reference[r].area &&
+                    (best < 0 || distance < bestDistance))
+                {
+                    best = (int)k;
+                    bestDistance = distance;
+                }
+            }
+
+            if (best < 0)
+            {
+                stats.AddError(HUGE_VAL);
+                continue;
+            }
+
+            used[best] = true;
+            stats.Add(reference[r].x, fast[best].x);
+            stats.Add(reference[r].y, fast[best].y);
+            stats.Add(reference[r].energy / 255.0, fast[best].energy);
+        }
+
+        cvReleaseImage(&pImage);
+    });
+    // occlusion.h: the four lookups of the summed-area table against
+    // counting the open pixels of the box, in pixels.
+    checker.Register("occlusion/box", 0.0, 32, [](MyRandom& random, ErrorStats& stats) {
+        int w = 16 + random.GetUInt() % 300, h = 16 + random.GetUInt() % 200;
+        bool mask = random.GetUInt() % 2 == 0;
+        IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, mask ? 1 : 3);
+        std::vector<int> open(w * h);
+        for (int i = 0; i < h; ++i)
+        {
+            unsigned char* p = (unsigned char*)(pImage->imageData + i * pImage->widthStep);
+            for (int j = 0; j < w; ++j)
+            {
+                // Gray pixels, half of them just at the threshold.
+                unsigned char v = random.GetUInt() % 2 ? 230 : (unsigned char)(random.GetUInt() % 256);
+                if (mask)
+                {
+                    p[j] = v;
+                    open[i * w + j] = v;
+                }
+                else
+                {
+                    p[j * 3] = p[j * 3 + 1] = p[j * 3 + 2] = v;
+                    open[i * w + j] = 256 * v >= (int)(0.9f * 255.0f * 256.0f) ? 255 : 0;
+                }
+            }
+        }
+
+        OcclusionMap occlusion(0.9f);
+        occlusion.Build(pImage);
+
+        for (int q = 0; q < 64; ++q)
+        {
+            int x0 = (int)random.GetFloat(-20.0f, (float)w + 20.0f);
+            int y0 = (int)random.GetFloat(-20.0f, (float)h + 20.0f);
+            int x1 = x0 + (int)random.GetFloat(0.0f, (float)w);
+            int y1 = y0 + (int)random.GetFloat(0.0f, (float)h);
+
+            double sum = 0;
+            for (int i = MAX(y0, 0); i < MIN(y1, h); ++i)
+            {
+                for (int j = MAX(x0, 0); j < MIN(x1, w); ++j)
+                {
+                    sum += open[i * w + j];
+                }
+            }
+            stats.Add(sum / 255.0, occlusion.GetOpenSum(x0, y0, x1, y1) / 255.0);
+        }
+
+        cvReleaseImage(&pImage);
+    });
+    // occlusion.h: a bright disk cut by a dark half-plane against its
+    // uncovered fraction, with the aperture of the disk's radius. The
+    // pixel disk is not quite pi r^2, hence the tolerance.
+    checker.Register("occlusion/disk", 0.03, 32, [](MyRandom& random, ErrorStats& stats) {
+        float radius = random.GetFloat(16.0f, 48.0f);
+        int size = 2 * (int)radius + 40;
+        float cx = (float)(size / 2), cy = (float)(size / 2);
+        IplImage* pImage = cvCreateImage(cvSize(size, size), IPL_DEPTH_8U, 3);
+
+        // The occluder covers the points past a line through the disk.
+        float angle = random.GetFloat(0.0f, 2.0f * (float)M_PI);
+        float nx = cos(angle), ny = sin(angle);
+        float offset = random.GetFloat(-radius, radius);
+
+        int disk = 0, open = 0;
+        for (int i = 0; i < size; ++i)
+        {
+            unsigned char* p = (unsigned char*)(pImage->imageData + i * pImage->widthStep);
+            for (int j = 0; j < size; ++j)
+            {
+                float dx = (float)j - cx, dy = (float)i - cy;
+                bool inside = dx * dx + dy * dy <= radius * radius;
+                bool covered = dx * nx + dy * ny > offset;
+                disk += inside ? 1 : 0;
+                open += inside && !covered ? 1 : 0;
+                p[j * 3] = p[j * 3 + 1] = p[j * 3 + 2] = inside && !covered ? 255 : 16;
+            }
+        }
+
+        OcclusionMap occlusion(0.9f);
+        occlusion.Build(pImage);
+
+        std::vector<LightSource> lights(1);
+        lights[0].x = cx;
+        lights[0].y = cy;
+        lights[0].area = open;
+        std::vector<float> visibility;
+        occlusion.GetVisibility(lights, radius, visibility);
+        stats.Add((double)open / disk, visibility[0]);
+
+        cvReleaseImage(&pImage);
+    });
+    // blur.h: the running sums against direct convolution. The
+    // rows are filtered before the columns in both.
+    checker.Register("blur/box", 1e-2, 24, [](MyRandom& random, ErrorStats& stats) {
+        int w = 1 + random.GetUInt() % 150, h = 1 + random.GetUInt() % 90;
+        int channels = 1 + random.GetUInt() % 4;
+        float sigma = random.GetFloat(0.5f, 40.0f);
+        IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, channels);
+        std::vector<double> reference(w * h * channels);
+        for (int i = 0; i < h; ++i)
+        {
+            float* p = (float*)(pImage->imageData + i * pImage->widthStep);
+            for (int k = 0; k < w * channels; ++k)
+            {
+                p[k] = random.GetFloat(0.0f, 255.0f);
+                reference[i * w * channels + k] = p[k];
+            }
+        }
+
+        int radii[BLUR_PASSES];
+        blurBoxRadii(sigma, BLUR_PASSES, radii);
+        if (radii[BLUR_PASSES - 1] > 0)
+        {
+            referenceBoxBlur(reference, w, h, channels, radii, BLUR_PASSES);
+        }
+
+        GaussianBlur blur;
+        blur.Apply(pImage, sigma);
+
+        for (int i = 0; i < h; ++i)
+        {
+            const float* p = (const float*)(pImage->imageData + i * pImage->widthStep);
+            for (int k = 0; k < w * channels; ++k)
+            {
+                stats.Add(reference[i * w * channels + k], p[k]);
+            }
+        }
+
+        cvReleaseImage(&pImage);
+    });
+    // streak.h: the prefix sums along the lines against direct
+    // convolution along the same lines.
+    checker.Register("streak/line", 1e-2, 24, [](MyRandom& random, ErrorStats& stats) {
+        int w = 1 + random.GetUInt() % 120, h = 1 + random.GetUInt() % 90;
+        int channels = 1 + random.GetUInt() % 4;
+        int stages = 1 + random.GetUInt() % 3;
+        float angle = random.GetFloat(0.0f, 2.0f * (float)M_PI);
+        float length = random.GetFloat(0.0f, 80.0f);
+        IplImage* pSrc = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, channels);
+        IplImage* pDst = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, channels);
+        cvZero(pDst);
+        for (int i = 0; i < h; ++i)
+        {
+            float* p = (float*)(pSrc->imageData + i * pSrc->widthStep);
+            for (int k = 0; k < w * channels; ++k)
+            {
+                p[k] = random.GetFloat() < 0.1f ? random.GetFloat(0.0f, 255.0f) : 0.0f;
+            }
+        }
+
+        StreakFilter filter;
+        filter.Apply(pSrc, pDst, angle, length, 1.0f, stages);
+
+        StreakLines lines;
+        lines.Init(pSrc, angle);
+        int radii[STREAK_MAX_STAGES];
+        streakRadii(length, lines.density, stages, radii);
+
+        for (int u = 0; u < lines.numU; ++u)
+        {
+            for (int v = 0; v < lines.numV; ++v)
+            {
+                double reference[4];
+                referenceStreak(pSrc, lines, radii, stages, u, v, reference);
+
+                const float* p = (const float*)pDst->imageData + u * lines.stepU + v * lines.stepV;
+                for (int c = 0; c < channels; ++c)
+                {
+                    stats.Add(reference[c], p[c]);
+                }
+            }
+        }
+
+        cvReleaseImage(&pSrc);
+        cvReleaseImage(&pDst);
+    });
+    // polyscan.h: the templated scan converter at 8x16 against
+    // drawPolygon, every area and mask.
+    checker.Register("poly/grid8x16", 0.0, 256, [](MyRandom& random, ErrorStats& stats) {
+        std::vector<Vertex> polygon;
+        referencePolygon(random, 200, 150, polygon);
+
+        PolyRecord reference, grid;
+        drawPolygonRecord(polygon, -1, reference);
+        drawPolygonRecord(polygon, POLY_GRID_8X16, grid);
+
+        if (reference.pixels.size() != grid.pixels.size())
+        {
+            stats.AddError(HUGE_VAL);
+            return;
+        }
+        for (size_t k = 0; k < reference.pixels.size(); ++k)
+        {
+            stats.Add(reference.pixels[k], grid.pixels[k]);
+        }
+    });
+    // polyscan.h: the area of each pixel against the bits of its
+    // mask, on every grid; the masks come from the generated tables.
+    // The 64-bit mask rows (the only ones of the 16x64 grid) must
+    // match the 32-bit ones on the narrower grids.
+    checker.Register("poly/masks", 0.0, 128, [](MyRandom& random, ErrorStats& stats) {
+        std::vector<Vertex> polygon;
+        referencePolygon(random, 200, 150, polygon);
+
+        for (int g = 0; g < POLY_GRID_COUNT; ++g)
+        {
+            PolyRecord record;
+            drawPolygonRecord(polygon, g, record, true);
+
+            for (size_t k = 0; k < record.pixels.size(); k += 3 + record.rows)
+            {
+                int bits = 0;
+                for (int y = 0; y < record.rows; ++y)
+                {
+                    for (uint64_t m = (uint64_t)record.pixels[k + 3 + y]; m != 0; m &= m - 1)
+                    {
+                        ++bits;
+                    }
+                }
+                stats.Add((double)record.pixels[k + 2], bits);
+            }
+
+            if (polyGridColumns((PolyGrid)g) > 32)
+            {
+                continue;
+            }
+            PolyRecord narrow;
+            drawPolygonRecord(polygon, g, narrow);
+            if (narrow.pixels != record.pixels)
+            {
+                stats.AddError(HUGE_VAL);
+            }
+        }
+    });
+    // starburst.h: the real 2D FFT against a direct DFT.
+    checker.Register("starburst/fft", 1e-4, 8, [](MyRandom& random, ErrorStats& stats) {
+        int n = 16 << (random.GetUInt() % 2);
+        std::vector<float> image(n * n), fast(n * n);
+        for (int k = 0; k < n * n; ++k)
+        {
+            image[k] = random.GetFloat();
+        }
+        powerSpectrum(&image[0], &fast[0], n, ThreadPool::Get());
+
+        // The direct transform, with the DC term moved to the center.
+        std::vector<double> reference(n * n);
+        double peak = 0;
+        for (int v = 0; v < n; ++v)
+        {
+            for (int f = 0; f < n; ++f)
+            {
+                double re = 0, im = 0;
+                for (int i = 0; i < n; ++i)
+                {
+                    for (int j = 0; j < n; ++j)
+                    {
+                        double a = -2.0 * M_PI * (double)((v * i + f * j) % n) / n;
+                        re += image[i * n + j] * cos(a);
+                        im += image[i * n + j] * sin(a);
+                    }
+                }
+                double p = re * re + im * im;
+                reference[((v + n / 2) % n) * n + (f + n / 2) % n] = p;
+                peak = MAX(peak, p);
+            }
+        }
+
+        for (int k = 0; k < n * n; ++k)
+        {
+            stats.Add(reference[k] / peak, fast[k] / peak);
+        }
+    });
+    // binning.h: the tiles against the flare.hpp primitives summed
+    // pixel by pixel.
+    checker.Register("binning/flare", 1e-5, 16, [](MyRandom& random, ErrorStats& stats) {
+        int w = 16 + random.GetUInt() % 200, h = 16 + random.GetUInt() % 150;
+        int count = 1 + random.GetUInt() % 40;
+
+        PrimitiveList primitives;
+        std::vector<Flare> rings;
+        std::vector<FlareSolid> disks;
+        std::vector<FlareGradient> gradients;
+        for (int p = 0; p < count; ++p)
+        {
+            int x = (int)random.GetFloat(-50.0f, (float)w + 50.0f);
+            int y = (int)random.GetFloat(-50.0f, (float)h + 50.0f);
+            float radius = random.GetFloat(0.5f, 120.0f);
+            float rgb[] = { random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f) };
+
+            switch (random.GetUInt() % 3)
+            {
+                case PRIMITIVE_RING:
+                {
+                    float thickness = random.GetFloat(0.5f, 30.0f);
+                    primitives.AddRing(x, y, radius, thickness, rgb);
+                    rings.push_back(Flare(w, h, x, y, radius, thickness, rgb));
+                    break;
+                }
+                case PRIMITIVE_DISK:
+                    primitives.AddDisk(x, y, radius, rgb);
+                    disks.push_back(FlareSolid(w, h, x, y, radius, rgb));
+                    break;
+                default:
+                {
+                    float gamma = random.GetFloat(0.2f, 4.0f);
+                    primitives.AddGradient(x, y, radius, rgb, gamma);
+                    gradients.push_back(FlareGradient(w, h, x, y, radius, rgb, gamma));
+                    break;
+                }
+            }
+        }
+
+        IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+        BinningRenderer renderer(random.GetUInt() % 2 ? 32 : 64);
+        renderer.Render(primitives, pImage);
+
+        for (int i = 0; i < h; ++i)
+        {
+            const float* p = (const float*)(pImage->imageData + i * pImage->widthStep);
+            for (int j = 0; j < w; ++j)
+            {
+                double sum[3] = {0, 0, 0};
+                float c[3];
+                size_t nr = 0, nd = 0, ng = 0;
+                for (int k = 0; k < count; ++k)
+                {
+                    switch (primitives.type[k])
+                    {
+                        case PRIMITIVE_RING: rings[nr++].GetPixel(i, j, c); break;
+                        case PRIMITIVE_DISK: disks[nd++].GetPixel(i, j, c); break;
+                        default:             gradients[ng++].GetPixel(i, j, c); break;
+                    }
+                    sum[0] += c[0];
+                    sum[1] += c[1];
+                    sum[2] += c[2];
+                }
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    stats.AddRelative(sum[k], p[j * 3 + k]);
+                }
+            }
+        }
+
+        cvReleaseImage(&pImage);
+    });
+    // fixedpoint.h: the 8-bit tiles against the float tiles rounded
+    // to 8 bits, within 1.
+    checker.Register("fixedpoint/binning", 1.0, 32, [](MyRandom& random, ErrorStats& stats) {
+        int w = 16 + random.GetUInt() % 200, h = 16 + random.GetUInt() % 150;
+        int channels = random.GetUInt() % 2 ? 3 : 4;
+        int count = 1 + random.GetUInt() % 40;
+        bool accumulate = random.GetUInt() % 2 == 0;
+
+        PrimitiveList primitives;
+        for (int p = 0; p < count; ++p)
+        {
+            int x = (int)random.GetFloat(-50.0f, (float)w + 50.0f);
+            int y = (int)random.GetFloat(-50.0f, (float)h + 50.0f);
+            float radius = random.GetFloat(0.5f, 120.0f);
+            float rgb[] = { random.GetFloat(0.0f, 96.0f), random.GetFloat(0.0f, 96.0f), random.GetFloat(0.0f, 96.0f) };
+
+            switch (random.GetUInt() % 3)
+            {
+                case PRIMITIVE_RING: primitives.AddRing(x, y, radius, random.GetFloat(0.5f, 30.0f), rgb); break;
+                case PRIMITIVE_DISK: primitives.AddDisk(x, y, radius, rgb); break;
+                default:             primitives.AddGradient(x, y, radius, rgb, random.GetFloat(0.2f, 4.0f)); break;
+            }
+        }
+
+        IplImage* pBytes = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, channels);
+        IplImage* pFloat = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+        for (int i = 0; i < h; ++i)
+        {
+            unsigned char* b = (unsigned char*)(pBytes->imageData + i * pBytes->widthStep);
+            float* f = (float*)(pFloat->imageData + i * pFloat->widthStep);
+            for (int j = 0; j < w; ++j)
+            {
+                for (int k = 0; k < channels; ++k)
+                {
+                    b[j * channels + k] = (unsigned char)(random.GetUInt() % 256);
+                }
+                for (int k = 0; k < 3; ++k)
+                {
+                    f[j * 3 + k] = accumulate ? (float)b[j * channels + k] : 0.0f;
+                }
+            }
+        }
+        IplImage* pBefore = cvCloneImage(pBytes);
+
+        BinningRenderer renderer(random.GetUInt() % 2 ? 32 : 64);
+        renderer.Render(primitives, pFloat, true);
+        renderer.Render(primitives, pBytes, accumulate);
+
+        for (int i = 0; i < h; ++i)
+        {
+            const unsigned char* b = (const unsigned char*)(pBytes->imageData + i * pBytes->widthStep);
+            const unsigned char* a = (const unsigned char*)(pBefore->imageData + i * pBefore->widthStep);
+            const float* f = (const float*)(pFloat->imageData + i * pFloat->widthStep);
+            for (int j = 0; j < w; ++j)
+            {
+                for (int k = 0; k < 3; ++k)
+                {
+                    stats.Add(clip(cvRound(f[j * 3 + k]), 0, 255), b[j * channels + k]);
+                }
+                if (channels == 4)
+                {
+                    stats.Add(accumulate ? a[j * 4 + 3] : 255, b[j * 4 + 3]);
+                }
+            }
+        }
+
+        cvReleaseImage(&pBefore);
+        cvReleaseImage(&pFloat);
+        cvReleaseImage(&pBytes);
+    });
+    // particles.h: the SIMD step against stepping each particle on
+    // its own. The size of a particle is its index, to find it again
+    // after the kills have moved it.
+    checker.Register("particles/update", 1e-5, 64, [](MyRandom& random, ErrorStats& stats) {
+        int n = 1 + random.GetUInt() % 300;
+        float dt = random.GetFloat(0.0f, 0.1f);
+        ParticleSystem particles(n);
+        std::vector<ParticleSystem::Particle> reference(n);
+        for (int k = 0; k < n; ++k)
+        {
+            ParticleSystem::Particle& p = reference[k];
+            p.x = random.GetFloat(-100.0f, 2000.0f);
+            p.y = random.GetFloat(-100.0f, 2000.0f);
+            p.vx = random.GetFloat(-50.0f, 50.0f);
+            p.vy = random.GetFloat(-50.0f, 50.0f);
+            p.size = (float)k;
+            p.phase = random.GetFloat(0.0f, 0.999f);
+            p.rate = random.GetFloat(0.0f, 20.0f);
+            p.rgb[0] = p.rgb[1] = p.rgb[2] = 255.0f;
+            p.life = random.GetFloat(0.1f, 2.0f);
+            p.age = random.GetFloat(0.0f, p.life);
+            particles.Add(p);
+        }
+
+        particles.Update(dt);
+
+        int alive = 0;
+        std::vector<float> intensity(n);
+        for (int k = 0; k < n; ++k)
+        {
+            ParticleSystem::Particle& p = reference[k];
+            p.x += p.vx * dt;
+            p.y += p.vy * dt;
+            p.phase += p.rate * dt;
+            p.phase -= floor(p.phase);
+            p.age += dt;
+            intensity[k] = particleBrightness(p.phase, MIN(p.age / p.life, 1.0f));
+            alive += p.age < p.life ? 1 : 0;
+        }
+        stats.Add(alive, particles.GetCount());
+
+        for (int k = 0; k < particles.GetCount(); ++k)
+        {
+            ParticleSystem::Particle p;
+            particles.Get(k, p);
+            const ParticleSystem::Particle& r = reference[(int)p.size];
+            stats.AddRelative(r.x, p.x);
+            stats.AddRelative(r.y, p.y);
+            stats.Add(r.phase, p.phase);
+            stats.Add(r.age, p.age);
+            stats.Add(intensity[(int)p.size], particles.GetIntensity(k));
+        }
+    });
+    // tiled.h: a canvas of primitives and bloom drawn tile by tile
+    // against drawing it whole, 8-bit. The halo covers the blur, so
+    // only its summation order differs.
+    checker.Register("tiled/canvas", 1.0, 16, [](MyRandom& random, ErrorStats& stats) {
+        int w = 64 + random.GetUInt() % 300, h = 64 + random.GetUInt() % 200;
+        float sigma = random.GetUInt() % 2 ? random.GetFloat(0.5f, 8.0f) : 0.0f;
+
+        PrimitiveList primitives;
+        for (int p = 0; p < 200; ++p)
+        {
+            int x = (int)random.GetFloat(-40.0f, (float)w + 40.0f);
+            int y = (int)random.GetFloat(-40.0f, (float)h + 40.0f);
+            float radius = random.GetFloat(1.0f, 40.0f);
+            float rgb[] = { random.GetFloat(0.0f, 96.0f), random.GetFloat(0.0f, 96.0f), random.GetFloat(0.0f, 96.0f) };
+            switch (p % 3)
+            {
+                case 0:  primitives.AddRing(x, y, radius, 0.2f * radius + 1.0f, rgb); break;
+                case 1:  primitives.AddDisk(x, y, radius, rgb); break;
+                default: primitives.AddGradient(x, y, radius, rgb, 2.2f); break;
+            }
+        }
+
+        GaussianBlur blur;
+        IplImage* pWhole = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+        IplImage* pReference = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+        IplImage* pTiled = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+        BinningRenderer whole;
+        whole.Render(primitives, pWhole);
+        if (sigma > 0)
+        {
+            blur.Apply(pWhole, sigma);
+        }
+        LFBuffer buffer;
+        lfWrapImage(pReference, &buffer);
+        lfWriteResult(pWhole, &buffer, 0, 0);
+
+        std::mutex mutex;
+        TiledRenderer renderer(16 + random.GetUInt() % 100, sigma > 0 ? blurSupport(sigma) : 0);
+        renderer.Render(w, h,
+            [&](IplImage* pTile, CvRect region) {
+                PrimitiveList culled;
+                cullPrimitives(primitives, region, culled);
+                BinningRenderer binning;
+                binning.Render(culled, pTile);
+                if (sigma > 0)
+                {
+                    blur.Apply(pTile, sigma);
+                }
+                return true;
+            },
+            [&](const IplImage* pTile, int x, int y) {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (int i = 0; i < pTile->height; ++i)
+                {
+                    memcpy(pTiled->imageData + (y + i) * pTiled->widthStep + x * 3,
+                           pTile->imageData + i * pTile->widthStep, pTile->width * 3);
+                }
+                return true;
+            });
+
+        for (int i = 0; i < h; ++i)
+        {
+            const unsigned char* p = (const unsigned char*)(pReference->imageData + i * pReference->widthStep);
+            const unsigned char* q = (const unsigned char*)(pTiled->imageData + i * pTiled->widthStep);
+            for (int k = 0; k < w * 3; ++k)
+            {
+                stats.Add(p[k], q[k]);
+            }
+        }
+
+        cvReleaseImage(&pWhole);
+        cvReleaseImage(&pReference);
+        cvReleaseImage(&pTiled);
+    });
+    // sweep.h: the colorized variants against the coverage times the
+    // color of each variant.
+    checker.Register("sweep/colorize", 1e-6, 16, [](MyRandom& random, ErrorStats& stats) {
+        int w = 1 + random.GetUInt() % 64, h = 1 + random.GetUInt() % 16;
+        std::vector<IplImage*> coverage;
+
+        Sweep sweep([&](const SweepVariant& variant) {
+            IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+            MyRandom pixels(variant.seed);
+            for (int i = 0; i < h; ++i)
+            {
+                float* p = (float*)(pImage->imageData + i * pImage->widthStep);
+                for (int k = 0; k < w * 3; ++k)
+                {
+                    p[k] = pixels.GetFloat(0.0f, 255.0f);
+                }
+            }
+            coverage.push_back(pImage);
+            return pImage;
+        });
+
+        for (int k = 0; k < 3; ++k)
+        {
+            sweep.AddSeed(random.GetUInt());
+        }
+        for (int k = 0; k < 4; ++k)
+        {
+            float color[] = { random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f) };
+            sweep.AddColor(color);
+        }
+        sweep.AddBrightness(random.GetFloat(0.0f, 2.0f));
+        sweep.AddBrightness(random.GetFloat(0.0f, 2.0f));
+
+        std::mutex mutex;
+        sweep.Run([&](const SweepVariant& variant, const IplImage* image) {
+            // The coverage of the variant, drawn in sweep order.
+            std::lock_guard<std::mutex> lock(mutex);
+            const IplImage* pCoverage = coverage[variant.index / 8];
+            for (int i = 0; i < h; ++i)
+            {
+                const float* c = (const float*)(pCoverage->imageData + i * pCoverage->widthStep);
+                const float* p = (const float*)(image->imageData + i * image->widthStep);
+                for (int k = 0; k < w * 3; ++k)
+                {
+                    stats.AddRelative(c[k] * variant.color[k % 3] / 255.0f * variant.brightness, p[k]);
+                }
+            }
+        });
+
+        for (size_t k = 0; k < coverage.size(); ++k)
+        {
+            cvReleaseImage(&coverage[k]);
+        }
+    });
+    // sweep.h: the cells against the scene drawn in the color of each
+    // variant. A scene of one color is colorized from its white
+    // render; one with a fixed red ring of its own, like effect01 and
+    // effect09, is not linear in the color and is drawn per variant.
+    checker.Register("sweep/render", 1e-5, 16, [](MyRandom& random, ErrorStats& stats) {
+        int w = 16 + random.GetUInt() % 96, h = 16 + random.GetUInt() % 64;
+        bool linear = random.GetUInt() % 2 == 0;
+        IplImage* pImage = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+        IplImage* pReference = cvCreateImage(cvSize(w, h), IPL_DEPTH_32F, 3);
+
+        Sweep sweep([&](const SweepVariant& variant) {
+            float color[] = {255, 255, 255};
+            for (int k = 0; k < 3 && !linear; ++k)
+            {
+                color[k] = variant.color[k] * variant.brightness;
+            }
+            drawSweepScene(variant.seed, color, !linear, pImage);
+            return pImage;
+        });
+        sweep.SetColorLinear(linear);
+
+        for (int k = 0; k < 2; ++k)
+        {
+            sweep.AddSeed(random.GetUInt());
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            float color[] = { random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f) };
+            sweep.AddColor(color);
+        }
+        sweep.AddBrightness(random.GetFloat(0.0f, 2.0f));
+        sweep.AddBrightness(random.GetFloat(0.0f, 2.0f));
+
+        std::mutex mutex;
+        sweep.Run([&](const SweepVariant& variant, const IplImage* image) {
+            std::lock_guard<std::mutex> lock(mutex);
+            float color[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                color[k] = variant.color[k] * variant.brightness;
+            }
+            drawSweepScene(variant.seed, color, !linear, pReference);
+
+            for (int i = 0; i < h; ++i)
+            {
+                const float* r = (const float*)(pReference->imageData + i * pReference->widthStep);
+                const float* p = (const float*)(image->imageData + i * image->widthStep);
+                for (int k = 0; k < w * 3; ++k)
+                {
+                    stats.AddRelative(r[k], p[k]);
+                }
+            }
+        });
+
+        cvReleaseImage(&pReference);
+        cvReleaseImage(&pImage);
+    });
+    // primitive.h: every profile, blend mode and pixel type against
+    // flare.hpp GetPixel blended pixel by pixel.
+    checker.Register("primitive/flare", 1e-5, 64, [](MyRandom& random, ErrorStats& stats) {
+        int w = 16 + random.GetUInt() % 200, h = 16 + random.GetUInt() % 150;
+        int type = random.GetUInt() % 3;
+        int mode = random.GetUInt() % 3;
+        bool bytes = random.GetUInt() % 2 == 0;
+
+        int x = (int)random.GetFloat(-50.0f, (float)w + 50.0f);
+        int y = (int)random.GetFloat(-50.0f, (float)h + 50.0f);
+        float radius = random.GetFloat(0.5f, 120.0f);
+        float thickness = random.GetFloat(0.5f, 30.0f);
+        float gamma = random.GetFloat(0.2f, 4.0f);
+        float rgb[] = { random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f), random.GetFloat(0.0f, 255.0f) };
+
+        Flare ring(w, h, x, y, radius, thickness, rgb);
+        FlareSolid disk(w, h, x, y, radius, rgb);
+        FlareGradient gradient(w, h, x, y, radius, rgb, gamma);
+
+        IplImage* pImage = cvCreateImage(cvSize(w, h), bytes ? IPL_DEPTH_8U : IPL_DEPTH_32F, 3);
+        std::vector<float> before(w * h * 3);
+        for (int i = 0; i < h; ++i)
+        {
+            for (int k = 0; k < w * 3; ++k)
+            {
+                float v = (float)(random.GetUInt() % 256);
+                before[i * w * 3 + k] = v;
+                if (bytes)
+                {
+                    ((unsigned char*)(pImage->imageData + i * pImage->widthStep))[k] = (unsigned char)v;
+                }
+                else
+                {
+                    ((float*)(pImage->imageData + i * pImage->widthStep))[k] = v;
+                }
+            }
+        }
+
+        if (bytes)
+        {
+            drawPrimitiveOf<unsigned char>(mode, type, radius, thickness, gamma, (float)x, (float)y, rgb, pImage);
+        }
+        else
+        {
+            drawPrimitiveOf<float>(mode, type, radius, thickness, gamma, (float)x, (float)y, rgb, pImage);
+        }
+
+        for (int i = 0; i < h; ++i)
+        {
+            for (int j = 0; j < w; ++j)
+            {
+                // Only the pixels GetPixel covers are drawn; the
+                // ones at zero coverage may or may not be.
+                float c[3];
+                switch (type)
+                {
+                    case 0:  ring.GetPixel(i, j, c); break;
+                    case 1:  disk.GetPixel(i, j, c); break;
+                    default: gradient.GetPixel(i, j, c); break;
+                }
+
+                for (int k = 0; k < 3; ++k)
+                {
+                    float d = before[(i * w + j) * 3 + k];
+                    float v = mode == 0 ? c[k] : (mode == 1 ? d + c[k] : MAX(d, c[k]));
+                    if (c[k] == 0 && mode == 0)
+                    {
+                        continue;
+                    }
+
+                    if (bytes)
+                    {
+                        float fast = ((const unsigned char*)(pImage->imageData + i * pImage->widthStep))[j * 3 + k];
+                        stats.Add(primitiveSaturate(v), fast);
+                    }
+                    else
+                    {
+                        float fast = ((const float*)(pImage->imageData + i * pImage->widthStep))[j * 3 + k];
+                        stats.AddRelative(v, fast);
+                    }
+                }
+            }
+        }
+
+        cvReleaseImage(&pImage);
+    });
+}
+
+#endif // !EQUIVALENCE_H
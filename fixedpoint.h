@@ -0,0 +1,374 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   fixedpoint.h
+ *
+ * Abstract:
+ *
+ *   The radial primitives of primitive.h drawn in 16-bit fixed
+ *   point, for previews and 8-bit targets.
+ *
+ *   The colors are 8.8 fixed point and the coverage 0.16, so a
+ *   shaded value is one high multiply; the values are summed with
+ *   saturating adds into a 16-bit accumulation buffer and rounded
+ *   once into the 8-bit pixels, again with saturating adds. The SSE2
+ *   kernels work on 8 lanes of 16 bits (16 of 8 bits on the way
+ *   out), twice the lanes of the float path. The rows of a ring or
+ *   a disk where it covers fully are added as a constant color
+ *   without shading each pixel, and a gradient disk looks its
+ *   coverage up by the squared distance.
+ *
+ *   The result stays within 1 of the float path rounded to 8 bits.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "common.h"
+#include "primitive.h"
+
+// \brief a color in [0, 255] as 8.8 fixed point, saturated.
+static inline
+uint16_t fixedColor(float v)
+{
+    v = v * 256.0f + 0.5f;
+    return (uint16_t)(v <= 0.0f ? 0 : (v >= 65535.0f ? 65535 : (int)v));
+}
+
+// \brief a coverage in [0, 1] as 0.16 fixed point; 1 saturates.
+static inline
+uint16_t fixedCoverage(float s)
+{
+    s = s * 65536.0f + 0.5f;
+    return (uint16_t)(s <= 0.0f ? 0 : (s >= 65535.0f ? 65535 : (int)s));
+}
+
+static inline
+uint16_t fixedAdd(uint16_t a, uint32_t b)
+{
+    uint32_t s = a + b;
+    return (uint16_t)(s > 65535 ? 65535 : s);
+}
+
+// \brief a color of Channels 8.8 values, also repeated over the
+// lanes of 8 pixels for the SSE2 kernels.
+template <int Channels>
+struct FixedColor
+{
+    uint16_t value[Channels];
+#ifdef LF_SSE2
+    __m128i  lanes[Channels];
+#endif
+
+    explicit FixedColor(const uint16_t color[])
+    {
+        for (int c = 0; c < Channels; ++c)
+        {
+            value[c] = color[c];
+        }
+
+#ifdef LF_SSE2
+        uint16_t pattern[8 * Channels];
+        for (int m = 0; m < 8 * Channels; ++m)
+        {
+            pattern[m] = color[m % Channels];
+        }
+
+        for (int c = 0; c < Channels; ++c)
+        {
+            lanes[c] = _mm_loadu_si128((const __m128i*)(pattern + c * 8));
+        }
+#endif
+    };
+};
+
+// \brief add a color to n pixels of Channels values: acc += color.
+template <int Channels>
+static inline
+void fixedAddSpan(uint16_t* acc, int n, const FixedColor<Channels>& color)
+{
+    int k = 0;
+    int total = n * Channels;
+
+#ifdef LF_SSE2
+    // Eight pixels are Channels registers.
+    for (; k + 8 * Channels <= total; k += 8 * Channels)
+    {
+        for (int r = 0; r < Channels; ++r)
+        {
+            __m128i* p = (__m128i*)(acc + k + r * 8);
+            _mm_storeu_si128(p, _mm_adds_epu16(_mm_loadu_si128(p), color.lanes[r]));
+        }
+    }
+#endif
+
+    for (; k < total; ++k)
+    {
+        acc[k] = fixedAdd(acc[k], color.value[k % Channels]);
+    }
+}
+
+// \brief add a color at the coverage of each of n pixels:
+// acc += color * cov.
+template <int Channels>
+static inline
+void fixedAddCoverageSpan(uint16_t* acc, const uint16_t* cov, int n, const FixedColor<Channels>& color)
+{
+    int j = 0;
+
+#ifdef LF_SSE2
+    for (; j + 8 <= n; j += 8)
+    {
+        // The coverage of each pixel in each of its lanes.
+        uint16_t expanded[8 * Channels];
+        for (int m = 0; m < 8 * Channels; ++m)
+        {
+            expanded[m] = cov[j + m / Channels];
+        }
+
+        // The high half of 8.8 x 0.16 is 8.8.
+        uint16_t* p = acc + j * Channels;
+        for (int r = 0; r < Channels; ++r)
+        {
+            __m128i v = _mm_mulhi_epu16(_mm_loadu_si128((const __m128i*)(expanded + r * 8)), color.lanes[r]);
+            __m128i* q = (__m128i*)(p + r * 8);
+            _mm_storeu_si128(q, _mm_adds_epu16(_mm_loadu_si128(q), v));
+        }
+    }
+#endif
+
+    for (; j < n; ++j)
+    {
+        for (int c = 0; c < Channels; ++c)
+        {
+            uint16_t& a = acc[j * Channels + c];
+            a = fixedAdd(a, ((uint32_t)color.value[c] * cov[j]) >> 16);
+        }
+    }
+}
+
+// \brief round n 8.8 values to 8 bits and write them: dst = acc, or
+// dst += acc saturated.
+static inline
+void fixedWriteSpan(const uint16_t* acc, unsigned char* dst, int n, bool accumulate)
+{
+    int k = 0;
+
+#ifdef LF_SSE2
+    const __m128i half = _mm_set1_epi16(128);
+    for (; k + 16 <= n; k += 16)
+    {
+        __m128i lo = _mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)(acc + k)), half), 8);
+        __m128i hi = _mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)(acc + k + 8)), half), 8);
+        __m128i v = _mm_packus_epi16(lo, hi);
+        if (accumulate)
+        {
+            v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i*)(dst + k)));
+        }
+        _mm_storeu_si128((__m128i*)(dst + k), v);
+    }
+#endif
+
+    for (; k < n; ++k)
+    {
+        int v = fixedAdd(acc[k], 128) >> 8;
+        dst[k] = (unsigned char)(accumulate ? MIN(dst[k] + v, 255) : v);
+    }
+}
+
+// \brief the coverage of a gradient disk looked up by the squared
+// distance, for a center on a pixel: dx and dy are whole, so the
+// table is exact and saves the pow() of every pixel.
+struct FixedGradientTable
+{
+    const uint16_t* table;  // the 0.16 coverage at d^2 = 0, 1, ...
+    int             size;
+    float           radius;
+
+    FixedGradientTable(const uint16_t* t, int n, float r)
+    {
+        table = t;
+        size = n;
+        radius = r;
+    };
+
+    // \brief the table entries of a gradient disk, 0 if too large.
+    static int GetSize(const GradientProfile& gradient)
+    {
+        float n = gradient.radius * gradient.radius + 1.0f;
+        return n <= 65536.0f ? (int)n : 0;
+    };
+
+    // \brief fill the GetSize() entries of a table.
+    static void Fill(const GradientProfile& gradient, uint16_t* table)
+    {
+        int n = GetSize(gradient);
+        for (int d2 = 0; d2 < n; ++d2)
+        {
+            float s;
+            table[d2] = gradient.Shade(sqrt((float)d2), s) ? fixedCoverage(s) : 0;
+        }
+    };
+
+    float Reach() const
+    {
+        return radius;
+    };
+};
+
+//
+// The 0.16 coverage of a profile at the offset (dx, dy) from its
+// center.
+//
+
+template <class Profile>
+static inline
+uint16_t fixedShade(const Profile& profile, float dx, float dy)
+{
+    float s;
+    return profile.Shade(sqrt(dx * dx + dy * dy), s) ? fixedCoverage(s) : 0;
+}
+
+static inline
+uint16_t fixedShade(const FixedGradientTable& gradient, float dx, float dy)
+{
+    int d2 = (int)(dx * dx + dy * dy);
+    return d2 < gradient.size ? gradient.table[d2] : 0;
+}
+
+//
+// The band of a row where a profile covers fully, lo <= |dx| <= hi:
+// Shade() gives 1 there, so the pixels are added as the color.
+//
+
+static inline
+bool fixedSolidBand(const RingProfile& ring, float dy, float& lo, float& hi)
+{
+    float in = ring.inner + 1.0f;
+    float out = ring.outer - 1.0f;
+    float e = out * out - dy * dy;
+    if (out < in || out < 0 || e < 0)
+    {
+        return false;
+    }
+
+    float e2 = in * in - dy * dy;
+    hi = sqrt(e);
+    lo = in > 0 && e2 > 0 ? sqrt(e2) : 0.0f;
+    return true;
+}
+
+static inline
+bool fixedSolidBand(const DiskProfile& disk, float dy, float& lo, float& hi)
+{
+    float out = disk.radius - 1.0f;
+    float e = out * out - dy * dy;
+    if (out < 0 || e < 0)
+    {
+        return false;
+    }
+
+    hi = sqrt(e);
+    lo = 0.0f;
+    return true;
+}
+
+template <class Profile>
+static inline
+bool fixedSolidBand(const Profile&, float, float&, float&)
+{
+    return false;
+}
+
+// \brief draw a primitive, summed, into an 8.8 accumulation buffer
+// of Channels values per pixel, like drawPrimitive with BlendAdditive.
+//
+// \param color the color; an alpha channel gets 0.
+template <class Profile, int Channels>
+static inline
+void drawPrimitiveFixed(const Profile& profile, float cx, float cy, const FixedColor<Channels>& color,
+                        const PrimitiveCanvas<uint16_t>& canvas)
+{
+    float reach = profile.Reach();
+
+    int y0 = MAX(canvas.y, (int)floor(cy - reach));
+    int y1 = MIN(canvas.y + canvas.height - 1, (int)ceil(cy + reach));
+
+    static thread_local std::vector<uint16_t> coverage;
+    coverage.resize(canvas.width);
+
+    for (int i = y0; i <= y1; ++i)
+    {
+        float dy = (float)i - cy;
+
+        float extent = reach * reach - dy * dy;
+        if (extent < 0)
+        {
+            continue;
+        }
+        extent = sqrt(extent) + 1.0f;
+        int j0 = MAX(canvas.x, (int)floor(cx - extent));
+        int j1 = MIN(canvas.x + canvas.width - 1, (int)ceil(cx + extent));
+
+        uint16_t* row = canvas.data + (i - canvas.y) * canvas.stride - canvas.x * Channels;
+
+        // Walk the row left to right: shaded pixels up to each
+        // solid run, then the run.
+        int j = j0;
+        auto upTo = [&](int end, bool solid) {
+            end = MIN(end, j1 + 1);
+            if (end <= j)
+            {
+                return;
+            }
+
+            if (solid)
+            {
+                fixedAddSpan<Channels>(row + j * Channels, end - j, color);
+            }
+            else
+            {
+                for (int k = j; k < end; ++k)
+                {
+                    coverage[k - j] = fixedShade(profile, (float)k - cx, dy);
+                }
+                fixedAddCoverageSpan<Channels>(row + j * Channels, &coverage[0], end - j, color);
+            }
+            j = end;
+        };
+
+        float lo, hi;
+        if (fixedSolidBand(profile, dy, lo, hi))
+        {
+            int a0 = (int)ceil(cx - hi);
+            int a1 = (int)floor(cx - lo);
+            int b0 = (int)ceil(cx + lo);
+            int b1 = (int)floor(cx + hi);
+            if (b0 <= a1 + 1)
+            {
+                // No hole on this row: one run.
+                a1 = b1;
+            }
+
+            upTo(a0, false);
+            upTo(a1 + 1, true);
+            upTo(b0, false);
+            upTo(b1 + 1, true);
+        }
+        upTo(j1 + 1, false);
+    }
+}
+
+#endif // !FIXED_POINT_H
@@ -0,0 +1,551 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   framefile.h
+ *
+ * Abstract:
+ *
+ *   A raw float/half-float frame sequence container for batch
+ *   renders. The file has an index for a number of frames and is
+ *   written through a memory mapping, so storing a frame is a
+ *   conversion into the mapped pages with no encoder involved.
+ *   The frames are mapped a few at first and the mapping doubles as
+ *   they are written; closing cuts the file to the frames written.
+ *   Readers map the file and get any frame by its index.
+ *
+ *   Layout (little endian):
+ *
+ *     FrameFileHeader   64 bytes
+ *     FrameIndexEntry   x capacity
+ *     padding           up to a page boundary
+ *     frames            frameSize bytes each, page aligned,
+ *                       frameCount of them
+ *
+ *   Pixels are interleaved BGR (or gray) in [0, 1] with the
+ *   values above 1 kept, i.e. effect results divided by 255.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef FRAME_FILE_H
+#define FRAME_FILE_H
+
+#include <stdint.h>
+#include <cstring>
+
+#include "cxcore.h"
+
+#include "mapfile.h"
+
+#define FRAME_FILE_MAGIC   0x5346464C // "LFFS"
+#define FRAME_FILE_VERSION 1
+#define FRAME_FILE_ALIGN   4096
+
+// The frames a new file has room for before its mapping grows.
+#define FRAME_FILE_INITIAL 4
+
+enum FrameFormat
+{
+    FRAME_FORMAT_F32 = 0,
+    FRAME_FORMAT_F16 = 1,
+};
+
+struct FrameFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t format;      // FrameFormat
+    uint32_t capacity;    // the number of index entries.
+    uint32_t frameCount;  // the number of frames written.
+    uint64_t frameSize;   // bytes per frame.
+    uint64_t indexOffset;
+    uint64_t dataOffset;
+    uint32_t reserved[2];
+};
+
+struct FrameIndexEntry
+{
+    uint64_t offset; // 0 if the frame has not been written.
+    uint32_t tag;    // caller data, e.g. the frame number.
+    uint32_t flags;
+};
+
+// \brief IEEE 754 binary16 conversions, rounding to nearest even.
+static inline
+uint16_t floatToHalf(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7FFFFF;
+    int e = (int)((x >> 23) & 0xFF);
+
+    // Inf and NaN.
+    if (e == 0xFF)
+    {
+        return (uint16_t)(sign | 0x7C00 | (mant ? 0x200 : 0));
+    }
+
+    e = e - 127 + 15;
+    if (e >= 31)
+    {
+        return (uint16_t)(sign | 0x7C00);
+    }
+
+    if (e <= 0)
+    {
+        // Subnormal or zero.
+        if (e < -10)
+        {
+            return (uint16_t)sign;
+        }
+        mant |= 0x800000;
+        int shift = 14 - e;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1)))
+        {
+            ++h;
+        }
+        return (uint16_t)(sign | h);
+    }
+
+    uint32_t h = ((uint32_t)e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+    {
+        ++h; // a carry into the exponent rounds up to the next power, or Inf.
+    }
+    return (uint16_t)(sign | h);
+}
+
+static inline
+float halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t x;
+
+    if (e == 0)
+    {
+        if (mant == 0)
+        {
+            x = sign;
+        }
+        else
+        {
+            // Renormalize the subnormal.
+            int shift = 0;
+            while ((mant & 0x400) == 0)
+            {
+                mant <<= 1;
+                ++shift;
+            }
+            mant &= 0x3FF;
+            x = sign | ((uint32_t)(127 - 15 + 1 - shift) << 23) | (mant << 13);
+        }
+    }
+    else if (e == 31)
+    {
+        x = sign | 0x7F800000 | (mant << 13);
+    }
+    else
+    {
+        x = sign | ((e + 127 - 15) << 23) | (mant << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+class FrameFileWriter
+{
+public:
+    FrameFileWriter()
+    {
+        m_pHeader = 0;
+        m_pIndex = 0;
+        m_allocated = 0;
+    };
+
+    ~FrameFileWriter()
+    {
+        Close();
+    };
+
+    // \brief create the file with an index of capacity frames.
+    // \return false if failed, e.g. a frame doesn't fit in memory,
+    // and true if OK.
+    bool Create(const char* path,
+                int width,
+                int height,
+                int channels,
+                FrameFormat format,
+                int capacity)
+    {
+        Close();
+
+        if (width <= 0 || height <= 0 || capacity <= 0 || (channels != 1 && channels != 3))
+        {
+            return false;
+        }
+
+        uint64_t pixelSize = (format == FRAME_FORMAT_F16) ? 2 : 4;
+        if ((uint64_t)width * height > GetMaxSize() / (channels * pixelSize))
+        {
+            return false;
+        }
+        uint64_t frameSize = Align((uint64_t)width * height * channels * pixelSize);
+        uint64_t indexOffset = sizeof(FrameFileHeader);
+        uint64_t dataOffset = Align(indexOffset + sizeof(FrameIndexEntry) * capacity);
+
+        int allocated = MIN(capacity, FRAME_FILE_INITIAL);
+        if (!Fits(dataOffset, frameSize, allocated) ||
+            !m_file.Create(path, (size_t)(dataOffset + frameSize * allocated)))
+        {
+            return false;
+        }
+        m_allocated = allocated;
+
+        m_pHeader = (FrameFileHeader*)m_file.GetData();
+        memset(m_pHeader, 0, sizeof(FrameFileHeader));
+        m_pHeader->magic = FRAME_FILE_MAGIC;
+        m_pHeader->version = FRAME_FILE_VERSION;
+        m_pHeader->width = width;
+        m_pHeader->height = height;
+        m_pHeader->channels = channels;
+        m_pHeader->format = format;
+        m_pHeader->capacity = capacity;
+        m_pHeader->frameCount = 0;
+        m_pHeader->frameSize = frameSize;
+        m_pHeader->indexOffset = indexOffset;
+        m_pHeader->dataOffset = dataOffset;
+
+        m_pIndex = (FrameIndexEntry*)(m_file.GetData() + indexOffset);
+        memset(m_pIndex, 0, sizeof(FrameIndexEntry) * capacity);
+
+        return true;
+    };
+
+    // \brief append a frame.
+    //
+    // \param image a float image ([0, 255], e.g. an effect result)
+    // with the channels of the file.
+    // \param tag caller data stored in the index.
+    // \return the index of the frame, or -1 if failed.
+    int Append(const IplImage* image, uint32_t tag = 0)
+    {
+        if (m_pHeader == 0 || m_pHeader->frameCount >= m_pHeader->capacity)
+        {
+            return -1;
+        }
+
+        int index = m_pHeader->frameCount;
+        if (!Write(index, image, tag))
+        {
+            return -1;
+        }
+        return index;
+    };
+
+    // \brief write a frame at any index (e.g. out of order from
+    // several batch workers).
+    // \return false if failed and true if OK.
+    bool Write(int index, const IplImage* image, uint32_t tag = 0)
+    {
+        if (m_pHeader == 0 || index < 0 || index >= (int)m_pHeader->capacity ||
+            image->depth != IPL_DEPTH_32F ||
+            image->nChannels != (int)m_pHeader->channels ||
+            image->width != (int)m_pHeader->width ||
+            image->height != (int)m_pHeader->height)
+        {
+            return false;
+        }
+
+        if (index >= m_allocated && !Reserve(index + 1))
+        {
+            return false;
+        }
+
+        uint64_t offset = m_pHeader->dataOffset + m_pHeader->frameSize * index;
+        unsigned char* pFrame = m_file.GetData() + offset;
+        int n = image->width * image->nChannels;
+
+        for (int i = 0; i < image->height; ++i)
+        {
+            const float* src = (const float*)(image->imageData + i * image->widthStep);
+
+            if (m_pHeader->format == FRAME_FORMAT_F16)
+            {
+                uint16_t* dst = (uint16_t*)pFrame + (size_t)i * n;
+                for (int k = 0; k < n; ++k)
+                {
+                    dst[k] = floatToHalf(src[k] * (1.0f / 255.0f));
+                }
+            }
+            else
+            {
+                float* dst = (float*)pFrame + (size_t)i * n;
+                for (int k = 0; k < n; ++k)
+                {
+                    dst[k] = src[k] * (1.0f / 255.0f);
+                }
+            }
+        }
+
+        m_pIndex[index].offset = offset;
+        m_pIndex[index].tag = tag;
+        m_pIndex[index].flags = 0;
+
+        if ((uint32_t)index >= m_pHeader->frameCount)
+        {
+            m_pHeader->frameCount = index + 1;
+        }
+
+        return true;
+    };
+
+    int GetFrameCount() const
+    {
+        return m_pHeader != 0 ? (int)m_pHeader->frameCount : 0;
+    };
+
+    // \brief cut the file to the frames written and close it.
+    void Close()
+    {
+        if (m_pHeader != 0)
+        {
+            uint64_t size = m_pHeader->dataOffset + m_pHeader->frameSize * m_pHeader->frameCount;
+            m_file.Flush();
+            m_file.Resize((size_t)size);
+        }
+        m_file.Close();
+        m_pHeader = 0;
+        m_pIndex = 0;
+        m_allocated = 0;
+    };
+
+private:
+    static uint64_t Align(uint64_t size)
+    {
+        return (size + FRAME_FILE_ALIGN - 1) & ~(uint64_t)(FRAME_FILE_ALIGN - 1);
+    };
+
+    // \brief the largest mapping of the address space.
+    static uint64_t GetMaxSize()
+    {
+        return (uint64_t)(size_t)-1;
+    };
+
+    // \brief whether a file of count frames can be mapped at all.
+    static bool Fits(uint64_t dataOffset, uint64_t frameSize, int count)
+    {
+        return dataOffset <= GetMaxSize() &&
+               frameSize <= (GetMaxSize() - dataOffset) / (uint64_t)MAX(count, 1);
+    };
+
+    // \brief grow the mapping to at least count frames, doubling it
+    // up to the capacity.
+    // \return false if failed; the file is then closed.
+    bool Reserve(int count)
+    {
+        int capacity = (int)m_pHeader->capacity;
+        int allocated = MIN(MAX(count, 2 * m_allocated), capacity);
+        uint64_t dataOffset = m_pHeader->dataOffset;
+        uint64_t frameSize = m_pHeader->frameSize;
+
+        if (!Fits(dataOffset, frameSize, allocated))
+        {
+            allocated = count;
+            if (!Fits(dataOffset, frameSize, allocated))
+            {
+                return false;
+            }
+        }
+
+        if (!m_file.Resize((size_t)(dataOffset + frameSize * allocated)))
+        {
+            m_pHeader = 0;
+            m_pIndex = 0;
+            m_allocated = 0;
+            return false;
+        }
+
+        m_pHeader = (FrameFileHeader*)m_file.GetData();
+        m_pIndex = (FrameIndexEntry*)(m_file.GetData() + m_pHeader->indexOffset);
+        m_allocated = allocated;
+        return true;
+    };
+
+private:
+    MappedFile       m_file;
+    FrameFileHeader* m_pHeader;
+    FrameIndexEntry* m_pIndex;
+    int              m_allocated; // the frames the mapping has room for.
+};
+
+class FrameFileReader
+{
+public:
+    FrameFileReader()
+    {
+        m_pHeader = 0;
+        m_pIndex = 0;
+    };
+
+    // \return false if the file is missing, not a frame file or its
+    // header and index reach past its end.
+    bool Open(const char* path)
+    {
+        m_pHeader = 0;
+        m_pIndex = 0;
+
+        if (!m_file.Open(path))
+        {
+            return false;
+        }
+
+        const FrameFileHeader* pHeader = (const FrameFileHeader*)m_file.GetData();
+        if (m_file.GetSize() < sizeof(FrameFileHeader) || !IsValid(pHeader, m_file.GetSize()))
+        {
+            m_file.Close();
+            return false;
+        }
+
+        m_pHeader = pHeader;
+        m_pIndex = (const FrameIndexEntry*)(m_file.GetData() + pHeader->indexOffset);
+        return true;
+    };
+
+    const FrameFileHeader* GetHeader() const
+    {
+        return m_pHeader;
+    };
+
+    int GetFrameCount() const
+    {
+        return m_pHeader != 0 ? (int)m_pHeader->frameCount : 0;
+    };
+
+    // \brief the mapped pixels of a frame, float or half depending
+    // on the header format.
+    // \return 0 if the frame was never written or its entry points
+    //   past the end of the file.
+    const void* GetFrame(int index, uint32_t* tag = 0) const
+    {
+        if (m_pHeader == 0 || index < 0 || index >= (int)m_pHeader->frameCount ||
+            m_pIndex[index].offset == 0 ||
+            !IsInside(m_pIndex[index].offset, m_pHeader->frameSize, m_file.GetSize()))
+        {
+            return 0;
+        }
+
+        if (tag != 0)
+        {
+            *tag = m_pIndex[index].tag;
+        }
+        return m_file.GetData() + m_pIndex[index].offset;
+    };
+
+    // \brief decode a frame into a float image of [0, 255] values.
+    // \return false if failed and true if OK.
+    bool ReadFrame(int index, IplImage* image) const
+    {
+        const void* pFrame = GetFrame(index);
+        if (pFrame == 0 ||
+            image->depth != IPL_DEPTH_32F ||
+            image->nChannels != (int)m_pHeader->channels ||
+            image->width != (int)m_pHeader->width ||
+            image->height != (int)m_pHeader->height)
+        {
+            return false;
+        }
+
+        int n = image->width * image->nChannels;
+        for (int i = 0; i < image->height; ++i)
+        {
+            float* dst = (float*)(image->imageData + i * image->widthStep);
+
+            if (m_pHeader->format == FRAME_FORMAT_F16)
+            {
+                const uint16_t* src = (const uint16_t*)pFrame + (size_t)i * n;
+                for (int k = 0; k < n; ++k)
+                {
+                    dst[k] = halfToFloat(src[k]) * 255.0f;
+                }
+            }
+            else
+            {
+                const float* src = (const float*)pFrame + (size_t)i * n;
+                for (int k = 0; k < n; ++k)
+                {
+                    dst[k] = src[k] * 255.0f;
+                }
+            }
+        }
+
+        return true;
+    };
+
+private:
+    // \brief whether the bytes [offset, offset + length) are in a file
+    // of size bytes, without overflow.
+    static bool IsInside(uint64_t offset, uint64_t length, uint64_t size)
+    {
+        return offset <= size && length <= size - offset;
+    };
+
+    // \brief check the header of a file of size bytes: the frames hold
+    // their pixels, and the index and the frames are in the file.
+    static bool IsValid(const FrameFileHeader* pHeader, uint64_t size)
+    {
+        if (pHeader->magic != FRAME_FILE_MAGIC ||
+            pHeader->version != FRAME_FILE_VERSION ||
+            (pHeader->format != FRAME_FORMAT_F32 && pHeader->format != FRAME_FORMAT_F16) ||
+            pHeader->width == 0 || pHeader->height == 0 || pHeader->channels == 0 ||
+            pHeader->frameCount > pHeader->capacity)
+        {
+            return false;
+        }
+
+        // The pixels of a frame, in bytes.
+        uint64_t pixelSize = (pHeader->format == FRAME_FORMAT_F16) ? 2 : 4;
+        uint64_t pixels = (uint64_t)pHeader->width * pHeader->height;
+        if (pixels > pHeader->frameSize / pixelSize / pHeader->channels)
+        {
+            return false;
+        }
+
+        // The entries are read in place, so they must be aligned.
+        if (pHeader->indexOffset % sizeof(uint64_t) != 0 ||
+            !IsInside(pHeader->indexOffset, (uint64_t)sizeof(FrameIndexEntry) * pHeader->capacity, size))
+        {
+            return false;
+        }
+
+        return pHeader->frameCount == 0 ||
+            (pHeader->dataOffset <= size &&
+             pHeader->frameCount <= (size - pHeader->dataOffset) / pHeader->frameSize);
+    };
+
+private:
+    MappedFile             m_file;
+    const FrameFileHeader* m_pHeader;
+    const FrameIndexEntry* m_pIndex;
+};
+
+#endif // !FRAME_FILE_H
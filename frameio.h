@@ -0,0 +1,539 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   frameio.h
+ *
+ * Abstract:
+ *
+ *   Read and write frame sequences: numbered images, a
+ *   directory of images, Y4M streams and raw BGR24 streams.
+ *   All frames are 8-bit 3-channel BGR images.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef FRAME_IO_H
+#define FRAME_IO_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+# include <windows.h>
+# include <io.h>
+# include <fcntl.h>
+#else
+# include <dirent.h>
+#endif
+
+#include "cv.h"
+#include "highgui.h"
+
+#include "common.h"
+
+class FrameReader
+{
+public:
+    virtual ~FrameReader() {};
+
+    // \brief prepare the reading and find out the frame size.
+    // \return false if failed and true if OK.
+    virtual bool Open() = 0;
+
+    // \brief read the next frame into a BGR24 image of the
+    // frame size.
+    // \return false at the end of the sequence.
+    virtual bool Read(IplImage* frame) = 0;
+
+    int GetWidth() const { return m_width; };
+    int GetHeight() const { return m_height; };
+
+protected:
+    int m_width;
+    int m_height;
+};
+
+class FrameWriter
+{
+public:
+    virtual ~FrameWriter() {};
+
+    // \brief write the next frame.
+    // \return false if failed and true if OK.
+    virtual bool Write(const IplImage* frame) = 0;
+};
+
+// \brief a sequence of images, either numbered by a printf
+// pattern such as "dumpsrc_%04d.bmp" or all the images of a
+// directory in name order.
+class ImageSequenceReader : public FrameReader
+{
+public:
+    ImageSequenceReader(const char* path, int first = 1)
+    {
+        m_path = path;
+        m_index = first;
+        m_pNext = 0;
+    };
+
+    ~ImageSequenceReader()
+    {
+        if (m_pNext != 0)
+        {
+            cvReleaseImage(&m_pNext);
+        }
+    };
+
+    bool Open()
+    {
+        if (m_path.find('%') == std::string::npos && !ListDirectory())
+        {
+            fprintf(stderr, "Err: %s is neither a pattern nor a directory.\n", m_path.c_str());
+            return false;
+        }
+
+        // The first image gives the frame size.
+        m_pNext = Load();
+        if (m_pNext == 0)
+        {
+            return false;
+        }
+
+        m_width = m_pNext->width;
+        m_height = m_pNext->height;
+        return true;
+    };
+
+    bool Read(IplImage* frame)
+    {
+        IplImage* pImage = m_pNext != 0 ? m_pNext : Load();
+        m_pNext = 0;
+
+        if (pImage == 0)
+        {
+            return false;
+        }
+
+        bool ok = pImage->width == m_width && pImage->height == m_height;
+        if (ok)
+        {
+            cvCopy(pImage, frame);
+        }
+        else
+        {
+            fprintf(stderr, "Err: frame size changed in the sequence.\n");
+        }
+
+        cvReleaseImage(&pImage);
+        return ok;
+    };
+
+private:
+    IplImage* Load()
+    {
+        char filename[1024];
+
+        if (m_files.empty())
+        {
+            sprintf(filename, m_path.c_str(), m_index);
+        }
+        else if (m_index < (int)m_files.size())
+        {
+            sprintf(filename, "%s/%s", m_path.c_str(), m_files[m_index].c_str());
+        }
+        else
+        {
+            return 0;
+        }
+
+        ++m_index;
+        return cvLoadImage(filename, CV_LOAD_IMAGE_COLOR);
+    };
+
+    static bool IsImage(const std::string& name)
+    {
+        static const char* extensions[] = {
+            ".bmp", ".png", ".jpg", ".jpeg", ".tif", ".tiff", ".ppm", ".pgm",
+        };
+
+        size_t dot = name.rfind('.');
+        if (dot == std::string::npos)
+        {
+            return false;
+        }
+
+        std::string ext = name.substr(dot);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+        {
+            if (ext == extensions[i])
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool ListDirectory()
+    {
+#ifdef _WIN32
+        WIN32_FIND_DATAA data;
+        HANDLE handle = FindFirstFileA((m_path + "\\*").c_str(), &data);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        do
+        {
+            if (IsImage(data.cFileName))
+            {
+                m_files.push_back(data.cFileName);
+            }
+        } while (FindNextFileA(handle, &data));
+        FindClose(handle);
+#else
+        DIR* dir = opendir(m_path.c_str());
+        if (dir == 0)
+        {
+            return false;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != 0)
+        {
+            if (IsImage(entry->d_name))
+            {
+                m_files.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+#endif
+        std::sort(m_files.begin(), m_files.end());
+        m_index = 0;
+        return !m_files.empty();
+    };
+
+private:
+    std::string              m_path;
+    std::vector<std::string> m_files; // empty when m_path is a pattern.
+    int                      m_index;
+    IplImage*                m_pNext; // the image loaded by Open().
+};
+
+class ImageSequenceWriter : public FrameWriter
+{
+public:
+    // \param pattern the printf pattern of the file names.
+    ImageSequenceWriter(const char* pattern, int first = 1)
+    {
+        m_pattern = pattern;
+        m_index = first;
+    };
+
+    bool Write(const IplImage* frame)
+    {
+        char filename[1024];
+        sprintf(filename, m_pattern.c_str(), m_index++);
+        return cvSaveImage(filename, frame) != 0;
+    };
+
+private:
+    std::string m_pattern;
+    int         m_index;
+};
+
+// BT.601 limited range YCbCr <-> RGB in 8.8 fixed point.
+static inline
+void yuv2bgr(int y, int u, int v, unsigned char* bgr)
+{
+    int c = 298 * (y - 16) + 128;
+    int d = u - 128;
+    int e = v - 128;
+
+    bgr[0] = (unsigned char)clip((c + 516 * d) >> 8, 0, 255);
+    bgr[1] = (unsigned char)clip((c - 100 * d - 208 * e) >> 8, 0, 255);
+    bgr[2] = (unsigned char)clip((c + 409 * e) >> 8, 0, 255);
+}
+
+static inline
+void bgr2yuv(const unsigned char* bgr, int& y, int& u, int& v)
+{
+    int b = bgr[0];
+    int g = bgr[1];
+    int r = bgr[2];
+
+    y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+enum StreamFormat
+{
+    STREAM_Y4M = 0, // YUV4MPEG2 with 4:2:0 or 4:4:4 chroma.
+    STREAM_RAW = 1, // headerless BGR24 frames of a given size.
+};
+
+// \brief switch stdin or stdout to binary mode, so that Windows
+// doesn't translate line ends and stop at 0x1A in the frames. Files
+// the caller opened are left as they are.
+static inline
+void setStreamBinary(FILE* file)
+{
+#ifdef _WIN32
+    if (file == stdin || file == stdout)
+    {
+        _setmode(_fileno(file), _O_BINARY);
+    }
+#else
+    (void)file;
+#endif
+}
+
+// \brief frames from a Y4M or raw BGR24 stream, stdin by default.
+class StreamReader : public FrameReader
+{
+public:
+    // \param width the frame width of a raw stream, ignored for Y4M.
+    // \param height ditto.
+    StreamReader(StreamFormat format, FILE* file = stdin, int width = 0, int height = 0)
+    {
+        m_format = format;
+        m_file = file;
+        m_width = width;
+        m_height = height;
+        m_chroma444 = false;
+        setStreamBinary(file);
+    };
+
+    bool Open()
+    {
+        if (m_format == STREAM_RAW)
+        {
+            return m_width > 0 && m_height > 0;
+        }
+
+        char header[256];
+        if (!ReadLine(header, sizeof(header)) || strncmp(header, "YUV4MPEG2 ", 10) != 0)
+        {
+            fprintf(stderr, "Err: not a Y4M stream.\n");
+            return false;
+        }
+
+        m_header = header;
+        m_width = m_height = 0;
+
+        // Parse the tagged parameters.
+        for (char* tag = strtok(header + 10, " "); tag != 0; tag = strtok(0, " "))
+        {
+            switch (tag[0])
+            {
+                case 'W': m_width = atoi(tag + 1); break;
+                case 'H': m_height = atoi(tag + 1); break;
+                case 'C':
+                    if (strncmp(tag + 1, "444", 3) == 0 && strcmp(tag + 1, "444alpha") != 0)
+                    {
+                        m_chroma444 = true;
+                    }
+                    else if (strncmp(tag + 1, "420", 3) != 0)
+                    {
+                        fprintf(stderr, "Err: unsupported Y4M colorspace %s.\n", tag);
+                        return false;
+                    }
+                    break;
+            }
+        }
+
+        if (m_width <= 0 || m_height <= 0)
+        {
+            return false;
+        }
+
+        int cw = m_chroma444 ? m_width : (m_width + 1) / 2;
+        int ch = m_chroma444 ? m_height : (m_height + 1) / 2;
+        m_planes.resize(m_width * m_height + 2 * cw * ch);
+        return true;
+    };
+
+    bool Read(IplImage* frame)
+    {
+        if (m_format == STREAM_RAW)
+        {
+            for (int i = 0; i < m_height; ++i)
+            {
+                if (fread(frame->imageData + i * frame->widthStep, 3, m_width, m_file) != (size_t)m_width)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        char line[256];
+        if (!ReadLine(line, sizeof(line)) || strncmp(line, "FRAME", 5) != 0)
+        {
+            return false;
+        }
+
+        if (fread(&m_planes[0], 1, m_planes.size(), m_file) != m_planes.size())
+        {
+            return false;
+        }
+
+        int cw = m_chroma444 ? m_width : (m_width + 1) / 2;
+        int cs = m_chroma444 ? 0 : 1;
+        const unsigned char* pY = &m_planes[0];
+        const unsigned char* pU = pY + m_width * m_height;
+        const unsigned char* pV = pU + (m_planes.size() - m_width * m_height) / 2;
+
+        for (int i = 0; i < m_height; ++i)
+        {
+            unsigned char* p = (unsigned char*)frame->imageData + i * frame->widthStep;
+            const unsigned char* rowU = pU + (i >> cs) * cw;
+            const unsigned char* rowV = pV + (i >> cs) * cw;
+
+            for (int j = 0; j < m_width; ++j, p += 3)
+            {
+                yuv2bgr(pY[i * m_width + j], rowU[j >> cs], rowV[j >> cs], p);
+            }
+        }
+
+        return true;
+    };
+
+    // \brief the Y4M stream header, to be copied to the output.
+    const std::string& GetHeader() const
+    {
+        return m_header;
+    };
+
+    bool IsChroma444() const
+    {
+        return m_chroma444;
+    };
+
+private:
+    bool ReadLine(char* line, int size)
+    {
+        if (fgets(line, size, m_file) == 0)
+        {
+            return false;
+        }
+        line[strcspn(line, "\n")] = 0;
+        return true;
+    };
+
+private:
+    StreamFormat               m_format;
+    FILE*                      m_file;
+    bool                       m_chroma444;
+    std::string                m_header;
+    std::vector<unsigned char> m_planes; // one Y4M frame.
+};
+
+// \brief frames to a Y4M or raw BGR24 stream, stdout by default.
+class StreamWriter : public FrameWriter
+{
+public:
+    // \param header the Y4M stream header (see StreamReader), or
+    // 0 to write a 4:2:0 header from the frame size.
+    StreamWriter(StreamFormat format, FILE* file = stdout, const char* header = 0)
+    {
+        m_format = format;
+        m_file = file;
+        m_header = header != 0 ? header : "";
+        m_chroma444 = m_header.find(" C444") != std::string::npos;
+        m_headerWritten = false;
+        setStreamBinary(file);
+    };
+
+    bool Write(const IplImage* frame)
+    {
+        int width = frame->width;
+        int height = frame->height;
+
+        if (m_format == STREAM_RAW)
+        {
+            for (int i = 0; i < height; ++i)
+            {
+                if (fwrite(frame->imageData + i * frame->widthStep, 3, width, m_file) != (size_t)width)
+                {
+                    return false;
+                }
+            }
+            return fflush(m_file) == 0;
+        }
+
+        if (!m_headerWritten)
+        {
+            if (m_header.empty())
+            {
+                fprintf(m_file, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C420jpeg\n", width, height);
+            }
+            else
+            {
+                fprintf(m_file, "%s\n", m_header.c_str());
+            }
+            m_headerWritten = true;
+        }
+
+        int cs = m_chroma444 ? 0 : 1;
+        int cw = m_chroma444 ? width : (width + 1) / 2;
+        int ch = m_chroma444 ? height : (height + 1) / 2;
+
+        m_planes.assign(width * height + 2 * cw * ch, 0);
+        std::vector<int> sums(2 * cw * ch, 0);
+        std::vector<int> counts(cw * ch, 0);
+
+        unsigned char* pY = &m_planes[0];
+        for (int i = 0; i < height; ++i)
+        {
+            const unsigned char* p = (const unsigned char*)frame->imageData + i * frame->widthStep;
+            for (int j = 0; j < width; ++j, p += 3)
+            {
+                int y, u, v;
+                bgr2yuv(p, y, u, v);
+                pY[i * width + j] = (unsigned char)clip(y, 0, 255);
+
+                // Box-filter the chroma down to the plane size.
+                int k = (i >> cs) * cw + (j >> cs);
+                sums[2 * k] += u;
+                sums[2 * k + 1] += v;
+                counts[k]++;
+            }
+        }
+
+        unsigned char* pU = pY + width * height;
+        unsigned char* pV = pU + cw * ch;
+        for (int k = 0; k < cw * ch; ++k)
+        {
+            pU[k] = (unsigned char)clip(sums[2 * k] / counts[k], 0, 255);
+            pV[k] = (unsigned char)clip(sums[2 * k + 1] / counts[k], 0, 255);
+        }
+
+        fputs("FRAME\n", m_file);
+        if (fwrite(&m_planes[0], 1, m_planes.size(), m_file) != m_planes.size())
+        {
+            return false;
+        }
+        return fflush(m_file) == 0;
+    };
+
+private:
+    StreamFormat               m_format;
+    FILE*                      m_file;
+    std::string                m_header;
+    bool                       m_chroma444;
+    bool                       m_headerWritten;
+    std::vector<unsigned char> m_planes;
+};
+
+#endif // !FRAME_IO_H
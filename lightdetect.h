@@ -0,0 +1,411 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   lightdetect.h
+ *
+ * Abstract:
+ *
+ *   Find the bright light sources in an image.
+ *
+ *   Bright-pass thresholding, connected components and the
+ *   centroid/intensity estimate are all done in a single pass
+ *   over the image. Above-threshold pixels are grouped into
+ *   runs per row, runs are joined to the overlapping runs of the
+ *   previous row with a union-find, and the moments of each
+ *   component are accumulated as the runs are found. Only the
+ *   runs of two rows are kept at any time.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef LIGHT_DETECT_H
+#define LIGHT_DETECT_H
+
+#include <vector>
+#include <algorithm>
+
+#include "common.h"
+#include "trace.h"
+
+// \brief a detected light source.
+struct LightSource
+{
+    float x;         // centroid, weighted by brightness.
+    float y;
+    float intensity; // mean brightness of the source in [0, 1].
+    float peak;      // the brightest pixel in [0, 1].
+    float energy;    // summed brightness, i.e. intensity * area.
+    int   area;      // the number of pixels.
+
+    // \brief the center as passed to the effect and flare
+    // constructors (cx, cy).
+    int CenterX() const { return (int)(x + 0.5f); };
+    int CenterY() const { return (int)(y + 0.5f); };
+
+    // \brief the radius of a disk with the same area.
+    float Radius() const { return mySqrt((float)area / M_PI); };
+};
+
+class LightDetector
+{
+public:
+    // \brief constructor.
+    //
+    // \param threshold the bright-pass threshold in [0, 1].
+    // \param minArea components smaller than it are dropped.
+    // \param maxSources at most this many sources are reported,
+    //   the most energetic first. 0 means no limit.
+    LightDetector(float threshold = 0.9f, int minArea = 4, int maxSources = 16)
+    {
+        m_threshold = threshold;
+        m_minArea = minArea;
+        m_maxSources = maxSources;
+    };
+
+    void SetThreshold(float threshold)
+    {
+        m_threshold = threshold;
+    };
+
+    void SetMinArea(int minArea)
+    {
+        m_minArea = minArea;
+    };
+
+    void SetMaxSources(int maxSources)
+    {
+        m_maxSources = maxSources;
+    };
+
+    // \brief detect the light sources.
+    //
+    // \param image a 1 or 3-channel (BGR) image, 8-bit or float.
+    //   Float images are in [0, 255] like the effect results.
+    // \param sources the detected light sources.
+    // \return false if the image format is not supported.
+    bool Detect(const IplImage* image, std::vector<LightSource>& sources)
+    {
+        sources.clear();
+
+        if ((image->depth != IPL_DEPTH_8U && image->depth != IPL_DEPTH_32F) ||
+            (image->nChannels != 1 && image->nChannels != 3))
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("detect");
+
+        m_parent.clear();
+        m_moments.clear();
+        m_prevRuns.clear();
+
+        // Integer luminance weights (Rec. 709, scaled by 256) for 8-bit.
+        int threshold8 = (int)(m_threshold * 255.0f * 256.0f);
+        float thresholdF = m_threshold * 255.0f;
+
+        std::vector<float> weights(image->width);
+
+        for (int i = 0; i < image->height; ++i)
+        {
+            m_runs.clear();
+
+            const char* row = image->imageData + i * image->widthStep;
+
+            if (image->depth == IPL_DEPTH_8U)
+            {
+                ScanRow8U((const unsigned char*)row, image->width, image->nChannels,
+                        threshold8, &weights[0]);
+            }
+            else
+            {
+                ScanRow32F((const float*)row, image->width, image->nChannels,
+                        thresholdF, &weights[0]);
+            }
+
+            m_prevCursor = 0;
+            for (size_t r = 0; r < m_runs.size(); ++r)
+            {
+                AddRun(m_runs[r], i, &weights[0]);
+            }
+
+            m_prevRuns.swap(m_runs);
+        }
+
+        // Collect the roots.
+        for (size_t l = 0; l < m_parent.size(); ++l)
+        {
+            if (m_parent[l] != (int)l)
+            {
+                continue;
+            }
+
+            const Moments& m = m_moments[l];
+            if (m.area < m_minArea || m.sum <= 0.0)
+            {
+                continue;
+            }
+
+            LightSource s;
+            s.x = (float)(m.sumX / m.sum);
+            s.y = (float)(m.sumY / m.sum);
+            s.energy = (float)m.sum;
+            s.area = m.area;
+            s.intensity = (float)(m.sum / m.area);
+            s.peak = m.peak;
+
+            sources.push_back(s);
+        }
+
+        std::sort(sources.begin(), sources.end(), MoreEnergy);
+
+        if (m_maxSources > 0 && (int)sources.size() > m_maxSources)
+        {
+            sources.resize(m_maxSources);
+        }
+
+        return true;
+    };
+
+private:
+    struct Run
+    {
+        int start; // the first pixel.
+        int end;   // the last pixel (inclusive).
+        int label;
+    };
+
+    struct Moments
+    {
+        double sum;
+        double sumX;
+        double sumY;
+        int    area;
+        float  peak;
+    };
+
+    static bool MoreEnergy(const LightSource& a, const LightSource& b)
+    {
+        return a.energy > b.energy;
+    };
+
+    // \brief find the runs of one row and store the brightness
+    // of the pixels in them (in [0, 1]).
+    void ScanRow8U(const unsigned char* p, int width, int channels,
+                   int threshold, float* weights)
+    {
+        int start = -1;
+
+#ifdef LF_SSE2
+        // The luminance never exceeds the largest channel, so blocks
+        // of 16 pixels whose channels are all below the threshold can
+        // be skipped with a few byte compares.
+        int minByte = MIN(threshold >> 8, 255);
+        const __m128i limit = _mm_set1_epi8((char)minByte);
+#endif
+
+        for (int j = 0; j < width; ++j, p += channels)
+        {
+#ifdef LF_SSE2
+            while (start < 0 && j + 16 <= width)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)p);
+                if (channels == 3)
+                {
+                    v = _mm_max_epu8(v, _mm_loadu_si128((const __m128i*)(p + 16)));
+                    v = _mm_max_epu8(v, _mm_loadu_si128((const __m128i*)(p + 32)));
+                }
+
+                // Bytes >= minByte are unchanged by max(v, limit).
+                __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, limit), v);
+                if (_mm_movemask_epi8(above) != 0)
+                {
+                    break;
+                }
+
+                j += 16;
+                p += 16 * channels;
+            }
+
+            if (j >= width)
+            {
+                break;
+            }
+#endif
+            int y = (channels == 3) ? 19 * p[0] + 183 * p[1] + 54 * p[2] : p[0] << 8;
+
+            if (y >= threshold)
+            {
+                weights[j] = (float)y * (1.0f / (255.0f * 256.0f));
+                if (start < 0)
+                {
+                    start = j;
+                }
+            }
+            else if (start >= 0)
+            {
+                PushRun(start, j - 1);
+                start = -1;
+            }
+        }
+
+        if (start >= 0)
+        {
+            PushRun(start, width - 1);
+        }
+    };
+
+    void ScanRow32F(const float* p, int width, int channels,
+                    float threshold, float* weights)
+    {
+        int start = -1;
+
+        for (int j = 0; j < width; ++j, p += channels)
+        {
+            float y = (channels == 3) ?
+                0.0722f * p[0] + 0.7152f * p[1] + 0.2126f * p[2] : p[0];
+
+            if (y >= threshold)
+            {
+                weights[j] = y * (1.0f / 255.0f);
+                if (start < 0)
+                {
+                    start = j;
+                }
+            }
+            else if (start >= 0)
+            {
+                PushRun(start, j - 1);
+                start = -1;
+            }
+        }
+
+        if (start >= 0)
+        {
+            PushRun(start, width - 1);
+        }
+    };
+
+    void PushRun(int start, int end)
+    {
+        Run run;
+        run.start = start;
+        run.end = end;
+        run.label = -1;
+        m_runs.push_back(run);
+    };
+
+    // \brief label a run of row i, join it with the 8-connected
+    // runs of the previous row and accumulate its moments.
+    void AddRun(Run& run, int i, const float* weights)
+    {
+        // Runs of both rows are sorted, so the scan of the previous
+        // row can resume where the last run left off.
+        while (m_prevCursor < m_prevRuns.size() &&
+               m_prevRuns[m_prevCursor].end + 1 < run.start)
+        {
+            ++m_prevCursor;
+        }
+
+        for (size_t k = m_prevCursor;
+             k < m_prevRuns.size() && m_prevRuns[k].start <= run.end + 1; ++k)
+        {
+            int root = Find(m_prevRuns[k].label);
+
+            if (run.label < 0)
+            {
+                run.label = root;
+            }
+            else
+            {
+                run.label = Union(run.label, root);
+            }
+        }
+
+        if (run.label < 0)
+        {
+            run.label = (int)m_parent.size();
+            m_parent.push_back(run.label);
+
+            Moments m = { 0.0, 0.0, 0.0, 0, 0.0f };
+            m_moments.push_back(m);
+        }
+
+        Moments& m = m_moments[run.label];
+        double sum = 0.0, sumX = 0.0;
+        for (int j = run.start; j <= run.end; ++j)
+        {
+            sum += weights[j];
+            sumX += weights[j] * j;
+            if (weights[j] > m.peak)
+            {
+                m.peak = weights[j];
+            }
+        }
+
+        m.sum += sum;
+        m.sumX += sumX;
+        m.sumY += sum * i;
+        m.area += run.end - run.start + 1;
+    };
+
+    int Find(int l)
+    {
+        while (m_parent[l] != l)
+        {
+            m_parent[l] = m_parent[m_parent[l]];
+            l = m_parent[l];
+        }
+        return l;
+    };
+
+    // \brief merge two components, returns the surviving root.
+    int Union(int a, int b)
+    {
+        a = Find(a);
+        b = Find(b);
+        if (a == b)
+        {
+            return a;
+        }
+
+        if (b < a)
+        {
+            std::swap(a, b);
+        }
+
+        m_parent[b] = a;
+
+        Moments& ma = m_moments[a];
+        const Moments& mb = m_moments[b];
+        ma.sum += mb.sum;
+        ma.sumX += mb.sumX;
+        ma.sumY += mb.sumY;
+        ma.area += mb.area;
+        if (mb.peak > ma.peak)
+        {
+            ma.peak = mb.peak;
+        }
+
+        return a;
+    };
+
+private:
+    float m_threshold;
+    int   m_minArea;
+    int   m_maxSources;
+
+    std::vector<Run>     m_runs;     // the runs of the current row.
+    std::vector<Run>     m_prevRuns; // the runs of the previous row.
+    size_t               m_prevCursor;
+    std::vector<int>     m_parent;   // union-find forest of labels.
+    std::vector<Moments> m_moments;  // indexed by label, valid at roots.
+};
+
+#endif // !LIGHT_DETECT_H
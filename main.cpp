@@ -31,7 +31,10 @@
 #include "cv.h"
 #include "highgui.h"
 #include <cmath>
+#include <csignal>
 #include <cstdlib>
+#include <map>
+#include <string>
 #endif
 
 #include "effect01_glowball.h"
@@ -43,8 +46,88 @@
 #include "effect15_singlepoly.h"
 #include "effect19_sparkle.h"
 
+#include "composite.h"
+#include "lightdetect.h"
+#include "pipeline.h"
+#include "buffer.h"
+#include "framefile.h"
+#include "trace.h"
+#include "equivalence.h"
+#include "blur.h"
+#include "streak.h"
+#include "starburst.h"
+#include "binning.h"
+#include "sweep.h"
+#include "registry.h"
+#include "renderworker.h"
+#include "resultcache.h"
+#include "renderservice.h"
+#include "shard.h"
+#include "scheduler.h"
+#include "particles.h"
+#include "tiled.h"
+#include "timer.h"
+
+// The frame on screen, owned by the render worker.
 IplImage* g_pImage = 0;
 
+// The size of the effect canvas.
+int g_width  = 640;
+int g_height = 480;
+
+// The photo the flares are composited onto (optional).
+IplImage*  g_pPhoto = 0;
+Compositor g_compositor;
+int        g_blendMode = BLEND_SCREEN;
+
+// The bloom added to the effect result, toggled with 'b'.
+GaussianBlur g_blur;
+IplImage*    g_pBloom = 0;
+bool         g_bloom = false;
+
+// The star filter streaks added to the effect result, toggled with 's'.
+StreakFilter g_streakFilter;
+IplImage*    g_pStreaks = 0;
+bool         g_streaks = false;
+
+// The aperture diffraction starburst on the light, toggled with 'a'.
+Starburst    g_starburst;
+IplImage*    g_pStarburst = 0;
+bool         g_starbursts = false;
+int          g_lightX = 320;
+int          g_lightY = 240;
+
+// The ghosts along the flare axis, toggled with 'g'.
+BinningRenderer g_ghostRenderer;
+PrimitiveList   g_ghosts;
+IplImage*       g_pGhosts = 0;
+bool            g_showGhosts = false;
+
+// The animated sparkles over the effect result, toggled with 'p'.
+// While they are on, every finished frame asks for the next one.
+// Like the other passes they belong to the render thread.
+ParticleSystem  g_particles;
+MyRandom        g_particleRandom;
+Timer           g_particleClock;
+BinningRenderer g_particleRenderer;
+PrimitiveList   g_sparkles;
+IplImage*       g_pParticles = 0;
+bool            g_animate = false;
+
+// The reduced canvas of the bloom and streak passes below full
+// resolution, and the pass drawn on it.
+IplImage* g_pReduced = 0;
+IplImage* g_pReducedPass = 0;
+
+// The frame time budget of the preview in ms (0 for none), cycled
+// with 'q', and the quality the render thread holds it with.
+int            g_budget = 0;
+FrameScheduler g_scheduler;
+QualityLevel   g_quality = FrameScheduler::GetQuality(0);
+
+// The HDR dump of the effect results, created on the first dump.
+FrameFileWriter g_frameFile;
+
 int g_effectId = 19;
 
 enum {
@@ -70,15 +153,87 @@ enum {
     EFFECT20     = 20,
 };
 
-effect01_glowball::Effect*      g_pEffect01;
-effect02_spikeball::Effect*     g_pEffect02;
-effect03_starfilter::Effect*    g_pEffect03;
-effect05_circlespread::Effect*  g_pEffect05;
-effect10_randomfan::Effect*     g_pEffect10;
-effect09_stripe::Effect*        g_pEffect09;
-effect15_singlepoly::Effect*    g_pEffect15;
-effect19_sparkle::Effect*       g_pEffect19;
+// The effects are built on first use; see registry.h.
+LazyEffect<effect01_glowball::Effect>      g_effect01;
+LazyEffect<effect02_spikeball::Effect>     g_effect02;
+LazyEffect<effect03_starfilter::Effect>    g_effect03;
+LazyEffect<effect05_circlespread::Effect>  g_effect05;
+LazyEffect<effect10_randomfan::Effect>     g_effect10;
+LazyEffect<effect09_stripe::Effect>        g_effect09;
+LazyEffect<effect15_singlepoly::Effect>    g_effect15;
+LazyEffect<effect19_sparkle::Effect>       g_effect19;
+EffectRegistry                             g_effects;
+
+// \brief the state a frame is rendered from: the sliders and the
+// toggles, copied on the GUI thread whenever one changes.
+struct ViewParams
+{
+    int  effectId;
+    int  number;    // Count
+    int  length;    // Scale
+    int  thickness; // Brightness
+    int  angle;     // Angle
+    int  blendMode;
+    bool bloom;
+    bool streaks;
+    bool starbursts;
+    bool ghosts;
+    bool particles;
+    int  budget;    // the frame time target in ms, 0 for none.
+};
+
+// The view being rendered and the one the effects were last drawn
+// for. Only the render thread touches them once it runs.
+static ViewParams g_view;
+static ViewParams g_drawn;
+
+RenderWorker<ViewParams>* g_pRenderWorker = 0;
+
+
+// \brief initialize and draw an effect, timed by the tracer.
+template <class EffectT>
+static
+bool InitEffect(EffectT* pEffect)
+{
+    LF_TRACE_SCOPE("Init");
+    return pEffect->Init();
+}
+
+template <class EffectT>
+static
+void DrawEffect(EffectT* pEffect)
+{
+    LF_TRACE_SCOPE("Draw");
+    pEffect->Draw();
+}
+
+// \brief initialize and draw a new effect, the factory of its
+// LazyEffect.
+// \return the effect, or 0 (and it is deleted) if Init failed.
+template <class EffectT>
+static
+EffectT* BuildEffect(EffectT* pEffect, const char* name)
+{
+    if (!InitEffect(pEffect))
+    {
+        fprintf(stderr, "Err: %s init failed.\n", name);
+        delete pEffect;
+        return 0;
+    }
+
+    DrawEffect(pEffect);
+    return pEffect;
+}
 
+// \brief build the selected effect if it isn't yet.
+// \return false if there is no such effect or it failed to build.
+static
+bool IsEffectReady()
+{
+    std::lock_guard<std::recursive_mutex> lock(g_effects.GetDrawMutex());
+    LazyEffectBase* pEffect = g_effects.Find(g_view.effectId);
+    return pEffect != 0 && pEffect->Build();
+}
 
 // The parameters of rays.
 static int g_rayNumber = 10;
@@ -86,361 +241,1557 @@ static int g_rayLength = 20;
 static int g_rayThickness = 20;
 static int g_rayAngle    = 133;
 
-static 
-void ShowResult()
+static
+IplImage* GetResult()
 {
-    switch (g_effectId)
+    if (!IsEffectReady())
     {
-        case EFFECT01: cvConvert(g_pEffect01->GetResult(), g_pImage); break;
-        case EFFECT02: cvConvert(g_pEffect02->GetResult(), g_pImage); break;
-        case EFFECT03: cvConvert(g_pEffect03->GetResult(), g_pImage); break;
-        case EFFECT05: cvConvert(g_pEffect05->GetResult(), g_pImage); break;
-        case EFFECT09: cvConvert(g_pEffect09->GetResult(), g_pImage); break;
-        case EFFECT10: cvConvert(g_pEffect10->GetResult(), g_pImage); break;
-        case EFFECT15: cvConvert(g_pEffect15->GetResult(), g_pImage); break;
-        case EFFECT19: cvConvert(g_pEffect19->GetResult(), g_pImage); break;
+        return 0;
+    }
+
+    switch (g_view.effectId)
+    {
+        case EFFECT01: return g_effect01->GetResult();
+        case EFFECT02: return g_effect02->GetResult();
+        case EFFECT03: return g_effect03->GetResult();
+        case EFFECT05: return g_effect05->GetResult();
+        case EFFECT09: return g_effect09->GetResult();
+        case EFFECT10: return g_effect10->GetResult();
+        case EFFECT15: return g_effect15->GetResult();
+        case EFFECT19: return g_effect19->GetResult();
         default:
-            cvZero(g_pImage);
-            fprintf(stderr, "Err: Not available!\n");
             break;
     }
 
-    cvShowImage("Lens Flare", g_pImage);
+    return 0;
+}
+
+// \brief a ray, sparkle or ghost count at the quality level.
+static
+int ScaleCount(int count)
+{
+    return MAX(1, cvRound((float)count * g_quality.counts));
+}
+
+// \brief a scratch image of the result at the resolution of the
+// quality level.
+// \return 0 at full resolution.
+static
+IplImage* GetReducedImage(IplImage** ppImage, const IplImage* pResult)
+{
+    if (g_quality.resolution >= 1.0f)
+    {
+        return 0;
+    }
+
+    CvSize size = cvSize(MAX(1, cvRound((float)pResult->width * g_quality.resolution)),
+                         MAX(1, cvRound((float)pResult->height * g_quality.resolution)));
+    if (*ppImage != 0 && ((*ppImage)->width != size.width || (*ppImage)->height != size.height))
+    {
+        cvReleaseImage(ppImage);
+    }
+    if (*ppImage == 0)
+    {
+        *ppImage = cvCreateImage(size, IPL_DEPTH_32F, 3);
+    }
+
+    return *ppImage;
+}
+
+// \brief add a wide blur of the result to itself.
+static
+IplImage* ApplyBloom(IplImage* pResult)
+{
+    if (g_pBloom == 0)
+    {
+        g_pBloom = cvCreateImage(cvGetSize(pResult), IPL_DEPTH_32F, 3);
+    }
+
+    float sigma = 0.02f * (float)MAX(g_width, g_height);
+    IplImage* pReduced = GetReducedImage(&g_pReduced, pResult);
+    if (pReduced == 0)
+    {
+        cvCopy(pResult, g_pBloom);
+        g_blur.Apply(g_pBloom, sigma);
+    }
+    else
+    {
+        // The blur is smooth enough to be drawn coarser.
+        cvResize(pResult, pReduced, CV_INTER_AREA);
+        g_blur.Apply(pReduced, sigma * g_quality.resolution);
+        cvResize(pReduced, g_pBloom, CV_INTER_LINEAR);
+    }
+    cvAdd(pResult, g_pBloom, g_pBloom);
+
+    return g_pBloom;
+}
+
+// \brief add four-arm star streaks of the result to itself.
+static
+IplImage* ApplyStreaks(IplImage* pResult)
+{
+    if (g_pStreaks == 0)
+    {
+        g_pStreaks = cvCreateImage(cvGetSize(pResult), IPL_DEPTH_32F, 3);
+    }
+
+    float angle = M_PI * (float)g_view.angle / 180.0f;
+    float length = 0.2f * (float)MAX(g_width, g_height);
+    int stages = g_quality.accuracy == 0 ? 2 : 1;
+
+    IplImage* pReduced = GetReducedImage(&g_pReduced, pResult);
+    if (pReduced == 0)
+    {
+        cvCopy(pResult, g_pStreaks);
+        g_streakFilter.ApplyStar(pResult, g_pStreaks, 4, angle, length, 8.0f, stages);
+    }
+    else
+    {
+        // Only the streaks are drawn coarser, the result stays sharp.
+        IplImage* pPass = GetReducedImage(&g_pReducedPass, pResult);
+        cvResize(pResult, pReduced, CV_INTER_AREA);
+        cvZero(pPass);
+        g_streakFilter.ApplyStar(pReduced, pPass, 4, angle, length * g_quality.resolution, 8.0f, stages);
+        cvResize(pPass, g_pStreaks, CV_INTER_LINEAR);
+        cvAdd(pResult, g_pStreaks, g_pStreaks);
+    }
+
+    return g_pStreaks;
+}
+
+// \brief add the diffraction starburst of an aperture of Count
+// blades at Angle to the result, as bright as Brightness. Only the
+// blades and the angle recompute the FFT.
+static
+IplImage* ApplyStarburst(IplImage* pResult)
+{
+    if (g_pStarburst == 0)
+    {
+        g_pStarburst = cvCreateImage(cvGetSize(pResult), IPL_DEPTH_32F, 3);
+    }
+
+    ApertureShape shape;
+    shape.blades = clip(g_view.number, 3, 16);
+    shape.rotation = M_PI * (float)g_view.angle / 180.0f;
+    shape.roundness = 0;
+    shape.size = 512;
+    shape.grid = polyFindGrid(g_quality.subpixelX, g_quality.subpixelY);
+
+    int radius = MAX(g_width, g_height) / 4;
+    float color[] = {255, 255, 255};
+
+    cvCopy(pResult, g_pStarburst);
+    if (g_starburst.Prepare(shape, radius, (float)radius / 64.0f, 1.0f,
+                            g_quality.accuracy == 0 ? 16 : 4))
+    {
+        g_starburst.Render(g_pStarburst, g_lightX, g_lightY, color, (float)g_view.thickness / 100.0f);
+    }
+
+    return g_pStarburst;
+}
+
+// \brief 4 x Count ghosts, mirrored through the canvas center from
+// the light.
+static
+void MakeGhosts(PrimitiveList& ghosts)
+{
+    float cx = 0.5f * (float)g_width;
+    float cy = 0.5f * (float)g_height;
+    float scale = (float)g_view.thickness / 100.0f;
+
+    MyRandom random(g_view.angle + 1);
+    ghosts.Clear();
+    for (int k = 0; k < 4 * ScaleCount(g_view.number); ++k)
+    {
+        float t = random.GetFloat(-1.5f, 1.0f);
+        int x = cvRound(cx + t * ((float)g_lightX - cx));
+        int y = cvRound(cy + t * ((float)g_lightY - cy));
+        float radius = random.GetFloat(0.01f, 0.08f) * (float)MAX(g_width, g_height);
+        float rgb[] = { scale * random.GetFloat(4.0f, 24.0f),
+                        scale * random.GetFloat(4.0f, 24.0f),
+                        scale * random.GetFloat(4.0f, 24.0f) };
+
+        switch (k % 3)
+        {
+            case 0:  ghosts.AddRing(x, y, radius, 0.1f * radius + 1.0f, rgb); break;
+            case 1:  ghosts.AddDisk(x, y, radius, rgb); break;
+            default: ghosts.AddGradient(x, y, radius, rgb, 2.2f); break;
+        }
+    }
+}
+
+// \brief add the ghosts to the result.
+static
+IplImage* ApplyGhosts(IplImage* pResult)
+{
+    if (g_pGhosts == 0)
+    {
+        g_pGhosts = cvCreateImage(cvGetSize(pResult), IPL_DEPTH_32F, 3);
+    }
+
+    MakeGhosts(g_ghosts);
+    cvCopy(pResult, g_pGhosts);
+    g_ghostRenderer.Render(g_ghosts, g_pGhosts, true);
+
+    return g_pGhosts;
+}
+
+// \brief the sparkles over the canvas: Scale sets their size and
+// Brightness their color.
+//
+// \param size the scale of their size.
+static
+ParticleEmitter GetSparkleEmitter(float size)
+{
+    float brightness = 255.0f * (float)g_view.thickness / 100.0f;
+    ParticleEmitter emitter;
+    emitter.left = 0.0f;
+    emitter.top = 0.0f;
+    emitter.right = (float)g_width;
+    emitter.bottom = (float)g_height;
+    emitter.minSize = size;
+    emitter.maxSize = size * (1.0f + (float)g_view.length / 10.0f);
+    emitter.minLife = 0.5f;
+    emitter.maxLife = 3.0f;
+    emitter.minRate = 0.5f;
+    emitter.maxRate = 4.0f;
+    emitter.speed = 8.0f;
+    emitter.color[0] = emitter.color[1] = emitter.color[2] = brightness;
+    emitter.tint = 0.3f;
+    return emitter;
+}
+
+// \brief step the sparkles by the time since the last frame, top
+// them up to 500 x Count and add them to the result. Every sparkle
+// twinkles, so every tile holding one changes each frame; only the
+// tiles without any are left as copied.
+static
+IplImage* ApplyParticles(IplImage* pResult)
+{
+    if (g_pParticles == 0)
+    {
+        g_pParticles = cvCreateImage(cvGetSize(pResult), IPL_DEPTH_32F, 3);
+    }
+
+    // A long pause (the first frame, or the sparkles were off) is
+    // one short step.
+    float dt = (float)g_particleClock.GetElapsedSeconds();
+    g_particleClock.Reset();
+    g_particles.Update(MIN(dt, 0.1f));
+
+    g_particles.Spawn(GetSparkleEmitter(1.0f), 500 * ScaleCount(g_view.number) - g_particles.GetCount(),
+                      g_particleRandom);
+
+    g_particles.Emit(g_sparkles);
+    cvCopy(pResult, g_pParticles);
+    g_particleRenderer.Render(g_sparkles, g_pParticles, true);
+
+    return g_pParticles;
+}
+
+// \brief whether a newer view was posted to the render thread.
+static
+bool IsViewStale()
+{
+    return g_pRenderWorker != 0 && g_pRenderWorker->IsStale();
+}
+
+// \brief finish a frame of the view: the effect result, the optional
+// passes on top and the photo compositing. The passes stop early when
+// the view went stale.
+//
+// \return false if it was cancelled.
+static
+bool RenderFrame(IplImage* pFrame)
+{
+    LF_TRACE_SCOPE("RenderFrame");
+
+    IplImage* pResult = GetResult();
+    if (pResult != 0 && g_view.ghosts)
+    {
+        pResult = ApplyGhosts(pResult);
+    }
+    if (pResult != 0 && g_view.particles)
+    {
+        pResult = ApplyParticles(pResult);
+    }
+    if (pResult != 0 && g_view.starbursts)
+    {
+        if (IsViewStale())
+        {
+            return false;
+        }
+        pResult = ApplyStarburst(pResult);
+    }
+    if (pResult != 0 && g_view.streaks)
+    {
+        if (IsViewStale())
+        {
+            return false;
+        }
+        pResult = ApplyStreaks(pResult);
+    }
+    if (pResult != 0 && g_view.bloom)
+    {
+        if (IsViewStale())
+        {
+            return false;
+        }
+        pResult = ApplyBloom(pResult);
+    }
+
+    if (pResult == 0)
+    {
+        cvZero(pFrame);
+        fprintf(stderr, "Err: Not available!\n");
+    }
+    else if (g_pPhoto != 0)
+    {
+        cvCopy(g_pPhoto, pFrame);
+        g_compositor.Composite(pResult, pFrame, 0, 0, (BlendMode)g_view.blendMode);
+    }
+    else
+    {
+        LFBuffer buffer;
+        lfWrapImage(pFrame, &buffer);
+        lfWriteResult(pResult, &buffer, 0, 0);
+    }
+
+    return true;
 }
 
+// \brief draw the selected effect.
 static
-void onTrackbar0(int pos)
+void DrawCurrentEffect()
 {
-    ShowResult();
+    std::lock_guard<std::recursive_mutex> lock(g_effects.GetDrawMutex());
+    switch (g_view.effectId)
+    {
+        case EFFECT01: DrawEffect(g_effect01.Get()); break;
+        case EFFECT02: DrawEffect(g_effect02.Get()); break;
+        case EFFECT03: DrawEffect(g_effect03.Get()); break;
+        case EFFECT05: DrawEffect(g_effect05.Get()); break;
+        case EFFECT09: DrawEffect(g_effect09.Get()); break;
+        case EFFECT10: DrawEffect(g_effect10.Get()); break;
+        case EFFECT15: DrawEffect(g_effect15.Get()); break;
+        case EFFECT19: DrawEffect(g_effect19.Get()); break;
+        default:
+            break;
+    }
 }
 
+// \brief set the ray count of the selected effect, scaled by the
+// quality level where it is a count.
 static
-void onTrackbar1(int pos)
+void ApplyCount()
 {
-    switch (g_effectId)
+    switch (g_view.effectId)
     {
         case EFFECT01:
-            g_pEffect01->SetRingSoftness(g_rayNumber);
-            //g_pEffect01->SetRampGamma(g_rayNumber);
-            g_pEffect01->Draw();
+            g_effect01->SetRingSoftness(g_view.number);
+            //g_effect01->SetRampGamma(g_view.number);
             break;
         case EFFECT02:
-            g_pEffect02->SetNumber(g_rayNumber);
-            g_pEffect02->Draw();
+            g_effect02->SetNumber(ScaleCount(g_view.number));
             break;
         case EFFECT03:
-            //g_pEffect03->SetCount(g_rayNumber);
-            g_pEffect03->SetThickness(g_rayNumber);
-            g_pEffect03->Draw();
+            //g_effect03->SetCount(g_view.number);
+            g_effect03->SetThickness(g_view.number);
             break;
         case EFFECT05:
-            g_pEffect05->SetCount(g_rayNumber);
-            g_pEffect05->Draw();
+            g_effect05->SetCount(ScaleCount(g_view.number));
             break;
         case EFFECT09:
-            g_pEffect09->SetThickness(g_rayNumber);
-            g_pEffect09->Draw();
+            g_effect09->SetThickness(g_view.number);
             break;
         case EFFECT10:
-            g_pEffect10->SetNumber(g_rayNumber);
-            g_pEffect10->Draw();
+            g_effect10->SetNumber(ScaleCount(g_view.number));
             break;
         case EFFECT15:
-            g_pEffect15->SetCount(g_rayNumber);
-            g_pEffect15->Draw();
+            g_effect15->SetCount(ScaleCount(g_view.number));
             break;
         case EFFECT19:
-            g_pEffect19->SetCount(g_rayNumber);
-            g_pEffect19->Draw();
+            g_effect19->SetCount(ScaleCount(g_view.number));
             break;
     }
-
-    ShowResult();
 }
 
-// \brief adjust the ray length.
+// \brief set the ray length of the selected effect.
 static
-void onTrackbar2(int pos)
+void ApplyScale()
 {
-    switch (g_effectId)
+    switch (g_view.effectId)
     {
         case EFFECT01:
-            g_pEffect01->SetRingTaper(g_rayLength);
-            //g_pEffect01->SetRampScale(g_rayLength);
-            g_pEffect01->Draw();
+            g_effect01->SetRingTaper(g_view.length);
+            //g_effect01->SetRampScale(g_view.length);
             break;
         case EFFECT02:
-            g_pEffect02->SetScale(g_rayLength);
-            g_pEffect02->Draw();
+            g_effect02->SetScale(g_view.length);
             break;
         case EFFECT03:
-            g_pEffect03->SetScale(g_rayLength);
-            g_pEffect03->Draw();
+            g_effect03->SetScale(g_view.length);
             break;
         case EFFECT05:
-            g_pEffect05->SetSpread(g_rayLength);
-            g_pEffect05->Draw();
+            g_effect05->SetSpread(g_view.length);
             break;
         case EFFECT09:
-            g_pEffect09->SetLength(g_rayLength);
-            g_pEffect09->Draw();
+            g_effect09->SetLength(g_view.length);
             break;
         case EFFECT10:
-            g_pEffect10->SetScale(g_rayLength);
-            g_pEffect10->Draw();
+            g_effect10->SetScale(g_view.length);
+            break;
         case EFFECT15: 
-            g_pEffect15->SetScale(g_rayLength);
-            g_pEffect15->Draw();
+            g_effect15->SetScale(g_view.length);
             break;
         case EFFECT19: 
-            g_pEffect19->SetScale(g_rayLength);
-            g_pEffect19->Draw();
+            g_effect19->SetScale(g_view.length);
             break;
     }
-    ShowResult();
 }
 
-// \brief adjust the ray brightness
+// \brief whether an effect is its white result times its color.
+// effect01 and effect09 also draw a fixed red color of their own, so
+// they have to be drawn in each color.
 static
-void onTrackbar3(int pos)
+bool IsColorLinear(int effectId)
 {
-    float color[3];
-    color[0] = color[1] = color[2] = 255.0f * (float)pos / 100.0f;
+    return effectId != EFFECT01 && effectId != EFFECT09;
+}
 
-    switch (g_effectId)
+// \brief set the color of the selected effect.
+static
+void SetEffectColor(float color[3])
+{
+    switch (g_view.effectId)
     {
         case EFFECT01:
-            g_pEffect01->SetOuterColor(color);
-            g_pEffect01->Draw();
+            g_effect01->SetOuterColor(color);
             break;
         case EFFECT02:
-            g_pEffect02->SetColor(color);
-            g_pEffect02->Draw();
+            g_effect02->SetColor(color);
             break;
         case EFFECT03:
-            g_pEffect03->SetColor(color);
-            g_pEffect03->Draw();
+            g_effect03->SetColor(color);
             break;
         case EFFECT05:
-            g_pEffect05->SetColor(color);
-            g_pEffect05->Draw();
+            g_effect05->SetColor(color);
             break;
         case EFFECT09:
-            g_pEffect09->SetColor(color);
-            g_pEffect09->Draw();
+            g_effect09->SetColor(color);
             break;
         case EFFECT10:
-            g_pEffect10->SetColor(color);
-            g_pEffect10->Draw();
+            g_effect10->SetColor(color);
             break;
         case EFFECT15:
-            g_pEffect15->SetColor(color);
-            g_pEffect15->Draw();
+            g_effect15->SetColor(color);
             break;
         case EFFECT19:
-            g_pEffect19->SetColor(color);
-            g_pEffect19->Draw();
+            g_effect19->SetColor(color);
             break;
     }
-    ShowResult();
 }
 
-// \brief adjust the ray angle
+// \brief set the ray brightness of the selected effect.
+static
+void ApplyBrightness()
+{
+    float color[3];
+    color[0] = color[1] = color[2] = 255.0f * (float)g_view.thickness / 100.0f;
+
+    SetEffectColor(color);
+}
+
+// \brief render the current effect in a few colors and brightness
+// levels (and seeds for the sparkles) onto a contact sheet, saved as
+// sweep.bmp. The geometry is drawn once per seed, or once per variant
+// if the effect is not linear in its color. The render thread must be
+// idle.
+static
+void SaveSweep()
+{
+    if (!IsEffectReady())
+    {
+        return;
+    }
+
+    bool linear = IsColorLinear(g_view.effectId);
+    Sweep sweep([=](const SweepVariant& variant) {
+        if (g_view.effectId == EFFECT19)
+        {
+            g_effect19->SetRandSeed(variant.seed);
+        }
+        float color[] = {255, 255, 255};
+        for (int k = 0; k < 3 && !linear; ++k)
+        {
+            color[k] = variant.color[k] * variant.brightness;
+        }
+        SetEffectColor(color);
+        DrawCurrentEffect();
+        return GetResult();
+    });
+    sweep.SetColorLinear(linear);
+
+    const float colors[][3] = { {255, 255, 255}, {255, 160, 96}, {96, 192, 255}, {128, 255, 160} };
+    for (int k = 0; k < 4; ++k)
+    {
+        sweep.AddColor(colors[k]);
+    }
+    sweep.AddBrightness(0.25f);
+    sweep.AddBrightness(0.5f);
+    sweep.AddBrightness(1.0f);
+    if (g_view.effectId == EFFECT19)
+    {
+        sweep.AddSeed(g_view.angle);
+        sweep.AddSeed(g_view.angle + 1);
+    }
+
+    // One brightness level per column.
+    int gap = 4;
+    int columns = 3;
+    int rows = sweep.GetVariantCount() / columns;
+    IplImage* pSheet = cvCreateImage(cvSize(columns * (g_width + gap) - gap,
+                rows * (g_height + gap) - gap), IPL_DEPTH_8U, 3);
+    cvZero(pSheet);
+
+    LFBuffer sheet;
+    if (lfWrapImage(pSheet, &sheet) && sweep.RenderSheet(&sheet, columns, gap))
+    {
+        cvSaveImage("sweep.bmp", pSheet);
+    }
+    cvReleaseImage(&pSheet);
+
+    // Back to the look of the sliders.
+    if (g_view.effectId == EFFECT19)
+    {
+        g_effect19->SetRandSeed(g_view.angle);
+    }
+    ApplyBrightness();
+    DrawCurrentEffect();
+}
+
+// \brief set the ray angle of the selected effect.
 static
-void onTrackbar4(int pos)
+void ApplyAngle()
 {
-    float rayAngle = M_PI * (float)g_rayAngle / 180.0f;
+    float rayAngle = M_PI * (float)g_view.angle / 180.0f;
 
-    switch (g_effectId)
+    switch (g_view.effectId)
     {
         case EFFECT02:
-            g_pEffect02->SetAngle(rayAngle);
-            g_pEffect02->Draw();
+            g_effect02->SetAngle(rayAngle);
             break;
         case EFFECT03:
-            g_pEffect03->SetAngle(rayAngle);
-            g_pEffect03->Draw();
+            g_effect03->SetAngle(rayAngle);
             break;
         case EFFECT05:
-            g_pEffect05->SetAngle(rayAngle);
-            g_pEffect05->Draw();
+            g_effect05->SetAngle(rayAngle);
             break;
         case EFFECT09:
-            g_pEffect09->SetAngle(rayAngle);
-            g_pEffect09->Draw();
+            g_effect09->SetAngle(rayAngle);
             break;
         case EFFECT10:
-            g_pEffect10->SetAngle(rayAngle);
-            g_pEffect10->Draw();
+            g_effect10->SetAngle(rayAngle);
             break;
         case EFFECT15:
-            g_pEffect15->SetAngle(rayAngle);
-            g_pEffect15->Draw();
+            g_effect15->SetAngle(rayAngle);
             break;
         case EFFECT19:
-            g_pEffect19->SetRandSeed(g_rayAngle);
-            g_pEffect19->Draw();
+            g_effect19->SetRandSeed(g_view.angle);
         default:
             break;
     }
-
-    ShowResult();
 }
 
-int main(int argc, char* argv[])
+// \brief select the effect of the view and apply the sliders that
+// moved since g_drawn to it, like the trackbar callbacks used to; it
+// is redrawn once.
+static
+void UpdateEffect(const ViewParams& view)
 {
-    // Load the input image and texture.
-    g_pImage = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 3);
-
-    // FIXME: Change the rand seed here.
-    srand(10001);
-
-    // Create the glare effect object.
-    float color[] = {255, 255, 255};
-    float color1[] = {255, 0, 0};
+    std::lock_guard<std::recursive_mutex> lock(g_effects.GetDrawMutex());
+    g_view = view;
 
-    g_pEffect01 = new effect01_glowball::Effect(
-            640, 
-            480,
-            20,
-            30,
-            20,
-            g_rayLength,
-            g_rayNumber,          
-            color,
-            color1);
-    if (!g_pEffect01->Init())
+    if (IsEffectReady())
     {
-        fprintf(stderr, "Err: effect01 init failed.\n");
-        return -1;
+        typedef void (*ApplyFn)();
+        const struct { bool moved; ApplyFn apply; } sliders[] = {
+            { view.number != g_drawn.number,       ApplyCount },
+            { view.length != g_drawn.length,       ApplyScale },
+            { view.thickness != g_drawn.thickness, ApplyBrightness },
+            { view.angle != g_drawn.angle,         ApplyAngle },
+        };
+
+        bool moved = false;
+        for (int k = 0; k < 4; ++k)
+        {
+            if (sliders[k].moved)
+            {
+                sliders[k].apply();
+                moved = true;
+            }
+        }
+        if (moved)
+        {
+            DrawCurrentEffect();
+        }
     }
-    //g_pEffect01->SetPosition(100, 100);
-    g_pEffect01->Draw();
+}
 
+// \brief render a frame of the view, on the render thread, at the
+// quality the scheduler holds the budget with.
+static
+bool RenderView(const ViewParams& view, IplImage* pFrame)
+{
+    Timer timer;
 
-    g_pEffect02 = new effect02_spikeball::Effect(
-            640, 
-            480,
-            g_rayLength,           
-            g_rayNumber,
-            color,
-            M_PI * (float)g_rayAngle / 180.0f);
-    if (!g_pEffect02->Init())
+    g_scheduler.SetTarget((double)view.budget);
+    const QualityLevel& quality = FrameScheduler::GetQuality(g_scheduler.GetLevel(view.effectId));
+    if (quality.counts != g_quality.counts)
     {
-        fprintf(stderr, "Err: effect02 init failed.\n");
-        return -1;
+        // Apply the Count slider again at the new scale.
+        g_drawn.number = -1;
     }
-    g_pEffect02->Draw();
-    
-    g_pEffect03 = new effect03_starfilter::Effect(
-            640, 
-            480,
-            g_rayNumber,           
-            g_rayLength,
-            color,
-            M_PI * (float)g_rayAngle / 180.0f,
-            5,
-            10);
-    if (!g_pEffect03->Init())
+    g_quality = quality;
+
+    UpdateEffect(view);
+
+    if (view.effectId != g_drawn.effectId)
     {
-        fprintf(stderr, "Err: effect03 init failed.\n");
-        return -1;
-    }
-    g_pEffect03->Draw();
-    
-    g_pEffect05 = new effect05_circlespread::Effect(
-            640, 
-            480,
-            50,
-            g_rayNumber,           
-            5,
-            50,
-            101,
-            102,
-            M_PI * (float)g_rayAngle / 180.0f,
-            color);
-    if (!g_pEffect05->Init())
-    {
-        fprintf(stderr, "Err: effect05 init failed.\n");
-        return -1;
+        g_effects.PrewarmAround(view.effectId);
     }
-    g_pEffect05->Draw();
-    
-    g_pEffect09 = new effect09_stripe::Effect(
-            640, 
-            480,
-            g_rayLength,           
-            g_rayNumber,
-            color1,
-            true,
-            color,
-            M_PI * (float)g_rayAngle / 180.0f);
-    if (!g_pEffect09->Init())
+    if (!view.particles && g_drawn.particles)
     {
-        fprintf(stderr, "Err: effect09 init failed.\n");
-        return -1;
+        // The sparkles start over when they are shown again.
+        g_particles.Clear();
     }
-    g_pEffect09->Draw();
+    g_drawn = view;
 
-    g_pEffect10 = new effect10_randomfan::Effect(
-            640, 
-            480,
-            g_rayNumber,           
-            g_rayLength,
-            color,
-            M_PI * (float)g_rayAngle / 180.0f);
-    if (!g_pEffect10->Init())
-    {
-        fprintf(stderr, "Err: effect10 init failed.\n");
-        return -1;
-    }
-    g_pEffect10->Draw();
-    
-    g_pEffect15 = new effect15_singlepoly::Effect(
-            640, 
-            480,
-            g_rayLength,
-            g_rayNumber,
-            0,
-            color,
-            M_PI * (float)g_rayAngle / 180.0f);
-    if (!g_pEffect15->Init())
+    if (!RenderFrame(pFrame))
     {
-        fprintf(stderr, "Err: effect15 init failed.\n");
-        return -1;
+        return false;
     }
-    g_pEffect15->Draw();
-    
-    g_pEffect19 = new effect19_sparkle::Effect(
-            640, 
-            480,
-            g_rayNumber,
-            g_rayLength,
-            color,
-            g_rayAngle);
-    if (!g_pEffect19->Init())
+
+    if (g_scheduler.AddFrame(view.effectId, timer.GetElapsedMilliseconds()))
     {
-        fprintf(stderr, "Err: effect19 init failed.\n");
-        return -1;
+        char text[128];
+        FrameScheduler::Describe(g_scheduler.GetLevel(view.effectId), text, sizeof(text));
+        fprintf(stdout, "Effect %d at %s.\n", view.effectId, text);
     }
-    g_pEffect19->Draw();
-    
-   
+
+    return true;
+}
+
+// \brief the view of the sliders and toggles.
+static
+ViewParams GetView()
+{
+    ViewParams view;
+    view.effectId = g_effectId;
+    view.number = g_rayNumber;
+    view.length = g_rayLength;
+    view.thickness = g_rayThickness;
+    view.angle = g_rayAngle;
+    view.blendMode = g_blendMode;
+    view.bloom = g_bloom;
+    view.streaks = g_streaks;
+    view.starbursts = g_starbursts;
+    view.ghosts = g_showGhosts;
+    view.particles = g_animate;
+    view.budget = g_budget;
+    return view;
+}
+
+// \brief post the view to the render thread; the frame shows up in
+// the main loop when it is done.
+static
+void RequestRender()
+{
+    g_pRenderWorker->Post(GetView());
+}
+
+static
+void onTrackbar(int pos)
+{
+    RequestRender();
+}
+
+// \brief register the effects. Each one is constructed, initialized
+// and drawn with the start-up parameters when it is first shown.
+//
+// \param hasLight whether the glowball goes on a light of the photo.
+// \param lightX the light position.
+// \param lightY
+static
+void RegisterEffects(bool hasLight, float lightX, float lightY)
+{
+    int width = g_width;
+    int height = g_height;
+    int rayNumber = g_rayNumber;
+    int rayLength = g_rayLength;
+    int rayAngle = g_rayAngle;
+    float angle = M_PI * (float)g_rayAngle / 180.0f;
+
+    g_effect01.SetFactory([=]() -> effect01_glowball::Effect* {
+        float color[] = {255, 255, 255};
+        float color1[] = {255, 0, 0};
+        effect01_glowball::Effect* pEffect = new effect01_glowball::Effect(
+                width,
+                height,
+                20,
+                30,
+                20,
+                rayLength,
+                rayNumber,
+                color,
+                color1);
+        if (!InitEffect(pEffect))
+        {
+            fprintf(stderr, "Err: effect01 init failed.\n");
+            delete pEffect;
+            return 0;
+        }
+        if (hasLight)
+        {
+            pEffect->SetPosition(lightX, lightY);
+        }
+        DrawEffect(pEffect);
+        return pEffect;
+    });
+
+    g_effect02.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect02_spikeball::Effect(
+                width,
+                height,
+                rayLength,
+                rayNumber,
+                color,
+                angle), "effect02");
+    });
+
+    g_effect03.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect03_starfilter::Effect(
+                width,
+                height,
+                rayNumber,
+                rayLength,
+                color,
+                angle,
+                5,
+                10), "effect03");
+    });
+
+    g_effect05.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect05_circlespread::Effect(
+                width,
+                height,
+                50,
+                rayNumber,
+                5,
+                50,
+                101,
+                102,
+                angle,
+                color), "effect05");
+    });
+
+    g_effect09.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        float color1[] = {255, 0, 0};
+        return BuildEffect(new effect09_stripe::Effect(
+                width,
+                height,
+                rayLength,
+                rayNumber,
+                color1,
+                true,
+                color,
+                angle), "effect09");
+    });
+
+    g_effect10.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect10_randomfan::Effect(
+                width,
+                height,
+                rayNumber,
+                rayLength,
+                color,
+                angle), "effect10");
+    });
+
+    g_effect15.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect15_singlepoly::Effect(
+                width,
+                height,
+                rayLength,
+                rayNumber,
+                0,
+                color,
+                angle), "effect15");
+    });
+
+    g_effect19.SetFactory([=]() {
+        float color[] = {255, 255, 255};
+        return BuildEffect(new effect19_sparkle::Effect(
+                width,
+                height,
+                rayNumber,
+                rayLength,
+                color,
+                rayAngle), "effect19");
+    });
+
+    g_effects.Add(EFFECT01, &g_effect01);
+    g_effects.Add(EFFECT02, &g_effect02);
+    g_effects.Add(EFFECT03, &g_effect03);
+    g_effects.Add(EFFECT05, &g_effect05);
+    g_effects.Add(EFFECT09, &g_effect09);
+    g_effects.Add(EFFECT10, &g_effect10);
+    g_effects.Add(EFFECT15, &g_effect15);
+    g_effects.Add(EFFECT19, &g_effect19);
+}
+
+// \brief put the glowball on the brightest light of each frame.
+class GlowballRenderer : public FrameRenderer
+{
+public:
+    // \param pEffect the glowball.
+    // \param key the hash of its parameters and size.
+    // \param seed the rand() seed of every layer, added to the key.
+    // \param pCache the results of earlier runs, or 0.
+    GlowballRenderer(effect01_glowball::Effect* pEffect, const ResultKey& key,
+                     unsigned long seed, ResultCache* pCache)
+    {
+        m_pEffect = pEffect;
+        m_key = key;
+        m_key.Add(seed);
+        m_seed = seed;
+        m_pCache = pCache;
+    };
+
+    IplImage* Render(const Frame& frame)
+    {
+        if (frame.lights.empty())
+        {
+            return 0;
+        }
+
+        float x = frame.lights[0].CenterX();
+        float y = frame.lights[0].CenterY();
+        if (m_pCache == 0)
+        {
+            return Draw(x, y);
+        }
+
+        // A static light renders the same layer on every frame.
+        ResultKey key = m_key;
+        key.Add(x).Add(y);
+        return (IplImage*)m_pCache->GetOrRender(key.Get(), [&]() {
+            return Draw(x, y);
+        });
+    };
+
+    // The layer dims as the light gets blocked.
+    float GetOpacity(const Frame& frame)
+    {
+        return frame.visibility.empty() ? 1.0f : frame.visibility[0];
+    };
+
+private:
+    // A layer only depends on the key, not on the layers before it.
+    IplImage* Draw(float x, float y)
+    {
+        srand((unsigned int)m_seed);
+        m_pEffect->SetPosition(x, y);
+        DrawEffect(m_pEffect);
+        return m_pEffect->GetResult();
+    };
+
+private:
+    effect01_glowball::Effect* m_pEffect;
+    ResultKey                  m_key;
+    unsigned long              m_seed;
+    ResultCache*               m_pCache;
+};
+
+// \brief process a frame sequence without the GUI.
+//
+// LensFlare -video <input> <output> [WxH] [-cache <dir>] [-occlusion <radius>]
+//
+// The input and output are printf patterns of numbered images,
+// the input can also be a directory of images. "-" is a Y4M
+// stream on stdin/stdout, or raw BGR24 frames when the frame
+// size is given. With a cache directory the flare layers are
+// kept on disk (up to 1 GB) and reused by later runs. With
+// -occlusion the glowball fades with the visible part of the light,
+// measured over the light's own size or within the given radius.
+static
+int RunVideo(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s -video <input> <output> [WxH] [-cache <dir>] [-occlusion <radius>]\n", argv[0]);
+        return -1;
+    }
+
+    const char* input = argv[2];
+    const char* output = argv[3];
+
+    int width = 0, height = 0;
+    StreamFormat format = STREAM_Y4M;
+    const char* cacheDir = 0;
+    float occlusionRadius = 0.0f;
+    for (int i = 4; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+        {
+            cacheDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-occlusion") == 0)
+        {
+            occlusionRadius = i + 1 < argc ? (float)atof(argv[++i]) : 0.0f;
+            if (occlusionRadius <= 0)
+            {
+                fprintf(stderr, "Err: -occlusion needs the radius of the light in pixels.\n");
+                return -1;
+            }
+        }
+        else if (sscanf(argv[i], "%dx%d", &width, &height) == 2)
+        {
+            format = STREAM_RAW;
+        }
+        else
+        {
+            fprintf(stderr, "Err: bad frame size %s.\n", argv[i]);
+            return -1;
+        }
+    }
+
+    ResultCache cache;
+    if (cacheDir != 0 && !cache.Open(cacheDir, (uint64_t)1 << 30))
+    {
+        return -1;
+    }
+
+    FrameReader* pReader;
+    StreamReader* pStream = 0;
+    if (strcmp(input, "-") == 0)
+    {
+        pReader = pStream = new StreamReader(format, stdin, width, height);
+    }
+    else
+    {
+        pReader = new ImageSequenceReader(input);
+    }
+
+    if (!pReader->Open())
+    {
+        fprintf(stderr, "Err: failed to open %s.\n", input);
+        delete pReader;
+        return -1;
+    }
+
+    FrameWriter* pWriter;
+    if (strcmp(output, "-") == 0)
+    {
+        pWriter = new StreamWriter(format, stdout,
+                pStream != 0 ? pStream->GetHeader().c_str() : 0);
+    }
+    else
+    {
+        pWriter = new ImageSequenceWriter(output);
+    }
+
+    float color[] = {255, 255, 255};
+    float color1[] = {255, 0, 0};
+
+    // The seed of the GUI, for Init and every layer.
+    unsigned long seed = 10001;
+    srand((unsigned int)seed);
+
+    effect01_glowball::Effect* pEffect = new effect01_glowball::Effect(
+            pReader->GetWidth(),
+            pReader->GetHeight(),
+            20,
+            30,
+            20,
+            g_rayLength,
+            g_rayNumber,
+            color,
+            color1);
+
+    int ret = 0;
+    if (!InitEffect(pEffect))
+    {
+        fprintf(stderr, "Err: effect01 init failed.\n");
+        ret = -1;
+    }
+    else
+    {
+        ResultKey key;
+        key.Add("effect01_glowball").Add(pReader->GetWidth()).Add(pReader->GetHeight());
+        key.Add(20).Add(30).Add(20).Add(g_rayLength).Add(g_rayNumber);
+        key.Add(color, 3).Add(color1, 3);
+
+        GlowballRenderer renderer(pEffect, key, seed, cacheDir != 0 ? &cache : 0);
+        FramePipeline pipeline(pReader, pWriter, &renderer);
+        pipeline.SetOcclusionRadius(occlusionRadius);
+
+        if (!pipeline.Run())
+        {
+            ret = -1;
+        }
+        fprintf(stderr, "%d frames processed.\n", pipeline.GetFrameCount());
+    }
+
+    if (Tracer::Get().ExportChrome("lensflare_trace.json"))
+    {
+        Tracer::Get().PrintStats(stderr);
+    }
+
+    delete pEffect;
+    delete pWriter;
+    delete pReader;
+
+    return ret;
+}
+
+// \brief render the ghosts, sparkles and bloom of the start-up
+// sliders on a canvas of any size, tile by tile, into a PPM file;
+// see tiled.h.
+//
+// LensFlare -tiled <output.ppm> <WxH> [tile] [passes]
+//
+// The passes are g (ghosts), p (sparkles) and b (bloom), "gp" by
+// default. The light is at a third of the canvas and the sparkles
+// are sized for it as for a 640-pixel one. The bloom widens the halo
+// of every tile to the reach of its blur, so it needs bigger tiles.
+static
+int RunTiled(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s -tiled <output.ppm> <WxH> [tile] [passes]\n", argv[0]);
+        return -1;
+    }
+
+    if (sscanf(argv[3], "%dx%d", &g_width, &g_height) != 2 || g_width <= 0 || g_height <= 0)
+    {
+        fprintf(stderr, "Err: bad canvas size %s.\n", argv[3]);
+        return -1;
+    }
+    int tileSize = argc > 4 ? atoi(argv[4]) : 1024;
+    const char* passes = argc > 5 ? argv[5] : "gp";
+
+    g_view = GetView();
+    g_lightX = g_width / 3;
+    g_lightY = g_height / 3;
+
+    PrimitiveList primitives;
+    if (strchr(passes, 'g') != 0)
+    {
+        MakeGhosts(primitives);
+    }
+    if (strchr(passes, 'p') != 0)
+    {
+        int count = 500 * g_view.number;
+        ParticleSystem particles(count);
+        MyRandom random;
+        particles.Spawn(GetSparkleEmitter((float)MAX(g_width, g_height) / 640.0f), count, random);
+
+        PrimitiveList sparkles;
+        particles.Emit(sparkles);
+        for (int p = 0; p < sparkles.GetCount(); ++p)
+        {
+            primitives.Append(sparkles, p, 0, 0);
+        }
+    }
+
+    bool bloom = strchr(passes, 'b') != 0;
+    float sigma = 0.02f * (float)MAX(g_width, g_height);
+    TiledRenderer renderer(tileSize, bloom ? blurSupport(sigma) : 0);
+
+    PPMTileWriter writer;
+    if (!writer.Create(argv[2], g_width, g_height))
+    {
+        fprintf(stderr, "Err: failed to create %s.\n", argv[2]);
+        return -1;
+    }
+
+    fprintf(stderr, "Rendering %dx%d in tiles of %d, about %d MB per thread.\n",
+            g_width, g_height, renderer.GetTileSize(), (int)(renderer.GetTileBytes() >> 20));
+
+    Timer timer;
+    bool ok = renderer.Render(g_width, g_height,
+        [&](IplImage* pTile, CvRect region) {
+            PrimitiveList culled;
+            cullPrimitives(primitives, region, culled);
+            BinningRenderer binning;
+            binning.Render(culled, pTile);
+
+            if (bloom)
+            {
+                IplImage* pBloom = cvCloneImage(pTile);
+                g_blur.Apply(pBloom, sigma);
+                cvAdd(pTile, pBloom, pTile);
+                cvReleaseImage(&pBloom);
+            }
+            return true;
+        },
+        [&](const IplImage* pTile, int x, int y) {
+            return writer.WriteTile(pTile, x, y);
+        });
+
+    if (!writer.Close() || !ok)
+    {
+        fprintf(stderr, "Err: failed to write %s.\n", argv[2]);
+        return -1;
+    }
+
+    fprintf(stderr, "%s written in %.1f s.\n", argv[2], timer.GetElapsedSeconds());
+    return 0;
+}
+
+#ifndef _WIN32
+RenderService* g_pService = 0;
+
+static
+void onServiceSignal(int sig)
+{
+    if (g_pService != 0)
+    {
+        g_pService->Stop();
+    }
+}
+
+// \brief serve frames to local clients until interrupted; see
+// renderservice.h.
+//
+// LensFlare -serve <socket> [WxH]
+//
+// All effects are built at start-up in the given size (640x480 by
+// default); requests of other sizes are refused.
+static
+int RunServe(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s -serve <socket> [WxH]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 3 && sscanf(argv[3], "%dx%d", &g_width, &g_height) != 2)
+    {
+        fprintf(stderr, "Err: bad frame size %s.\n", argv[3]);
+        return -1;
+    }
+
+    g_lightX = g_width / 2;
+    g_lightY = g_height / 2;
+    RegisterEffects(false, 0.0f, 0.0f);
+    for (int id = EFFECT01; id <= EFFECT20; ++id)
+    {
+        g_effects.Prewarm(id);
+    }
+
+    // The sliders each effect was last drawn with, so switching
+    // between effects applies what differs.
+    ViewParams start = GetView();
+    std::map<int, ViewParams> drawn;
+
+    RenderService service([&](const ServiceRequest& request) {
+        std::map<int, ViewParams>::iterator it = drawn.find(request.effectId);
+        g_drawn = it != drawn.end() ? it->second : start;
+
+        ViewParams view = g_drawn;
+        view.effectId = request.effectId;
+        view.number = request.number;
+        view.length = request.length;
+        view.angle = request.angle;
+        view.thickness = 100; // white, colored by the service.
+        UpdateEffect(view);
+
+        if (!IsColorLinear(request.effectId) && IsEffectReady())
+        {
+            // Drawn in the color of the request; every request of the
+            // effect sets it again, so the slider is left at white.
+            float color[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                color[k] = request.color[k] * request.brightness;
+            }
+            SetEffectColor(color);
+            DrawCurrentEffect();
+        }
+
+        drawn[request.effectId] = view;
+        return (const IplImage*)GetResult();
+    });
+    service.SetColorLinear(IsColorLinear);
+
+    if (!service.Open(argv[2]))
+    {
+        g_effects.Stop();
+        return -1;
+    }
+
+    g_pService = &service;
+    signal(SIGINT, onServiceSignal);
+    signal(SIGTERM, onServiceSignal);
+
+    fprintf(stderr, "Serving %dx%d frames on %s.\n", g_width, g_height, argv[2]);
+    service.Run();
+
+    g_pService = 0;
+    service.Close();
+    g_effects.Stop();
+
+    if (Tracer::Get().ExportChrome("lensflare_trace.json"))
+    {
+        Tracer::Get().PrintStats(stderr);
+    }
+
+    return 0;
+}
+
+// \brief ask a render service for the same effect from several
+// clients at once, each in its own color, and save the frames.
+//
+// LensFlare -client <socket> <output> [effect] [clients] [WxH]
+//
+// The output is a printf pattern of the client number. The clients
+// share the geometry, so the service draws it once for all.
+static
+int RunClient(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s -client <socket> <output> [effect] [clients] [WxH]\n", argv[0]);
+        return -1;
+    }
+
+    const char* path = argv[2];
+    const char* output = argv[3];
+    int effectId = argc > 4 ? atoi(argv[4]) : g_effectId;
+    int clients = argc > 5 ? MAX(atoi(argv[5]), 1) : 4;
+    if (argc > 6 && sscanf(argv[6], "%dx%d", &g_width, &g_height) != 2)
+    {
+        fprintf(stderr, "Err: bad frame size %s.\n", argv[6]);
+        return -1;
+    }
+
+    std::mutex mutex;
+    int failed = 0;
+    std::vector<std::thread> threads;
+    for (int k = 0; k < clients; ++k)
+    {
+        threads.push_back(std::thread([&, k]() {
+            ServiceRequest request;
+            memset(&request, 0, sizeof(request));
+            request.effectId = effectId;
+            request.number = g_rayNumber;
+            request.length = g_rayLength;
+            request.angle = g_rayAngle;
+            request.width = g_width;
+            request.height = g_height;
+            request.color[0] = 255.0f;
+            request.color[1] = 255.0f * (float)(k + 1) / (float)clients;
+            request.color[2] = 255.0f * (float)(clients - k) / (float)clients;
+            request.brightness = 1.0f;
+            request.format = LF_FORMAT_U8;
+            request.order = LF_ORDER_BGR;
+
+            RenderClient client;
+            LFBuffer frame;
+            int batch = 0;
+            bool ok = client.Connect(path) && client.Render(request, &frame, &batch);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok)
+            {
+                ++failed;
+                return;
+            }
+
+            IplImage image;
+            cvInitImageHeader(&image, cvSize(frame.width, frame.height), IPL_DEPTH_8U, 3);
+            cvSetData(&image, frame.data, frame.stride);
+
+            char filename[1024];
+            snprintf(filename, sizeof(filename), output, k);
+            cvSaveImage(filename, &image);
+            fprintf(stderr, "Client %d: %s, drawn in a batch of %d.\n", k, filename, batch);
+        }));
+    }
+
+    for (size_t k = 0; k < threads.size(); ++k)
+    {
+        threads[k].join();
+    }
+
+    return failed == 0 ? 0 : -1;
+}
+
+// \brief a frame of a batch: the view to render and the file to save.
+struct BatchJob
+{
+    ViewParams  view;
+    std::string output;
+};
+
+// \brief read a job list, one job per line:
+//
+//   <effect> <count> <scale> <brightness> <angle> <output> [passes]
+//
+// The passes are the letters of the viewer toggles: b (bloom), s
+// (streaks), a (starburst) and g (ghosts). '#' starts a comment.
+static
+bool LoadBatchJobs(const char* path, std::vector<BatchJob>& jobs)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == 0)
+    {
+        fprintf(stderr, "Err: failed to open %s.\n", path);
+        return false;
+    }
+
+    char line[1024];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), fp) != 0)
+    {
+        ++lineNo;
+        if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#')
+        {
+            continue;
+        }
+
+        BatchJob job;
+        job.view = GetView();
+        char output[1024];
+        char passes[16] = "";
+        if (sscanf(line, "%d %d %d %d %d %1023s %15s", &job.view.effectId, &job.view.number,
+                   &job.view.length, &job.view.thickness, &job.view.angle, output, passes) < 6)
+        {
+            fprintf(stderr, "Err: bad job at %s:%d.\n", path, lineNo);
+            fclose(fp);
+            return false;
+        }
+
+        job.output = output;
+        job.view.bloom = strchr(passes, 'b') != 0;
+        job.view.streaks = strchr(passes, 's') != 0;
+        job.view.starbursts = strchr(passes, 'a') != 0;
+        job.view.ghosts = strchr(passes, 'g') != 0;
+        jobs.push_back(job);
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// \brief render a job list in worker processes; see shard.h.
+//
+// LensFlare -batch <jobs> [workers] [WxH]
+//
+// One process per core by default. Every job is rendered from the
+// effects as built at start-up and its own seed, so the frames are the
+// same for any number of workers.
+static
+int RunBatch(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s -batch <jobs> [workers] [WxH]\n", argv[0]);
+        return -1;
+    }
+
+    int workers = argc > 3 ? atoi(argv[3]) : (int)std::thread::hardware_concurrency();
+    if (argc > 4 && sscanf(argv[4], "%dx%d", &g_width, &g_height) != 2)
+    {
+        fprintf(stderr, "Err: bad frame size %s.\n", argv[4]);
+        return -1;
+    }
+
+    std::vector<BatchJob> jobs;
+    if (!LoadBatchJobs(argv[2], jobs))
+    {
+        return -1;
+    }
+
+    // The effects are only built in the workers, after the fork.
+    g_lightX = g_width / 2;
+    g_lightY = g_height / 2;
+    RegisterEffects(false, 0.0f, 0.0f);
+
+    ShardCoordinator coordinator(cvSize(g_width, g_height), IPL_DEPTH_8U, 3);
+    int failed = coordinator.Run((int)jobs.size(), MAX(workers, 1),
+        [&](int k, IplImage* pFrame) {
+            const BatchJob& job = jobs[k];
+            g_view = job.view;
+            if (!IsEffectReady())
+            {
+                return false;
+            }
+
+            // Apply every slider, whatever the worker drew before.
+            srand(10001 + k);
+            g_drawn = job.view;
+            g_drawn.number = g_drawn.length = g_drawn.thickness = g_drawn.angle = -1;
+            UpdateEffect(job.view);
+            g_drawn = job.view;
+
+            return RenderFrame(pFrame);
+        },
+        [&](int k, const IplImage* frame) {
+            if (!cvSaveImage(jobs[k].output.c_str(), frame))
+            {
+                fprintf(stderr, "Err: failed to save %s.\n", jobs[k].output.c_str());
+            }
+        },
+        [=](int worker) {
+            // The cores shared out between the workers.
+            int cores = (int)std::thread::hardware_concurrency();
+            ThreadPool::Get().SetThreadCount(MAX(cores / MAX(workers, 1), 1));
+
+            // Build the effects in the same order in every worker.
+            srand(10001);
+            for (int id = EFFECT01; id <= EFFECT20; ++id)
+            {
+                LazyEffectBase* pEffect = g_effects.Find(id);
+                if (pEffect != 0)
+                {
+                    pEffect->Build();
+                }
+            }
+        });
+
+    fprintf(stderr, "%d jobs, %d failed, %d workers restarted.\n",
+            (int)jobs.size(), MAX(failed, 0), coordinator.GetRestartCount());
+
+    return failed == 0 ? 0 : -1;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "-video") == 0)
+    {
+        return RunVideo(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "-tiled") == 0)
+    {
+        return RunTiled(argc, argv);
+    }
+
+#ifndef _WIN32
+    if (argc > 1 && strcmp(argv[1], "-serve") == 0)
+    {
+        return RunServe(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "-client") == 0)
+    {
+        return RunClient(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "-batch") == 0)
+    {
+        return RunBatch(argc, argv);
+    }
+#endif
+
+    // Check the optimized kernels against the reference code.
+    if (argc > 1 && strcmp(argv[1], "-verify") == 0)
+    {
+        EquivalenceChecker checker;
+        registerStandardChecks(checker);
+        return checker.Run(stdout,
+                argc > 2 ? argv[2] : 0,
+                argc > 3 ? strtoul(argv[3], 0, 10) : 10001) ? 0 : 1;
+    }
+
+    // Load the input image and texture.
+    if (argc > 1)
+    {
+        g_pPhoto = cvLoadImage(argv[1], CV_LOAD_IMAGE_COLOR);
+        if (g_pPhoto == 0)
+        {
+            fprintf(stderr, "Err: failed to load %s.\n", argv[1]);
+            return -1;
+        }
+        g_width = g_pPhoto->width;
+        g_height = g_pPhoto->height;
+    }
+
+    // Place the flare on the brightest light of the photo.
+    std::vector<LightSource> lights;
+    if (g_pPhoto != 0)
+    {
+        LightDetector detector;
+        detector.Detect(g_pPhoto, lights);
+
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            fprintf(stdout, "Light %d: (%.1f, %.1f) intensity %.2f area %d\n",
+                    (int)i, lights[i].x, lights[i].y, lights[i].intensity, lights[i].area);
+        }
+    }
+
+    // FIXME: Change the rand seed here.
+    srand(10001);
+
+    // The effects are built on first use, the glowball on the light.
+    bool hasLight = !lights.empty();
+    float lightX = hasLight ? lights[0].CenterX() : 0.0f;
+    float lightY = hasLight ? lights[0].CenterY() : 0.0f;
+    g_lightX = hasLight ? cvRound(lightX) : g_width / 2;
+    g_lightY = hasLight ? cvRound(lightY) : g_height / 2;
+    RegisterEffects(hasLight, lightX, lightY);
+
+    // Only the effect on screen is built before the first frame.
+    g_view = GetView();
+    g_drawn = g_view;
+    if (!IsEffectReady())
+    {
+        return -1;
+    }
+
+    // From here on the effects are drawn on the render thread.
+    g_pRenderWorker = new RenderWorker<ViewParams>(RenderView,
+            cvSize(g_width, g_height), IPL_DEPTH_8U, 3);
+
     // Create window.
     cvNamedWindow("Lens Flare", 1);
     
-    cvCreateTrackbar("Effect",     "Lens Flare", &g_effectId,     20,  onTrackbar0);
-    cvCreateTrackbar("Count",      "Lens Flare", &g_rayNumber,    100, onTrackbar1);
-    cvCreateTrackbar("Scale",      "Lens Flare", &g_rayLength,    100, onTrackbar2);
-    cvCreateTrackbar("Brightness", "Lens Flare", &g_rayThickness, 100, onTrackbar3);
-    cvCreateTrackbar("Angle",      "Lens Flare", &g_rayAngle,     180,  onTrackbar4);
+    cvCreateTrackbar("Effect",     "Lens Flare", &g_effectId,     20,  onTrackbar);
+    cvCreateTrackbar("Count",      "Lens Flare", &g_rayNumber,    100, onTrackbar);
+    cvCreateTrackbar("Scale",      "Lens Flare", &g_rayLength,    100, onTrackbar);
+    cvCreateTrackbar("Brightness", "Lens Flare", &g_rayThickness, 100, onTrackbar);
+    cvCreateTrackbar("Angle",      "Lens Flare", &g_rayAngle,     180,  onTrackbar);
 
-    ShowResult();
+    RequestRender();
+    g_effects.PrewarmAround(g_effectId);
     
     // Enter the main loop.
     while(1){
         int key = cvWaitKey(10);
 
+        // Show the newest finished frame.
+        IplImage* pFrame = g_pRenderWorker->Acquire();
+        if (pFrame != 0)
+        {
+            g_pImage = pFrame;
+            cvShowImage("Lens Flare", g_pImage);
+
+            // The next frame of the sparkles.
+            if (g_animate)
+            {
+                RequestRender();
+            }
+        }
+
         // Exit.
         if (key == 27)
         {
@@ -454,23 +1805,138 @@ int main(int argc, char* argv[])
                     static int fileId = 1;
                     char filename[1024];
                     sprintf(filename, "dumpsrc_%04d.bmp", fileId);
-                    cvSaveImage(filename, g_pImage);
+                    if (g_pImage != 0)
+                    {
+                        cvSaveImage(filename, g_pImage);
+                    }
                 }
                 break;
+            // Export the trace and print the per-stage timing.
+            case 't':
+                if (Tracer::Get().ExportChrome("lensflare_trace.json"))
+                {
+                    Tracer::Get().PrintStats(stdout);
+                }
+                else
+                {
+                    fprintf(stderr, "Err: tracing is not compiled in (LF_ENABLE_TRACE).\n");
+                }
+                break;
+            // Append the float effect result to the frame file.
+            case 'h':
+                {
+                    g_pRenderWorker->WaitIdle();
+                    IplImage* pResult = GetResult();
+                    if (pResult == 0)
+                    {
+                        break;
+                    }
+                    if (g_frameFile.GetFrameCount() == 0 &&
+                        !g_frameFile.Create("dumpsrc.lff", pResult->width, pResult->height,
+                            3, FRAME_FORMAT_F16, 1024))
+                    {
+                        fprintf(stderr, "Err: failed to create dumpsrc.lff.\n");
+                        break;
+                    }
+                    if (g_frameFile.Append(pResult, g_effectId) < 0)
+                    {
+                        fprintf(stderr, "Err: dumpsrc.lff is full.\n");
+                    }
+                }
+                break;
+            // Cycle the blend mode of the photo compositing.
+            case 'm':
+                g_blendMode = (g_blendMode + 1) % BLEND_MODE_COUNT;
+                RequestRender();
+                break;
+            // Toggle the bloom.
+            case 'b':
+                g_bloom = !g_bloom;
+                RequestRender();
+                break;
+            // Toggle the star filter streaks.
+            case 's':
+                g_streaks = !g_streaks;
+                RequestRender();
+                break;
+            // Toggle the aperture starburst.
+            case 'a':
+                g_starbursts = !g_starbursts;
+                RequestRender();
+                break;
+            // Toggle the ghosts.
+            case 'g':
+                g_showGhosts = !g_showGhosts;
+                RequestRender();
+                break;
+            // Toggle the animated sparkles.
+            case 'p':
+                g_animate = !g_animate;
+                RequestRender();
+                break;
+            // Cycle the frame time budget: none, 33 and 16 ms.
+            case 'q':
+                g_budget = g_budget == 0 ? 33 : (g_budget == 33 ? 16 : 0);
+                if (g_budget == 0)
+                {
+                    fprintf(stdout, "No frame budget.\n");
+                }
+                else
+                {
+                    fprintf(stdout, "Frame budget %d ms.\n", g_budget);
+                }
+                RequestRender();
+                break;
+            // Save the color and brightness sweep of the effect.
+            case 'w':
+                g_pRenderWorker->WaitIdle();
+                SaveSweep();
+                RequestRender();
+                break;
         }
     }
     
     cvDestroyWindow("Lens Flare");
 
-    // The end of the main loop.
-    cvReleaseImage(&g_pImage);
+    g_frameFile.Close();
+
+    // The end of the main loop. The frames go with the worker.
+    delete g_pRenderWorker;
+    if (g_pBloom != 0)
+    {
+        cvReleaseImage(&g_pBloom);
+    }
+    if (g_pStreaks != 0)
+    {
+        cvReleaseImage(&g_pStreaks);
+    }
+    if (g_pStarburst != 0)
+    {
+        cvReleaseImage(&g_pStarburst);
+    }
+    if (g_pGhosts != 0)
+    {
+        cvReleaseImage(&g_pGhosts);
+    }
+    if (g_pParticles != 0)
+    {
+        cvReleaseImage(&g_pParticles);
+    }
+    if (g_pReduced != 0)
+    {
+        cvReleaseImage(&g_pReduced);
+    }
+    if (g_pReducedPass != 0)
+    {
+        cvReleaseImage(&g_pReducedPass);
+    }
+    if (g_pPhoto != 0)
+    {
+        cvReleaseImage(&g_pPhoto);
+    }
 
-    delete g_pEffect01;
-    delete g_pEffect02;
-    delete g_pEffect03;
-    delete g_pEffect09;
-    delete g_pEffect10;
-    delete g_pEffect15;
+    // The effects are deleted with their LazyEffect.
+    g_effects.Stop();
 
     return 0;
 }
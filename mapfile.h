@@ -0,0 +1,286 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   mapfile.h
+ *
+ * Abstract:
+ *
+ *   Memory-mapped files on Windows and POSIX systems.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef MAP_FILE_H
+#define MAP_FILE_H
+
+#include <cstddef>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+class MappedFile
+{
+public:
+    MappedFile()
+    {
+        m_pData = 0;
+        m_size = 0;
+        m_writable = false;
+#ifdef _WIN32
+        m_hFile = INVALID_HANDLE_VALUE;
+        m_hMapping = 0;
+#else
+        m_fd = -1;
+#endif
+    };
+
+    ~MappedFile()
+    {
+        Close();
+    };
+
+    // \brief create (or truncate) a file of the given size and map
+    // it for writing. The disk space is allocated up front (see
+    // SetFileSize), so a full disk fails here.
+    // \return false if failed and true if OK.
+    bool Create(const char* path, size_t size)
+    {
+        Close();
+
+#ifdef _WIN32
+        m_hFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+#else
+        m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+#endif
+        if (!SetFileSize(0, size))
+        {
+            Close();
+            return false;
+        }
+        return Map(size, true);
+    };
+
+    // \brief map an existing file.
+    // \return false if failed and true if OK.
+    bool Open(const char* path, bool writable = false)
+    {
+        Close();
+
+#ifdef _WIN32
+        DWORD access = writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+        m_hFile = CreateFileA(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, 0,
+                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_hFile, &size))
+        {
+            Close();
+            return false;
+        }
+        return Map((size_t)size.QuadPart, writable);
+#else
+        m_fd = open(path, writable ? O_RDWR : O_RDONLY);
+        if (m_fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(m_fd, &st) != 0)
+        {
+            Close();
+            return false;
+        }
+        return Map((size_t)st.st_size, writable);
+#endif
+    };
+
+    // \brief grow or shrink a file mapped for writing and map it
+    // again, allocating the space it grows by. The mapping may move,
+    // so pointers into it go stale.
+    // \return false if failed (the file is closed) and true if OK.
+    bool Resize(size_t size)
+    {
+        if (m_pData == 0 || !m_writable)
+        {
+            return false;
+        }
+
+#ifdef _WIN32
+        UnmapViewOfFile(m_pData);
+        CloseHandle(m_hMapping);
+        m_pData = 0;
+        m_hMapping = 0;
+#else
+        munmap(m_pData, m_size);
+        m_pData = 0;
+#endif
+
+        if (!SetFileSize(m_size, size))
+        {
+            Close();
+            return false;
+        }
+        return Map(size, true);
+    };
+
+    // \brief write the dirty pages back to the file.
+    void Flush()
+    {
+        if (m_pData == 0 || !m_writable)
+        {
+            return;
+        }
+#ifdef _WIN32
+        FlushViewOfFile(m_pData, 0);
+#else
+        msync(m_pData, m_size, MS_SYNC);
+#endif
+    };
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (m_pData != 0)
+        {
+            UnmapViewOfFile(m_pData);
+        }
+        if (m_hMapping != 0)
+        {
+            CloseHandle(m_hMapping);
+        }
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+        }
+        m_hFile = INVALID_HANDLE_VALUE;
+        m_hMapping = 0;
+#else
+        if (m_pData != 0)
+        {
+            munmap(m_pData, m_size);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+        m_fd = -1;
+#endif
+        m_pData = 0;
+        m_size = 0;
+    };
+
+    bool IsOpen() const
+    {
+        return m_pData != 0;
+    };
+
+    unsigned char* GetData() const
+    {
+        return (unsigned char*)m_pData;
+    };
+
+    size_t GetSize() const
+    {
+        return m_size;
+    };
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    // \brief set the size of the file from the size it has, allocating
+    // the disk space it grows by. A sparse file would only run out of
+    // space on a store to the mapping, which faults (SIGBUS). Windows
+    // allocates on SetEndOfFile; elsewhere than Linux the file may
+    // stay sparse.
+    bool SetFileSize(size_t from, size_t size)
+    {
+#ifdef _WIN32
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)size;
+        return SetFilePointerEx(m_hFile, end, 0, FILE_BEGIN) && SetEndOfFile(m_hFile);
+#else
+        if (ftruncate(m_fd, (off_t)size) != 0)
+        {
+            return false;
+        }
+# ifdef __linux__
+        return size <= from || posix_fallocate(m_fd, (off_t)from, (off_t)(size - from)) == 0;
+# else
+        return true;
+# endif
+#endif
+    };
+
+    bool Map(size_t size, bool writable)
+    {
+        if (size == 0)
+        {
+            Close();
+            return false;
+        }
+
+#ifdef _WIN32
+        DWORD high = (DWORD)((unsigned long long)size >> 32);
+        DWORD low = (DWORD)(size & 0xFFFFFFFF);
+        m_hMapping = CreateFileMappingA(m_hFile, 0, writable ? PAGE_READWRITE : PAGE_READONLY,
+                high, low, 0);
+        if (m_hMapping != 0)
+        {
+            m_pData = MapViewOfFile(m_hMapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+        }
+#else
+        void* p = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                MAP_SHARED, m_fd, 0);
+        m_pData = (p == MAP_FAILED) ? 0 : p;
+#endif
+        if (m_pData == 0)
+        {
+            Close();
+            return false;
+        }
+
+        m_size = size;
+        m_writable = writable;
+        return true;
+    };
+
+private:
+    void*  m_pData;
+    size_t m_size;
+    bool   m_writable;
+
+#ifdef _WIN32
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+#else
+    int    m_fd;
+#endif
+};
+
+#endif // !MAP_FILE_H
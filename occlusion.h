@@ -0,0 +1,235 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   occlusion.h
+ *
+ * Abstract:
+ *
+ *   How much of each light source is visible, to dim its flare
+ *   when something passes in front of it.
+ *
+ *   The open pixels of a frame (above the bright-pass threshold,
+ *   or given as a mask) are summed once into a summed-area table.
+ *   The open area of any box is then four lookups, so a query
+ *   costs the same for any aperture radius and hundreds of lights
+ *   cost next to nothing. The table is 32-bit and wraps, which is
+ *   harmless: the box sums are differences and stay exact as long
+ *   as a box holds fewer than 2^24 pixels.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "common.h"
+#include "lightdetect.h"
+#include "threadpool.h"
+#include "trace.h"
+
+class OcclusionMap
+{
+public:
+    // \brief constructor.
+    //
+    // \param threshold the bright-pass threshold in [0, 1], like
+    //   the one of LightDetector.
+    // \param pPool the threads building the table, the shared
+    //   pool by default.
+    OcclusionMap(float threshold = 0.9f, ThreadPool* pPool = 0)
+    {
+        m_threshold = threshold;
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+        m_width = 0;
+        m_height = 0;
+    };
+
+    void SetThreshold(float threshold)
+    {
+        m_threshold = threshold;
+    };
+
+    // \brief build the table of a frame.
+    //
+    // \param image a 3-channel (BGR) image, 8-bit or float in
+    //   [0, 255], whose pixels above the threshold are open; or a
+    //   1-channel 8-bit mask, 255 for open and 0 for blocked.
+    // \return false if the image format is not supported.
+    bool Build(const IplImage* image)
+    {
+        bool mask = image->depth == IPL_DEPTH_8U && image->nChannels == 1;
+        if (!mask && ((image->depth != IPL_DEPTH_8U && image->depth != IPL_DEPTH_32F) ||
+                      image->nChannels != 3))
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("occlusion");
+
+        m_width = image->width;
+        m_height = image->height;
+        m_sums.assign((size_t)(m_width + 1) * (m_height + 1), 0);
+
+        // The running sums of each row, then down the columns.
+        m_pPool->ParallelFor(m_height, 16, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                const char* row = image->imageData + i * image->widthStep;
+                uint32_t* sums = &m_sums[(size_t)(i + 1) * (m_width + 1) + 1];
+
+                if (mask)
+                {
+                    SumRowMask((const unsigned char*)row, sums);
+                }
+                else if (image->depth == IPL_DEPTH_8U)
+                {
+                    SumRow8U((const unsigned char*)row, sums);
+                }
+                else
+                {
+                    SumRow32F((const float*)row, sums);
+                }
+            }
+        });
+
+        m_pPool->ParallelFor(m_width + 1, 256, [&](int begin, int end) {
+            for (int i = 1; i <= m_height; ++i)
+            {
+                const uint32_t* above = &m_sums[(size_t)(i - 1) * (m_width + 1)];
+                uint32_t* sums = &m_sums[(size_t)i * (m_width + 1)];
+                for (int j = begin; j < end; ++j)
+                {
+                    sums[j] += above[j];
+                }
+            }
+        });
+
+        return true;
+    };
+
+    // \brief the open area of the pixels [x0, x1) x [y0, y1), in
+    // units of 255 per pixel. The box is clipped to the frame.
+    uint32_t GetOpenSum(int x0, int y0, int x1, int y1) const
+    {
+        x0 = clip(x0, 0, m_width);
+        x1 = clip(x1, 0, m_width);
+        y0 = clip(y0, 0, m_height);
+        y1 = clip(y1, 0, m_height);
+        if (x1 <= x0 || y1 <= y0)
+        {
+            return 0;
+        }
+
+        const uint32_t* top = &m_sums[(size_t)y0 * (m_width + 1)];
+        const uint32_t* bottom = &m_sums[(size_t)y1 * (m_width + 1)];
+        return bottom[x1] - bottom[x0] - top[x1] + top[x0];
+    };
+
+    // \brief the visible fraction of a light at (x, y).
+    //
+    // The aperture is the box of half-width radius around the
+    // pixel of (x, y); its open area is taken relative to the disk
+    // of that radius, so a round source of the aperture's size that
+    // is in full view gives 1. Pixels off the frame are blocked.
+    //
+    // The radius is the size of the light unblocked, which the frame
+    // can't tell: the bright pass of a blocked light is only its
+    // open part, so its own LightSource::Radius() shrinks with it.
+    //
+    // \return the fraction in [0, 1].
+    float GetVisibility(float x, float y, float radius) const
+    {
+        radius = MAX(radius, 0.5f);
+
+        int cx = (int)floor(x + 0.5f);
+        int cy = (int)floor(y + 0.5f);
+        int r = (int)radius;
+        uint32_t sum = GetOpenSum(cx - r, cy - r, cx + r + 1, cy + r + 1);
+
+        float visible = (float)sum / (255.0f * M_PI * radius * radius);
+        return MIN(visible, 1.0f);
+    };
+
+    // \brief the visible fraction of each light.
+    //
+    // \param radius the aperture radius of all the lights.
+    void GetVisibility(const std::vector<LightSource>& lights, float radius,
+                       std::vector<float>& visibility) const
+    {
+        visibility.resize(lights.size());
+        for (size_t i = 0; i < lights.size(); ++i)
+        {
+            visibility[i] = GetVisibility(lights[i].x, lights[i].y, radius);
+        }
+    };
+
+    int GetWidth() const
+    {
+        return m_width;
+    };
+
+    int GetHeight() const
+    {
+        return m_height;
+    };
+
+private:
+    void SumRowMask(const unsigned char* p, uint32_t* sums)
+    {
+        uint32_t sum = 0;
+        for (int j = 0; j < m_width; ++j)
+        {
+            sum += p[j];
+            sums[j] = sum;
+        }
+    };
+
+    // The luminance weights of LightDetector::ScanRow8U.
+    void SumRow8U(const unsigned char* p, uint32_t* sums)
+    {
+        int threshold = (int)(m_threshold * 255.0f * 256.0f);
+
+        uint32_t sum = 0;
+        for (int j = 0; j < m_width; ++j, p += 3)
+        {
+            int y = 19 * p[0] + 183 * p[1] + 54 * p[2];
+            sum += y >= threshold ? 255 : 0;
+            sums[j] = sum;
+        }
+    };
+
+    void SumRow32F(const float* p, uint32_t* sums)
+    {
+        float threshold = m_threshold * 255.0f;
+
+        uint32_t sum = 0;
+        for (int j = 0; j < m_width; ++j, p += 3)
+        {
+            float y = 0.0722f * p[0] + 0.7152f * p[1] + 0.2126f * p[2];
+            sum += y >= threshold ? 255 : 0;
+            sums[j] = sum;
+        }
+    };
+
+private:
+    float       m_threshold;
+    ThreadPool* m_pPool;
+    int         m_width;
+    int         m_height;
+
+    // The open sum of the pixels [0, j) x [0, i) is at
+    // i * (width + 1) + j.
+    std::vector<uint32_t> m_sums;
+};
+
+#endif // !OCCLUSION_H
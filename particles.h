@@ -0,0 +1,374 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   particles.h
+ *
+ * Abstract:
+ *
+ *   Animated sparkles. Effect19 draws a fresh random set on every
+ *   call, so its sparkles can't move or twinkle from one frame to
+ *   the next; a ParticleSystem keeps them alive instead.
+ *
+ *   The particles are stored as a structure of arrays, one array
+ *   per field, allocated once for the capacity. The live particles
+ *   are the first GetCount() of each array: a spawn appends and a
+ *   kill moves the last particle into the hole, so neither
+ *   allocates. A frame steps four particles per SSE2 instruction
+ *   (position, twinkle phase and age, then the brightness), and the
+ *   visible ones are emitted as gradient disks into a PrimitiveList
+ *   for BinningRenderer, reusing the list's storage.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <math.h>
+#include <vector>
+
+#include "binning.h"
+#include "common.h"
+#include "trace.h"
+
+// \brief the brightness of a particle: a smooth twinkle, bright at
+// phase 0 and dark at 0.5, faded out over its life by fading().
+//
+// \param phase the twinkle phase in [0, 1).
+// \param t the age over the life, in [0, 1].
+static inline
+float particleBrightness(float phase, float t)
+{
+    float tri = fabs(2.0f * phase - 1.0f);
+    float twinkle = tri * tri * (3.0f - 2.0f * tri);
+    float b = twinkle * fading(t);
+    return b > 0.0f ? b : 0.0f;
+}
+
+// \brief where and how particles are spawned.
+struct ParticleEmitter
+{
+    float left;       // the area the particles appear in, in pixels.
+    float top;
+    float right;
+    float bottom;
+    float minSize;    // the radius in pixels.
+    float maxSize;
+    float minLife;    // seconds.
+    float maxLife;
+    float minRate;    // twinkles per second.
+    float maxRate;
+    float speed;      // the largest drift in pixels per second.
+    float color[3];   // rgb[0..2] like the flares, in [0, 255].
+    float tint;       // the random darkening of each channel, [0, 1].
+};
+
+class ParticleSystem
+{
+public:
+    // \brief one particle, for Add() and Get().
+    struct Particle
+    {
+        float x;
+        float y;
+        float vx;     // pixels per second.
+        float vy;
+        float size;   // the radius in pixels.
+        float phase;  // the twinkle phase in [0, 1).
+        float rate;   // twinkles per second.
+        float rgb[3];
+        float age;    // seconds.
+        float life;
+    };
+
+    // \brief constructor.
+    //
+    // \param capacity the most particles alive at once.
+    ParticleSystem(int capacity = 65536)
+    {
+        m_capacity = MAX(capacity, 0);
+        m_count = 0;
+
+        std::vector<float>* fields[] = {
+            &m_x, &m_y, &m_vx, &m_vy, &m_size, &m_phase, &m_rate,
+            &m_red, &m_green, &m_blue, &m_age, &m_life, &m_intensity
+        };
+        for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f)
+        {
+            fields[f]->assign(m_capacity, 0.0f);
+        }
+    };
+
+    int GetCapacity() const
+    {
+        return m_capacity;
+    };
+
+    // \brief the number of live particles.
+    int GetCount() const
+    {
+        return m_count;
+    };
+
+    void Clear()
+    {
+        m_count = 0;
+    };
+
+    // \brief add a particle.
+    //
+    // \return false if the system is full.
+    bool Add(const Particle& p)
+    {
+        if (m_count >= m_capacity)
+        {
+            return false;
+        }
+
+        int i = m_count++;
+        m_x[i] = p.x;
+        m_y[i] = p.y;
+        m_vx[i] = p.vx;
+        m_vy[i] = p.vy;
+        m_size[i] = p.size;
+        m_phase[i] = p.phase;
+        m_rate[i] = p.rate;
+        m_red[i] = p.rgb[0];
+        m_green[i] = p.rgb[1];
+        m_blue[i] = p.rgb[2];
+        m_age[i] = p.age;
+        m_life[i] = MAX(p.life, 1e-3f);
+        m_intensity[i] = particleBrightness(p.phase, MIN(m_age[i] / m_life[i], 1.0f));
+        return true;
+    };
+
+    void Get(int index, Particle& p) const
+    {
+        p.x = m_x[index];
+        p.y = m_y[index];
+        p.vx = m_vx[index];
+        p.vy = m_vy[index];
+        p.size = m_size[index];
+        p.phase = m_phase[index];
+        p.rate = m_rate[index];
+        p.rgb[0] = m_red[index];
+        p.rgb[1] = m_green[index];
+        p.rgb[2] = m_blue[index];
+        p.age = m_age[index];
+        p.life = m_life[index];
+    };
+
+    // \brief the brightness of a particle after the last Update(),
+    // in [0, 1].
+    float GetIntensity(int index) const
+    {
+        return m_intensity[index];
+    };
+
+    // \brief remove a particle; the last one takes its index.
+    void Kill(int index)
+    {
+        int last = --m_count;
+        if (index == last)
+        {
+            return;
+        }
+
+        m_x[index] = m_x[last];
+        m_y[index] = m_y[last];
+        m_vx[index] = m_vx[last];
+        m_vy[index] = m_vy[last];
+        m_size[index] = m_size[last];
+        m_phase[index] = m_phase[last];
+        m_rate[index] = m_rate[last];
+        m_red[index] = m_red[last];
+        m_green[index] = m_green[last];
+        m_blue[index] = m_blue[last];
+        m_age[index] = m_age[last];
+        m_life[index] = m_life[last];
+        m_intensity[index] = m_intensity[last];
+    };
+
+    // \brief spawn particles at random in the emitter's area, with a
+    // random phase so they don't twinkle in step.
+    //
+    // \return the number spawned, fewer than count if the system is
+    //   full.
+    int Spawn(const ParticleEmitter& emitter, int count, MyRandom& random)
+    {
+        int spawned = 0;
+        for (; spawned < count && m_count < m_capacity; ++spawned)
+        {
+            Particle p;
+            p.x = Uniform(random, emitter.left, emitter.right);
+            p.y = Uniform(random, emitter.top, emitter.bottom);
+
+            float angle = random.GetFloat(0.0f, 2.0f * (float)M_PI);
+            float speed = emitter.speed * random.GetFloat();
+            p.vx = speed * cos(angle);
+            p.vy = speed * sin(angle);
+
+            p.size = Uniform(random, emitter.minSize, emitter.maxSize);
+            p.phase = MIN(random.GetFloat(), 0.999f);
+            p.rate = Uniform(random, emitter.minRate, emitter.maxRate);
+            for (int c = 0; c < 3; ++c)
+            {
+                p.rgb[c] = emitter.color[c] * (1.0f - emitter.tint * random.GetFloat());
+            }
+            p.age = 0.0f;
+            p.life = Uniform(random, emitter.minLife, emitter.maxLife);
+            Add(p);
+        }
+        return spawned;
+    };
+
+    // \brief advance the particles by dt seconds and kill the ones
+    // past their life.
+    void Update(float dt)
+    {
+        LF_TRACE_SCOPE("particles");
+
+        if (m_count == 0)
+        {
+            return;
+        }
+
+        UpdateSpan(0, m_count, MAX(dt, 0.0f));
+
+        for (int i = 0; i < m_count; )
+        {
+            if (m_age[i] >= m_life[i])
+            {
+                Kill(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    };
+
+    // \brief replace the primitives with the particles brighter than
+    // the cutoff, as gradient disks of their color times their
+    // brightness. The list keeps its storage from frame to frame.
+    //
+    // \param cutoff the dimmest channel value worth drawing, in the
+    //   units of the color.
+    // \param gamma the falloff of the disks, see GradientProfile.
+    void Emit(PrimitiveList& primitives, float cutoff = 0.5f, float gamma = 2.2f) const
+    {
+        primitives.Clear();
+
+        for (int i = 0; i < m_count; ++i)
+        {
+            float b = m_intensity[i];
+            float rgb[] = { b * m_red[i], b * m_green[i], b * m_blue[i] };
+            if (MAX(rgb[0], MAX(rgb[1], rgb[2])) < cutoff || m_size[i] <= 0.0f)
+            {
+                continue;
+            }
+            primitives.AddGradient((int)floor(m_x[i] + 0.5f), (int)floor(m_y[i] + 0.5f),
+                                   m_size[i], rgb, gamma);
+        }
+    };
+
+private:
+    static float Uniform(MyRandom& random, float inf, float sup)
+    {
+        return inf < sup ? random.GetFloat(inf, sup) : inf;
+    };
+
+    // The SIMD step of the particles [begin, end), the same
+    // arithmetic as the scalar tail.
+    void UpdateSpan(int begin, int end, float dt)
+    {
+        float* x = &m_x[0];
+        float* y = &m_y[0];
+        float* phase = &m_phase[0];
+        float* age = &m_age[0];
+        float* intensity = &m_intensity[0];
+        const float* vx = &m_vx[0];
+        const float* vy = &m_vy[0];
+        const float* rate = &m_rate[0];
+        const float* life = &m_life[0];
+
+        int k = begin;
+
+#ifdef LF_SSE2
+        const __m128 step  = _mm_set1_ps(dt);
+        const __m128 zero  = _mm_setzero_ps();
+        const __m128 one   = _mm_set1_ps(1.0f);
+        const __m128 two   = _mm_set1_ps(2.0f);
+        const __m128 three = _mm_set1_ps(3.0f);
+        const __m128 sign  = _mm_set1_ps(-0.0f);
+
+        for (; k + 4 <= end; k += 4)
+        {
+            _mm_storeu_ps(x + k, _mm_add_ps(_mm_loadu_ps(x + k), _mm_mul_ps(_mm_loadu_ps(vx + k), step)));
+            _mm_storeu_ps(y + k, _mm_add_ps(_mm_loadu_ps(y + k), _mm_mul_ps(_mm_loadu_ps(vy + k), step)));
+
+            // The phase stays positive, so truncation is floor.
+            __m128 p = _mm_add_ps(_mm_loadu_ps(phase + k), _mm_mul_ps(_mm_loadu_ps(rate + k), step));
+            p = _mm_sub_ps(p, _mm_cvtepi32_ps(_mm_cvttps_epi32(p)));
+            _mm_storeu_ps(phase + k, p);
+
+            __m128 a = _mm_add_ps(_mm_loadu_ps(age + k), step);
+            _mm_storeu_ps(age + k, a);
+
+            // particleBrightness().
+            __m128 tri = _mm_andnot_ps(sign, _mm_sub_ps(_mm_mul_ps(two, p), one));
+            __m128 twinkle = _mm_mul_ps(_mm_mul_ps(tri, tri), _mm_sub_ps(three, _mm_mul_ps(two, tri)));
+
+            __m128 t = _mm_min_ps(_mm_div_ps(a, _mm_loadu_ps(life + k)), one);
+            __m128 f = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(10.2182f), t), _mm_set1_ps(30.6413f));
+            f = _mm_add_ps(_mm_mul_ps(f, t), _mm_set1_ps(32.0970f));
+            f = _mm_sub_ps(_mm_mul_ps(f, t), _mm_set1_ps(12.0388f));
+            f = _mm_sub_ps(_mm_mul_ps(f, t), _mm_set1_ps(0.6378f));
+            f = _mm_add_ps(_mm_mul_ps(f, t), _mm_set1_ps(1.0028f));
+
+            _mm_storeu_ps(intensity + k, _mm_max_ps(_mm_mul_ps(twinkle, f), zero));
+        }
+#endif
+
+        for (; k < end; ++k)
+        {
+            x[k] += vx[k] * dt;
+            y[k] += vy[k] * dt;
+
+            float p = phase[k] + rate[k] * dt;
+            p -= (float)(int)p;
+            phase[k] = p;
+
+            age[k] += dt;
+            intensity[k] = particleBrightness(p, MIN(age[k] / life[k], 1.0f));
+        }
+    };
+
+private:
+    int m_capacity;
+    int m_count;
+
+    // The fields of the particles, the live ones first.
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_vx;
+    std::vector<float> m_vy;
+    std::vector<float> m_size;
+    std::vector<float> m_phase;
+    std::vector<float> m_rate;
+    std::vector<float> m_red;
+    std::vector<float> m_green;
+    std::vector<float> m_blue;
+    std::vector<float> m_age;
+    std::vector<float> m_life;
+    std::vector<float> m_intensity;
+};
+
+#endif // !PARTICLES_H
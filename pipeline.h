@@ -0,0 +1,334 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   pipeline.h
+ *
+ * Abstract:
+ *
+ *   Apply flares to a frame sequence with a four-stage pipeline:
+ *   decode, light detection (and occlusion), render/composite and
+ *   encode. Each stage runs on its own thread and the stages are
+ *   connected by bounded lock-free queues, so while one frame is
+ *   encoded the next ones are being rendered, detected and
+ *   decoded, and the throughput is bound by the slowest stage only.
+ *
+ *   Every stage is a single thread consuming its queue in order,
+ *   therefore the frames leave the pipeline in input order. The
+ *   frame buffers are allocated once and recycled from the
+ *   encoder back to the decoder.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+#include "queue.h"
+#include "frameio.h"
+#include "lightdetect.h"
+#include "occlusion.h"
+#include "composite.h"
+#include "trace.h"
+
+// \brief a frame travelling through the pipeline.
+struct Frame
+{
+    int                      index;
+    IplImage*                pImage; // 8-bit BGR, composited in place.
+    std::vector<LightSource> lights;
+    std::vector<float>       visibility; // of each light, in [0, 1].
+};
+
+// \brief renders the flare layer of one frame. Only called from
+// the render stage thread.
+class FrameRenderer
+{
+public:
+    virtual ~FrameRenderer() {};
+
+    // \brief render the flares for the detected lights.
+    // \return the float layer to composite, or 0 to leave the
+    // frame untouched.
+    virtual IplImage* Render(const Frame& frame) = 0;
+
+    // \brief the opacity the layer is composited with, e.g. the
+    // visibility of the light it was drawn for.
+    virtual float GetOpacity(const Frame& frame)
+    {
+        return 1.0f;
+    };
+};
+
+class FramePipeline
+{
+public:
+    // \brief constructor.
+    //
+    // \param reader the source of the frames, already opened.
+    // \param writer where the frames go.
+    // \param renderer the flare renderer.
+    // \param depth the capacity of each queue between stages.
+    FramePipeline(FrameReader* reader,
+                  FrameWriter* writer,
+                  FrameRenderer* renderer,
+                  int depth = 4)
+        : m_detectQueue(depth),
+          m_renderQueue(depth),
+          m_encodeQueue(depth),
+          m_freeQueue(3 * depth + 4)
+    {
+        m_pReader = reader;
+        m_pWriter = writer;
+        m_pRenderer = renderer;
+        m_blendMode = BLEND_SCREEN;
+        m_pinThreads = true;
+        m_occlusionRadius = 0.0f;
+
+        // Enough frames to fill the queues and keep every stage busy.
+        int frames = 3 * depth + 4;
+        for (int i = 0; i < frames; ++i)
+        {
+            Frame* pFrame = new Frame;
+            pFrame->index = -1;
+            pFrame->pImage = cvCreateImage(
+                    cvSize(reader->GetWidth(), reader->GetHeight()), IPL_DEPTH_8U, 3);
+            m_frames.push_back(pFrame);
+            m_freeQueue.Push(pFrame);
+        }
+
+        m_numFrames.store(0);
+        m_failed.store(false);
+    };
+
+    ~FramePipeline()
+    {
+        for (size_t i = 0; i < m_frames.size(); ++i)
+        {
+            cvReleaseImage(&m_frames[i]->pImage);
+            delete m_frames[i];
+        }
+    };
+
+    void SetBlendMode(BlendMode mode)
+    {
+        m_blendMode = mode;
+    };
+
+    LightDetector& GetDetector()
+    {
+        return m_detector;
+    };
+
+    // \brief find how much of each light is visible (see
+    // occlusion.h) in the detect stage.
+    //
+    // \param radius the aperture radius in pixels, the size of the
+    //   lights unblocked; 0 (the default) leaves every light in full
+    //   view.
+    void SetOcclusionRadius(float radius)
+    {
+        m_occlusionRadius = MAX(radius, 0.0f);
+    };
+
+    OcclusionMap& GetOcclusionMap()
+    {
+        return m_occlusion;
+    };
+
+    // \brief whether each stage is pinned to its own core.
+    void SetPinThreads(bool pin)
+    {
+        m_pinThreads = pin;
+    };
+
+    // \brief process the whole sequence. Blocks until the last
+    // frame is written.
+    // \return false if a frame failed to be written.
+    bool Run()
+    {
+        std::thread decoder(&FramePipeline::DecodeStage, this);
+        std::thread detector(&FramePipeline::DetectStage, this);
+        std::thread renderer(&FramePipeline::RenderStage, this);
+        std::thread encoder(&FramePipeline::EncodeStage, this);
+
+        if (m_pinThreads)
+        {
+            Pin(decoder, 0);
+            Pin(detector, 1);
+            Pin(renderer, 2);
+            Pin(encoder, 3);
+        }
+
+        decoder.join();
+        detector.join();
+        renderer.join();
+        encoder.join();
+
+        return !m_failed.load();
+    };
+
+    // \brief the number of frames written so far.
+    int GetFrameCount() const
+    {
+        return m_numFrames.load();
+    };
+
+private:
+    // A null frame marks the end of the sequence.
+
+    void DecodeStage()
+    {
+        LF_TRACE_THREAD("decode");
+
+        for (int index = 0; ; ++index)
+        {
+            Frame* pFrame = m_freeQueue.Pop();
+
+            // The unused frame is not returned to the free queue,
+            // whose only producer is the encode stage.
+            bool ok;
+            {
+                LF_TRACE_SCOPE("decode");
+                ok = !m_failed.load() && m_pReader->Read(pFrame->pImage);
+            }
+            if (!ok)
+            {
+                break;
+            }
+
+            pFrame->index = index;
+            m_detectQueue.Push(pFrame);
+        }
+
+        m_detectQueue.Push(0);
+    };
+
+    void DetectStage()
+    {
+        LF_TRACE_THREAD("detect");
+
+        Frame* pFrame;
+        while ((pFrame = m_detectQueue.Pop()) != 0)
+        {
+            m_detector.Detect(pFrame->pImage, pFrame->lights);
+
+            if (m_occlusionRadius > 0 && !pFrame->lights.empty())
+            {
+                m_occlusion.Build(pFrame->pImage);
+                m_occlusion.GetVisibility(pFrame->lights, m_occlusionRadius, pFrame->visibility);
+            }
+            else
+            {
+                pFrame->visibility.assign(pFrame->lights.size(), 1.0f);
+            }
+            m_renderQueue.Push(pFrame);
+        }
+
+        m_renderQueue.Push(0);
+    };
+
+    void RenderStage()
+    {
+        LF_TRACE_THREAD("render");
+
+        Frame* pFrame;
+        while ((pFrame = m_renderQueue.Pop()) != 0)
+        {
+            LF_TRACE_SCOPE("render");
+
+            IplImage* pLayer = m_pRenderer->Render(*pFrame);
+            if (pLayer != 0)
+            {
+                m_compositor.Composite(pLayer, pFrame->pImage, 0, 0, m_blendMode,
+                                       m_pRenderer->GetOpacity(*pFrame));
+            }
+            m_encodeQueue.Push(pFrame);
+        }
+
+        m_encodeQueue.Push(0);
+    };
+
+    void EncodeStage()
+    {
+        LF_TRACE_THREAD("encode");
+
+        Frame* pFrame;
+        while ((pFrame = m_encodeQueue.Pop()) != 0)
+        {
+            if (!m_failed.load())
+            {
+                LF_TRACE_SCOPE("encode");
+
+                if (m_pWriter->Write(pFrame->pImage))
+                {
+                    m_numFrames.fetch_add(1);
+                }
+                else
+                {
+                    fprintf(stderr, "Err: failed to write frame %d.\n", pFrame->index);
+                    m_failed.store(true);
+                }
+            }
+            m_freeQueue.Push(pFrame);
+        }
+    };
+
+    static void Pin(std::thread& thread, int stage)
+    {
+#ifdef __linux__
+        unsigned int cores = std::thread::hardware_concurrency();
+        if (cores < 4)
+        {
+            return;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(stage % cores, &set);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+        (void)thread;
+        (void)stage;
+#endif
+    };
+
+private:
+    FrameReader*   m_pReader;
+    FrameWriter*   m_pWriter;
+    FrameRenderer* m_pRenderer;
+
+    LightDetector m_detector;   // used by the detect stage only.
+    OcclusionMap  m_occlusion;  // used by the detect stage only.
+    float         m_occlusionRadius;
+    Compositor    m_compositor; // used by the render stage only.
+    BlendMode     m_blendMode;
+    bool          m_pinThreads;
+
+    SpscQueue<Frame*> m_detectQueue; // decode -> detect
+    SpscQueue<Frame*> m_renderQueue; // detect -> render
+    SpscQueue<Frame*> m_encodeQueue; // render -> encode
+    SpscQueue<Frame*> m_freeQueue;   // encode -> decode
+
+    std::vector<Frame*> m_frames;
+
+    std::atomic<int>  m_numFrames;
+    std::atomic<bool> m_failed;
+};
+
+#endif // !PIPELINE_H
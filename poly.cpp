@@ -3,7 +3,8 @@
    by Jack Morrison
    from "Graphics Gems", Academic Press, 1990
 
-   user provides screenX(), vLerp(), and renderPixel() routines.
+   user provides screenX(), vLerp(), and renderPixel() routines
+   through PolyCallbacks (see poly.h).
    */
 
 /*
@@ -17,28 +18,16 @@
  * Graphics, January 1985 for a fast incremental interpolator.
  */
 #include <math.h>
-#include "GraphicsGems.h"
+#include "poly.h"
+#include "polyscan.h"
+#include "trace.h"
 
-#define	SUBYRES	8		/* subpixel Y resolution per scanline */
-#define	SUBXRES	16		/* subpixel X resolution per pixel */
-#define	MAX_AREA	(SUBYRES*SUBXRES)
 #define	MODRES(y)	((y) & 7)		/*subpixel Y modulo */
 #define MAX_X	0x7FFF	/* subpixel X beyond right edge */
 
-typedef struct SurfaceStruct {  /* object shading surface info */
-    int	red, green, blue;		   /* color components */
-} Surface;
-/*
- * In  real life, SurfaceStruct will contain many more parameters as
- * required by the shading and rendering programs, such as diffuse
- * and specular factors, texture information, transparency, etc.
- */
-
-typedef struct VertexStruct	{	/* polygon vertex */
-    Vector3	model, world,		/* geometric information */
-                normal, image;
-    int y;					/* subpixel display coordinate */
-} Vertex;
+static void renderScanline(Vertex *Vl, Vertex *Vr, int y, Surface *object,
+                           const PolyCallbacks *cb);
+static int Coverage(int x);
 
 Vertex *Vleft, *VnextLeft;		/* current left edge */
 Vertex *Vright, *VnextRight;	/* current right edge */
@@ -50,26 +39,14 @@ struct	SubPixel  {			/* subpixel extents for scanline */
 int	xLmin, xLmax;		/* subpixel x extremes for scanline */
 int	xRmax, xRmin;		/* (for optimization shortcut) */
 
-/* Compute sub-pixel x coordinate for vertex */
-extern int screenX(/* Vertex *v */);
-
-/* Interpolate vertex information */
-extern void vLerp(/* double alpha, Vertex *Va, *Vb, *Vout */);
-
-/* Render polygon for one pixel, given coverage area */
-/*  and bitmask */
-extern void renderPixel(/* int x, y, Vertex *V,
-                           int area, unsigned mask[], 
-                           Surface *object */);
-
 /*
  * Render shaded polygon
  */
-drawPolygon(polygon, numVertex, object)
-    Vertex	polygon[];		/*clockwise clipped vertex list */
-    int	numVertex;			/*number of vertices in polygon */
-
-    Surface *object;			/* shading parms for this object */
+void drawPolygon(
+    Vertex	polygon[],		/*clockwise clipped vertex list */
+    int	numVertex,			/*number of vertices in polygon */
+    Surface *object,			/* shading parms for this object */
+    const PolyCallbacks *cb)		/* user routines */
 {
     Vertex *endPoly;			/* end of polygon vertex list */
     Vertex VscanLeft, VscanRight;	/* interpolated vertices */ 								/* at scanline */
@@ -79,6 +56,8 @@ drawPolygon(polygon, numVertex, object)
     int  xRight, xNextRight;		/* active polygon edges */
     int i,y;						
 
+    LF_TRACE_SCOPE("rasterize");
+
     /* find vertex with minimum y (display coordinate) */
     Vleft = polygon;
     for  (i=1; i<numVertex; i++)
@@ -104,23 +83,23 @@ drawPolygon(polygon, numVertex, object)
                 VnextLeft = polygon;
             if (VnextLeft == Vright)	/* all y's same?  */
                 return;				/* (null polygon) */ 
-            xLeft = screenX(Vleft);
-            xNextLeft = screenX(VnextLeft);
+            xLeft = cb->screenX(Vleft, cb->user);
+            xNextLeft = cb->screenX(VnextLeft, cb->user);
         }
 
         while (y == VnextRight->y)  { /*reached next right vertex */
             VnextRight = (Vright=VnextRight) -1;
             if (VnextRight < polygon)			/* (wraparound) */
                 VnextRight = endPoly;
-            xRight = screenX(Vright);
-            xNextRight = screenX(VnextRight);
+            xRight = cb->screenX(Vright, cb->user);
+            xNextRight = cb->screenX(VnextRight, cb->user);
         }
 
         if (y>VnextLeft->y || y>VnextRight->y)	{
             /* done, mark uncovered part of last scanline */
             for (; MODRES(y); y++)
                 sp[MODRES(y)].xLeft = sp[MODRES(y)].xRight = -1;
-            renderScanline(Vleft, Vright, y/SUBYRES, object);
+            renderScanline(Vleft, Vright, y/SUBYRES, object, cb);
             return;
         }
 
@@ -147,9 +126,9 @@ drawPolygon(polygon, numVertex, object)
 
         if (MODRES(y) == SUBYRES-1)	{	/* end of scanline */
             /* interpolate edges to this scanline */
-            vLerp(aLeft, Vleft, VnextLeft, &VscanLeft);
-            vLerp(aRight, Vright, VnextRight, &VscanRight);
-            renderScanline(&VscanLeft, &VscanRight, y/SUBYRES, object);
+            cb->vLerp(aLeft, Vleft, VnextLeft, &VscanLeft, cb->user);
+            cb->vLerp(aRight, Vright, VnextRight, &VscanRight, cb->user);
+            renderScanline(&VscanLeft, &VscanRight, y/SUBYRES, object, cb);
             xLmin = xRmin = MAX_X; 		/* reset extremes */
             xLmax = xRmax = -1;
         }
@@ -160,29 +139,30 @@ drawPolygon(polygon, numVertex, object)
  * Render one scanline of polygon
  */
 
-renderScanline(Vl, Vr, y, object)
-    Vertex *Vl, *Vr; 	/* polygon vertices interpolated */
+static void renderScanline(
+    Vertex *Vl, Vertex *Vr, 	/* polygon vertices interpolated */
     /* at scanline */   
-    int y;			/* scanline coordinate */
-    Surface *object;	/* shading parms for this object */
+    int y,			/* scanline coordinate */
+    Surface *object,	/* shading parms for this object */
+    const PolyCallbacks *cb)
 {
     Vertex Vpixel;	/*object info interpolated at one pixel */
     unsigned mask[SUBYRES];	/*pixel coverage bitmask */
     int x;			/* leftmost subpixel of current pixel */
 
     for (x=SUBXRES*floor((double)(xLmin/SUBXRES)); x<=xRmax; x+=SUBXRES) {
-        vLerp((double)(x-xLmin)/(xRmax-xLmin), Vl, Vr, &Vpixel);
+        cb->vLerp((double)(x-xLmin)/(xRmax-xLmin), Vl, Vr, &Vpixel, cb->user);
         computePixelMask(x, mask);
-        renderPixel(x/SUBXRES, y, &Vpixel,
-                /*computePixel*/Coverage(x), mask, object);
+        cb->renderPixel(x/SUBXRES, y, &Vpixel,
+                /*computePixel*/Coverage(x), mask, object, cb->user);
     }
 }
 
 /*
  * Compute number of subpixels covered by polygon at current pixel
  */
-/*computePixel*/Coverage(x)
-    int x;			/* left subpixel of pixel */
+static int /*computePixel*/Coverage(
+    int x)			/* left subpixel of pixel */
 {
     int  area;			/* total covered area */
     int partialArea;	  /* covered area for current subpixel y */
@@ -206,9 +186,9 @@ renderScanline(Vl, Vr, y, object)
  * polygon at current pixel. (Not all hidden-surface methods
  * need this mask. )
  */
-computePixelMask(x, mask)
-    int x;			/* left subpixel of pixel */
-    unsigned mask[];	/* output bitmask */
+void computePixelMask(
+    int x,			/* left subpixel of pixel */
+    unsigned mask[])	/* output bitmask */
 {
     static unsigned leftMaskTable[] =
     { 0xFFFF, 0x7FFF, 0x3FFF, 0x1FFF, 0x0FFF, 0x07FF, 0x03FF,
@@ -247,3 +227,87 @@ computePixelMask(x, mask)
     }
 }
 
+/*
+ * The same scan converter on a grid picked at run time; see
+ * polyscan.h.
+ */
+
+static const int gridRows[POLY_GRID_COUNT]    = { 4, 8, 16, 16 };
+static const int gridColumns[POLY_GRID_COUNT] = { 4, 16, 32, 64 };
+
+int polyGridRows(PolyGrid grid)
+{
+    return gridRows[grid];
+}
+
+int polyGridColumns(PolyGrid grid)
+{
+    return gridColumns[grid];
+}
+
+PolyGrid polyFindGrid(int columns, int rows)
+{
+    for (int g = 0; g < POLY_GRID_16X64; g++)
+        if (gridColumns[g] >= columns && gridRows[g] >= rows)
+            return (PolyGrid)g;
+    return POLY_GRID_16X32;
+}
+
+void drawPolygonGrid(
+    PolyGrid grid,
+    Vertex polygon[],
+    int numVertex,
+    Surface *object,
+    const PolyCallbacks *cb)
+{
+    switch (grid) {
+        case POLY_GRID_4X4: {
+            PolyScanner<4, 4> scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+        case POLY_GRID_16X32: {
+            PolyScanner<16, 32> scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+        case POLY_GRID_16X64:
+            break;
+        default: {
+            PolyScanner<SUBYRES, SUBXRES> scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+    }
+}
+
+void drawPolygonGrid(
+    PolyGrid grid,
+    Vertex polygon[],
+    int numVertex,
+    Surface *object,
+    const PolyCallbacks64 *cb)
+{
+    switch (grid) {
+        case POLY_GRID_4X4: {
+            PolyScanner<4, 4, PolyMaskWord<4, false> > scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+        case POLY_GRID_16X32: {
+            PolyScanner<16, 32, PolyMaskWord<32, false> > scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+        case POLY_GRID_16X64: {
+            PolyScanner<16, 64> scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+        default: {
+            PolyScanner<SUBYRES, SUBXRES, PolyMaskWord<SUBXRES, false> > scanner;
+            scanner.Draw(polygon, numVertex, object, cb);
+            break;
+        }
+    }
+}
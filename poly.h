@@ -0,0 +1,127 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   poly.h
+ *
+ * Abstract:
+ *
+ *   The interface of the anti-aliased polygon scan converter
+ *   in poly.cpp (Jack Morrison, Graphics Gems), at SUBYRES x
+ *   SUBXRES subpixels or on a grid picked at run time.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef POLY_H
+#define POLY_H
+
+#include <stdint.h>
+
+#include "GraphicsGems.h"
+
+#define	SUBYRES	8		/* subpixel Y resolution per scanline */
+#define	SUBXRES	16		/* subpixel X resolution per pixel */
+#define	MAX_AREA	(SUBYRES*SUBXRES)
+
+typedef struct SurfaceStruct {  /* object shading surface info */
+    int	red, green, blue;		   /* color components */
+} Surface;
+/*
+ * In  real life, SurfaceStruct will contain many more parameters as
+ * required by the shading and rendering programs, such as diffuse
+ * and specular factors, texture information, transparency, etc.
+ */
+
+typedef struct VertexStruct	{	/* polygon vertex */
+    Vector3	model, world,		/* geometric information */
+                normal, image;
+    int y;					/* subpixel display coordinate */
+} Vertex;
+
+// \brief the routines the user of the scan converter provides.
+typedef struct PolyCallbacksStruct {
+    /* Compute sub-pixel x coordinate for vertex */
+    int  (*screenX)(Vertex *v, void *user);
+
+    /* Interpolate vertex information */
+    void (*vLerp)(double alpha, Vertex *Va, Vertex *Vb, Vertex *Vout, void *user);
+
+    /* Render polygon for one pixel, given coverage area */
+    /*  and bitmask */
+    void (*renderPixel)(int x, int y, Vertex *V,
+                        int area, unsigned mask[],
+                        Surface *object, void *user);
+
+    void *user;     /* passed back to every routine */
+} PolyCallbacks;
+
+// \brief the routines of the scan converter for grids wider than
+// 32 subpixels, whose mask rows are 64-bit; see PolyCallbacks.
+typedef struct PolyCallbacks64Struct {
+    int  (*screenX)(Vertex *v, void *user);
+    void (*vLerp)(double alpha, Vertex *Va, Vertex *Vb, Vertex *Vout, void *user);
+    void (*renderPixel)(int x, int y, Vertex *V,
+                        int area, uint64_t mask[],
+                        Surface *object, void *user);
+    void *user;
+} PolyCallbacks64;
+
+// \brief render a polygon.
+//
+// \param polygon the clockwise clipped vertex list; y is in
+//   subpixel units (SUBYRES per scanline).
+// \param numVertex the number of vertices.
+// \param object the shading parameters, passed to renderPixel.
+// \param cb the user routines.
+void drawPolygon(Vertex polygon[], int numVertex, Surface *object,
+                 const PolyCallbacks *cb);
+
+// \brief compute the subpixel coverage bitmask of a pixel of the
+// current scanline.
+void computePixelMask(int x, unsigned mask[]);
+
+// The subpixel grids of drawPolygonGrid, rows x columns per pixel.
+enum PolyGrid
+{
+    POLY_GRID_4X4   = 0, // previews
+    POLY_GRID_8X16  = 1, // SUBYRES x SUBXRES, as drawPolygon
+    POLY_GRID_16X32 = 2, // finals
+    POLY_GRID_16X64 = 3, // 64-bit mask rows, PolyCallbacks64 only
+    POLY_GRID_COUNT
+};
+
+// \brief the subpixel rows of a pixel of a grid.
+int polyGridRows(PolyGrid grid);
+
+// \brief the subpixel columns of a pixel of a grid.
+int polyGridColumns(PolyGrid grid);
+
+// \brief the coarsest grid of 32-bit mask rows with at least the
+// given subpixels, the finest of them if there is none.
+PolyGrid polyFindGrid(int columns, int rows);
+
+// \brief render a polygon like drawPolygon on one of the grids (see
+// polyscan.h).
+//
+// \param grid the subpixel grid.
+// \param polygon the clockwise clipped vertex list; y is in rows of
+//   the grid and screenX returns columns of the grid. The area
+//   passed to renderPixel goes up to rows x columns and the mask
+//   has a word of columns bits per row. POLY_GRID_16X64 draws
+//   nothing here; it needs the 64-bit callbacks.
+void drawPolygonGrid(PolyGrid grid, Vertex polygon[], int numVertex,
+                     Surface *object, const PolyCallbacks *cb);
+
+// \brief render a polygon on one of the grids with 64-bit mask rows,
+// which take every grid; the masks are the same as above.
+void drawPolygonGrid(PolyGrid grid, Vertex polygon[], int numVertex,
+                     Surface *object, const PolyCallbacks64 *cb);
+
+#endif // !POLY_H
@@ -0,0 +1,344 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   polyscan.h
+ *
+ * Abstract:
+ *
+ *   The scan converter of poly.cpp with the subpixel grid as a
+ *   template parameter, so that previews can sample 4x4 and finals
+ *   16x32 with the same code; drawPolygonGrid() in poly.cpp picks
+ *   one at run time.
+ *
+ *   The left and right mask tables are generated at compile time
+ *   for the grid width. A mask row is one 32-bit word up to 32
+ *   subpixels across and one 64-bit word up to 64 (the callbacks
+ *   then take PolyCallbacks64, which every grid can also use). The
+ *   scan state is a member rather than global, so scanners on
+ *   different threads don't share it.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef POLY_SCAN_H
+#define POLY_SCAN_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "poly.h"
+#include "trace.h"
+
+// \brief the word of a mask row of SubX subpixels; Narrow = false
+// takes 64-bit words for any SubX.
+template <int SubX, bool Narrow = (SubX <= 32)>
+struct PolyMaskWord
+{
+    typedef unsigned Type;
+    typedef PolyCallbacks Callbacks;
+};
+
+template <int SubX>
+struct PolyMaskWord<SubX, false>
+{
+    typedef uint64_t Type;
+    typedef PolyCallbacks64 Callbacks;
+};
+
+// \brief the mask of a full row of SubX subpixels, the leftmost the
+// most significant.
+template <class Word, int SubX>
+constexpr Word polyFullMask()
+{
+    return (Word)(~(Word)0 >> (8 * sizeof(Word) - SubX));
+}
+
+// \brief the subpixels from k to the right edge.
+template <class Word, int SubX>
+constexpr Word polyLeftMask(int k)
+{
+    return (Word)(polyFullMask<Word, SubX>() >> k);
+}
+
+// \brief the subpixels from the left edge to k.
+template <class Word, int SubX>
+constexpr Word polyRightMask(int k)
+{
+    return (Word)(polyFullMask<Word, SubX>() & ~((polyFullMask<Word, SubX>() >> k) >> 1));
+}
+
+template <int... K>
+struct PolyIndices
+{
+};
+
+template <int N, int... K>
+struct PolyMakeIndices : PolyMakeIndices<N - 1, N - 1, K...>
+{
+};
+
+template <int... K>
+struct PolyMakeIndices<0, K...>
+{
+    typedef PolyIndices<K...> Type;
+};
+
+// \brief the masks of a row whose left or right edge is at the
+// subpixel k of the pixel.
+template <class Word, int SubX, class Indices = typename PolyMakeIndices<SubX>::Type>
+struct PolyMaskTables;
+
+template <class Word, int SubX, int... K>
+struct PolyMaskTables<Word, SubX, PolyIndices<K...> >
+{
+    static constexpr Word left[SubX] = { polyLeftMask<Word, SubX>(K)... };
+    static constexpr Word right[SubX] = { polyRightMask<Word, SubX>(K)... };
+};
+
+template <class Word, int SubX, int... K>
+constexpr Word PolyMaskTables<Word, SubX, PolyIndices<K...> >::left[SubX];
+
+template <class Word, int SubX, int... K>
+constexpr Word PolyMaskTables<Word, SubX, PolyIndices<K...> >::right[SubX];
+
+// The tables of poly.cpp.
+static_assert(PolyMaskTables<unsigned, 16>::left[1] == 0x7FFF &&
+              PolyMaskTables<unsigned, 16>::right[4] == 0xF800 &&
+              PolyMaskTables<unsigned, 16>::right[15] == 0xFFFF, "bad mask tables");
+
+// \brief the anti-aliased scan converter of poly.cpp on a grid of
+// SubY subpixel rows of SubX subpixels per pixel, with the mask rows
+// in the words of Mask.
+template <int SubY, int SubX, class Mask = PolyMaskWord<SubX> >
+class PolyScanner
+{
+public:
+    typedef typename Mask::Type      Word;
+    typedef typename Mask::Callbacks Callbacks;
+
+    static_assert(SubY > 0 && (SubY & (SubY - 1)) == 0, "SubY must be a power of two");
+    static_assert(SubX > 0 && SubX <= 8 * (int)sizeof(Word), "SubX must fit the mask word");
+
+    // The area of a fully covered pixel.
+    enum { MAX_COVERAGE = SubY * SubX };
+
+    // \brief render a polygon, like drawPolygon.
+    //
+    // \param polygon the clockwise clipped vertex list; y is in
+    //   subpixel units (SubY per scanline) and screenX returns SubX
+    //   per pixel.
+    void Draw(Vertex polygon[], int numVertex, Surface* object, const Callbacks* cb)
+    {
+        Vertex* endPoly;
+        Vertex VscanLeft, VscanRight;
+        double aLeft, aRight;
+        int xLeft = 0, xNextLeft = 0;
+        int xRight = 0, xNextRight = 0;
+
+        LF_TRACE_SCOPE("rasterize");
+
+        // The vertex with the minimum y.
+        Vertex* Vleft = polygon;
+        for (int i = 1; i < numVertex; i++)
+        {
+            if (polygon[i].y < Vleft->y)
+            {
+                Vleft = &polygon[i];
+            }
+        }
+        endPoly = &polygon[numVertex - 1];
+
+        Vertex* Vright = Vleft;
+        Vertex* VnextLeft = Vleft;
+        Vertex* VnextRight = Vleft;
+
+        // The bottom of the first scanline is not covered.
+        for (int i = 0; i < SubY; i++)
+        {
+            m_sp[i].xLeft = m_sp[i].xRight = -1;
+        }
+        ResetExtremes();
+
+        for (int y = Vleft->y; ; y++)
+        {
+            while (y == VnextLeft->y)
+            {
+                VnextLeft = (Vleft = VnextLeft) + 1;
+                if (VnextLeft > endPoly)
+                {
+                    VnextLeft = polygon;
+                }
+                if (VnextLeft == Vright)
+                {
+                    // All y's are the same.
+                    return;
+                }
+                xLeft = cb->screenX(Vleft, cb->user);
+                xNextLeft = cb->screenX(VnextLeft, cb->user);
+            }
+
+            while (y == VnextRight->y)
+            {
+                VnextRight = (Vright = VnextRight) - 1;
+                if (VnextRight < polygon)
+                {
+                    VnextRight = endPoly;
+                }
+                xRight = cb->screenX(Vright, cb->user);
+                xNextRight = cb->screenX(VnextRight, cb->user);
+            }
+
+            if (y > VnextLeft->y || y > VnextRight->y)
+            {
+                // Done; the rest of the last scanline is not covered.
+                for (; (y & (SubY - 1)) != 0; y++)
+                {
+                    m_sp[y & (SubY - 1)].xLeft = m_sp[y & (SubY - 1)].xRight = -1;
+                }
+                RenderScanline(Vleft, Vright, y / SubY, object, cb);
+                return;
+            }
+
+            // The subpixel ends at this y and their extremes over the
+            // scanline.
+            SubPixel* sp = &m_sp[y & (SubY - 1)];
+            aLeft = (double)(y - Vleft->y) / (VnextLeft->y - Vleft->y);
+            sp->xLeft = LERP(aLeft, xLeft, xNextLeft);
+            m_xLmin = MIN(m_xLmin, sp->xLeft);
+            m_xLmax = MAX(m_xLmax, sp->xLeft);
+
+            aRight = (double)(y - Vright->y) / (VnextRight->y - Vright->y);
+            sp->xRight = LERP(aRight, xRight, xNextRight);
+            m_xRmin = MIN(m_xRmin, sp->xRight);
+            m_xRmax = MAX(m_xRmax, sp->xRight);
+
+            if ((y & (SubY - 1)) == SubY - 1)
+            {
+                cb->vLerp(aLeft, Vleft, VnextLeft, &VscanLeft, cb->user);
+                cb->vLerp(aRight, Vright, VnextRight, &VscanRight, cb->user);
+                RenderScanline(&VscanLeft, &VscanRight, y / SubY, object, cb);
+                ResetExtremes();
+            }
+        }
+    };
+
+    // \brief the subpixels of the current scanline covered in the
+    // pixel starting at the subpixel x.
+    int Coverage(int x) const
+    {
+        int xr = x + SubX - 1;
+
+        // The common case of a fully covered pixel.
+        if (x > m_xLmax && x < m_xRmin)
+        {
+            return MAX_COVERAGE;
+        }
+
+        int area = 0;
+        for (int y = 0; y < SubY; y++)
+        {
+            int partialArea = MIN(m_sp[y].xRight, xr) - MAX(m_sp[y].xLeft, x) + 1;
+            if (partialArea > 0)
+            {
+                area += partialArea;
+            }
+        }
+        return area;
+    };
+
+    // \brief the covered subpixels of the pixel starting at the
+    // subpixel x, a row of SubX bits per subpixel row.
+    void ComputePixelMask(int x, Word mask[]) const
+    {
+        typedef PolyMaskTables<Word, SubX> Tables;
+        const Word full = polyFullMask<Word, SubX>();
+        int xr = x + SubX - 1;
+
+        if (x > m_xLmax && x < m_xRmin)
+        {
+            for (int y = 0; y < SubY; y++)
+            {
+                mask[y] = full;
+            }
+            return;
+        }
+
+        for (int y = 0; y < SubY; y++)
+        {
+            Word leftMask, rightMask;
+
+            if (m_sp[y].xLeft < x)
+            {
+                leftMask = full;
+            }
+            else if (m_sp[y].xLeft > xr)
+            {
+                leftMask = 0;
+            }
+            else
+            {
+                leftMask = Tables::left[m_sp[y].xLeft - x];
+            }
+
+            if (m_sp[y].xRight > xr)
+            {
+                rightMask = full;
+            }
+            else if (m_sp[y].xRight < x)
+            {
+                rightMask = 0;
+            }
+            else
+            {
+                rightMask = Tables::right[m_sp[y].xRight - x];
+            }
+
+            mask[y] = leftMask & rightMask;
+        }
+    };
+
+private:
+    // The subpixel x beyond the right edge.
+    enum { MAX_X = 0x7FFFFFFF };
+
+    struct SubPixel
+    {
+        int xLeft;
+        int xRight;
+    };
+
+    void ResetExtremes()
+    {
+        m_xLmin = m_xRmin = MAX_X;
+        m_xLmax = m_xRmax = -1;
+    };
+
+    void RenderScanline(Vertex* Vl, Vertex* Vr, int y, Surface* object, const Callbacks* cb)
+    {
+        Vertex Vpixel;
+        Word mask[SubY];
+
+        for (int x = SubX * (int)floor((double)(m_xLmin / SubX)); x <= m_xRmax; x += SubX)
+        {
+            cb->vLerp((double)(x - m_xLmin) / (m_xRmax - m_xLmin), Vl, Vr, &Vpixel, cb->user);
+            ComputePixelMask(x, mask);
+            cb->renderPixel(x / SubX, y, &Vpixel, Coverage(x), mask, object, cb->user);
+        }
+    };
+
+private:
+    SubPixel m_sp[SubY];  // the subpixel ends of the scanline.
+    int      m_xLmin;     // their extremes, for the fully covered
+    int      m_xLmax;     // shortcut.
+    int      m_xRmin;
+    int      m_xRmax;
+};
+
+#endif // !POLY_SCAN_H
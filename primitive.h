@@ -0,0 +1,259 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   primitive.h
+ *
+ * Abstract:
+ *
+ *   Radial primitives (the disks of flare.hpp) drawn by one
+ *   template loop.
+ *
+ *   A primitive is a profile: the coverage at a distance from its
+ *   center. The loop is specialized at compile time on the profile,
+ *   the number of channels, the pixel type and the blend mode, so
+ *   every combination becomes a single inlined loop over the rows
+ *   of the primitive with no per-pixel test of the mode. A new
+ *   primitive only needs a profile struct with Reach() and Shade().
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include "common.h"
+
+//
+// Profiles. Shade() gives the coverage at the distance d from the
+// center and returns false where the primitive doesn't reach, so the
+// pixel is left alone.
+//
+
+// \brief the thin ring of Flare, anti-aliased on both edges.
+struct RingProfile
+{
+    float inner;
+    float outer;
+
+    RingProfile(float radius, float thickness)
+    {
+        inner = radius - thickness * 0.5f;
+        outer = radius + thickness * 0.5f;
+    };
+
+    // \brief the ring between two radii.
+    static RingProfile FromEdges(float in, float out)
+    {
+        RingProfile ring(0, 0);
+        ring.inner = in;
+        ring.outer = out;
+        return ring;
+    };
+
+    float Reach() const
+    {
+        return outer;
+    };
+
+    bool Shade(float d, float& s) const
+    {
+        float d1 = d - inner;
+        float d2 = d - outer;
+        if (d1 < 0 || d2 > 0)
+        {
+            return false;
+        }
+        s = d1 < 1.0f ? d1 : (d2 > -1.0f ? -d2 : 1.0f);
+        return true;
+    };
+};
+
+// \brief the solid disk of FlareSolid, anti-aliased on the edge.
+struct DiskProfile
+{
+    float radius;
+
+    DiskProfile(float r)
+    {
+        radius = r;
+    };
+
+    float Reach() const
+    {
+        return radius;
+    };
+
+    bool Shade(float d, float& s) const
+    {
+        float o = d - radius;
+        if (o > 0)
+        {
+            return false;
+        }
+        s = o > -1.0f ? -o : 1.0f;
+        return true;
+    };
+};
+
+// \brief the disk of FlareGradient, (1 - d / radius)^gamma.
+struct GradientProfile
+{
+    float radius;
+    float gamma;
+
+    GradientProfile(float r, float g)
+    {
+        radius = r;
+        gamma = g;
+    };
+
+    float Reach() const
+    {
+        return radius;
+    };
+
+    bool Shade(float d, float& s) const
+    {
+        if (d - radius > 0)
+        {
+            return false;
+        }
+        s = pow(1.0f - d / radius, gamma);
+        return true;
+    };
+};
+
+//
+// Blend modes of a value v (the color times the coverage) into a
+// pixel. The 8-bit pixels are rounded and saturated.
+//
+
+static inline
+unsigned char primitiveSaturate(float v)
+{
+    return (unsigned char)(v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (int)(v + 0.5f)));
+}
+
+struct BlendOverwrite
+{
+    static void Apply(float& p, float v)         { p = v; };
+    static void Apply(unsigned char& p, float v) { p = primitiveSaturate(v); };
+};
+
+struct BlendAdditive
+{
+    static void Apply(float& p, float v)         { p += v; };
+    static void Apply(unsigned char& p, float v) { p = primitiveSaturate((float)p + v); };
+};
+
+struct BlendMax
+{
+    static void Apply(float& p, float v)         { p = MAX(p, v); };
+    static void Apply(unsigned char& p, float v) { p = MAX(p, primitiveSaturate(v)); };
+};
+
+// \brief a window of pixels to draw into. It may be part of a larger
+// canvas: x and y are the canvas coordinates of its first pixel.
+template <class PixelT>
+struct PrimitiveCanvas
+{
+    PixelT* data;
+    int     stride; // pixels of PixelT between rows.
+    int     x;
+    int     y;
+    int     width;
+    int     height;
+
+    PrimitiveCanvas(PixelT* d, int s, int w, int h, int x0 = 0, int y0 = 0)
+    {
+        data = d;
+        stride = s;
+        width = w;
+        height = h;
+        x = x0;
+        y = y0;
+    };
+};
+
+// \brief draw a primitive centered at (cx, cy) in canvas coordinates.
+//
+// \param profile the shape.
+// \param color Channels values, the color at full coverage; color[0]
+//    goes to the first channel, like GetPixel.
+// \param canvas the pixels, Channels interleaved per pixel.
+template <class Profile, int Channels, class PixelT, class Blend>
+static inline
+void drawPrimitive(const Profile& profile, float cx, float cy, const float color[],
+                   const PrimitiveCanvas<PixelT>& canvas)
+{
+    float reach = profile.Reach();
+
+    int y0 = MAX(canvas.y, (int)floor(cy - reach));
+    int y1 = MIN(canvas.y + canvas.height - 1, (int)ceil(cy + reach));
+
+    float rgb[Channels];
+    for (int c = 0; c < Channels; ++c)
+    {
+        rgb[c] = color[c];
+    }
+
+    for (int i = y0; i <= y1; ++i)
+    {
+        float dy = (float)i - cy;
+
+        // Only the pixels within the reach of this row.
+        float extent = reach * reach - dy * dy;
+        if (extent < 0)
+        {
+            continue;
+        }
+        extent = sqrt(extent) + 1.0f;
+        int j0 = MAX(canvas.x, (int)floor(cx - extent));
+        int j1 = MIN(canvas.x + canvas.width - 1, (int)ceil(cx + extent));
+
+        PixelT* p = canvas.data + (i - canvas.y) * canvas.stride + (j0 - canvas.x) * Channels;
+        for (int j = j0; j <= j1; ++j, p += Channels)
+        {
+            float dx = (float)j - cx;
+            float s;
+            if (!profile.Shade(sqrt(dx * dx + dy * dy), s))
+            {
+                continue;
+            }
+
+            for (int c = 0; c < Channels; ++c)
+            {
+                Blend::Apply(p[c], rgb[c] * s);
+            }
+        }
+    }
+}
+
+// \brief drawPrimitive into a whole image of Channels channels and
+// the depth of PixelT.
+//
+// \return false if the image doesn't match.
+template <class Profile, int Channels, class PixelT, class Blend>
+static inline
+bool drawPrimitive(const Profile& profile, float cx, float cy, const float color[], IplImage* image)
+{
+    int depth = sizeof(PixelT) == 1 ? IPL_DEPTH_8U : IPL_DEPTH_32F;
+    if (image->depth != depth || image->nChannels != Channels)
+    {
+        return false;
+    }
+
+    PrimitiveCanvas<PixelT> canvas((PixelT*)image->imageData, image->widthStep / sizeof(PixelT),
+                                   image->width, image->height);
+    drawPrimitive<Profile, Channels, PixelT, Blend>(profile, cx, cy, color, canvas);
+    return true;
+}
+
+#endif // !PRIMITIVE_H
@@ -0,0 +1,158 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   queue.h
+ *
+ * Abstract:
+ *
+ *   Bounded lock-free single-producer single-consumer queue,
+ *   used to connect the stages of the frame pipeline.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+
+#define LF_CACHE_LINE 64
+
+// \brief wait politely: spin first, then yield, then sleep.
+class Backoff
+{
+public:
+    Backoff()
+    {
+        m_count = 0;
+    };
+
+    void Wait()
+    {
+        if (m_count < 64)
+        {
+            // busy spin.
+        }
+        else if (m_count < 1024)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        ++m_count;
+    };
+
+    void Reset()
+    {
+        m_count = 0;
+    };
+
+private:
+    int m_count;
+};
+
+template <class T>
+class SpscQueue
+{
+public:
+    // \brief constructor.
+    //
+    // \param capacity the number of items the queue holds; it is
+    // rounded up to a power of two.
+    explicit SpscQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        m_items.resize(size);
+        m_mask = size - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    };
+
+    // \brief called by the producer only.
+    // \return false if the queue is full.
+    bool TryPush(const T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+        {
+            return false;
+        }
+
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    };
+
+    // \brief called by the consumer only.
+    // \return false if the queue is empty.
+    bool TryPop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    };
+
+    // \brief block until there is room.
+    void Push(const T& item)
+    {
+        Backoff backoff;
+        while (!TryPush(item))
+        {
+            backoff.Wait();
+        }
+    };
+
+    // \brief block until there is an item.
+    T Pop()
+    {
+        T item;
+        Backoff backoff;
+        while (!TryPop(item))
+        {
+            backoff.Wait();
+        }
+        return item;
+    };
+
+    size_t Capacity() const
+    {
+        return m_mask + 1;
+    };
+
+private:
+    SpscQueue(const SpscQueue&);
+    SpscQueue& operator=(const SpscQueue&);
+
+    std::vector<T> m_items;
+    size_t         m_mask;
+
+    // The consumer and producer indices live on their own cache
+    // lines so the two threads don't false-share.
+    alignas(LF_CACHE_LINE) std::atomic<size_t> m_head;
+    alignas(LF_CACHE_LINE) std::atomic<size_t> m_tail;
+};
+
+#endif // !QUEUE_H
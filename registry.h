@@ -0,0 +1,252 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   registry.h
+ *
+ * Abstract:
+ *
+ *   Effects built on first use.
+ *
+ *   A LazyEffect holds a factory instead of an effect; the effect is
+ *   constructed, initialized and drawn the first time it is asked
+ *   for, so start-up only pays for the effect on screen. The
+ *   registry maps the effect ids to them and builds the ones likely
+ *   to be picked next on a background thread. The effects share
+ *   state (rand(), the scan converter of poly.cpp), so a background
+ *   build holds the draw mutex, which the drawing thread holds too.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "trace.h"
+
+class LazyEffectBase
+{
+public:
+    virtual ~LazyEffectBase()
+    {
+    };
+
+    // \brief build the effect unless it is built.
+    // \return false if the factory failed.
+    virtual bool Build() = 0;
+
+    virtual bool IsBuilt() const = 0;
+};
+
+template <class T>
+class LazyEffect : public LazyEffectBase
+{
+public:
+    // \brief construct, initialize and draw the effect; 0 on failure.
+    typedef std::function<T* ()> Factory;
+
+    LazyEffect()
+    {
+        m_pEffect.store(0);
+        m_failed = false;
+    };
+
+    ~LazyEffect()
+    {
+        delete m_pEffect.load();
+    };
+
+    void SetFactory(Factory factory)
+    {
+        m_factory = factory;
+    };
+
+    // \brief the effect, built on the first call. If another thread
+    // is building it, wait for it.
+    // \return 0 if the factory failed.
+    T* Get()
+    {
+        T* pEffect = m_pEffect.load(std::memory_order_acquire);
+        if (pEffect != 0)
+        {
+            return pEffect;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pEffect = m_pEffect.load(std::memory_order_relaxed);
+        if (pEffect == 0 && !m_failed && m_factory)
+        {
+            pEffect = m_factory();
+            m_failed = pEffect == 0;
+            m_pEffect.store(pEffect, std::memory_order_release);
+        }
+
+        return pEffect;
+    };
+
+    T* operator->()
+    {
+        return Get();
+    };
+
+    virtual bool Build()
+    {
+        return Get() != 0;
+    };
+
+    virtual bool IsBuilt() const
+    {
+        return m_pEffect.load(std::memory_order_acquire) != 0;
+    };
+
+private:
+    Factory         m_factory;
+    std::atomic<T*> m_pEffect;
+    bool            m_failed;
+    std::mutex      m_mutex; // held while building.
+};
+
+class EffectRegistry
+{
+public:
+    EffectRegistry()
+    {
+        m_quit = false;
+    };
+
+    ~EffectRegistry()
+    {
+        Stop();
+    };
+
+    // \brief register an effect. Not thread-safe; add them all before
+    // the first Prewarm.
+    void Add(int id, LazyEffectBase* pEffect)
+    {
+        m_effects[id] = pEffect;
+    };
+
+    // \return the effect of the id or 0.
+    LazyEffectBase* Find(int id) const
+    {
+        std::map<int, LazyEffectBase*>::const_iterator it = m_effects.find(id);
+        return it != m_effects.end() ? it->second : 0;
+    };
+
+    // \brief build an effect on the background thread.
+    void Prewarm(int id)
+    {
+        LazyEffectBase* pEffect = Find(id);
+        if (pEffect == 0 || pEffect->IsBuilt())
+        {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_quit)
+            {
+                return;
+            }
+            if (!m_thread.joinable())
+            {
+                m_thread = std::thread(&EffectRegistry::WorkerMain, this);
+            }
+            m_pending.push_back(pEffect);
+        }
+        m_wake.notify_one();
+    };
+
+    // \brief prewarm the registered effects before and after the id,
+    // the ones a step of the effect slider reaches.
+    void PrewarmAround(int id)
+    {
+        std::map<int, LazyEffectBase*>::const_iterator next = m_effects.upper_bound(id);
+        std::map<int, LazyEffectBase*>::const_iterator prev = m_effects.lower_bound(id);
+
+        if (next != m_effects.end())
+        {
+            Prewarm(next->first);
+        }
+        if (prev != m_effects.begin())
+        {
+            --prev;
+            Prewarm(prev->first);
+        }
+    };
+
+    // \brief the mutex held while an effect is built in the
+    // background. Hold it while drawing or changing an effect.
+    std::recursive_mutex& GetDrawMutex()
+    {
+        return m_drawMutex;
+    };
+
+    // \brief drop the pending builds and wait for the one running.
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+            m_pending.clear();
+        }
+        m_wake.notify_one();
+
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    };
+
+private:
+    void WorkerMain()
+    {
+        LF_TRACE_THREAD("prewarm");
+
+        for (;;)
+        {
+            LazyEffectBase* pEffect;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_quit || !m_pending.empty(); });
+                if (m_quit)
+                {
+                    return;
+                }
+                pEffect = m_pending.front();
+                m_pending.pop_front();
+            }
+
+            std::lock_guard<std::recursive_mutex> draw(m_drawMutex);
+            LF_TRACE_SCOPE("prewarm");
+            pEffect->Build();
+        }
+    };
+
+private:
+    std::map<int, LazyEffectBase*> m_effects;
+
+    std::mutex                     m_mutex;
+    std::condition_variable        m_wake;
+    std::deque<LazyEffectBase*>    m_pending;
+    std::thread                    m_thread;
+    bool                           m_quit;
+
+    std::recursive_mutex           m_drawMutex;
+};
+
+#endif // !REGISTRY_H
@@ -0,0 +1,870 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   renderservice.h
+ *
+ * Abstract:
+ *
+ *   A local render service, so several processes share one warm
+ *   renderer instead of each building the effects.
+ *
+ *   The service listens on a Unix domain socket. A client sends a
+ *   request (the effect, its parameters, the size and the pixel
+ *   format) and names a shared memory object it created; the frame
+ *   is written straight into it and only a short reply goes back on
+ *   the socket. The requests that arrive together are batched: the
+ *   ones with the same geometry (effect, parameters and size) are
+ *   drawn once in white and each is only colored and converted, all
+ *   of them in one dispatch to the thread pool. An effect that isn't
+ *   linear in its color (one with a second color of its own) is
+ *   drawn in the color of the request, so its requests are grouped
+ *   by the color and brightness as well.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+#ifndef _WIN32
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "buffer.h"
+#include "sweep.h"
+#include "threadpool.h"
+#include "trace.h"
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#define SERVICE_MAGIC 0x5253464C // "LFSR"
+
+// The rows colored per task.
+#define SERVICE_BAND  32
+
+enum ServiceStatus
+{
+    SERVICE_OK            = 0,
+    SERVICE_BAD_REQUEST   = 1, // malformed, an unknown pixel format or a
+                               // color that is not finite.
+    SERVICE_BAD_SIZE      = 2, // not the size the service renders.
+    SERVICE_BAD_MEMORY    = 3, // the shared memory is missing or too small.
+    SERVICE_RENDER_FAILED = 4,
+};
+
+// \brief a frame asked of the service. The requests with the same
+// geometry fields are drawn once and only colored apart.
+struct ServiceRequest
+{
+    uint32_t magic;
+    int32_t  effectId;   // geometry.
+    int32_t  number;     // Count
+    int32_t  length;     // Scale
+    int32_t  angle;      // Angle
+    int32_t  width;
+    int32_t  height;
+    float    color[3];   // BGR in [0, 255].
+    float    brightness;
+    int32_t  format;     // LFPixelFormat
+    int32_t  order;      // LFChannelOrder
+    char     shm[64];    // the shared memory object of the client.
+};
+
+struct ServiceReply
+{
+    uint32_t magic;
+    int32_t  status;     // ServiceStatus
+    int32_t  stride;     // bytes between the rows of the frame.
+    int32_t  batch;      // the requests drawn with the same geometry.
+};
+
+// \brief the bytes of the frame of a request, the rows packed.
+// \return 0 if the request is malformed.
+static inline
+size_t serviceFrameSize(const ServiceRequest& request)
+{
+    if (request.width <= 0 || request.height <= 0 ||
+        request.format < LF_FORMAT_U8 || request.format > LF_FORMAT_F32 ||
+        request.order < LF_ORDER_BGR || request.order > LF_ORDER_GRAY)
+    {
+        return 0;
+    }
+
+    return (size_t)request.height * request.width *
+        lfPixelSize((LFPixelFormat)request.format, (LFChannelOrder)request.order);
+}
+
+// \brief send all n bytes, retrying interrupted calls.
+// \return false if the peer is gone.
+static inline
+bool serviceSend(int fd, const void* data, size_t n)
+{
+    const char* p = (const char*)data;
+    while (n > 0)
+    {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        p += sent;
+        n -= (size_t)sent;
+    }
+    return true;
+}
+
+// \brief receive all n bytes, retrying interrupted calls.
+// \return false if the peer closed or failed.
+static inline
+bool serviceRecv(int fd, void* data, size_t n)
+{
+    char* p = (char*)data;
+    while (n > 0)
+    {
+        ssize_t received = recv(fd, p, n, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        p += received;
+        n -= (size_t)received;
+    }
+    return true;
+}
+
+// \brief a POSIX shared memory object, mapped.
+class SharedMemory
+{
+public:
+    SharedMemory()
+    {
+        m_pData = 0;
+        m_size = 0;
+        m_owner = false;
+    };
+
+    ~SharedMemory()
+    {
+        Close();
+    };
+
+    // \brief create an object of size bytes, removed again on Close.
+    // \return false if failed and true if OK.
+    bool Create(const char* name, size_t size)
+    {
+        Close();
+
+        shm_unlink(name);
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        m_name = name;
+        m_owner = true;
+
+        if (ftruncate(fd, (off_t)size) != 0 || !Map(fd, size))
+        {
+            close(fd);
+            Close();
+            return false;
+        }
+
+        close(fd);
+        return true;
+    };
+
+    // \brief map an object another process created.
+    // \return false if failed and true if OK.
+    bool Open(const char* name)
+    {
+        Close();
+
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0 || !Map(fd, (size_t)st.st_size))
+        {
+            close(fd);
+            return false;
+        }
+        m_name = name;
+
+        close(fd);
+        return true;
+    };
+
+    void Close()
+    {
+        if (m_pData != 0)
+        {
+            munmap(m_pData, m_size);
+        }
+        if (m_owner)
+        {
+            shm_unlink(m_name.c_str());
+        }
+
+        m_pData = 0;
+        m_size = 0;
+        m_owner = false;
+        m_name.clear();
+    };
+
+    void* GetData() const
+    {
+        return m_pData;
+    };
+
+    size_t GetSize() const
+    {
+        return m_size;
+    };
+
+    const std::string& GetName() const
+    {
+        return m_name;
+    };
+
+private:
+    bool Map(int fd, size_t size)
+    {
+        void* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            return false;
+        }
+
+        m_pData = p;
+        m_size = size;
+        return true;
+    };
+
+private:
+    std::string m_name;
+    void*       m_pData;
+    size_t      m_size;
+    bool        m_owner; // created here, so unlinked on Close.
+};
+
+class RenderService
+{
+public:
+    // \brief draw the geometry of a request in white at full
+    // brightness, or in the color and brightness of the request if
+    // the effect is not linear in its color: a 32F 3-channel image of
+    // the request size, or 0. Only ever called from the batch thread.
+    typedef std::function<const IplImage* (const ServiceRequest& request)> RenderFn;
+
+    // \brief whether an effect is its white result times its color.
+    typedef std::function<bool (int effectId)> LinearFn;
+
+    // \param render draws the geometry.
+    // \param pPool the threads to color on, 0 for the shared pool.
+    // \param window the microseconds a batch waits after its first
+    //    request for the others sent at the same time.
+    RenderService(RenderFn render, ThreadPool* pPool = 0, int window = 500)
+    {
+        m_render = render;
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+        m_window = window;
+        m_listen = -1;
+        m_quit.store(false);
+        m_stopBatch = false;
+    };
+
+    // \brief tell the effects that are not linear in their color; by
+    // default all are. Set before Run().
+    void SetColorLinear(LinearFn linear)
+    {
+        m_linear = linear;
+    };
+
+    ~RenderService()
+    {
+        Close();
+    };
+
+    // \brief listen on a socket path, replacing a stale socket file.
+    // \return false if failed and true if OK.
+    bool Open(const char* path)
+    {
+        Close();
+
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "Err: the socket path %s is too long.\n", path);
+            return false;
+        }
+        strcpy(addr.sun_path, path);
+
+        m_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_listen < 0)
+        {
+            fprintf(stderr, "Err: failed to create the service socket.\n");
+            return false;
+        }
+
+        unlink(path);
+        if (bind(m_listen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listen, 16) != 0)
+        {
+            fprintf(stderr, "Err: failed to listen on %s.\n", path);
+            Close();
+            return false;
+        }
+
+        m_path = path;
+        return true;
+    };
+
+    // \brief stop listening and remove the socket file.
+    void Close()
+    {
+        if (m_listen >= 0)
+        {
+            close(m_listen);
+            m_listen = -1;
+        }
+        if (!m_path.empty())
+        {
+            unlink(m_path.c_str());
+            m_path.clear();
+        }
+    };
+
+    // \brief serve the clients until Stop.
+    void Run()
+    {
+        m_stopBatch = false;
+        std::thread batcher(&RenderService::BatchMain, this);
+
+        while (!m_quit.load())
+        {
+            pollfd pfd;
+            pfd.fd = m_listen;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int ready = poll(&pfd, 1, 200);
+
+            Reap(false);
+            if (ready <= 0)
+            {
+                continue;
+            }
+
+            int fd = accept(m_listen, 0, 0);
+            if (fd < 0)
+            {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Connection* pConnection = new Connection;
+            pConnection->fd = fd;
+            pConnection->finished = false;
+            m_connections.push_back(pConnection);
+            pConnection->thread = std::thread(&RenderService::Serve, this, pConnection);
+        }
+
+        // Wake the connections blocked on their sockets. The ones
+        // waiting for a frame get it first; the batches still run.
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (std::list<Connection*>::iterator it = m_connections.begin();
+                 it != m_connections.end(); ++it)
+            {
+                shutdown((*it)->fd, SHUT_RDWR);
+            }
+        }
+        Reap(true);
+
+        {
+            std::lock_guard<std::mutex> lock(m_jobMutex);
+            m_stopBatch = true;
+        }
+        m_wake.notify_all();
+        batcher.join();
+
+        m_quit.store(false);
+    };
+
+    // \brief make Run return. Safe in a signal handler.
+    void Stop()
+    {
+        m_quit.store(true);
+    };
+
+private:
+    struct Connection
+    {
+        int         fd;
+        std::thread thread;
+        bool        finished;
+    };
+
+    struct Job
+    {
+        ServiceRequest request;
+        ServiceReply   reply;
+        LFBuffer       frame; // the client's shared memory.
+        bool           done;
+    };
+
+    // \brief join the connections that hung up, or all of them.
+    void Reap(bool all)
+    {
+        std::list<Connection*> finished;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::list<Connection*>::iterator it = m_connections.begin();
+            while (it != m_connections.end())
+            {
+                if (all || (*it)->finished)
+                {
+                    finished.push_back(*it);
+                    it = m_connections.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        for (std::list<Connection*>::iterator it = finished.begin(); it != finished.end(); ++it)
+        {
+            (*it)->thread.join();
+            close((*it)->fd);
+            delete *it;
+        }
+    };
+
+    // \brief answer the requests of one client, on its own thread.
+    void Serve(Connection* pConnection)
+    {
+        LF_TRACE_THREAD("service");
+
+        SharedMemory memory;
+        Job job;
+        while (serviceRecv(pConnection->fd, &job.request, sizeof(job.request)))
+        {
+            job.reply.magic = SERVICE_MAGIC;
+            job.reply.stride = 0;
+            job.reply.batch = 0;
+            job.reply.status = Prepare(job, memory);
+            if (job.reply.status == SERVICE_OK)
+            {
+                Submit(&job);
+            }
+
+            if (!serviceSend(pConnection->fd, &job.reply, sizeof(job.reply)))
+            {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pConnection->finished = true;
+    };
+
+    // \brief check a request and point its frame at the shared
+    // memory of the client, mapped once per object.
+    int Prepare(Job& job, SharedMemory& memory)
+    {
+        ServiceRequest& request = job.request;
+        request.shm[sizeof(request.shm) - 1] = 0;
+
+        size_t size = serviceFrameSize(request);
+        if (request.magic != SERVICE_MAGIC || size == 0)
+        {
+            return SERVICE_BAD_REQUEST;
+        }
+
+        // The color orders the batch (LessGroup), where a NaN breaks
+        // the sort.
+        for (int k = 0; k < 3; ++k)
+        {
+            if (!std::isfinite(request.color[k]))
+            {
+                return SERVICE_BAD_REQUEST;
+            }
+        }
+        if (!std::isfinite(request.brightness))
+        {
+            return SERVICE_BAD_REQUEST;
+        }
+
+        if (memory.GetName() != request.shm && !memory.Open(request.shm))
+        {
+            return SERVICE_BAD_MEMORY;
+        }
+        if (memory.GetSize() < size)
+        {
+            // Maybe it was recreated larger under the same name.
+            if (!memory.Open(request.shm) || memory.GetSize() < size)
+            {
+                return SERVICE_BAD_MEMORY;
+            }
+        }
+
+        LFBuffer& frame = job.frame;
+        frame.data = memory.GetData();
+        frame.width = request.width;
+        frame.height = request.height;
+        frame.format = (LFPixelFormat)request.format;
+        frame.order = (LFChannelOrder)request.order;
+        frame.stride = request.width * lfPixelSize(frame.format, frame.order);
+        job.reply.stride = frame.stride;
+
+        return SERVICE_OK;
+    };
+
+    // \brief queue a job for the next batch and wait until it is done.
+    void Submit(Job* pJob)
+    {
+        std::unique_lock<std::mutex> lock(m_jobMutex);
+        pJob->done = false;
+        m_pending.push_back(pJob);
+        m_wake.notify_all();
+
+        m_done.wait(lock, [pJob] { return pJob->done; });
+    };
+
+    void BatchMain()
+    {
+        LF_TRACE_THREAD("batch");
+
+        for (;;)
+        {
+            std::vector<Job*> jobs;
+            {
+                std::unique_lock<std::mutex> lock(m_jobMutex);
+                m_wake.wait(lock, [this] { return m_stopBatch || !m_pending.empty(); });
+                if (m_pending.empty())
+                {
+                    return;
+                }
+
+                // Let the requests sent at the same time catch up.
+                if (m_window > 0)
+                {
+                    m_wake.wait_for(lock, std::chrono::microseconds(m_window),
+                            [this] { return m_stopBatch; });
+                }
+                jobs.swap(m_pending);
+            }
+
+            RenderBatch(jobs);
+
+            {
+                std::lock_guard<std::mutex> lock(m_jobMutex);
+                for (size_t k = 0; k < jobs.size(); ++k)
+                {
+                    jobs[k]->done = true;
+                }
+            }
+            m_done.notify_all();
+        }
+    };
+
+    // \brief draw the jobs, once per geometry.
+    void RenderBatch(std::vector<Job*>& jobs)
+    {
+        LF_TRACE_SCOPE("service/batch");
+
+        std::stable_sort(jobs.begin(), jobs.end(), [this](const Job* a, const Job* b) {
+            return LessGroup(a, b);
+        });
+
+        size_t first = 0;
+        while (first < jobs.size())
+        {
+            size_t last = first + 1;
+            while (last < jobs.size() && !LessGroup(jobs[first], jobs[last]))
+            {
+                ++last;
+            }
+
+            RenderGroup(&jobs[first], (int)(last - first));
+            first = last;
+        }
+    };
+
+    // \brief draw the geometry of jobs that share it and color it
+    // into each frame, band by band over the pool. A group of an
+    // effect that is not linear in its color shares the color too
+    // and is drawn in it, so it is only converted.
+    void RenderGroup(Job** group, int count)
+    {
+        const ServiceRequest& request = group[0]->request;
+        bool linear = IsColorLinear(request.effectId);
+
+        const IplImage* pCoverage;
+        {
+            LF_TRACE_SCOPE("service/render");
+            pCoverage = m_render(request);
+        }
+
+        int status = SERVICE_OK;
+        if (pCoverage == 0 || pCoverage->depth != IPL_DEPTH_32F || pCoverage->nChannels != 3)
+        {
+            status = SERVICE_RENDER_FAILED;
+        }
+        else if (pCoverage->width != request.width || pCoverage->height != request.height)
+        {
+            status = SERVICE_BAD_SIZE;
+        }
+
+        for (int k = 0; k < count; ++k)
+        {
+            group[k]->reply.status = status;
+            group[k]->reply.batch = count;
+        }
+        if (status != SERVICE_OK)
+        {
+            return;
+        }
+
+        LF_TRACE_SCOPE("service/colorize");
+
+        int width = request.width;
+        int height = request.height;
+        int bands = (height + SERVICE_BAND - 1) / SERVICE_BAND;
+
+        m_pPool->ParallelFor(count * bands, 1, [&](int begin, int end) {
+            static thread_local std::vector<float> scratch;
+            scratch.resize((size_t)width * 3 * SERVICE_BAND);
+
+            for (int t = begin; t < end; ++t)
+            {
+                Job* pJob = group[t / bands];
+                int y0 = (t % bands) * SERVICE_BAND;
+                int rows = MIN(SERVICE_BAND, height - y0);
+
+                float color[] = {1.0f, 1.0f, 1.0f};
+                for (int k = 0; k < 3 && linear; ++k)
+                {
+                    color[k] = pJob->request.color[k] / 255.0f * pJob->request.brightness;
+                }
+                for (int i = 0; i < rows; ++i)
+                {
+                    colorizeSpan((const float*)(pCoverage->imageData + (y0 + i) * pCoverage->widthStep),
+                                 &scratch[(size_t)i * width * 3], width, color);
+                }
+
+                IplImage band;
+                cvInitImageHeader(&band, cvSize(width, rows), IPL_DEPTH_32F, 3);
+                cvSetData(&band, &scratch[0], width * 3 * sizeof(float));
+                lfWriteResult(&band, &pJob->frame, 0, y0);
+            }
+        });
+    };
+
+    bool IsColorLinear(int effectId) const
+    {
+        return !m_linear || m_linear(effectId);
+    };
+
+    // \brief order the jobs by geometry, and by color for the effects
+    // that are not linear in it, so a group is a run.
+    bool LessGroup(const Job* a, const Job* b) const
+    {
+        const int ka[] = { a->request.effectId, a->request.number, a->request.length,
+                           a->request.angle, a->request.width, a->request.height };
+        const int kb[] = { b->request.effectId, b->request.number, b->request.length,
+                           b->request.angle, b->request.width, b->request.height };
+        if (std::lexicographical_compare(ka, ka + 6, kb, kb + 6))
+        {
+            return true;
+        }
+        if (std::lexicographical_compare(kb, kb + 6, ka, ka + 6) || IsColorLinear(a->request.effectId))
+        {
+            return false;
+        }
+
+        const float ca[] = { a->request.color[0], a->request.color[1], a->request.color[2], a->request.brightness };
+        const float cb[] = { b->request.color[0], b->request.color[1], b->request.color[2], b->request.brightness };
+        return std::lexicographical_compare(ca, ca + 4, cb, cb + 4);
+    };
+
+private:
+    RenderFn                m_render;
+    LinearFn                m_linear;
+    ThreadPool*             m_pPool;
+    int                     m_window;
+
+    int                     m_listen;
+    std::string             m_path;
+    std::atomic<bool>       m_quit;
+
+    std::mutex              m_mutex;     // guards the connections.
+    std::list<Connection*>  m_connections;
+
+    std::mutex              m_jobMutex;  // guards the jobs.
+    std::condition_variable m_wake;      // a job came or stop.
+    std::condition_variable m_done;      // a batch is done.
+    std::vector<Job*>       m_pending;
+    bool                    m_stopBatch;
+};
+
+class RenderClient
+{
+public:
+    RenderClient()
+    {
+        m_fd = -1;
+        m_serial = 0;
+    };
+
+    ~RenderClient()
+    {
+        Close();
+    };
+
+    // \return false if failed and true if OK.
+    bool Connect(const char* path)
+    {
+        Close();
+
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0 || connect(m_fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            fprintf(stderr, "Err: failed to connect to the render service at %s.\n", path);
+            Close();
+            return false;
+        }
+
+        return true;
+    };
+
+    void Close()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+        m_memory.Close();
+    };
+
+    // \brief render a frame. The geometry, color and format of the
+    // request are used; the rest is filled in.
+    //
+    // \param frame receives the frame, in the shared memory of the
+    //    client. It stays valid until the next call.
+    // \param pBatch receives the number of requests the geometry was
+    //    drawn for, or 0.
+    // \return false if the service failed.
+    bool Render(ServiceRequest request, LFBuffer* frame, int* pBatch = 0)
+    {
+        size_t size = serviceFrameSize(request);
+        if (m_fd < 0 || size == 0)
+        {
+            fprintf(stderr, "Err: bad render request.\n");
+            return false;
+        }
+
+        // Reused while it is large enough.
+        if (m_memory.GetSize() < size)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "/lensflare.%ld.%p.%d", (long)getpid(), (void*)this, ++m_serial);
+            if (!m_memory.Create(name, size))
+            {
+                fprintf(stderr, "Err: failed to create the shared memory %s.\n", name);
+                return false;
+            }
+        }
+
+        request.magic = SERVICE_MAGIC;
+        strncpy(request.shm, m_memory.GetName().c_str(), sizeof(request.shm) - 1);
+        request.shm[sizeof(request.shm) - 1] = 0;
+
+        ServiceReply reply;
+        if (!serviceSend(m_fd, &request, sizeof(request)) ||
+            !serviceRecv(m_fd, &reply, sizeof(reply)) || reply.magic != SERVICE_MAGIC)
+        {
+            fprintf(stderr, "Err: lost the render service.\n");
+            return false;
+        }
+        if (reply.status != SERVICE_OK)
+        {
+            fprintf(stderr, "Err: the render service failed with status %d.\n", reply.status);
+            return false;
+        }
+
+        frame->data = m_memory.GetData();
+        frame->width = request.width;
+        frame->height = request.height;
+        frame->stride = reply.stride;
+        frame->format = (LFPixelFormat)request.format;
+        frame->order = (LFChannelOrder)request.order;
+        if (pBatch != 0)
+        {
+            *pBatch = reply.batch;
+        }
+
+        return true;
+    };
+
+private:
+    int          m_fd;
+    SharedMemory m_memory;
+    int          m_serial;
+};
+
+#endif // !_WIN32
+
+#endif // !RENDER_SERVICE_H
@@ -0,0 +1,262 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   renderworker.h
+ *
+ * Abstract:
+ *
+ *   Render the frames of an interactive view on a worker thread.
+ *
+ *   The GUI thread posts the parameters of the view; only the
+ *   newest ones are kept, so the intermediate values of a dragged
+ *   slider are skipped and a render whose parameters went stale
+ *   can stop at its next check (unless no frame was shown for a
+ *   while, so a long drag still updates the screen). The finished
+ *   frames go through a lock-free triple buffer: the worker always
+ *   has a frame to draw into, and the GUI thread picks up the
+ *   newest finished one without waiting.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef RENDER_WORKER_H
+#define RENDER_WORKER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+#include "trace.h"
+
+// \brief three slots passed between one writer and one reader. The
+// writer fills the back slot and publishes it; the reader takes the
+// newest published slot as its front one. Neither ever waits.
+template <class T>
+class TripleBuffer
+{
+public:
+    TripleBuffer()
+    {
+        m_back = 0;
+        m_middle.store(1);
+        m_front = 2;
+    };
+
+    T& GetSlot(int k)
+    {
+        return m_slots[k];
+    };
+
+    // \brief the slot of the writer.
+    T& GetBack()
+    {
+        return m_slots[m_back];
+    };
+
+    // \brief hand the back slot to the reader and take the older one.
+    void Publish()
+    {
+        m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & INDEX;
+    };
+
+    // \brief take the newest published slot, if any.
+    // \return false if nothing was published since the last call.
+    bool Update()
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & FRESH) == 0)
+        {
+            return false;
+        }
+
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX;
+        return true;
+    };
+
+    // \brief the slot of the reader.
+    T& GetFront()
+    {
+        return m_slots[m_front];
+    };
+
+private:
+    enum
+    {
+        INDEX = 3,
+        FRESH = 4, // the middle slot was published and not yet taken.
+    };
+
+    T                m_slots[3];
+    int              m_back;   // the writer's.
+    std::atomic<int> m_middle;
+    int              m_front;  // the reader's.
+};
+
+template <class Params>
+class RenderWorker
+{
+public:
+    // \brief render a frame of the parameters.
+    // \return false if it was cancelled or failed; the frame is then
+    //    not shown.
+    typedef std::function<bool (const Params& params, IplImage* pFrame)> RenderFn;
+
+    // \param render renders on the worker thread.
+    // \param size the frame size.
+    // \param depth the frame depth, e.g. IPL_DEPTH_8U.
+    // \param channels the frame channels.
+    // \param maxLatency the milliseconds after the last frame shown
+    //    when stale renders are no longer cancelled.
+    RenderWorker(RenderFn render, CvSize size, int depth, int channels, int maxLatency = 100)
+    {
+        m_render = render;
+        m_maxLatency = std::chrono::milliseconds(maxLatency);
+        m_published = std::chrono::steady_clock::now();
+        for (int k = 0; k < 3; ++k)
+        {
+            m_frames.GetSlot(k) = cvCreateImage(size, depth, channels);
+            cvZero(m_frames.GetSlot(k));
+        }
+
+        m_posted.store(0);
+        m_started = 0;
+        m_finished = 0;
+        m_quit = false;
+        m_thread = std::thread(&RenderWorker::WorkerMain, this);
+    };
+
+    ~RenderWorker()
+    {
+        Stop();
+
+        for (int k = 0; k < 3; ++k)
+        {
+            cvReleaseImage(&m_frames.GetSlot(k));
+        }
+    };
+
+    // \brief ask for a frame of the parameters, replacing any request
+    // not yet started. Called from the GUI thread.
+    void Post(const Params& params)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_params = params;
+            m_posted.fetch_add(1, std::memory_order_release);
+        }
+        m_wake.notify_all();
+    };
+
+    // \brief whether newer parameters were posted than the ones being
+    // rendered and a frame was shown recently. Polled by the render
+    // function between its stages.
+    bool IsStale() const
+    {
+        return m_posted.load(std::memory_order_acquire) != m_started &&
+               std::chrono::steady_clock::now() - m_published < m_maxLatency;
+    };
+
+    // \brief the newest finished frame, without locking. The frame
+    // stays valid until the next call. Called from the GUI thread.
+    //
+    // \return 0 if no frame finished since the last call.
+    IplImage* Acquire()
+    {
+        return m_frames.Update() ? m_frames.GetFront() : 0;
+    };
+
+    // \brief wait until every posted request is rendered, so the
+    // caller may touch the state the worker renders from until it
+    // posts again.
+    void WaitIdle()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] {
+            return m_quit || m_finished == m_posted.load(std::memory_order_relaxed);
+        });
+    };
+
+    // \brief finish the current render and stop.
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
+    };
+
+private:
+    void WorkerMain()
+    {
+        LF_TRACE_THREAD("render");
+
+        for (;;)
+        {
+            Params params;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] {
+                    return m_quit || m_started != m_posted.load(std::memory_order_relaxed);
+                });
+                if (m_quit)
+                {
+                    return;
+                }
+
+                params = m_params;
+                m_started = m_posted.load(std::memory_order_relaxed);
+            }
+
+            bool done;
+            {
+                LF_TRACE_SCOPE("frame");
+                done = m_render(params, m_frames.GetBack());
+            }
+            if (done)
+            {
+                m_frames.Publish();
+                m_published = std::chrono::steady_clock::now();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_finished = m_started;
+            }
+            m_idle.notify_all();
+        }
+    };
+
+private:
+    RenderFn                  m_render;
+    std::chrono::milliseconds m_maxLatency;
+    std::chrono::steady_clock::time_point m_published; // the last frame done.
+    TripleBuffer<IplImage*>   m_frames;
+
+    std::mutex                m_mutex;
+    std::condition_variable   m_wake;
+    std::condition_variable   m_idle;
+    Params                    m_params;   // the newest posted.
+    std::atomic<unsigned>     m_posted;   // the requests posted.
+    unsigned                  m_started;  // the posted count of the render running.
+    unsigned                  m_finished; // ditto, of the last render done.
+    bool                      m_quit;
+    std::thread               m_thread;
+};
+
+#endif // !RENDER_WORKER_H
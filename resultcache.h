@@ -0,0 +1,468 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   resultcache.h
+ *
+ * Abstract:
+ *
+ *   An on-disk cache of rendered effect results for batch jobs
+ *   that render the same presets again and again.
+ *
+ *   A result is keyed by a 64-bit FNV-1a hash of everything that
+ *   determines it: the effect, its parameters, the MyRandom seed
+ *   and the size. Each result is a file of its own, written and
+ *   read through a memory mapping; a hit is an image header over
+ *   the mapped pixels, so it goes to the output with no render and
+ *   no read copy. An index file, also mapped, keeps the size and
+ *   the last use of every result; the least recently used ones are
+ *   removed to stay under the size cap.
+ *
+ *   Layout of the directory:
+ *
+ *     index.lfc         ResultCacheHeader, ResultCacheEntry x capacity
+ *     <key>.lfr         ResultFileHeader, padding to RESULT_DATA_OFFSET,
+ *                       the rows of the image (its widthStep apart)
+ *
+ *   A cache is used by one thread of one process at a time.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <stdint.h>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+
+#ifdef _WIN32
+# include <direct.h>
+#else
+# include <sys/stat.h>
+# include <sys/types.h>
+#endif
+
+#include "cxcore.h"
+
+#include "mapfile.h"
+#include "trace.h"
+
+#define RESULT_CACHE_MAGIC   0x43524C46 // "FLRC"
+#define RESULT_FILE_MAGIC    0x52524C46 // "FLRR"
+#define RESULT_CACHE_VERSION 1
+
+// The offset of the pixels in a result file, a multiple of 16.
+#define RESULT_DATA_OFFSET   64
+
+// \brief a 64-bit FNV-1a hash of the values a result depends on.
+// The values are hashed by their bytes, so a key is the same on all
+// little-endian machines.
+class ResultKey
+{
+public:
+    ResultKey()
+    {
+        m_hash = 14695981039346656037ULL;
+    };
+
+    void AddBytes(const void* data, size_t size)
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        for (size_t k = 0; k < size; ++k)
+        {
+            m_hash ^= p[k];
+            m_hash *= 1099511628211ULL;
+        }
+    };
+
+    ResultKey& Add(int v)           { AddBytes(&v, sizeof(v)); return *this; };
+    ResultKey& Add(unsigned long v) { uint64_t w = v; AddBytes(&w, sizeof(w)); return *this; };
+    ResultKey& Add(float v)         { AddBytes(&v, sizeof(v)); return *this; };
+
+    // \brief a name, with its terminator so "ab"+"c" != "a"+"bc".
+    ResultKey& Add(const char* s)   { AddBytes(s, strlen(s) + 1); return *this; };
+
+    ResultKey& Add(const float* v, int n)
+    {
+        AddBytes(v, n * sizeof(float));
+        return *this;
+    };
+
+    uint64_t Get() const
+    {
+        return m_hash;
+    };
+
+private:
+    uint64_t m_hash;
+};
+
+struct ResultCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;   // the number of entries.
+    uint32_t reserved;
+    uint64_t tick;       // the clock of the last uses.
+    uint64_t totalSize;  // the bytes of all result files.
+};
+
+struct ResultCacheEntry
+{
+    uint64_t key;        // 0 if the entry is free.
+    uint64_t size;       // the bytes of the file.
+    uint64_t lastUsed;   // the tick of the last store or hit.
+};
+
+struct ResultFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    uint32_t depth;      // IPL_DEPTH_8U or IPL_DEPTH_32F.
+    uint32_t widthStep;
+    uint32_t reserved;
+};
+
+class ResultCache
+{
+public:
+    // \brief render a result that was not in the cache.
+    typedef std::function<const IplImage* ()> RenderFn;
+
+    ResultCache()
+    {
+        m_pHeader = 0;
+        m_pEntries = 0;
+        m_maxSize = 0;
+    };
+
+    ~ResultCache()
+    {
+        Close();
+    };
+
+    // \brief open the cache in a directory, created if missing.
+    //
+    // \param dir the directory.
+    // \param maxSize the cap of the bytes of all results.
+    // \param capacity the most results kept, used if the index is new.
+    // \return false if failed and true if OK.
+    bool Open(const char* dir, uint64_t maxSize, int capacity = 1024)
+    {
+        Close();
+
+#ifdef _WIN32
+        _mkdir(dir);
+#else
+        mkdir(dir, 0755);
+#endif
+        m_dir = dir;
+        m_maxSize = maxSize;
+
+        std::string path = m_dir + "/index.lfc";
+        if (!m_index.Open(path.c_str(), true) || !IsValidIndex())
+        {
+            size_t size = sizeof(ResultCacheHeader) + sizeof(ResultCacheEntry) * capacity;
+            if (capacity <= 0 || !m_index.Create(path.c_str(), size))
+            {
+                fprintf(stderr, "Err: failed to create the result cache in %s.\n", dir);
+                return false;
+            }
+
+            ResultCacheHeader* pHeader = (ResultCacheHeader*)m_index.GetData();
+            memset(pHeader, 0, size);
+            pHeader->magic = RESULT_CACHE_MAGIC;
+            pHeader->version = RESULT_CACHE_VERSION;
+            pHeader->capacity = capacity;
+        }
+
+        m_pHeader = (ResultCacheHeader*)m_index.GetData();
+        m_pEntries = (ResultCacheEntry*)(m_pHeader + 1);
+
+        m_slots.clear();
+        for (uint32_t k = 0; k < m_pHeader->capacity; ++k)
+        {
+            if (m_pEntries[k].key != 0)
+            {
+                m_slots[m_pEntries[k].key] = k;
+            }
+        }
+
+        Evict(0);
+        return true;
+    };
+
+    void Close()
+    {
+        m_hit.Close();
+        m_index.Close();
+        m_pHeader = 0;
+        m_pEntries = 0;
+        m_slots.clear();
+    };
+
+    // \brief find a result.
+    //
+    // \return an image over the mapped pixels, valid until the next
+    //    call of the cache, or 0 if the key is not cached.
+    const IplImage* Lookup(uint64_t key)
+    {
+        m_hit.Close();
+
+        std::map<uint64_t, uint32_t>::iterator it = m_slots.find(key);
+        if (m_pHeader == 0 || it == m_slots.end())
+        {
+            return 0;
+        }
+
+        LF_TRACE_SCOPE("cache/hit");
+
+        ResultCacheEntry& entry = m_pEntries[it->second];
+        const ResultFileHeader* pFile = 0;
+        if (m_hit.Open(GetPath(key).c_str()) && m_hit.GetSize() == entry.size &&
+            entry.size >= RESULT_DATA_OFFSET)
+        {
+            pFile = (const ResultFileHeader*)m_hit.GetData();
+        }
+        if (pFile == 0 || pFile->magic != RESULT_FILE_MAGIC || pFile->key != key ||
+            !IsValid(pFile, entry.size))
+        {
+            // Lost or damaged; forget it.
+            m_hit.Close();
+            Remove(it->second);
+            return 0;
+        }
+
+        entry.lastUsed = ++m_pHeader->tick;
+
+        cvInitImageHeader(&m_image, cvSize(pFile->width, pFile->height), pFile->depth, pFile->channels);
+        cvSetData(&m_image, m_hit.GetData() + RESULT_DATA_OFFSET, pFile->widthStep);
+        return &m_image;
+    };
+
+    // \brief store a result, replacing the one of the same key.
+    //
+    // \param image an 8-bit or float image.
+    // \return false if failed and true if OK.
+    bool Store(uint64_t key, const IplImage* image)
+    {
+        m_hit.Close();
+
+        if (m_pHeader == 0 || key == 0 ||
+            (image->depth != IPL_DEPTH_8U && image->depth != IPL_DEPTH_32F))
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("cache/store");
+
+        std::map<uint64_t, uint32_t>::iterator it = m_slots.find(key);
+        if (it != m_slots.end())
+        {
+            Remove(it->second);
+        }
+
+        int rowSize = image->width * image->nChannels * (image->depth == IPL_DEPTH_8U ? 1 : 4);
+        int widthStep = (rowSize + 3) & ~3;
+        uint64_t size = RESULT_DATA_OFFSET + (uint64_t)widthStep * image->height;
+        if (size > m_maxSize)
+        {
+            return false;
+        }
+
+        // Room in the index and under the cap.
+        Evict(size);
+        int slot = FindFreeSlot();
+        if (slot < 0)
+        {
+            return false;
+        }
+
+        MappedFile file;
+        if (!file.Create(GetPath(key).c_str(), (size_t)size))
+        {
+            fprintf(stderr, "Err: failed to write the result cache.\n");
+            return false;
+        }
+
+        ResultFileHeader* pFile = (ResultFileHeader*)file.GetData();
+        memset(pFile, 0, RESULT_DATA_OFFSET);
+        pFile->magic = RESULT_FILE_MAGIC;
+        pFile->version = RESULT_CACHE_VERSION;
+        pFile->key = key;
+        pFile->width = image->width;
+        pFile->height = image->height;
+        pFile->channels = image->nChannels;
+        pFile->depth = image->depth;
+        pFile->widthStep = widthStep;
+
+        for (int i = 0; i < image->height; ++i)
+        {
+            memcpy(file.GetData() + RESULT_DATA_OFFSET + (size_t)i * widthStep,
+                   image->imageData + i * image->widthStep, rowSize);
+        }
+        file.Close();
+
+        ResultCacheEntry& entry = m_pEntries[slot];
+        entry.key = key;
+        entry.size = size;
+        entry.lastUsed = ++m_pHeader->tick;
+        m_pHeader->totalSize += size;
+        m_slots[key] = slot;
+
+        return true;
+    };
+
+    // \brief the cached result of the key, or the rendered one, which
+    // is then stored.
+    //
+    // \return 0 if the render failed.
+    const IplImage* GetOrRender(uint64_t key, RenderFn render)
+    {
+        const IplImage* pImage = Lookup(key);
+        if (pImage != 0)
+        {
+            return pImage;
+        }
+
+        pImage = render();
+        if (pImage != 0)
+        {
+            Store(key, pImage);
+        }
+        return pImage;
+    };
+
+    // \brief remove all results.
+    void Clear()
+    {
+        m_hit.Close();
+
+        for (uint32_t k = 0; m_pHeader != 0 && k < m_pHeader->capacity; ++k)
+        {
+            if (m_pEntries[k].key != 0)
+            {
+                Remove(k);
+            }
+        }
+    };
+
+    int GetCount() const
+    {
+        return (int)m_slots.size();
+    };
+
+    uint64_t GetTotalSize() const
+    {
+        return m_pHeader != 0 ? m_pHeader->totalSize : 0;
+    };
+
+private:
+    bool IsValidIndex() const
+    {
+        const ResultCacheHeader* pHeader = (const ResultCacheHeader*)m_index.GetData();
+        return m_index.GetSize() >= sizeof(ResultCacheHeader) &&
+               pHeader->magic == RESULT_CACHE_MAGIC &&
+               pHeader->version == RESULT_CACHE_VERSION &&
+               m_index.GetSize() >= sizeof(ResultCacheHeader) + sizeof(ResultCacheEntry) * pHeader->capacity;
+    };
+
+    // \brief whether the image of a result file of size bytes is one
+    // Store() writes and its rows are in the file.
+    static bool IsValid(const ResultFileHeader* pFile, uint64_t size)
+    {
+        if ((pFile->depth != IPL_DEPTH_8U && pFile->depth != IPL_DEPTH_32F) ||
+            pFile->channels < 1 || pFile->channels > 4 ||
+            pFile->width == 0 || pFile->height == 0 ||
+            pFile->height > INT_MAX || pFile->widthStep > INT_MAX)
+        {
+            return false;
+        }
+
+        uint64_t rowSize = (uint64_t)pFile->width * pFile->channels * (pFile->depth == IPL_DEPTH_8U ? 1 : 4);
+        return pFile->widthStep >= rowSize &&
+            (uint64_t)pFile->widthStep * pFile->height <= size - RESULT_DATA_OFFSET;
+    };
+
+    std::string GetPath(uint64_t key) const
+    {
+        char name[32];
+        sprintf(name, "/%016llx.lfr", (unsigned long long)key);
+        return m_dir + name;
+    };
+
+    int FindFreeSlot() const
+    {
+        for (uint32_t k = 0; k < m_pHeader->capacity; ++k)
+        {
+            if (m_pEntries[k].key == 0)
+            {
+                return (int)k;
+            }
+        }
+        return -1;
+    };
+
+    void Remove(uint32_t slot)
+    {
+        ResultCacheEntry& entry = m_pEntries[slot];
+        remove(GetPath(entry.key).c_str());
+
+        m_slots.erase(entry.key);
+        m_pHeader->totalSize -= entry.size;
+        memset(&entry, 0, sizeof(entry));
+    };
+
+    // \brief remove the least recently used results until a result of
+    // the size fits under the cap and in the index.
+    void Evict(uint64_t size)
+    {
+        while (!m_slots.empty() &&
+               (m_pHeader->totalSize + size > m_maxSize ||
+                (size > 0 && m_slots.size() >= m_pHeader->capacity)))
+        {
+            uint32_t oldest = 0;
+            uint64_t tick = ~(uint64_t)0;
+            for (std::map<uint64_t, uint32_t>::iterator it = m_slots.begin(); it != m_slots.end(); ++it)
+            {
+                if (m_pEntries[it->second].lastUsed < tick)
+                {
+                    tick = m_pEntries[it->second].lastUsed;
+                    oldest = it->second;
+                }
+            }
+            Remove(oldest);
+        }
+    };
+
+private:
+    std::string        m_dir;
+    uint64_t           m_maxSize;
+    MappedFile         m_index;
+    ResultCacheHeader* m_pHeader;
+    ResultCacheEntry*  m_pEntries;
+
+    // The slots of the keys in the index.
+    std::map<uint64_t, uint32_t> m_slots;
+
+    // The result of the last hit.
+    MappedFile         m_hit;
+    IplImage           m_image;
+};
+
+#endif // !RESULT_CACHE_H
@@ -0,0 +1,230 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   scheduler.h
+ *
+ * Abstract:
+ *
+ *   Hold the preview to a frame time budget by trading quality.
+ *
+ *   The frame times of each effect are smoothed and compared with
+ *   the target. An effect over the target for a few frames drops
+ *   to the next cheaper quality level; one well under it (below
+ *   QUALITY_UP_RATIO of the target) for a longer run goes back up.
+ *   The gap between the two thresholds and the longer wait to go up
+ *   keep the level from flapping, and a level that proves too slow
+ *   right after going up doubles the wait before it is tried again.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdio>
+#include <map>
+
+#include "common.h"
+
+// The weight of a new frame time in the smoothed time.
+#define QUALITY_SMOOTHING 0.3
+
+// The frames over the target before a level is dropped.
+#define QUALITY_DOWN_FRAMES 3
+
+// The frames under QUALITY_UP_RATIO of the target before a level is
+// raised, doubled after each bounce up to QUALITY_MAX_UP_FRAMES.
+#define QUALITY_UP_FRAMES     16
+#define QUALITY_MAX_UP_FRAMES 512
+#define QUALITY_UP_RATIO      0.6
+
+// \brief the knobs of a quality level.
+struct QualityLevel
+{
+    float resolution; // the scale of the canvas of the bloom and
+                      // streak passes.
+    int   subpixelX;  // the poly.cpp sampling grid of a pixel, see
+    int   subpixelY;  // polyFindGrid().
+    float counts;     // the scale of the ray, sparkle and ghost counts.
+    int   accuracy;   // 0 for the reference kernels, 1 for cheaper
+                      // approximations (fewer box stages and
+                      // wavelengths).
+};
+
+class FrameScheduler
+{
+public:
+    // \brief constructor.
+    //
+    // \param target the frame time to hold in milliseconds, 0 for
+    //   none (every frame at full quality).
+    FrameScheduler(double target = 0.0)
+    {
+        m_target = target;
+    };
+
+    // \brief the number of levels, 0 the best.
+    static int GetLevelCount()
+    {
+        return 5;
+    };
+
+    static const QualityLevel& GetQuality(int level)
+    {
+        static const QualityLevel levels[] = {
+            { 1.0f,  16, 8, 1.0f,  0 },
+            { 1.0f,  16, 8, 1.0f,  1 },
+            { 0.5f,  16, 8, 1.0f,  1 },
+            { 0.5f,   4, 4, 0.5f,  1 },
+            { 0.25f,  4, 4, 0.25f, 1 },
+        };
+        return levels[clip(level, 0, GetLevelCount() - 1)];
+    };
+
+    // \brief describe a level, e.g. "level 2 (50% resolution, 8x16
+    // subpixels, 100% counts, fast)".
+    static void Describe(int level, char* text, size_t size)
+    {
+        const QualityLevel& q = GetQuality(level);
+        snprintf(text, size, "level %d (%d%% resolution, %dx%d subpixels, %d%% counts, %s)",
+                 level, (int)(100.0f * q.resolution + 0.5f), q.subpixelY, q.subpixelX,
+                 (int)(100.0f * q.counts + 0.5f), q.accuracy == 0 ? "exact" : "fast");
+    };
+
+    // \brief set the frame time to hold; a new target starts every
+    // effect over from the best level.
+    void SetTarget(double target)
+    {
+        if (target != m_target)
+        {
+            m_target = target;
+            m_states.clear();
+        }
+    };
+
+    double GetTarget() const
+    {
+        return m_target;
+    };
+
+    // \brief the level to render the next frame of an effect at.
+    int GetLevel(int effectId) const
+    {
+        std::map<int, State>::const_iterator it = m_states.find(effectId);
+        return it != m_states.end() ? it->second.level : 0;
+    };
+
+    // \brief the smoothed frame time of an effect in milliseconds,
+    // 0 before its second frame at the current level.
+    double GetFrameTime(int effectId) const
+    {
+        std::map<int, State>::const_iterator it = m_states.find(effectId);
+        return it != m_states.end() ? it->second.smoothed : 0.0;
+    };
+
+    // \brief record the time of a frame rendered at GetLevel().
+    //
+    // \param effectId the effect.
+    // \param time the frame time in milliseconds.
+    // \return true if the level of the effect changed.
+    bool AddFrame(int effectId, double time)
+    {
+        State& s = GetState(effectId);
+
+        // The first frame at a level also redraws the effect.
+        if (++s.frames == 1)
+        {
+            return false;
+        }
+        s.smoothed = s.smoothed > 0 ? s.smoothed + QUALITY_SMOOTHING * (time - s.smoothed) : time;
+
+        if (m_target <= 0)
+        {
+            return false;
+        }
+
+        if (s.smoothed > m_target)
+        {
+            s.over++;
+            s.under = 0;
+        }
+        else if (s.smoothed < QUALITY_UP_RATIO * m_target)
+        {
+            s.under++;
+            s.over = 0;
+        }
+        else
+        {
+            s.over = 0;
+            s.under = 0;
+        }
+
+        if (s.over >= QUALITY_DOWN_FRAMES && s.level + 1 < GetLevelCount())
+        {
+            // Too slow soon after going up: wait longer next time.
+            if (s.raised && s.frames < s.upFrames)
+            {
+                s.upFrames = MIN(2 * s.upFrames, QUALITY_MAX_UP_FRAMES);
+            }
+            SetLevel(s, s.level + 1, false);
+            return true;
+        }
+
+        if (s.under >= s.upFrames && s.level > 0)
+        {
+            SetLevel(s, s.level - 1, true);
+            return true;
+        }
+
+        return false;
+    };
+
+private:
+    struct State
+    {
+        int    level;
+        double smoothed; // ms, 0 for no frame yet.
+        int    frames;   // at this level.
+        int    over;     // consecutive frames over the target.
+        int    under;    // consecutive frames well under it.
+        int    upFrames; // the run of under frames to go up.
+        bool   raised;   // whether the level was reached going up.
+    };
+
+    State& GetState(int effectId)
+    {
+        std::map<int, State>::iterator it = m_states.find(effectId);
+        if (it == m_states.end())
+        {
+            State s;
+            s.upFrames = QUALITY_UP_FRAMES;
+            SetLevel(s, 0, false);
+            it = m_states.insert(std::make_pair(effectId, s)).first;
+        }
+        return it->second;
+    };
+
+    // The times of the old level say nothing about the new one.
+    static void SetLevel(State& s, int level, bool raised)
+    {
+        s.level = level;
+        s.smoothed = 0;
+        s.frames = 0;
+        s.over = 0;
+        s.under = 0;
+        s.raised = raised;
+    };
+
+private:
+    double               m_target; // ms
+    std::map<int, State> m_states; // by effect id.
+};
+
+#endif // !SCHEDULER_H
@@ -0,0 +1,557 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   shard.h
+ *
+ * Abstract:
+ *
+ *   Render a large batch of jobs in several worker processes.
+ *
+ *   The job list is split into one contiguous shard per worker. The
+ *   workers are forked, so each has its own heap and a crash only
+ *   takes its current jobs down. The frames come back through a ring
+ *   of frame slots in shared memory: the coordinator hands a worker
+ *   a job and a free slot over a pipe, the worker renders into the
+ *   slot and answers on another pipe, and the coordinator passes the
+ *   frame on and frees the slot. A worker that dies is replaced by a
+ *   new process that resumes its shard; a job that crashed a worker
+ *   twice is given up.
+ *
+ *   The jobs are numbered by their place in the list, not in the
+ *   shard, so a render that seeds itself from the job number gives
+ *   the same frames for any number of workers.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// The jobs a worker may have outstanding, so it starts the next one
+// while the coordinator takes the last.
+#define SHARD_DEPTH    2
+
+// The workers a job may crash before it is given up.
+#define SHARD_ATTEMPTS 2
+
+class ShardCoordinator
+{
+public:
+    // \brief called in a new worker process before its first job.
+    typedef std::function<void (int worker)> StartFn;
+
+    // \brief render a job into a frame slot, in a worker process.
+    // \return false if it failed.
+    typedef std::function<bool (int job, IplImage* pFrame)> RenderFn;
+
+    // \brief take a finished frame, in the coordinator. The frame is
+    // only valid in the call.
+    typedef std::function<void (int job, const IplImage* frame)> SinkFn;
+
+    // \param size the frame size.
+    // \param depth the frame depth, e.g. IPL_DEPTH_8U.
+    // \param channels the frame channels.
+    ShardCoordinator(CvSize size, int depth, int channels)
+    {
+        m_size = size;
+        m_depth = depth;
+        m_channels = channels;
+        m_pRing = 0;
+        m_ringSize = 0;
+        m_restarts = 0;
+    };
+
+    ~ShardCoordinator()
+    {
+        FreeRing();
+    };
+
+    // \brief render jobs [0, jobs) in worker processes. The caller
+    // must not have started any threads the workers rely on: a forked
+    // process only has the calling thread. The shared ThreadPool
+    // starts its threads on its first loop, so the workers rely on no
+    // loop having run here; each then starts a pool of its own, whose
+    // size the start function may set (ThreadPool::SetThreadCount).
+    //
+    // \param jobs the number of jobs.
+    // \param workers the number of worker processes.
+    // \return the number of jobs that failed or were given up, or -1
+    //    if the workers could not be started.
+    int Run(int jobs, int workers, RenderFn render, SinkFn sink, StartFn start = StartFn())
+    {
+        workers = clip(workers, 1, MAX(jobs, 1));
+        m_restarts = 0;
+
+        if (ThreadPool::Get().IsStarted())
+        {
+            fprintf(stderr, "Err: the thread pool was started before the workers were forked.\n");
+            return -1;
+        }
+
+        if (!AllocRing(workers * SHARD_DEPTH))
+        {
+            fprintf(stderr, "Err: failed to map the frame ring.\n");
+            return -1;
+        }
+
+        // A dead worker shows as a failed write and an end of file.
+        void (*oldPipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+        m_workers.assign(workers, Worker());
+        m_attempts.assign(jobs, 0);
+        m_freeSlots.clear();
+        for (int s = (int)m_slots.size() - 1; s >= 0; --s)
+        {
+            m_freeSlots.push_back(s);
+        }
+
+        // Contiguous shards, as even as they come.
+        for (int w = 0; w < workers; ++w)
+        {
+            int begin = (int)((long long)jobs * w / workers);
+            int end = (int)((long long)jobs * (w + 1) / workers);
+            for (int j = begin; j < end; ++j)
+            {
+                m_workers[w].pending.push_back(j);
+            }
+        }
+
+        int failed = 0;
+        int remaining = jobs;
+        for (int w = 0; w < workers; ++w)
+        {
+            if (!Spawn(w, render, start))
+            {
+                Shutdown();
+                signal(SIGPIPE, oldPipe);
+                return -1;
+            }
+        }
+
+        while (remaining > 0)
+        {
+            Dispatch();
+
+            std::vector<pollfd> fds;
+            std::vector<int> owners;
+            for (int w = 0; w < workers; ++w)
+            {
+                if (m_workers[w].pid > 0)
+                {
+                    pollfd pfd;
+                    pfd.fd = m_workers[w].results;
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                    fds.push_back(pfd);
+                    owners.push_back(w);
+                }
+            }
+
+            if (fds.empty())
+            {
+                break;
+            }
+            if (poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR)
+            {
+                fprintf(stderr, "Err: failed to wait for the workers.\n");
+                break;
+            }
+
+            for (size_t k = 0; k < fds.size(); ++k)
+            {
+                if (fds[k].revents == 0)
+                {
+                    continue;
+                }
+
+                int w = owners[k];
+                Result result;
+                if (ReadAll(m_workers[w].results, &result, sizeof(result)))
+                {
+                    LF_TRACE_SCOPE("shard/sink");
+
+                    Worker& worker = m_workers[w];
+                    for (std::deque<Command>::iterator it = worker.running.begin();
+                         it != worker.running.end(); ++it)
+                    {
+                        if (it->job == result.job)
+                        {
+                            worker.running.erase(it);
+                            break;
+                        }
+                    }
+                    if (result.ok)
+                    {
+                        sink(result.job, m_slots[result.slot]);
+                    }
+                    else
+                    {
+                        fprintf(stderr, "Err: job %d failed.\n", result.job);
+                        ++failed;
+                    }
+                    m_freeSlots.push_back(result.slot);
+                    --remaining;
+                }
+                else
+                {
+                    int lost = Recover(w);
+                    failed += lost;
+                    remaining -= lost;
+                    if (!m_workers[w].pending.empty())
+                    {
+                        if (!Spawn(w, render, start))
+                        {
+                            failed += (int)m_workers[w].pending.size();
+                            remaining -= (int)m_workers[w].pending.size();
+                            m_workers[w].pending.clear();
+                            continue;
+                        }
+                        ++m_restarts;
+                    }
+                }
+            }
+        }
+
+        Shutdown();
+        signal(SIGPIPE, oldPipe);
+
+        return failed + remaining;
+    };
+
+    // \brief the workers replaced in the last Run.
+    int GetRestartCount() const
+    {
+        return m_restarts;
+    };
+
+private:
+    struct Command
+    {
+        int job;
+        int slot;
+    };
+
+    struct Result
+    {
+        int job;
+        int slot;
+        int ok;
+    };
+
+    struct Worker
+    {
+        pid_t            pid;
+        int              commands; // the write end of its command pipe.
+        int              results;  // the read end of its result pipe.
+        std::deque<int>  pending;  // its shard, not yet sent.
+        std::deque<Command> running;
+
+        Worker()
+        {
+            pid = -1;
+            commands = -1;
+            results = -1;
+        };
+    };
+
+    bool AllocRing(int slots)
+    {
+        FreeRing();
+
+        IplImage header;
+        cvInitImageHeader(&header, m_size, m_depth, m_channels);
+        size_t slotSize = ((size_t)header.imageSize + 63) & ~(size_t)63;
+
+        // Anonymous and shared, so the forked workers see it.
+        m_ringSize = slotSize * slots;
+        void* p = mmap(0, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            m_ringSize = 0;
+            return false;
+        }
+        m_pRing = (char*)p;
+
+        for (int s = 0; s < slots; ++s)
+        {
+            IplImage* pSlot = cvCreateImageHeader(m_size, m_depth, m_channels);
+            cvSetData(pSlot, m_pRing + slotSize * s, header.widthStep);
+            m_slots.push_back(pSlot);
+        }
+
+        return true;
+    };
+
+    void FreeRing()
+    {
+        for (size_t s = 0; s < m_slots.size(); ++s)
+        {
+            cvReleaseImageHeader(&m_slots[s]);
+        }
+        m_slots.clear();
+
+        if (m_pRing != 0)
+        {
+            munmap(m_pRing, m_ringSize);
+            m_pRing = 0;
+            m_ringSize = 0;
+        }
+    };
+
+    // \brief fork a process for the shard of worker w.
+    bool Spawn(int w, const RenderFn& render, const StartFn& start)
+    {
+        int commands[2];
+        int results[2];
+        if (pipe(commands) != 0)
+        {
+            fprintf(stderr, "Err: failed to create a worker pipe.\n");
+            return false;
+        }
+        if (pipe(results) != 0)
+        {
+            close(commands[0]);
+            close(commands[1]);
+            fprintf(stderr, "Err: failed to create a worker pipe.\n");
+            return false;
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "Err: failed to fork worker %d.\n", w);
+            close(commands[0]);
+            close(commands[1]);
+            close(results[0]);
+            close(results[1]);
+            return false;
+        }
+
+        if (pid == 0)
+        {
+            // The pipes of the other workers would keep them alive.
+            for (size_t k = 0; k < m_workers.size(); ++k)
+            {
+                if (m_workers[k].pid > 0)
+                {
+                    close(m_workers[k].commands);
+                    close(m_workers[k].results);
+                }
+            }
+            close(commands[1]);
+            close(results[0]);
+
+            WorkerMain(w, commands[0], results[1], render, start);
+            _exit(0);
+        }
+
+        close(commands[0]);
+        close(results[1]);
+
+        Worker& worker = m_workers[w];
+        worker.pid = pid;
+        worker.commands = commands[1];
+        worker.results = results[0];
+
+        return true;
+    };
+
+    void WorkerMain(int w, int commands, int results, const RenderFn& render, const StartFn& start)
+    {
+        if (start)
+        {
+            start(w);
+        }
+
+        Command command;
+        while (ReadAll(commands, &command, sizeof(command)))
+        {
+            Result result;
+            result.job = command.job;
+            result.slot = command.slot;
+            {
+                LF_TRACE_SCOPE("shard/job");
+                result.ok = render(command.job, m_slots[command.slot]) ? 1 : 0;
+            }
+
+            if (!WriteAll(results, &result, sizeof(result)))
+            {
+                break;
+            }
+        }
+    };
+
+    // \brief hand out the free slots to the workers with jobs left,
+    // round robin.
+    void Dispatch()
+    {
+        bool sent = true;
+        while (sent && !m_freeSlots.empty())
+        {
+            sent = false;
+            for (size_t w = 0; w < m_workers.size() && !m_freeSlots.empty(); ++w)
+            {
+                Worker& worker = m_workers[w];
+                if (worker.pid <= 0 || worker.pending.empty() || worker.running.size() >= SHARD_DEPTH)
+                {
+                    continue;
+                }
+
+                Command command;
+                command.job = worker.pending.front();
+                command.slot = m_freeSlots.back();
+                if (!WriteAll(worker.commands, &command, sizeof(command)))
+                {
+                    // It died; poll sees the end of its results.
+                    continue;
+                }
+
+                worker.pending.pop_front();
+                worker.running.push_back(command);
+                m_freeSlots.pop_back();
+                sent = true;
+            }
+        }
+    };
+
+    // \brief reap a dead worker and put its running jobs back at the
+    // front of its shard. It renders them in order, so the first one
+    // crashed it; the others only waited.
+    // \return the jobs given up.
+    int Recover(int w)
+    {
+        Worker& worker = m_workers[w];
+
+        int status = 0;
+        waitpid(worker.pid, &status, 0);
+        close(worker.commands);
+        close(worker.results);
+        worker.pid = -1;
+
+        fprintf(stderr, "Err: worker %d died (status %d).\n", w, status);
+
+        int lost = 0;
+        while (!worker.running.empty())
+        {
+            Command command = worker.running.back();
+            worker.running.pop_back();
+            m_freeSlots.push_back(command.slot);
+
+            bool crashed = worker.running.empty();
+            if (!crashed || ++m_attempts[command.job] < SHARD_ATTEMPTS)
+            {
+                worker.pending.push_front(command.job);
+            }
+            else
+            {
+                fprintf(stderr, "Err: job %d crashed %d workers, given up.\n",
+                        command.job, SHARD_ATTEMPTS);
+                ++lost;
+            }
+        }
+
+        return lost;
+    };
+
+    // \brief close the command pipes and wait for the workers.
+    void Shutdown()
+    {
+        for (size_t w = 0; w < m_workers.size(); ++w)
+        {
+            Worker& worker = m_workers[w];
+            if (worker.pid > 0)
+            {
+                close(worker.commands);
+                close(worker.results);
+                waitpid(worker.pid, 0, 0);
+                worker.pid = -1;
+            }
+        }
+    };
+
+    static bool ReadAll(int fd, void* data, size_t n)
+    {
+        char* p = (char*)data;
+        while (n > 0)
+        {
+            ssize_t got = read(fd, p, n);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                return false;
+            }
+            p += got;
+            n -= (size_t)got;
+        }
+        return true;
+    };
+
+    static bool WriteAll(int fd, const void* data, size_t n)
+    {
+        const char* p = (const char*)data;
+        while (n > 0)
+        {
+            ssize_t put = write(fd, p, n);
+            if (put < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (put <= 0)
+            {
+                return false;
+            }
+            p += put;
+            n -= (size_t)put;
+        }
+        return true;
+    };
+
+private:
+    CvSize                 m_size;
+    int                    m_depth;
+    int                    m_channels;
+
+    char*                  m_pRing;    // the frame slots, shared with the workers.
+    size_t                 m_ringSize;
+    std::vector<IplImage*> m_slots;    // headers over the ring.
+    std::vector<int>       m_freeSlots;
+
+    std::vector<Worker>    m_workers;
+    std::vector<int>       m_attempts; // the crashes per job.
+    int                    m_restarts;
+};
+
+#endif // !_WIN32
+
+#endif // !SHARD_H
@@ -0,0 +1,549 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   starburst.h
+ *
+ * Abstract:
+ *
+ *   Physically based starbursts from the diffraction of an
+ *   N-blade aperture.
+ *
+ *   The far-field diffraction pattern of an aperture is the power
+ *   spectrum of its Fourier transform. The aperture is rasterized
+ *   with the anti-aliased scan converter of poly.cpp, transformed
+ *   with a real 2D FFT and kept per aperture shape. The pattern of
+ *   a wavelength is the same spectrum scaled by the wavelength, so
+ *   the colored starburst is the sum of a few scaled copies
+ *   weighted by the RGB response of each wavelength. That RGB
+ *   kernel is kept as well, so a new color or intensity is only a
+ *   multiply-add into the image.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef STARBURST_H
+#define STARBURST_H
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "common.h"
+#include "poly.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// The wavelength in nm the spectrum is computed at.
+#define STARBURST_REFERENCE_NM 550.0f
+
+// \brief the in-place radix-2 FFT of n complex values (interleaved
+// re, im), n a power of two.
+class FFT
+{
+public:
+    FFT(int n)
+    {
+        m_n = n;
+
+        m_bitReverse.resize(n);
+        int bits = 0;
+        while ((1 << bits) < n)
+        {
+            bits++;
+        }
+        for (int k = 0; k < n; ++k)
+        {
+            int r = 0;
+            for (int b = 0; b < bits; ++b)
+            {
+                r |= ((k >> b) & 1) << (bits - 1 - b);
+            }
+            m_bitReverse[k] = r;
+        }
+
+        // exp(-2 pi i k / n) for k < n / 2.
+        m_twiddle.resize(n > 1 ? n : 2);
+        for (int k = 0; k < n / 2; ++k)
+        {
+            double a = -2.0 * M_PI * (double)k / (double)n;
+            m_twiddle[2 * k] = (float)cos(a);
+            m_twiddle[2 * k + 1] = (float)sin(a);
+        }
+    };
+
+    int GetSize() const
+    {
+        return m_n;
+    };
+
+    // \brief the forward transform (no scaling).
+    void Forward(float* data) const
+    {
+        for (int k = 0; k < m_n; ++k)
+        {
+            int r = m_bitReverse[k];
+            if (r > k)
+            {
+                float re = data[2 * k], im = data[2 * k + 1];
+                data[2 * k] = data[2 * r];
+                data[2 * k + 1] = data[2 * r + 1];
+                data[2 * r] = re;
+                data[2 * r + 1] = im;
+            }
+        }
+
+        for (int half = 1; half < m_n; half *= 2)
+        {
+            int step = m_n / (2 * half);
+            for (int start = 0; start < m_n; start += 2 * half)
+            {
+                for (int k = 0; k < half; ++k)
+                {
+                    float wr = m_twiddle[2 * k * step];
+                    float wi = m_twiddle[2 * k * step + 1];
+                    float* a = data + 2 * (start + k);
+                    float* b = data + 2 * (start + k + half);
+
+                    float tr = b[0] * wr - b[1] * wi;
+                    float ti = b[0] * wi + b[1] * wr;
+                    b[0] = a[0] - tr;
+                    b[1] = a[1] - ti;
+                    a[0] += tr;
+                    a[1] += ti;
+                }
+            }
+        }
+    };
+
+private:
+    int                m_n;
+    std::vector<int>   m_bitReverse;
+    std::vector<float> m_twiddle;
+};
+
+// \brief the power spectrum of an n x n real image, n a power of
+// two. Two rows are transformed as one complex row, and only the
+// n / 2 + 1 non-redundant columns are transformed.
+//
+// \param image n x n values, row by row.
+// \param power receives n x n values with the DC term at (n/2, n/2).
+static inline
+void powerSpectrum(const float* image, float* power, int n, ThreadPool& pool)
+{
+    FFT fft(n);
+    int columns = n / 2 + 1;
+
+    // The row transforms, columns 0..n/2 of each row.
+    std::vector<float> rows((size_t)n * columns * 2);
+    pool.ParallelFor(n / 2, 8, [&](int begin, int end) {
+        std::vector<float> z(2 * n);
+        for (int pair = begin; pair < end; ++pair)
+        {
+            const float* a = image + (2 * pair) * n;
+            const float* b = a + n;
+            for (int k = 0; k < n; ++k)
+            {
+                z[2 * k] = a[k];
+                z[2 * k + 1] = b[k];
+            }
+            fft.Forward(&z[0]);
+
+            // Split Z into A = (Z[f] + conj(Z[-f])) / 2 and
+            // B = (Z[f] - conj(Z[-f])) / 2i.
+            float* pa = &rows[(size_t)(2 * pair) * columns * 2];
+            float* pb = pa + columns * 2;
+            for (int f = 0; f < columns; ++f)
+            {
+                int g = (n - f) & (n - 1);
+                float zr = z[2 * f], zi = z[2 * f + 1];
+                float cr = z[2 * g], ci = -z[2 * g + 1];
+                pa[2 * f] = 0.5f * (zr + cr);
+                pa[2 * f + 1] = 0.5f * (zi + ci);
+                pb[2 * f] = 0.5f * (zi - ci);
+                pb[2 * f + 1] = -0.5f * (zr - cr);
+            }
+        }
+    });
+
+    // The column transforms; the other half of the spectrum is the
+    // mirror image, P(-v, -f) = P(v, f).
+    int h = n / 2;
+    pool.ParallelFor(columns, 8, [&](int begin, int end) {
+        std::vector<float> z(2 * n);
+        for (int f = begin; f < end; ++f)
+        {
+            for (int v = 0; v < n; ++v)
+            {
+                z[2 * v] = rows[((size_t)v * columns + f) * 2];
+                z[2 * v + 1] = rows[((size_t)v * columns + f) * 2 + 1];
+            }
+            fft.Forward(&z[0]);
+
+            for (int v = 0; v < n; ++v)
+            {
+                float p = z[2 * v] * z[2 * v] + z[2 * v + 1] * z[2 * v + 1];
+                int row = (v + h) & (n - 1);
+                power[row * n + ((f + h) & (n - 1))] = p;
+                int mirror = (n - v) & (n - 1);
+                power[((mirror + h) & (n - 1)) * n + ((n - f + h) & (n - 1))] = p;
+            }
+        }
+    });
+}
+
+// \brief the shape of an aperture.
+struct ApertureShape
+{
+    int   blades;    // the number of blades, below 3 for a circle.
+    float rotation;  // radians.
+    float roundness; // 0 for straight blades to 1 for a circle.
+    int   size;      // the FFT size, a power of two up to 2048.
+    int   grid;      // the PolyGrid the aperture is rasterized on,
+                     // up to POLY_GRID_16X32.
+
+    bool operator<(const ApertureShape& other) const
+    {
+        if (blades != other.blades) return blades < other.blades;
+        if (rotation != other.rotation) return rotation < other.rotation;
+        if (roundness != other.roundness) return roundness < other.roundness;
+        if (size != other.size) return size < other.size;
+        return grid < other.grid;
+    };
+
+    bool operator==(const ApertureShape& other) const
+    {
+        return !(*this < other) && !(other < *this);
+    };
+};
+
+class Starburst
+{
+public:
+    // \brief constructor.
+    //
+    // \param maxShapes the number of spectra kept.
+    // \param pPool the threads to run on, 0 for the shared pool.
+    Starburst(int maxShapes = 8, ThreadPool* pPool = 0)
+    {
+        m_maxShapes = maxShapes > 0 ? maxShapes : 1;
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+        m_clock = 0;
+        m_radius = -1;
+        m_scale = 0;
+        m_dispersion = 0;
+        m_wavelengths = 0;
+        memset(&m_shape, 0, sizeof(m_shape));
+    };
+
+    // \brief the diffraction pattern of the aperture at the reference
+    // wavelength: size x size values with the center at (size/2,
+    // size/2), normalized to 1 there. Computed once per shape.
+    //
+    // \return 0 if the size is not supported.
+    const std::vector<float>* GetSpectrum(const ApertureShape& shape)
+    {
+        if (shape.size < 16 || shape.size > 2048 || (shape.size & (shape.size - 1)) != 0)
+        {
+            return 0;
+        }
+
+        std::map<ApertureShape, Entry>::iterator it = m_spectra.find(shape);
+        if (it != m_spectra.end())
+        {
+            it->second.lastUse = ++m_clock;
+            return &it->second.spectrum;
+        }
+
+        // Drop the least recently used spectrum.
+        if ((int)m_spectra.size() >= m_maxShapes)
+        {
+            std::map<ApertureShape, Entry>::iterator oldest = m_spectra.begin();
+            for (it = m_spectra.begin(); it != m_spectra.end(); ++it)
+            {
+                if (it->second.lastUse < oldest->second.lastUse)
+                {
+                    oldest = it;
+                }
+            }
+            m_spectra.erase(oldest);
+        }
+
+        LF_TRACE_SCOPE("starburst/fft");
+
+        int n = shape.size;
+        std::vector<float> aperture((size_t)n * n, 0.0f);
+        RasterizeAperture(shape, &aperture[0]);
+
+        Entry& entry = m_spectra[shape];
+        entry.lastUse = ++m_clock;
+        entry.spectrum.resize((size_t)n * n);
+        powerSpectrum(&aperture[0], &entry.spectrum[0], n, *m_pPool);
+
+        float dc = entry.spectrum[(n / 2) * n + n / 2];
+        float scale = dc > 0 ? 1.0f / dc : 0.0f;
+        for (size_t k = 0; k < entry.spectrum.size(); ++k)
+        {
+            entry.spectrum[k] *= scale;
+        }
+
+        return &entry.spectrum;
+    };
+
+    // \brief build the RGB starburst kernel. Nothing is done if the
+    // parameters are those of the last call.
+    //
+    // \param shape the aperture.
+    // \param radius the half size of the kernel in pixels.
+    // \param scale the pixels per spectrum sample at the reference
+    //    wavelength.
+    // \param dispersion the spread of the wavelengths, 0 for none
+    //    and 1 for the physical one.
+    // \param wavelengths the number of wavelengths from 400 to 700 nm.
+    // \return false if the shape is not supported.
+    bool Prepare(const ApertureShape& shape,
+                 int radius,
+                 float scale,
+                 float dispersion = 1.0f,
+                 int wavelengths = 16)
+    {
+        if (radius == m_radius && scale == m_scale && dispersion == m_dispersion &&
+            wavelengths == m_wavelengths && shape == m_shape)
+        {
+            return true;
+        }
+
+        const std::vector<float>* pSpectrum = GetSpectrum(shape);
+        if (pSpectrum == 0 || radius < 0 || scale <= 0 || wavelengths < 1)
+        {
+            fprintf(stderr, "Err: unsupported starburst parameters.\n");
+            return false;
+        }
+
+        LF_TRACE_SCOPE("starburst/kernel");
+
+        // The RGB response of each wavelength. The pattern of a
+        // wavelength spreads over scale^2 as much area, so its peak
+        // falls by as much; the weights are balanced so that white
+        // light still peaks at white.
+        static const float centers[3] = {450.0f, 550.0f, 610.0f}; // B, G, R
+        static const float widths[3]  = {35.0f, 40.0f, 40.0f};
+        std::vector<float> weights(wavelengths * 3);
+        std::vector<float> scales(wavelengths);
+        float total[3] = {0, 0, 0};
+        for (int k = 0; k < wavelengths; ++k)
+        {
+            float nm = wavelengths > 1 ? 400.0f + 300.0f * (float)k / (float)(wavelengths - 1)
+                                       : STARBURST_REFERENCE_NM;
+            float relative = 1.0f + dispersion * (nm / STARBURST_REFERENCE_NM - 1.0f);
+            scales[k] = scale * relative;
+            for (int c = 0; c < 3; ++c)
+            {
+                float d = (nm - centers[c]) / widths[c];
+                weights[k * 3 + c] = exp(-0.5f * d * d) / (relative * relative);
+                total[c] += weights[k * 3 + c];
+            }
+        }
+        for (int k = 0; k < wavelengths; ++k)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                weights[k * 3 + c] /= total[c];
+            }
+        }
+
+        int size = 2 * radius + 1;
+        int n = shape.size;
+        const float* spectrum = &(*pSpectrum)[0];
+        m_kernel.assign((size_t)size * size * 3, 0.0f);
+
+        m_pPool->ParallelFor(size, 16, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                float* dst = &m_kernel[(size_t)i * size * 3];
+                for (int j = 0; j < size; ++j, dst += 3)
+                {
+                    for (int k = 0; k < wavelengths; ++k)
+                    {
+                        float v = Sample(spectrum, n, (float)(j - radius) / scales[k],
+                                         (float)(i - radius) / scales[k]);
+                        dst[0] += v * weights[k * 3];
+                        dst[1] += v * weights[k * 3 + 1];
+                        dst[2] += v * weights[k * 3 + 2];
+                    }
+                }
+            }
+        });
+
+        m_shape = shape;
+        m_radius = radius;
+        m_scale = scale;
+        m_dispersion = dispersion;
+        m_wavelengths = wavelengths;
+
+        return true;
+    };
+
+    // \brief add the prepared kernel to the image.
+    //
+    // \param dst a 3-channel float image.
+    // \param x the x coordinate of the light.
+    // \param y ditto.
+    // \param color the BGR color of the light in [0, 255].
+    // \param intensity the scale of the color.
+    // \return false if not prepared or the image is not supported.
+    bool Render(IplImage* dst, int x, int y, const float color[3], float intensity)
+    {
+        if (m_radius < 0 || dst->depth != IPL_DEPTH_32F || dst->nChannels != 3)
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("starburst/render");
+
+        int size = 2 * m_radius + 1;
+        int x0 = MAX(x - m_radius, 0);
+        int y0 = MAX(y - m_radius, 0);
+        int x1 = MIN(x + m_radius + 1, dst->width);
+        int y1 = MIN(y + m_radius + 1, dst->height);
+
+        float c[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            c[k] = color[k] * intensity;
+        }
+
+        for (int i = y0; i < y1; ++i)
+        {
+            const float* src = &m_kernel[((size_t)(i - y + m_radius) * size + (x0 - x + m_radius)) * 3];
+            float* p = (float*)(dst->imageData + i * dst->widthStep) + x0 * 3;
+            for (int j = x0; j < x1; ++j, src += 3, p += 3)
+            {
+                p[0] += src[0] * c[0];
+                p[1] += src[1] * c[1];
+                p[2] += src[2] * c[2];
+            }
+        }
+
+        return true;
+    };
+
+private:
+    struct Entry
+    {
+        std::vector<float> spectrum;
+        unsigned long      lastUse;
+    };
+
+    struct Raster
+    {
+        float* image;
+        int    n;
+        int    columns; // the subpixels of the grid.
+        int    rows;
+    };
+
+    static int ScreenX(Vertex* v, void* user)
+    {
+        return (int)(v->image.x * ((Raster*)user)->columns);
+    };
+
+    static void Lerp(double alpha, Vertex* a, Vertex* b, Vertex* out, void*)
+    {
+        out->image.x = LERP(alpha, a->image.x, b->image.x);
+        out->image.y = LERP(alpha, a->image.y, b->image.y);
+        out->y = (int)LERP(alpha, a->y, b->y);
+    };
+
+    static void RenderPixel(int x, int y, Vertex*, int area, unsigned[], Surface*, void* user)
+    {
+        Raster* pRaster = (Raster*)user;
+        if (x >= 0 && x < pRaster->n && y >= 0 && y < pRaster->n)
+        {
+            pRaster->image[y * pRaster->n + x] = (float)area / (float)(pRaster->rows * pRaster->columns);
+        }
+    };
+
+    // \brief the aperture, a quarter of the grid wide so that the
+    // spectrum is sampled finely enough.
+    static void RasterizeAperture(const ApertureShape& shape, float* image)
+    {
+        int n = shape.size;
+        float center = 0.5f * (float)n;
+        float radius = 0.125f * (float)n;
+
+        // Curved blades bulge between the corners of the polygon.
+        int blades = shape.blades >= 3 ? shape.blades : 0;
+        int segments = blades > 0 ? 8 : 1;
+        int count = blades > 0 ? blades * segments : 64;
+
+        PolyGrid grid = (PolyGrid)clip(shape.grid, 0, POLY_GRID_16X32);
+        Raster raster = { image, n, polyGridColumns(grid), polyGridRows(grid) };
+
+        std::vector<Vertex> polygon(count);
+        for (int k = 0; k < count; ++k)
+        {
+            // Counterclockwise in y-down space, the scan order.
+            float a = shape.rotation - 2.0f * (float)M_PI * (float)k / (float)count;
+            float r = radius;
+            if (blades > 0)
+            {
+                float sector = 2.0f * (float)M_PI / (float)blades;
+                float local = (float)(k % segments) / (float)segments * sector - 0.5f * sector;
+                float flat = radius * cos(0.5f * sector) / cos(local);
+                r = flat + (radius - flat) * shape.roundness;
+            }
+
+            memset(&polygon[k], 0, sizeof(Vertex));
+            polygon[k].image.x = center + r * cos(a);
+            polygon[k].image.y = center + r * sin(a);
+            polygon[k].y = (int)(polygon[k].image.y * raster.rows);
+        }
+
+        PolyCallbacks callbacks = { ScreenX, Lerp, RenderPixel, &raster };
+        Surface surface = { 255, 255, 255 };
+        drawPolygonGrid(grid, &polygon[0], count, &surface, &callbacks);
+    };
+
+    // \brief the bilinear sample of the spectrum at (x, y) from its
+    // center, 0 outside.
+    static float Sample(const float* spectrum, int n, float x, float y)
+    {
+        x += 0.5f * (float)n;
+        y += 0.5f * (float)n;
+        if (x < 0 || y < 0 || x >= (float)(n - 1) || y >= (float)(n - 1))
+        {
+            return 0;
+        }
+
+        int xi = (int)x, yi = (int)y;
+        float tx = x - (float)xi, ty = y - (float)yi;
+        const float* p = spectrum + yi * n + xi;
+        float top = p[0] + (p[1] - p[0]) * tx;
+        float bottom = p[n] + (p[n + 1] - p[n]) * tx;
+        return top + (bottom - top) * ty;
+    };
+
+private:
+    int                            m_maxShapes;
+    ThreadPool*                    m_pPool;
+    std::map<ApertureShape, Entry> m_spectra;
+    unsigned long                  m_clock;
+
+    // The last prepared kernel, (2 m_radius + 1)^2 BGR values.
+    std::vector<float>             m_kernel;
+    ApertureShape                  m_shape;
+    int                            m_radius;
+    float                          m_scale;
+    float                          m_dispersion;
+    int                            m_wavelengths;
+};
+
+#endif // !STARBURST_H
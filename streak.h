@@ -0,0 +1,349 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   streak.h
+ *
+ * Abstract:
+ *
+ *   Directional streaks (star filter arms, stripes) at any angle
+ *   at a constant cost per pixel.
+ *
+ *   The image is cut into parallel sampling lines along the streak
+ *   direction. The lines step one pixel along the major axis and
+ *   tan(angle) along the minor one, where the samples are linearly
+ *   interpolated; every pixel belongs to the nearest line. Along a
+ *   line, a box filter is the difference of two prefix sums (a
+ *   running sum), so its cost does not depend on the length. A few
+ *   box stages give the fading profile: one is a flat bar, two fade
+ *   linearly, three fade smoothly.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef STREAK_H
+#define STREAK_H
+
+#include <vector>
+
+#include "common.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// The most box stages of the fading profile.
+#define STREAK_MAX_STAGES 4
+
+// \brief the geometry of the sampling lines of one angle. The line
+// v0 passes through (u, v0 + u * slope) in (major, minor) coordinates
+// and owns the pixels (u, v0 + round(u * slope)).
+struct StreakLines
+{
+    int    numU;      // pixels along the major axis.
+    int    numV;      // pixels along the minor axis.
+    int    stepU;     // floats between neighbours along the major axis.
+    int    stepV;     // ditto, minor axis.
+    float  slope;     // the minor step per major step, in [-1, 1].
+    float  density;   // major steps per pixel of length.
+    int    firstLine; // the v0 of the first line.
+    int    numLines;
+
+    // The offsets of the lines at each u, the same for all lines.
+    std::vector<int>   lower;   // floor(u * slope).
+    std::vector<float> weight;  // u * slope - lower.
+    std::vector<int>   nearest; // round(u * slope).
+
+    // \brief set up the lines of an image at an angle.
+    void Init(const IplImage* image, float angle)
+    {
+        float c = cos(angle);
+        float s = sin(angle);
+        int stepX = image->nChannels;
+        int stepY = image->widthStep / sizeof(float);
+
+        if (fabs(c) >= fabs(s))
+        {
+            numU = image->width;
+            numV = image->height;
+            stepU = stepX;
+            stepV = stepY;
+            slope = s / c;
+            density = fabs(c);
+        }
+        else
+        {
+            numU = image->height;
+            numV = image->width;
+            stepU = stepY;
+            stepV = stepX;
+            slope = c / s;
+            density = fabs(s);
+        }
+
+        lower.resize(numU);
+        weight.resize(numU);
+        nearest.resize(numU);
+        for (int u = 0; u < numU; ++u)
+        {
+            float v = (float)u * slope;
+            lower[u] = (int)floor(v);
+            weight[u] = v - (float)lower[u];
+            nearest[u] = (int)floor(v + 0.5f);
+        }
+
+        // The lines owning some pixel.
+        int shift = nearest[numU - 1];
+        firstLine = -MAX(0, shift);
+        numLines = numV + MAX(0, shift) - MIN(0, shift);
+    };
+
+    // \brief the range [begin, end) of u where the line v0 has
+    // samples inside the image.
+    void GetRange(int v0, int& begin, int& end) const
+    {
+        if (slope == 0)
+        {
+            begin = 0;
+            end = (v0 >= 0 && v0 < numV) ? numU : 0;
+            return;
+        }
+
+        // Solve -1 < v0 + u * slope < numV, with a sample to spare.
+        float u0 = (-1.0f - (float)v0) / slope;
+        float u1 = ((float)numV - (float)v0) / slope;
+        if (u0 > u1)
+        {
+            float t = u0;
+            u0 = u1;
+            u1 = t;
+        }
+
+        begin = MAX(0, (int)floor(u0));
+        end = MIN(numU, (int)ceil(u1) + 1);
+        if (end < begin)
+        {
+            end = begin;
+        }
+    };
+
+    // \brief the line owning the pixel (u, v).
+    int GetLine(int u, int v) const
+    {
+        return v - nearest[u];
+    };
+};
+
+// \brief the radii in line samples of the box stages of a streak.
+// The radii add up to the length, so the profile reaches length
+// pixels from the source on each side.
+static inline
+void streakRadii(float length, float density, int stages, int radii[])
+{
+    float total = length * density;
+    for (int k = 0; k < stages; ++k)
+    {
+        float share = total * (float)(k + 1) / (float)stages - total * (float)k / (float)stages;
+        radii[k] = MAX(0, (int)floor(share + 0.5f));
+    }
+}
+
+class StreakFilter
+{
+public:
+    // \brief constructor.
+    //
+    // \param pPool the threads to run on, 0 for the shared pool.
+    StreakFilter(ThreadPool* pPool = 0)
+    {
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+    };
+
+    // \brief add the streak of src through every pixel to dst, along
+    // the angle in both directions.
+    //
+    // \param src a float image of 1 to 4 channels.
+    // \param dst a float image of the same size and channels, which
+    //    may not be src.
+    // \param angle the direction of the streak in radians.
+    // \param length the length of each side of the streak in pixels.
+    // \param gain the scale of the streak; the profile sums to 1.
+    // \param stages the number of box stages, 1 to STREAK_MAX_STAGES.
+    // \return false if the images are not supported.
+    bool Apply(const IplImage* src,
+               IplImage* dst,
+               float angle,
+               float length,
+               float gain = 1.0f,
+               int stages = 2)
+    {
+        if (src->depth != IPL_DEPTH_32F || dst->depth != IPL_DEPTH_32F ||
+            src->nChannels < 1 || src->nChannels > 4 || src->nChannels != dst->nChannels ||
+            src->width != dst->width || src->height != dst->height ||
+            src->widthStep != dst->widthStep || src == dst ||
+            stages < 1 || stages > STREAK_MAX_STAGES)
+        {
+            return false;
+        }
+
+        LF_TRACE_SCOPE("streak");
+
+        StreakLines lines;
+        lines.Init(src, angle);
+
+        int radii[STREAK_MAX_STAGES];
+        streakRadii(length, lines.density, stages, radii);
+
+        const float* pSrc = (const float*)src->imageData;
+        float* pDst = (float*)dst->imageData;
+        int channels = src->nChannels;
+
+        m_pPool->ParallelFor(lines.numLines, 32, [&](int begin, int end) {
+            for (int l = begin; l < end; ++l)
+            {
+                FilterLine(lines, lines.firstLine + l, pSrc, pDst, channels, radii, stages, gain);
+            }
+        });
+
+        return true;
+    };
+
+    // \brief add a star of arms streaks through every pixel, at equal
+    // angles from the given one. Each arm runs both ways, so there
+    // are 2 * arms rays.
+    bool ApplyStar(const IplImage* src,
+                   IplImage* dst,
+                   int arms,
+                   float angle,
+                   float length,
+                   float gain = 1.0f,
+                   int stages = 2)
+    {
+        for (int k = 0; k < arms; ++k)
+        {
+            if (!Apply(src, dst, angle + (float)M_PI * (float)k / (float)arms, length, gain, stages))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+private:
+    // \brief filter one sampling line and write the pixels whose
+    // nearest line it is.
+    static void FilterLine(const StreakLines& lines,
+                           int v0,
+                           const float* src,
+                           float* dst,
+                           int channels,
+                           const int radii[],
+                           int stages,
+                           float gain)
+    {
+        int first, last;
+        lines.GetRange(v0, first, last);
+        if (last <= first)
+        {
+            return;
+        }
+
+        // The inner stages spread past the image; the outer ones
+        // bring that back, so the line is padded by their radii.
+        int pad = 0;
+        for (int s = 1; s < stages; ++s)
+        {
+            pad += radii[s];
+        }
+        int begin = first - pad;
+        int n = last - first + 2 * pad;
+
+        static thread_local std::vector<float> buffer;
+        buffer.assign((size_t)n * channels * 2, 0.0f);
+        float* samples = &buffer[0];
+        float* filtered = samples + n * channels;
+
+        // Gather, interpolating across the minor axis. The samples
+        // outside the image are 0.
+        for (int k = pad; k < pad + last - first; ++k)
+        {
+            int u = begin + k;
+            int vi = v0 + lines.lower[u];
+            float t = lines.weight[u];
+            float w0 = (vi >= 0 && vi < lines.numV) ? 1.0f - t : 0.0f;
+            float w1 = (vi + 1 >= 0 && vi + 1 < lines.numV) ? t : 0.0f;
+            const float* p0 = src + u * lines.stepU + clip(vi, 0, lines.numV - 1) * lines.stepV;
+            const float* p1 = src + u * lines.stepU + clip(vi + 1, 0, lines.numV - 1) * lines.stepV;
+
+            for (int c = 0; c < channels; ++c)
+            {
+                samples[k * channels + c] = w0 * p0[c] + w1 * p1[c];
+            }
+        }
+
+        // Each stage is a box, the difference of two prefix sums kept
+        // as a running sum in doubles so long lines don't drift. The
+        // samples past the ends are 0.
+        for (int s = 0; s < stages; ++s)
+        {
+            int r = radii[s];
+            if (r == 0)
+            {
+                continue;
+            }
+
+            double scale = 1.0 / (double)(2 * r + 1);
+            double sum[4] = {0, 0, 0, 0};
+            for (int k = 0; k <= r && k < n; ++k)
+            {
+                for (int c = 0; c < channels; ++c)
+                {
+                    sum[c] += samples[k * channels + c];
+                }
+            }
+
+            for (int k = 0; k < n; ++k)
+            {
+                const float* pAdd = k + r + 1 < n ? samples + (k + r + 1) * channels : 0;
+                const float* pSub = k - r >= 0 ? samples + (k - r) * channels : 0;
+
+                for (int c = 0; c < channels; ++c)
+                {
+                    filtered[k * channels + c] = (float)(sum[c] * scale);
+                    sum[c] += (pAdd != 0 ? pAdd[c] : 0.0f) - (pSub != 0 ? pSub[c] : 0.0f);
+                }
+            }
+
+            float* t = samples;
+            samples = filtered;
+            filtered = t;
+        }
+
+        // Scatter to the pixels this line owns.
+        for (int k = pad; k < pad + last - first; ++k)
+        {
+            int u = begin + k;
+            int v = v0 + lines.nearest[u];
+            if (v < 0 || v >= lines.numV)
+            {
+                continue;
+            }
+
+            float* p = dst + u * lines.stepU + v * lines.stepV;
+            for (int c = 0; c < channels; ++c)
+            {
+                p[c] += gain * samples[k * channels + c];
+            }
+        }
+    };
+
+private:
+    ThreadPool* m_pPool;
+};
+
+#endif // !STREAK_H
@@ -0,0 +1,341 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   sweep.h
+ *
+ * Abstract:
+ *
+ *   Render the variants of one effect over parameter axes, e.g.
+ *   to pick a look or to build training data.
+ *
+ *   Most effects are linear in their color: a result is the
+ *   coverage of the geometry times the color. So the geometry is
+ *   drawn once in white for every combination of the axes that
+ *   change it (seeds, a shape parameter) and each color and
+ *   brightness variant is only a multiply of that coverage. An
+ *   effect with a second color of its own (effect01, effect09) is
+ *   not, and is drawn once per variant instead. The variants go to
+ *   a callback or are laid out on a contact sheet.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "common.h"
+#include "buffer.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// \brief one variant of a sweep.
+struct SweepVariant
+{
+    int           index;      // the position in the sweep.
+    unsigned long seed;       // geometry axes.
+    float         param;
+    float         color[3];   // color axes, BGR in [0, 255].
+    float         brightness;
+};
+
+// \brief scale the white coverage by a color, n pixels of 3
+// channels: dst = src * color.
+static inline
+void colorizeSpan(const float* src, float* dst, int n, const float color[3])
+{
+    int k = 0;
+
+#ifdef LF_SSE2
+    // Four pixels are three registers with the colors rotated.
+    const __m128 c0 = _mm_setr_ps(color[0], color[1], color[2], color[0]);
+    const __m128 c1 = _mm_setr_ps(color[1], color[2], color[0], color[1]);
+    const __m128 c2 = _mm_setr_ps(color[2], color[0], color[1], color[2]);
+
+    for (; k + 4 <= n; k += 4)
+    {
+        const float* s = src + k * 3;
+        float* d = dst + k * 3;
+        _mm_storeu_ps(d,     _mm_mul_ps(_mm_loadu_ps(s),     c0));
+        _mm_storeu_ps(d + 4, _mm_mul_ps(_mm_loadu_ps(s + 4), c1));
+        _mm_storeu_ps(d + 8, _mm_mul_ps(_mm_loadu_ps(s + 8), c2));
+    }
+#endif
+
+    for (; k < n; ++k)
+    {
+        dst[k * 3]     = src[k * 3]     * color[0];
+        dst[k * 3 + 1] = src[k * 3 + 1] * color[1];
+        dst[k * 3 + 2] = src[k * 3 + 2] * color[2];
+    }
+}
+
+class Sweep
+{
+public:
+    // \brief draw the effect for the geometry of a variant (seed,
+    // param) in white at full brightness and return its result; if
+    // the effect is not linear in the color, draw it in the color and
+    // brightness of the variant.
+    typedef std::function<IplImage* (const SweepVariant& variant)> RenderFn;
+
+    // \brief receive a variant; the image is only valid in the call.
+    // Called from the pool threads.
+    typedef std::function<void (const SweepVariant& variant, const IplImage* image)> SinkFn;
+
+    // \param render draws the geometry.
+    // \param pPool the threads to colorize on, 0 for the shared pool.
+    Sweep(RenderFn render, ThreadPool* pPool = 0)
+    {
+        m_render = render;
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+        m_linear = true;
+    };
+
+    // \brief whether the result is the white result times the color,
+    // so the colors are multiplied in rather than drawn; true by
+    // default.
+    void SetColorLinear(bool linear)
+    {
+        m_linear = linear;
+    };
+
+    // \brief the axes. An empty axis is a single default value: seed
+    // 10001, param 0, white and brightness 1.
+    void AddSeed(unsigned long seed)
+    {
+        m_seeds.push_back(seed);
+    };
+
+    void AddParam(float param)
+    {
+        m_params.push_back(param);
+    };
+
+    void AddColor(const float color[3])
+    {
+        m_colors.push_back(color[0]);
+        m_colors.push_back(color[1]);
+        m_colors.push_back(color[2]);
+    };
+
+    void AddBrightness(float brightness)
+    {
+        m_brightness.push_back(brightness);
+    };
+
+    // \brief the variants in sweep order: seed, then param, then
+    // color, then brightness.
+    int GetVariantCount() const
+    {
+        return NumSeeds() * NumParams() * NumColors() * NumBrightness();
+    };
+
+    // \brief the number of times the effect is drawn.
+    int GetRenderCount() const
+    {
+        return m_linear ? NumSeeds() * NumParams() : GetVariantCount();
+    };
+
+    SweepVariant GetVariant(int index) const
+    {
+        SweepVariant variant;
+        variant.index = index;
+
+        int b = index % NumBrightness();
+        index /= NumBrightness();
+        int c = index % NumColors();
+        index /= NumColors();
+        int p = index % NumParams();
+        int s = index / NumParams();
+
+        variant.seed = m_seeds.empty() ? 10001 : m_seeds[s];
+        variant.param = m_params.empty() ? 0.0f : m_params[p];
+        for (int k = 0; k < 3; ++k)
+        {
+            variant.color[k] = m_colors.empty() ? 255.0f : m_colors[c * 3 + k];
+        }
+        variant.brightness = m_brightness.empty() ? 1.0f : m_brightness[b];
+
+        return variant;
+    };
+
+    // \brief render every variant to the sink.
+    // \return false if the effect failed to render.
+    bool Run(SinkFn sink)
+    {
+        return Run(sink, 0);
+    };
+
+    // \brief lay all variants out on a contact sheet, row by row.
+    //
+    // \param sheet the sheet, at least columns x rows cells of the
+    //    result size plus the gaps.
+    // \param columns the cells per row.
+    // \param gap the pixels between cells.
+    // \return false if the sheet is too small or a render failed.
+    bool RenderSheet(const LFBuffer* sheet, int columns, int gap)
+    {
+        // The first render gives the cell size and is reused.
+        const IplImage* pFirst = m_render(GetVariant(0));
+        if (pFirst == 0 || columns < 1)
+        {
+            return false;
+        }
+
+        int cellWidth = pFirst->width + gap;
+        int cellHeight = pFirst->height + gap;
+        int rows = (GetVariantCount() + columns - 1) / columns;
+        if (sheet->width < columns * cellWidth - gap || sheet->height < rows * cellHeight - gap)
+        {
+            fprintf(stderr, "Err: the contact sheet is too small.\n");
+            return false;
+        }
+
+        // The cells don't overlap, so the threads write them freely.
+        return Run([&](const SweepVariant& variant, const IplImage* image) {
+            lfWriteResult(image, sheet,
+                    (variant.index % columns) * cellWidth,
+                    (variant.index / columns) * cellHeight);
+        }, pFirst);
+    };
+
+private:
+    // \param pFirst the first render if it is already drawn, or 0.
+    bool Run(SinkFn sink, const IplImage* pFirst)
+    {
+        if (!m_linear)
+        {
+            return RunEach(sink, pFirst);
+        }
+
+        int colors = NumColors() * NumBrightness();
+
+        // The scratch images, one per busy thread.
+        std::vector<IplImage*> scratch;
+        std::mutex mutex;
+        bool ok = true;
+
+        for (int g = 0; g < GetRenderCount() && ok; ++g)
+        {
+            SweepVariant first = GetVariant(g * colors);
+
+            const IplImage* pCoverage = g == 0 ? pFirst : 0;
+            if (pCoverage == 0)
+            {
+                LF_TRACE_SCOPE("sweep/render");
+                pCoverage = m_render(first);
+            }
+            if (pCoverage == 0 || pCoverage->depth != IPL_DEPTH_32F || pCoverage->nChannels != 3)
+            {
+                fprintf(stderr, "Err: sweep variant %d failed to render.\n", first.index);
+                ok = false;
+                break;
+            }
+
+            LF_TRACE_SCOPE("sweep/colorize");
+
+            m_pPool->ParallelFor(colors, 1, [&](int begin, int end) {
+                IplImage* pImage = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!scratch.empty())
+                    {
+                        pImage = scratch.back();
+                        scratch.pop_back();
+                    }
+                }
+                if (pImage == 0)
+                {
+                    pImage = cvCreateImage(cvGetSize(pCoverage), IPL_DEPTH_32F, 3);
+                }
+
+                for (int v = begin; v < end; ++v)
+                {
+                    SweepVariant variant = GetVariant(g * colors + v);
+                    Colorize(pCoverage, pImage, variant);
+                    sink(variant, pImage);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                scratch.push_back(pImage);
+            });
+        }
+
+        for (size_t k = 0; k < scratch.size(); ++k)
+        {
+            cvReleaseImage(&scratch[k]);
+        }
+
+        return ok;
+    };
+
+    // \brief draw every variant in its color and hand it on as it is.
+    bool RunEach(SinkFn sink, const IplImage* pFirst)
+    {
+        for (int v = 0; v < GetVariantCount(); ++v)
+        {
+            SweepVariant variant = GetVariant(v);
+
+            const IplImage* pImage = v == 0 ? pFirst : 0;
+            if (pImage == 0)
+            {
+                LF_TRACE_SCOPE("sweep/render");
+                pImage = m_render(variant);
+            }
+            if (pImage == 0 || pImage->depth != IPL_DEPTH_32F || pImage->nChannels != 3)
+            {
+                fprintf(stderr, "Err: sweep variant %d failed to render.\n", variant.index);
+                return false;
+            }
+
+            sink(variant, pImage);
+        }
+
+        return true;
+    };
+
+    int NumSeeds() const      { return m_seeds.empty() ? 1 : (int)m_seeds.size(); };
+    int NumParams() const     { return m_params.empty() ? 1 : (int)m_params.size(); };
+    int NumColors() const     { return m_colors.empty() ? 1 : (int)m_colors.size() / 3; };
+    int NumBrightness() const { return m_brightness.empty() ? 1 : (int)m_brightness.size(); };
+
+    static void Colorize(const IplImage* pCoverage, IplImage* pImage, const SweepVariant& variant)
+    {
+        float color[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            color[k] = variant.color[k] / 255.0f * variant.brightness;
+        }
+
+        for (int i = 0; i < pCoverage->height; ++i)
+        {
+            colorizeSpan((const float*)(pCoverage->imageData + i * pCoverage->widthStep),
+                         (float*)(pImage->imageData + i * pImage->widthStep),
+                         pCoverage->width, color);
+        }
+    };
+
+private:
+    RenderFn             m_render;
+    ThreadPool*          m_pPool;
+    bool                 m_linear; // the colors are multiplied in.
+
+    std::vector<unsigned long> m_seeds;
+    std::vector<float>   m_params;
+    std::vector<float>   m_colors;
+    std::vector<float>   m_brightness;
+};
+
+#endif // !SWEEP_H
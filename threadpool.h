@@ -0,0 +1,247 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   threadpool.h
+ *
+ * Abstract:
+ *
+ *   A fixed pool of worker threads for data-parallel loops.
+ *
+ *   The threads are started by the first loop that needs them, not
+ *   by the constructor, so the shared pool can be asked for during
+ *   static initialization and a process that forks before any loop
+ *   (shard.h) forks with no pool threads.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+class ThreadPool
+{
+public:
+    typedef std::function<void (int begin, int end)> Task;
+
+    // \brief the process-wide pool with one thread per core.
+    static ThreadPool& Get()
+    {
+        static ThreadPool pool;
+        return pool;
+    };
+
+    // \param threads the number of threads including the caller's,
+    // 0 for one per core.
+    explicit ThreadPool(int threads = 0)
+    {
+        if (threads <= 0)
+        {
+            threads = (int)std::thread::hardware_concurrency();
+        }
+        m_numThreads = threads > 0 ? threads : 1;
+
+        m_pLoop = 0;
+        m_generation = 0;
+        m_active = 0;
+        m_quit = false;
+    };
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+
+        for (size_t t = 0; t < m_workers.size(); ++t)
+        {
+            m_workers[t].join();
+        }
+    };
+
+    int GetThreadCount() const
+    {
+        return m_numThreads;
+    };
+
+    // \brief change the number of threads, including the caller's.
+    // Only before the first loop, from the thread that runs them.
+    // \return false if the threads are already started.
+    bool SetThreadCount(int threads)
+    {
+        std::lock_guard<std::mutex> serial(m_serial);
+        if (!m_workers.empty())
+        {
+            return false;
+        }
+
+        m_numThreads = threads > 0 ? threads : 1;
+        return true;
+    };
+
+    // \brief whether a loop has started the threads.
+    bool IsStarted()
+    {
+        std::lock_guard<std::mutex> serial(m_serial);
+        return !m_workers.empty();
+    };
+
+    // \brief run task over [0, count) in chunks of grain items and
+    // wait for all of them. Called from a worker it runs inline.
+    void ParallelFor(int count, int grain, const Task& task)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+
+        grain = grain > 0 ? grain : 1;
+        if (m_numThreads == 1 || count <= grain || IsWorker())
+        {
+            task(0, count);
+            return;
+        }
+
+        // One loop at a time.
+        std::lock_guard<std::mutex> serial(m_serial);
+
+        // The calling thread of ParallelFor is one of the workers.
+        for (int t = (int)m_workers.size() + 1; t < m_numThreads; ++t)
+        {
+            m_workers.push_back(std::thread(&ThreadPool::WorkerMain, this));
+        }
+
+        Loop loop;
+        loop.pTask = &task;
+        loop.count = count;
+        loop.grain = grain;
+        loop.next.store(0);
+        loop.pending.store((count + grain - 1) / grain);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pLoop = &loop;
+            m_generation++;
+        }
+        m_wake.notify_all();
+
+        IsWorker() = true;
+        RunChunks(loop);
+        IsWorker() = false;
+
+        // No worker joins the loop once it is withdrawn; the ones in it
+        // still read it, so it lives until they leave.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&] { return loop.pending.load() == 0; });
+        m_pLoop = 0;
+        m_done.wait(lock, [this] { return m_active == 0; });
+    };
+
+private:
+    // \brief a ParallelFor in progress, published to the workers as a
+    // whole under m_mutex.
+    struct Loop
+    {
+        const Task*      pTask;
+        int              count;
+        int              grain;
+        std::atomic<int> next;
+        std::atomic<int> pending; // chunks not finished yet.
+    };
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    static bool& IsWorker()
+    {
+        static thread_local bool worker = false;
+        return worker;
+    };
+
+    void WorkerMain()
+    {
+        LF_TRACE_THREAD("worker");
+        IsWorker() = true;
+
+        unsigned long seen = 0;
+        for (;;)
+        {
+            Loop* pLoop;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_quit || (m_pLoop != 0 && m_generation != seen); });
+                if (m_quit)
+                {
+                    return;
+                }
+                seen = m_generation;
+                pLoop = m_pLoop;
+                m_active++;
+            }
+
+            RunChunks(*pLoop);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_active == 0)
+            {
+                m_done.notify_all();
+            }
+        }
+    };
+
+    void RunChunks(Loop& loop)
+    {
+        for (;;)
+        {
+            int begin = loop.next.fetch_add(loop.grain);
+            if (begin >= loop.count)
+            {
+                return;
+            }
+
+            int end = begin + loop.grain < loop.count ? begin + loop.grain : loop.count;
+            (*loop.pTask)(begin, end);
+
+            if (loop.pending.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.notify_all();
+            }
+        }
+    };
+
+private:
+    int                      m_numThreads;
+    std::vector<std::thread> m_workers;
+
+    std::mutex               m_serial;  // serializes ParallelFor calls
+                                        // and guards m_workers.
+    std::mutex               m_mutex;
+    std::condition_variable  m_wake;
+    std::condition_variable  m_done;
+
+    // Under m_mutex.
+    Loop*                    m_pLoop;      // the loop to join, 0 for none.
+    unsigned long            m_generation; // counts the loops.
+    int                      m_active;     // workers in m_pLoop.
+    bool                     m_quit;
+};
+
+#endif // !THREAD_POOL_H
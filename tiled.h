@@ -0,0 +1,305 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   tiled.h
+ *
+ * Abstract:
+ *
+ *   Out-of-core rendering of canvases too big for a float image,
+ *   e.g. 16k x 16k prints (3 GB as 3-channel float).
+ *
+ *   The canvas is drawn one tile at a time on the thread pool. Each
+ *   tile is drawn with a halo of extra pixels around it, so that a
+ *   pass reaching across the tile edge (a blur) sees the pixels of
+ *   the neighbours; the halo is cut off when the tile is converted
+ *   to 8 bits and handed to the sink, which streams it to the file.
+ *   Only the tiles in flight are in memory: about GetTileBytes()
+ *   per thread, whatever the canvas size.
+ *
+ *   Primitives are drawn per tile by moving them to the tile's
+ *   origin (cullPrimitives); one crossing a tile edge is drawn by
+ *   each tile it touches, and the pixels come out the same as from
+ *   drawing the whole canvas.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef TILED_H
+#define TILED_H
+
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "binning.h"
+#include "buffer.h"
+#include "common.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// \brief copy the primitives that reach into a region of the canvas,
+// moved to the region's origin, for drawing the region into an image
+// of its own size. Their order is kept.
+static inline
+void cullPrimitives(const PrimitiveList& src, CvRect region, PrimitiveList& dst)
+{
+    dst.Clear();
+
+    float x1 = (float)(region.x + region.width - 1);
+    float y1 = (float)(region.y + region.height - 1);
+    for (int p = 0; p < src.GetCount(); ++p)
+    {
+        float out = src.outer[p];
+        if (src.cx[p] + out < (float)region.x || src.cx[p] - out > x1 ||
+            src.cy[p] + out < (float)region.y || src.cy[p] - out > y1)
+        {
+            continue;
+        }
+        dst.Append(src, p, -region.x, -region.y);
+    }
+}
+
+class TiledRenderer
+{
+public:
+    // \brief draw the pixels of region (in canvas coordinates) into
+    // tile, a zeroed 3-channel float image of the region's size.
+    // Called from the pool threads.
+    // \return false to stop the rendering.
+    typedef std::function<bool (IplImage* tile, CvRect region)> RenderFn;
+
+    // \brief receive a finished tile, 8-bit BGR, whose top-left pixel
+    // is (x, y) on the canvas. The image is only valid in the call.
+    // Called from the pool threads.
+    // \return false to stop the rendering.
+    typedef std::function<bool (const IplImage* tile, int x, int y)> SinkFn;
+
+    // \brief constructor.
+    //
+    // \param tileSize the width and height of the tiles written.
+    // \param halo the pixels drawn around each tile and cut off.
+    // \param pPool the threads to run on, 0 for the shared pool.
+    TiledRenderer(int tileSize = 1024, int halo = 0, ThreadPool* pPool = 0)
+    {
+        m_tileSize = MAX(tileSize, 16);
+        m_halo = MAX(halo, 0);
+        m_pPool = pPool != 0 ? pPool : &ThreadPool::Get();
+    };
+
+    void SetHalo(int halo)
+    {
+        m_halo = MAX(halo, 0);
+    };
+
+    int GetTileSize() const
+    {
+        return m_tileSize;
+    };
+
+    // \brief the memory of one tile in flight: the float tile with its
+    // halo and the 8-bit tile.
+    size_t GetTileBytes() const
+    {
+        size_t side = (size_t)(m_tileSize + 2 * m_halo);
+        return side * side * 3 * sizeof(float) + (size_t)m_tileSize * m_tileSize * 3;
+    };
+
+    // \brief the most memory the tiles take at once.
+    size_t GetPeakBytes() const
+    {
+        return GetTileBytes() * m_pPool->GetThreadCount();
+    };
+
+    // \brief render a canvas tile by tile.
+    //
+    // \param width the canvas size.
+    // \param height
+    // \param render draws a tile with its halo; the halo is clipped to
+    //   the canvas, so at the canvas edges the tile is the edge.
+    // \param sink receives the tiles without their halo.
+    // \return false if render or sink failed.
+    bool Render(int width, int height, RenderFn render, SinkFn sink)
+    {
+        int tilesX = (width + m_tileSize - 1) / m_tileSize;
+        int tilesY = (height + m_tileSize - 1) / m_tileSize;
+        std::atomic<bool> failed(false);
+
+        LF_TRACE_SCOPE("tiled");
+
+        m_pPool->ParallelFor(tilesX * tilesY, 1, [&](int begin, int end) {
+            for (int t = begin; t < end && !failed.load(); ++t)
+            {
+                int x = (t % tilesX) * m_tileSize;
+                int y = (t / tilesX) * m_tileSize;
+                int w = MIN(m_tileSize, width - x);
+                int h = MIN(m_tileSize, height - y);
+
+                int x0 = MAX(x - m_halo, 0);
+                int y0 = MAX(y - m_halo, 0);
+                int x1 = MIN(x + w + m_halo, width);
+                int y1 = MIN(y + h + m_halo, height);
+                CvRect region = cvRect(x0, y0, x1 - x0, y1 - y0);
+
+                IplImage* pTile = cvCreateImage(cvSize(region.width, region.height), IPL_DEPTH_32F, 3);
+                IplImage* pOut = cvCreateImage(cvSize(w, h), IPL_DEPTH_8U, 3);
+                cvZero(pTile);
+
+                bool ok = render(pTile, region);
+                if (ok)
+                {
+                    LFBuffer buffer;
+                    lfWrapImage(pOut, &buffer);
+                    lfWriteResult(pTile, &buffer, x0 - x, y0 - y);
+                    ok = sink(pOut, x, y);
+                }
+                if (!ok)
+                {
+                    failed.store(true);
+                }
+
+                cvReleaseImage(&pOut);
+                cvReleaseImage(&pTile);
+            }
+        });
+
+        return !failed.load();
+    };
+
+private:
+    int         m_tileSize;
+    int         m_halo;
+    ThreadPool* m_pPool;
+};
+
+// \brief a binary PPM file written tile by tile, in any order and
+// from any thread. The file is sized up front and each tile row is
+// written at its place.
+class PPMTileWriter
+{
+public:
+    PPMTileWriter()
+    {
+        m_file = 0;
+        m_width = 0;
+        m_height = 0;
+        m_header = 0;
+        m_failed = false;
+    };
+
+    ~PPMTileWriter()
+    {
+        Close();
+    };
+
+    // \brief create (or truncate) the file of a canvas.
+    // \return false if failed and true if OK.
+    bool Create(const char* path, int width, int height)
+    {
+        Close();
+
+        m_file = fopen(path, "wb");
+        if (m_file == 0)
+        {
+            return false;
+        }
+
+        m_width = width;
+        m_height = height;
+        m_header = fprintf(m_file, "P6\n%d %d\n255\n", width, height);
+        m_failed = false;
+
+        int64_t size = m_header + (int64_t)width * height * 3;
+        if (m_header <= 0 || !Seek(size - 1) || fputc(0, m_file) == EOF)
+        {
+            fclose(m_file);
+            m_file = 0;
+            return false;
+        }
+        return true;
+    };
+
+    // \brief write a tile, 8-bit BGR, at (x, y) on the canvas.
+    // \return false if it failed or doesn't fit.
+    bool WriteTile(const IplImage* tile, int x, int y)
+    {
+        int w = tile->width;
+        int h = tile->height;
+        if (m_file == 0 || tile->depth != IPL_DEPTH_8U || tile->nChannels != 3 ||
+            x < 0 || y < 0 || x + w > m_width || y + h > m_height)
+        {
+            return false;
+        }
+
+        // PPM is RGB.
+        static thread_local std::vector<unsigned char> rgb;
+        rgb.resize((size_t)w * h * 3);
+        for (int i = 0; i < h; ++i)
+        {
+            const unsigned char* p = (const unsigned char*)(tile->imageData + i * tile->widthStep);
+            unsigned char* q = &rgb[(size_t)i * w * 3];
+            for (int j = 0; j < w; ++j, p += 3, q += 3)
+            {
+                q[0] = p[2];
+                q[1] = p[1];
+                q[2] = p[0];
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int i = 0; i < h && !m_failed; ++i)
+        {
+            if (!Seek(m_header + ((int64_t)(y + i) * m_width + x) * 3) ||
+                fwrite(&rgb[(size_t)i * w * 3], 3, w, m_file) != (size_t)w)
+            {
+                m_failed = true;
+            }
+        }
+        return !m_failed;
+    };
+
+    // \return false if any write failed.
+    bool Close()
+    {
+        if (m_file == 0)
+        {
+            return false;
+        }
+
+        bool ok = fclose(m_file) == 0 && !m_failed;
+        m_file = 0;
+        return ok;
+    };
+
+private:
+    PPMTileWriter(const PPMTileWriter&);
+    PPMTileWriter& operator=(const PPMTileWriter&);
+
+    bool Seek(int64_t offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(m_file, offset, SEEK_SET) == 0;
+#else
+        return fseeko(m_file, (off_t)offset, SEEK_SET) == 0;
+#endif
+    };
+
+private:
+    FILE*      m_file;
+    int        m_width;
+    int        m_height;
+    int        m_header; // bytes before the first pixel.
+    bool       m_failed;
+    std::mutex m_mutex;
+};
+
+#endif // !TILED_H
@@ -0,0 +1,60 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   timer.h
+ *
+ * Abstract:
+ *
+ *   High resolution wall clock timer.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+
+class Timer
+{
+public:
+    Timer()
+    {
+        Reset();
+    };
+
+    void Reset()
+    {
+        m_start = std::chrono::steady_clock::now();
+    };
+
+    double GetElapsedSeconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    };
+
+    double GetElapsedMilliseconds() const
+    {
+        return GetElapsedSeconds() * 1000.0;
+    };
+
+    // \brief microseconds since an arbitrary fixed point, shared
+    // by all timers of the process.
+    static double GetTimestamp()
+    {
+        static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+    };
+
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // !TIMER_H
@@ -0,0 +1,338 @@
+/**********************************************************\
+ *
+ * Hongwei Li
+ * Copyright (c) Hongwei Li
+ *
+ * File Name:
+ *
+ *   trace.h
+ *
+ * Abstract:
+ *
+ *   Scoped timers for the render stages.
+ *
+ *   LF_TRACE_SCOPE("stage") records the time spent in the
+ *   enclosing scope. The spans go to a buffer owned by the
+ *   calling thread, so recording never takes a lock, and each
+ *   thread also keeps per-stage counters (calls, total and
+ *   longest time). The spans can be exported as Chrome/Perfetto
+ *   trace JSON (chrome://tracing, ui.perfetto.dev) and the
+ *   counters can be queried at any time.
+ *
+ *   Tracing is compiled in with LF_ENABLE_TRACE only; otherwise
+ *   the macros expand to nothing and the Tracer is an empty stub.
+ *
+ * Author:
+ *
+ *   Hongwei Li
+ *
+ **********************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vector>
+#include <string>
+
+// \brief the aggregate of one stage over all threads.
+struct TraceStat
+{
+    std::string name;
+    long long   count;
+    double      total; // microseconds.
+    double      max;   // microseconds.
+};
+
+#ifdef LF_ENABLE_TRACE
+
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+
+#include "timer.h"
+
+// The number of spans kept per thread; later spans are dropped.
+#ifndef LF_TRACE_SPANS
+# define LF_TRACE_SPANS (1 << 18)
+#endif
+
+// The number of distinct stages per thread (a power of two).
+#define LF_TRACE_COUNTERS 64
+
+struct TraceSpan
+{
+    const char* name;
+    double      start;    // microseconds.
+    double      duration; // microseconds.
+};
+
+// \brief the trace data of one thread. Only the owning thread
+// writes it; readers see everything below the published counts.
+struct TraceThread
+{
+    struct Counter
+    {
+        std::atomic<const char*> name;
+        std::atomic<long long>   count;
+        std::atomic<double>      total;
+        std::atomic<double>      max;
+    };
+
+    int                 id;
+    std::string         name;
+    std::vector<TraceSpan> spans;
+    std::atomic<size_t> numSpans;
+    std::atomic<size_t> numDropped;
+    Counter             counters[LF_TRACE_COUNTERS];
+
+    TraceThread(int threadId)
+    {
+        id = threadId;
+        spans.resize(LF_TRACE_SPANS);
+        numSpans.store(0);
+        numDropped.store(0);
+        for (int k = 0; k < LF_TRACE_COUNTERS; ++k)
+        {
+            counters[k].name.store(0);
+            counters[k].count.store(0);
+            counters[k].total.store(0);
+            counters[k].max.store(0);
+        }
+    };
+
+    void Record(const char* stage, double start, double duration)
+    {
+        size_t n = numSpans.load(std::memory_order_relaxed);
+        if (n < spans.size())
+        {
+            TraceSpan& span = spans[n];
+            span.name = stage;
+            span.start = start;
+            span.duration = duration;
+            numSpans.store(n + 1, std::memory_order_release);
+        }
+        else
+        {
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // The stage names are literals, so their addresses are keys.
+        size_t k = ((size_t)stage >> 3) & (LF_TRACE_COUNTERS - 1);
+        for (int probe = 0; probe < LF_TRACE_COUNTERS; ++probe, k = (k + 1) & (LF_TRACE_COUNTERS - 1))
+        {
+            Counter& c = counters[k];
+            const char* key = c.name.load(std::memory_order_relaxed);
+            if (key == 0)
+            {
+                c.name.store(stage, std::memory_order_release);
+            }
+            else if (key != stage)
+            {
+                continue;
+            }
+
+            c.count.store(c.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            c.total.store(c.total.load(std::memory_order_relaxed) + duration, std::memory_order_relaxed);
+            if (duration > c.max.load(std::memory_order_relaxed))
+            {
+                c.max.store(duration, std::memory_order_relaxed);
+            }
+            return;
+        }
+    };
+};
+
+class Tracer
+{
+public:
+    static Tracer& Get()
+    {
+        static Tracer tracer;
+        return tracer;
+    };
+
+    // \brief the trace data of the calling thread.
+    TraceThread* GetThread()
+    {
+        static thread_local TraceThread* pThread = 0;
+        if (pThread == 0)
+        {
+            // The data outlives the thread so it can still be exported.
+            std::lock_guard<std::mutex> lock(m_mutex);
+            pThread = new TraceThread((int)m_threads.size() + 1);
+            m_threads.push_back(pThread);
+        }
+        return pThread;
+    };
+
+    void SetThreadName(const char* name)
+    {
+        TraceThread* pThread = GetThread();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pThread->name = name;
+    };
+
+    void Record(const char* stage, double start, double end)
+    {
+        GetThread()->Record(stage, start, end - start);
+    };
+
+    // \brief write the spans as Chrome trace event JSON.
+    // \return false if failed and true if OK.
+    bool ExportChrome(const char* path)
+    {
+        FILE* fp = fopen(path, "w");
+        if (fp == 0)
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+        bool first = true;
+        for (size_t t = 0; t < m_threads.size(); ++t)
+        {
+            const TraceThread* pThread = m_threads[t];
+
+            if (!pThread->name.empty())
+            {
+                fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                        "\"args\": {\"name\": \"%s\"}}", first ? "" : ",\n",
+                        pThread->id, pThread->name.c_str());
+                first = false;
+            }
+
+            size_t n = pThread->numSpans.load(std::memory_order_acquire);
+            for (size_t s = 0; s < n; ++s)
+            {
+                const TraceSpan& span = pThread->spans[s];
+                fprintf(fp, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f}", first ? "" : ",\n",
+                        span.name, pThread->id, span.start, span.duration);
+                first = false;
+            }
+        }
+        fprintf(fp, "\n]}\n");
+
+        fclose(fp);
+        return true;
+    };
+
+    // \brief the per-stage counters summed over all threads.
+    void GetStats(std::vector<TraceStat>& stats)
+    {
+        stats.clear();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (size_t t = 0; t < m_threads.size(); ++t)
+        {
+            const TraceThread* pThread = m_threads[t];
+            for (int k = 0; k < LF_TRACE_COUNTERS; ++k)
+            {
+                const TraceThread::Counter& c = pThread->counters[k];
+                const char* name = c.name.load(std::memory_order_acquire);
+                if (name == 0)
+                {
+                    continue;
+                }
+
+                // The same literal may have several addresses.
+                size_t s = 0;
+                while (s < stats.size() && stats[s].name != name)
+                {
+                    ++s;
+                }
+                if (s == stats.size())
+                {
+                    TraceStat stat;
+                    stat.name = name;
+                    stat.count = 0;
+                    stat.total = 0;
+                    stat.max = 0;
+                    stats.push_back(stat);
+                }
+
+                TraceStat& stat = stats[s];
+                double max = c.max.load(std::memory_order_relaxed);
+                stat.count += c.count.load(std::memory_order_relaxed);
+                stat.total += c.total.load(std::memory_order_relaxed);
+                stat.max = max > stat.max ? max : stat.max;
+            }
+        }
+    };
+
+    // \brief print the counters, one stage per line.
+    void PrintStats(FILE* fp)
+    {
+        std::vector<TraceStat> stats;
+        GetStats(stats);
+
+        fprintf(fp, "%-24s %10s %12s %12s %12s\n", "stage", "calls", "total ms", "mean ms", "max ms");
+        for (size_t s = 0; s < stats.size(); ++s)
+        {
+            const TraceStat& stat = stats[s];
+            fprintf(fp, "%-24s %10lld %12.3f %12.3f %12.3f\n", stat.name.c_str(), stat.count,
+                    stat.total / 1000.0, stat.total / 1000.0 / (stat.count > 0 ? stat.count : 1),
+                    stat.max / 1000.0);
+        }
+    };
+
+private:
+    Tracer() {};
+
+    std::mutex                m_mutex;
+    std::vector<TraceThread*> m_threads;
+};
+
+class ScopedTrace
+{
+public:
+    ScopedTrace(const char* stage)
+    {
+        m_stage = stage;
+        m_start = Timer::GetTimestamp();
+    };
+
+    ~ScopedTrace()
+    {
+        Tracer::Get().Record(m_stage, m_start, Timer::GetTimestamp());
+    };
+
+private:
+    const char* m_stage;
+    double      m_start;
+};
+
+#define LF_TRACE_CONCAT2(a, b) a##b
+#define LF_TRACE_CONCAT(a, b)  LF_TRACE_CONCAT2(a, b)
+
+#define LF_TRACE_SCOPE(stage)  ScopedTrace LF_TRACE_CONCAT(lfTrace, __LINE__)(stage)
+#define LF_TRACE_THREAD(name)  Tracer::Get().SetThreadName(name)
+
+#else // LF_ENABLE_TRACE
+
+#include <cstdio>
+
+class Tracer
+{
+public:
+    static Tracer& Get()
+    {
+        static Tracer tracer;
+        return tracer;
+    };
+
+    bool ExportChrome(const char*) { return false; };
+    void GetStats(std::vector<TraceStat>& stats) { stats.clear(); };
+    void PrintStats(FILE*) {};
+};
+
+#define LF_TRACE_SCOPE(stage)  ((void)0)
+#define LF_TRACE_THREAD(name)  ((void)0)
+
+#endif // LF_ENABLE_TRACE
+
+#endif // !TRACE_H